@@ -0,0 +1,76 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SA_SLAB_CLASSES 12 // 64 bytes to 128KB, enough for any response
+
+/*
+ * sa_allocator supplies the memory for buffers which hold secrets - agent
+ * responses, decoded secrets and cached copies. Both hooks must be set,
+ * otherwise malloc and free are used.
+*/
+typedef struct sa_allocator_s {
+	void* (*alloc)(size_t size, void* udata); // returns NULL on failure
+	void (*free)(void* p, void* udata);
+	void* udata;
+} sa_allocator;
+
+/*
+ * sa_slab is a built-in allocator for secret buffers. It carves power of 2
+ * size classes out of one mlock'ed region, so secrets never reach swap or,
+ * on Linux, core dumps. Freed buffers are zeroed and kept on per class free
+ * lists for reuse. When the region is used up allocations fail rather than
+ * fall back to unlocked memory.
+*/
+typedef struct sa_slab_s {
+	pthread_mutex_t lock;
+	uint8_t* region;
+	size_t size;
+	size_t used; // blocks are carved from the start of the region
+	void* free_lists[SA_SLAB_CLASSES];
+} sa_slab;
+
+// sa_alloc allocates size bytes with a, which may be NULL
+void* sa_alloc(const sa_allocator* a, size_t size);
+
+// sa_free frees p, which may be NULL, allocated by sa_alloc with a
+void sa_free(const sa_allocator* a, void* p);
+
+// sa_zero zeroes size bytes at p in a way the compiler can't optimize away
+void sa_zero(void* p, size_t size);
+
+/*
+ * sa_slab_new maps and locks a region of at least size bytes.
+ * Returns NULL, after logging why, if the region can't be locked -
+ * check RLIMIT_MEMLOCK.
+*/
+sa_slab* sa_slab_new(size_t size);
+
+// zeroes, unlocks and unmaps the region, which must have no buffers in use
+void sa_slab_destroy(sa_slab* slab);
+
+// sa_slab_allocator sets a to allocate from slab
+void sa_slab_allocator(sa_slab* slab, sa_allocator* a);
+
+// the hooks set by sa_slab_allocator, udata is the slab
+void* sa_slab_alloc(size_t size, void* udata);
+void sa_slab_free(void* p, void* udata);
@@ -20,6 +20,33 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+/******************************************************************************
+ * TYPES
+ ******************************************************************************/
+
+// Decoders for the bulk of an input - the first block of input that isn't
+// plain base64 characters, and the padded end, are always decoded by the
+// scalar code.
+typedef enum {
+	SA_B64_AUTO, // fastest this CPU supports, selected on first use
+	SA_B64_SCALAR,
+	SA_B64_SSE41,
+	SA_B64_AVX2,
+	SA_B64_AVX512VBMI
+} sa_b64_kernel;
+
+// Resumable decoder state - input may be split anywhere, including inside a
+// quad, and is validated as it is decoded. Initialize with
+// sa_b64_stream_init().
+typedef struct sa_b64_stream_s {
+	uint8_t carry[4]; // start of a quad split across updates
+	uint32_t n_carry;
+	bool decoded; // at least one quad decoded
+	bool padded; // the last quad had padding - nothing may follow it
+	bool failed;
+} sa_b64_stream;
+
+
 /******************************************************************************
  * FUNCTIONS
  ******************************************************************************/
@@ -48,4 +75,22 @@ void sa_b64_decode_in_place(uint8_t* in_out, uint32_t in_len, uint32_t* out_size
 bool sa_b64_validate_and_decode(const char* in, uint32_t in_len, uint8_t* out, uint32_t* out_size);
 bool sa_b64_validate_and_decode_in_place(uint8_t* in_out, uint32_t in_len, uint32_t* out_size);
 
+void sa_b64_stream_init(sa_b64_stream* s);
+
+// The size returned here is the most a call to sa_b64_stream_update() with
+// 'in_len' more characters can write to 'out'.
+static inline uint32_t
+sa_b64_stream_out_size(const sa_b64_stream* s, uint32_t in_len)
+{
+	return ((s->n_carry + in_len) >> 2) * 3;
+}
+
+bool sa_b64_stream_update(sa_b64_stream* s, const char* in, uint32_t in_len, uint8_t* out, uint32_t* out_size);
+bool sa_b64_stream_finish(sa_b64_stream* s);
+
+// For tests and benchmarks - force a decode kernel, or SA_B64_AUTO to go back
+// to the default. Returns false if this CPU or build can't run 'kernel'.
+bool sa_b64_set_kernel(sa_b64_kernel kernel);
+sa_b64_kernel sa_b64_get_kernel();
+
 /******************************************************************************/
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include "sa_alloc.h"
+#include "sa_error.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * sa_cache_cfg configures the optional in-process secret cache.
+ * sa_cache_cfg should be initialised using sa_cache_cfg_init.
+*/
+typedef struct sa_cache_cfg_s {
+	int ttl; // milliseconds a fetched secret is served from the cache, 0 disables caching
+	int stale_ttl; // milliseconds past ttl an expired secret may be served while one caller refreshes it, 0 disables
+	uint32_t max_entries; // least recently used secrets are evicted beyond this many entries
+	size_t max_bytes; // least recently used secrets are evicted beyond this many bytes of secret values
+} sa_cache_cfg;
+
+typedef struct sa_cache_entry_s {
+	struct sa_cache_entry_s* next; // hash bucket chain
+	struct sa_cache_entry_s* lru_prev; // towards most recently used
+	struct sa_cache_entry_s* lru_next; // towards least recently used
+	char* key;
+	uint32_t key_len;
+	uint8_t* value;
+	size_t size;
+	uint64_t fetched_ms;
+	bool refreshing; // a caller is fetching a new value for this expired entry
+} sa_cache_entry;
+
+typedef struct sa_cache_s {
+	pthread_mutex_t lock;
+	sa_cache_cfg cfg;
+	const sa_allocator* alloc; // allocates the secret values
+	sa_cache_entry** buckets;
+	uint32_t n_buckets; // power of 2
+	sa_cache_entry* lru_head; // most recently used
+	sa_cache_entry* lru_tail; // least recently used
+	uint32_t n_entries;
+	size_t n_bytes;
+} sa_cache;
+
+typedef enum sa_cache_result_e {
+	SA_CACHE_MISS, // no usable value, caller must fetch and sa_cache_put
+	SA_CACHE_HIT, // value returned
+	SA_CACHE_REFRESH // stale value returned, caller must fetch and sa_cache_put or sa_cache_refresh_failed
+} sa_cache_result;
+
+sa_cache_cfg* sa_cache_cfg_init(sa_cache_cfg* cfg);
+
+// alloc, which may be NULL, must outlive the cache
+sa_cache* sa_cache_new(const sa_cache_cfg* cfg, const sa_allocator* alloc);
+
+// zeroes and frees all cached secrets and frees cache
+void sa_cache_destroy(sa_cache* cache);
+
+/*
+ * sa_cache_get looks up the secret stored under key.
+ * On SA_CACHE_HIT and SA_CACHE_REFRESH r is set to a copy of the secret,
+ * with an extra byte for null termination, that the caller must free with
+ * sa_cache_free_value. SA_CACHE_REFRESH is returned to only one caller at a time,
+ * while it refreshes the entry other callers get the stale value as a hit.
+*/
+sa_cache_result sa_cache_get(sa_cache* cache, const char* key, uint32_t key_len, uint8_t** r, size_t* size_r);
+
+// stores a copy of the secret under key, evicting least recently used entries as needed
+void sa_cache_put(sa_cache* cache, const char* key, uint32_t key_len, const uint8_t* value, size_t size);
+
+// zeroes and frees a secret returned by sa_cache_get
+void sa_cache_free_value(const sa_cache* cache, uint8_t* value, size_t size);
+
+// lets another caller refresh key after a refresh failed
+void sa_cache_refresh_failed(sa_cache* cache, const char* key, uint32_t key_len);
+
+/*
+ * sa_cache_finish completes a fetch that followed a cache miss or refresh.
+ * A successfully fetched secret is stored in the cache. If a refresh failed
+ * the stale value is returned through r with SA_OK, otherwise the stale value
+ * is freed. Returns the outcome of the fetch.
+*/
+sa_err sa_cache_finish(sa_cache* cache, const char* key, uint32_t key_len, sa_cache_result cache_res, uint8_t* stale, size_t stale_size, sa_err err, uint8_t** r, size_t* size_r);
@@ -17,11 +17,23 @@
 
 #pragma once
 
+#include "sa_alloc.h"
+#include "sa_cache.h"
+#include "sa_clock.h"
+#include "sa_endpoint.h"
 #include "sa_error.h"
+#include "sa_flight.h"
 #include "sa_logging.h"
+#include "sa_pool.h"
+#include "sa_request.h"
+#include "sa_resolve.h"
+#include "sa_secrets.h"
 #include "sa_socket.h"
+#include "sa_stats.h"
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /*
  * sa_client.h and the files included here define the secret-agent-client-c API.
@@ -39,10 +51,25 @@
 */
 typedef struct sa_cfg_s
 {
-	char* addr; // address of the secret agent
-	char* port; // port the secret agent is running on
-	int timeout; // timeout in milliseconds
+	char* addr; // address of the secret agent, or unix: and a socket path or @ and abstract socket name
+	char* port; // port the secret agent is running on, unused for unix: addresses
+	int timeout; // bound in milliseconds on each call, from its start to the secret being returned, 0 or less for none
 	sa_tls_cfg tls; // tls configuration
+	int pool_size; // max idle connections kept for reuse, 0 disables pooling
+	int pool_idle_timeout; // idle connections older than this many milliseconds are not reused
+	sa_cache_cfg cache; // secret cache configuration, disabled by default
+	bool io_uring; // use the io_uring backend for sa_secret_get_bytes, needs a build with IO_URING=1
+	int dns_ttl; // milliseconds resolved addresses of addr are reused, 0 disables
+	char* pinned_addrs; // comma separated numeric addresses connected to instead of looking up addr, ignored with endpoints
+	int peer_uid; // uid the agent must run as when addr is a unix: address, -1 skips the check
+	sa_allocator alloc; // allocates buffers holding secrets, malloc and free if unset
+	const sa_endpoint_cfg* endpoints; // agents used instead of addr and port, at most SA_MAX_ENDPOINTS
+	int n_endpoints; // number of endpoints, 0 to use addr and port
+	int hedge_percentile; // hedge fetches slower than this percentile of recent fetches, 0 disables hedging
+	int hedge_min_delay; // least milliseconds before a fetch is hedged, used until enough fetches are timed
+	bool coalesce; // concurrent callers of the same secret share one request
+	bool stats; // keep counters and phase latencies, read with sa_client_get_stats
+	sa_trace trace; // hooks called as each phase of a request starts and ends, unset by default
 } sa_cfg;
 
 /*
@@ -53,6 +80,17 @@ typedef struct sa_cfg_s
 */
 typedef struct sa_client_s {
 	sa_cfg* cfg;
+	sa_endpoint* endpoints; // &endpoint, or one per cfg->endpoints
+	uint32_t n_endpoints;
+	sa_endpoint endpoint; // addr and port, when cfg->endpoints is not set
+	uint64_t* picks; // drives the random choices of sa_endpoint_pick, NULL with a single endpoint
+	sa_hedge* hedge; // NULL when hedging is disabled
+	sa_flights* flights; // NULL when coalescing is disabled
+	sa_stats* stats; // NULL unless cfg->stats is set
+	sa_cache* cache; // NULL when caching is disabled
+	sa_resolver* resolver; // NULL when neither dns_ttl nor any pinned_addrs are set
+	sa_scratch scratch; // for sa_secret_get_into responses that don't fit the caller's buffer
+	bool heap; // true when created with sa_client_new
 } sa_client;
 
 /*
@@ -69,18 +107,144 @@ sa_client_init(sa_client* c, sa_cfg* cfg);
 sa_client*
 sa_client_new(sa_cfg* cfg);
 
+/*
+ * sa_client_destroy closes any pooled connections held by c
+ * and zeroes and frees any cached secrets.
+ * If c was created with sa_client_new it is also freed.
+ * cfg is not destroyed.
+*/
+void
+sa_client_destroy(sa_client* c);
+
 /*
  * sa_secret_get_bytes requests a secret from the secret agent.
  * c should be a pointer to an initialised sa_client.
  * path is the secret path, the format is, "secrets:<resource_key>:<secret_key>".
  * r is a result parameter, which is filled in with the secret value.
- * On success, r is heap allocated. The caller is responsible for freeing r.
+ * On success, r is allocated with cfg->alloc. The caller is responsible for
+ * freeing r, with sa_secret_free if the allocator hooks are set.
+ * If the cache is enabled, r may be a copy of a previously fetched secret.
  * size_r is a result parameter, which is filled in with the size of the secret value.
  * Return value is an sa_err, set to SA_OK on success and any other value on failure.
 */
 sa_err
 sa_secret_get_bytes(const sa_client* c, const char* path, uint8_t** r, size_t* size_r);
 
+/*
+ * sa_secret_get_bytes_by is sa_secret_get_bytes giving up at deadline_ms
+ * instead of cfg->timeout after the call. deadline_ms is an absolute time on
+ * the sa_now_ms() clock, so one deadline can be shared by several calls.
+*/
+sa_err
+sa_secret_get_bytes_by(const sa_client* c, const char* path, uint64_t deadline_ms, uint8_t** r,
+		size_t* size_r);
+
+/*
+ * sa_client_get_coalesce_stats fills stats with the number of requests sent
+ * for secrets and the number of callers who shared them instead of sending
+ * their own. Both are 0 unless cfg->coalesce is set.
+*/
+void
+sa_client_get_coalesce_stats(const sa_client* c, sa_coalesce_stats* stats);
+
+/*
+ * sa_client_get_stats copies the client's counters into stats, and zeroes
+ * them if reset is true, so each call can report the interval since the last.
+ * Percentiles of each phase's latencies are read from stats->phases with
+ * sa_histogram_percentile. stats is zeroed unless cfg->stats is set.
+*/
+void
+sa_client_get_stats(const sa_client* c, sa_stats* stats, bool reset);
+
+/*
+ * sa_secret_free zeroes the size bytes of a secret returned by c,
+ * then frees it with the allocator it came from.
+*/
+void
+sa_secret_free(const sa_client* c, uint8_t* secret, size_t size);
+
+/*
+ * sa_secret_get_into is sa_secret_get_bytes decoding the secret into the cap
+ * bytes at buf instead of allocating. Exactly size_r bytes are written, with
+ * no null terminator. If the secret does not fit, SA_FAILED_BUFFER_TOO_SMALL
+ * is returned with size_r set to the size needed - buf may be NULL with cap 0
+ * to ask for it. The cache, hedging and the io_uring backend are not used. With a
+ * pooled connection the call allocates nothing, but a client that used it
+ * must be destroyed with sa_client_destroy.
+*/
+sa_err
+sa_secret_get_into(const sa_client* c, const char* path, uint8_t* buf, size_t cap, size_t* size_r);
+
+/*
+ * sa_secret_handle is a secret path prepared for repeated requests.
+ * It holds the parsed path and the request ready to send.
+*/
+typedef struct sa_secret_handle_s sa_secret_handle;
+
+/*
+ * sa_secret_prepare validates path, in the same format as for sa_secret_get_bytes,
+ * and builds its request once for sa_secret_get_prepared.
+ * On success hp is set to a handle the caller must free with sa_secret_handle_destroy.
+ * The handle refers to c, which must outlive it, but not to path.
+*/
+sa_err
+sa_secret_prepare(const sa_client* c, const char* path, sa_secret_handle** hp);
+
+/*
+ * sa_secret_get_prepared is sa_secret_get_bytes for a prepared path, without
+ * the per call parsing and formatting. Handles may be used by many threads at once.
+*/
+sa_err
+sa_secret_get_prepared(const sa_secret_handle* h, uint8_t** r, size_t* size_r);
+
+// sa_secret_get_into for a prepared path
+sa_err
+sa_secret_get_prepared_into(const sa_secret_handle* h, uint8_t* buf, size_t cap, size_t* size_r);
+
+void
+sa_secret_handle_destroy(sa_secret_handle* h);
+
+#define SA_PREFETCH_CONCURRENCY 16 // default connections sa_client_prefetch may have open
+
+/*
+ * sa_secret_result holds the outcome of one path requested with sa_secret_get_many.
+*/
+typedef struct sa_secret_result_s {
+	sa_err err; // SA_OK on success
+	uint8_t* value; // on success, secret the caller is responsible for freeing, see sa_secret_get_bytes
+	size_t size; // size of value
+} sa_secret_result;
+
+/*
+ * sa_secret_get_many requests n secrets from the secret agent on a single connection.
+ * All requests are written back to back before their responses are read,
+ * so the batch takes about one round trip instead of n.
+ * paths is an array of n secret paths, in the same format as for sa_secret_get_bytes.
+ * results is an array of n results, filled in with the outcome of each path.
+ * As with sa_secret_get_bytes each value has an extra byte for null termination.
+ * Return value is SA_OK if every secret was fetched, otherwise the error of the first
+ * failed path. Check results for the secrets that were fetched.
+*/
+sa_err
+sa_secret_get_many(const sa_client* c, const char** paths, size_t n, sa_secret_result* results);
+
+/*
+ * sa_client_prefetch requests n secrets from the secret agent, for resolving
+ * many secrets at startup, with up to concurrency requests in progress at
+ * once, each on its own connection. 0 uses SA_PREFETCH_CONCURRENCY. The
+ * requests are driven by sa_request on the calling thread, which waits on all
+ * of their connections together, and each is bounded by cfg->timeout from
+ * when it starts. Secrets are served from, and added to, the cache as for
+ * sa_secret_get_bytes, and requests are spread over the client's endpoints.
+ * results is an array of n sa_secret_result, filled in as for
+ * sa_secret_get_many, and elapsed_us, if not NULL, is set to the wall clock
+ * time taken. Return value is SA_OK if every secret was fetched, otherwise
+ * the error of the first that was not.
+*/
+sa_err
+sa_client_prefetch(const sa_client* c, const char** paths, size_t n, uint32_t concurrency,
+		sa_secret_result* results, uint64_t* elapsed_us);
+
 /*
  * sa_cfg_init initialises a stack allocated sa_cfg.
 */
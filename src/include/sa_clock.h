@@ -0,0 +1,63 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+/******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+
+// Monotonic clock, unaffected by wall clock changes.
+static inline uint64_t
+sa_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t
+sa_now_ms()
+{
+	return sa_now_ns() / 1000000;
+}
+
+// milliseconds left until deadline_ms, on the sa_now_ms clock, as a poll timeout
+static inline int
+sa_remaining_ms(uint64_t deadline_ms)
+{
+	uint64_t now = sa_now_ms();
+
+	if (now >= deadline_ms) {
+		return 0;
+	}
+
+	return deadline_ms - now > INT_MAX ? INT_MAX : (int)(deadline_ms - now);
+}
+
+// the deadline timeout_ms from now, or none if timeout_ms is 0 or negative
+static inline uint64_t
+sa_deadline_ms(int timeout_ms)
+{
+	return timeout_ms <= 0 ? UINT64_MAX : sa_now_ms() + (uint64_t)timeout_ms;
+}
+
+/******************************************************************************/
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include "sa_client.h"
+#include "sa_error.h"
+#include "sa_secrets.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * sa_config_secret is a secret referenced, once or more, by a config text.
+*/
+typedef struct sa_config_secret_s {
+	char* path; // "secrets:<resource>:<key>", owned
+	sa_secret_ref ref; // points into path
+	size_t n_refs; // times it is referenced in the text
+	sa_secret_result result; // filled in by sa_config_fetch
+} sa_config_secret;
+
+// sa_config_ref is one reference to a secret in a config text
+typedef struct sa_config_ref_s {
+	size_t offset; // of the reference in the text
+	size_t len;
+	size_t secret; // index of the secret referenced
+} sa_config_ref;
+
+/*
+ * sa_config_refs holds the secret references found in a config text by
+ * sa_config_scan. Each secret appears once in secrets, sorted by resource,
+ * so the keys of a resource are adjacent, then by key.
+*/
+typedef struct sa_config_refs_s {
+	const sa_client* client; // the secrets were fetched with, NULL until then
+	sa_config_secret* secrets;
+	size_t n_secrets;
+	sa_config_ref* refs; // in the order they appear in the text
+	size_t n_refs;
+} sa_config_refs;
+
+/*
+ * sa_config_write_func is passed the substituted text in order, a span of
+ * the original text or, when secret is true, the value of a secret
+ * replacing a reference.
+*/
+typedef void (*sa_config_write_func)(void* udata, const uint8_t* data, size_t size, bool secret);
+
+/*
+ * sa_config_scan finds the secret references in the len bytes of text, in
+ * one pass. A reference is SA_SECRETS_PATH_REFIX, not preceded by a letter,
+ * digit or any of "_-./:", followed by the longest run of those characters,
+ * less any trailing ':', as for sa_secret_get_bytes. refs must be released
+ * with sa_config_refs_destroy, even on failure.
+*/
+sa_err sa_config_scan(const char* text, size_t len, sa_config_refs* refs);
+
+/*
+ * sa_config_fetch requests each secret in refs once, with sa_client_prefetch,
+ * setting the secrets' results. Return value is SA_OK if every secret was
+ * fetched, otherwise the error of the first that was not.
+*/
+sa_err sa_config_fetch(const sa_client* c, sa_config_refs* refs);
+
+/*
+ * sa_config_write streams text, which refs was scanned from, to func with
+ * each reference replaced by its secret. If any secret was not fetched
+ * nothing is written and its error is returned.
+*/
+sa_err sa_config_write(const sa_config_refs* refs, const char* text, size_t len, sa_config_write_func func, void* udata);
+
+/*
+ * sa_config_substitute scans, fetches and writes text into out, with every
+ * secret reference replaced by its secret. out is allocated as for
+ * sa_secret_get_bytes, with an extra byte set to 0, and must be freed with
+ * sa_secret_free when the allocator hooks are set.
+*/
+sa_err sa_config_substitute(const sa_client* c, const char* text, size_t len, uint8_t** out, size_t* out_len);
+
+// sa_config_refs_destroy frees the secrets fetched, and everything else, in refs
+void sa_config_refs_destroy(sa_config_refs* refs);
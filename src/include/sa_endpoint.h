@@ -0,0 +1,122 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include "sa_error.h"
+#include "sa_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SA_HEDGE_WINDOW 128 // fetch latencies the hedge delay is taken from
+#define SA_HEDGE_MIN_SAMPLES 16 // fetches timed before the percentile is used
+
+#define SA_MAX_ENDPOINTS 64
+#define SA_EWMA_ONE 1024 // an error rate of 1, every request failing
+#define SA_EJECT_FAILURES 3 // consecutive failures that eject an endpoint
+#define SA_EJECT_BASE_MS 1000 // first ejection, doubled by each further one
+#define SA_EJECT_MAX_MS 60000
+
+/*
+ * sa_endpoint_cfg is the address of an agent, addr, port and pinned_addrs
+ * as for sa_cfg.
+*/
+typedef struct sa_endpoint_cfg_s {
+	const char* addr;
+	const char* port;
+	const char* pinned_addrs; // comma separated numeric addresses connected to instead of looking up addr
+} sa_endpoint_cfg;
+
+/*
+ * sa_endpoint is an agent a client sends requests to, with its own pool of
+ * idle connections. Its health, from the requests sent to it, is used to
+ * balance requests between endpoints. After SA_EJECT_FAILURES consecutive
+ * failures it is ejected and not picked until the ejection expires, when
+ * a single request probes whether it has recovered.
+*/
+typedef struct sa_endpoint_s {
+	const char* addr;
+	const char* port;
+	sa_conn_pool* pool; // NULL when pooling is disabled
+
+	pthread_mutex_t lock; // guards the health below
+	uint32_t in_flight; // requests picked and not done
+	uint64_t latency_us; // moving average, 0 until the first request is done
+	uint32_t error_rate; // moving average of failures, out of SA_EWMA_ONE
+	uint32_t failures; // consecutive
+	uint32_t ejections; // consecutive, each doubles the time ejected
+	uint64_t ejected_until_ms; // 0 if not ejected
+	bool probing; // a request is testing the endpoint after its ejection expired
+	uint64_t last_done_ms; // the averages decay while the endpoint is unused
+} sa_endpoint;
+
+void sa_endpoint_init(sa_endpoint* ep, const char* addr, const char* port);
+
+// destroys the lock, the pool is not destroyed
+void sa_endpoint_destroy(sa_endpoint* ep);
+
+/*
+ * sa_endpoint_pick picks the endpoint to send a request to from the n
+ * endpoints, skipping those with their index's bit set in tried. Two of the
+ * endpoints not ejected are chosen at random, using and advancing picks, and
+ * the one with the lower latency, weighted by its requests in flight and
+ * error rate, is picked. Both averages halve for every second an endpoint
+ * goes unused, so one that was slow is tried again. If all are ejected the one ejected the soonest is
+ * picked. The request is counted in flight until sa_endpoint_done or
+ * sa_endpoint_abandon. Returns NULL if every endpoint has been tried.
+ * picks is not used, and may be NULL, when n is 1.
+*/
+sa_endpoint* sa_endpoint_pick(sa_endpoint* endpoints, uint32_t n, uint64_t tried, uint64_t* picks);
+
+/*
+ * sa_endpoint_done ends a request to ep that took latency_us, updating the
+ * endpoint's health. Requests the agent answered, even with an error,
+ * succeeded. The rest failed.
+*/
+void sa_endpoint_done(sa_endpoint* ep, uint64_t latency_us, enum sa_error_code code);
+
+// sa_endpoint_abandon ends a request to ep that was cancelled, leaving its health alone
+void sa_endpoint_abandon(sa_endpoint* ep);
+
+/*
+ * sa_hedge times the fetches answered by the agents to decide how long to
+ * wait for one agent before sending the same request to another. The delay
+ * is the configured percentile of the last SA_HEDGE_WINDOW fetch latencies,
+ * and never less than min_delay_us, which is also used until
+ * SA_HEDGE_MIN_SAMPLES fetches have been timed.
+*/
+typedef struct sa_hedge_s {
+	pthread_mutex_t lock;
+	uint32_t percentile;
+	uint32_t min_delay_us;
+	uint32_t delay_us; // read without the lock
+	uint32_t n_samples; // recorded so far, the window holds the last SA_HEDGE_WINDOW
+	uint32_t samples[SA_HEDGE_WINDOW]; // microseconds
+} sa_hedge;
+
+// percentile is of the recent fetch latencies, from 1 to 100
+sa_hedge* sa_hedge_new(uint32_t percentile, uint32_t min_delay_ms);
+
+void sa_hedge_destroy(sa_hedge* hedge);
+
+// sa_hedge_delay_ms returns how long a fetch may take before it is hedged
+uint32_t sa_hedge_delay_ms(const sa_hedge* hedge);
+
+// sa_hedge_record adds the latency of a fetch an agent answered
+void sa_hedge_record(sa_hedge* hedge, uint64_t latency_us);
@@ -22,7 +22,8 @@ enum sa_error_code {
 	SA_FAILED_BAD_REQUEST,
 	SA_FAILED_BAD_CONFIG,
 	SA_FAILED_INTERNAL,
-	SA_FAILED_TIMEOUT
+	SA_FAILED_TIMEOUT,
+	SA_FAILED_BUFFER_TOO_SMALL // the size needed is returned with the error
 };
 
 typedef struct sa_error_s
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include "sa_alloc.h"
+#include "sa_error.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SA_FLIGHT_BUCKETS 64
+
+/*
+ * sa_flight is a fetch in progress which other callers of the same
+ * secret wait on instead of sending their own request.
+*/
+typedef struct sa_flight_s {
+	struct sa_flight_s* next; // hash bucket chain
+	const char* key; // the leader's, valid until the flight lands
+	uint32_t key_len;
+	uint32_t refs; // the leader and each waiter
+	bool landed;
+	sa_err err;
+	uint8_t* value; // copy of the leader's secret for the waiters
+	size_t size;
+	pthread_cond_t cond;
+} sa_flight;
+
+typedef struct sa_coalesce_stats_s {
+	uint64_t fetches; // requests sent by the first caller of a secret
+	uint64_t coalesced; // callers who waited on another's request instead of sending their own
+} sa_coalesce_stats;
+
+/*
+ * sa_flights tracks the fetches in progress, by secret, so that
+ * concurrent callers of the same secret share one request.
+*/
+typedef struct sa_flights_s {
+	pthread_mutex_t lock;
+	const sa_allocator* alloc; // allocates the copies of secrets
+	sa_flight* buckets[SA_FLIGHT_BUCKETS];
+	sa_coalesce_stats stats;
+} sa_flights;
+
+// alloc, which may be NULL, must outlive flights
+sa_flights* sa_flights_new(const sa_allocator* alloc);
+
+// no flights may be in progress
+void sa_flights_destroy(sa_flights* flights);
+
+/*
+ * sa_flight_join returns true if the caller is the first for key and must
+ * fetch it, then call sa_flight_land. Otherwise the caller must collect the
+ * first caller's result with sa_flight_wait. Either way fp is set to the flight.
+ * Returns true with fp set to NULL if the flight could not be allocated,
+ * the caller then fetches alone.
+*/
+bool sa_flight_join(sa_flights* flights, const char* key, uint32_t key_len, sa_flight** fp);
+
+/*
+ * sa_flight_land hands the leader's result to the callers waiting on f.
+ * value, the size byte secret with its extra byte, remains the leader's.
+*/
+void sa_flight_land(sa_flights* flights, sa_flight* f, sa_err err, const uint8_t* value, size_t size);
+
+/*
+ * sa_flight_wait waits until deadline_ms, on the sa_now_ms() clock, for f to
+ * land and returns its result. On success r is set to the caller's own copy
+ * of the secret, allocated as for sa_secret_get_bytes.
+*/
+sa_err sa_flight_wait(sa_flights* flights, sa_flight* f, uint64_t deadline_ms, uint8_t** r, size_t* size_r);
+
+// sa_flights_get_stats fills stats with the counters of flights
+void sa_flights_get_stats(sa_flights* flights, sa_coalesce_stats* stats);
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The members of an agent response the client needs. Each points at its
+ * unescaped, null terminated string inside the scanned json, or is NULL if
+ * the response has no such member or its value is not a string.
+*/
+typedef struct sa_json_response_s {
+	char* error;
+	uint32_t error_len;
+	char* secret_value;
+	uint32_t secret_value_len;
+} sa_json_response;
+
+/*
+ * sa_json_scan_response validates the null terminated json in a single pass,
+ * without allocating, and finds the top level "Error" and "SecretValue"
+ * strings. Strings are unescaped in place, so json is modified. What is
+ * accepted, and which of duplicate members is found, matches json_loads().
+ * Returns false, after logging why, if json is not valid.
+*/
+bool sa_json_scan_response(char* json, sa_json_response* res);
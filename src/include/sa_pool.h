@@ -0,0 +1,72 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include "sa_socket.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct sa_pool_conn_s {
+	sa_socket* sock;
+	uint64_t last_used_ms;
+} sa_pool_conn;
+
+/*
+ * sa_conn_pool holds idle, already connected (and tls handshaked)
+ * sockets so that consecutive requests can reuse them.
+ * Idle connections are kept as a stack so the most recently used
+ * connection, the one most likely to still be alive, is handed out first.
+*/
+typedef struct sa_conn_pool_s {
+	pthread_mutex_t lock;
+	sa_pool_conn* conns;
+	uint32_t size; // number of idle connections
+	uint32_t capacity; // max number of idle connections
+	uint32_t idle_timeout_ms;
+} sa_conn_pool;
+
+/*
+ * sa_pool_new creates a pool holding at most capacity idle connections.
+ * Connections idle for longer than idle_timeout_ms are not reused.
+*/
+sa_conn_pool* sa_pool_new(uint32_t capacity, uint32_t idle_timeout_ms);
+
+// closes all idle connections and frees pool
+void sa_pool_destroy(sa_conn_pool* pool);
+
+/*
+ * sa_pool_get pops an idle connection from pool.
+ * Expired and dead connections are closed and skipped.
+ * Returns NULL if no usable connection is available.
+*/
+sa_socket* sa_pool_get(sa_conn_pool* pool);
+
+/*
+ * sa_pool_put returns a healthy connection to pool.
+ * If pool is full the connection is closed instead.
+ * Connections that hit an error must not be returned, use sa_pool_close.
+*/
+void sa_pool_put(sa_conn_pool* pool, sa_socket* sock);
+
+// closes the fd associated with sock and destroys sock
+void sa_pool_close(sa_socket* sock);
+
+// returns the number of idle connections currently held by pool
+uint32_t sa_pool_idle_count(sa_conn_pool* pool);
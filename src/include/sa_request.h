@@ -0,0 +1,136 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include "sa_cache.h"
+#include "sa_endpoint.h"
+#include "sa_error.h"
+#include "sa_resolve.h"
+#include "sa_secrets.h"
+#include "sa_socket.h"
+#include "sa_stats.h"
+
+#include <netdb.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct sa_client_s;
+
+typedef enum sa_request_state_e {
+	SA_REQUEST_RESOLVE,
+	SA_REQUEST_CONNECT,
+	SA_REQUEST_TLS_HANDSHAKE,
+	SA_REQUEST_SEND,
+	SA_REQUEST_RECV_HEADER,
+	SA_REQUEST_RECV_BODY,
+	SA_REQUEST_DONE
+} sa_request_state;
+
+/*
+ * sa_request is a secret fetch that never blocks, for callers driving
+ * their own event loop. Each step, from the host lookup through the
+ * connect, tls handshake, request and response, is attempted by
+ * sa_request_advance and stops as soon as the socket would block.
+*/
+typedef struct sa_request_s {
+	const struct sa_client_s* client;
+	sa_endpoint* endpoint; // the agent the request is sent to, NULL once it is done with
+	uint64_t start_ns; // when the request to endpoint began
+	sa_request_state state;
+	sa_err err;
+	uint64_t deadline_ms;
+	short events; // events the current step is waiting for
+	sa_probe probe; // times the steps for the client's stats and trace hooks
+
+	char* path; // owned copy, ref points into it
+	sa_secret_ref ref;
+	bool cached; // the result goes through the client's cache
+	sa_cache_result cache_res;
+	uint8_t* stale;
+	size_t stale_size;
+
+	sa_resolve* resolve;
+	sa_addrs* addrs;
+	struct addrinfo* next_addr; // next address to try connecting to
+	int connect_fd; // fd of the connect in progress, -1 if none
+	sa_socket* sock;
+	bool reused; // sock came from the client's pool
+	bool retried;
+
+	char* req; // framed request
+	uint32_t req_sz;
+	uint32_t req_pos;
+	char header[SA_HEADER_SIZE];
+	uint32_t header_pos;
+	char* body;
+	uint32_t body_sz;
+	uint32_t body_pos;
+
+	uint8_t* value;
+	size_t size;
+} sa_request;
+
+/*
+ * sa_request_start begins fetching the secret at path using client c.
+ * The request must be completed by calling sa_request_advance whenever the
+ * fd returned by sa_request_fd is ready, until sa_request_advance returns true.
+ * The whole request must complete within the client's configured timeout.
+ * It is sent to an endpoint picked by sa_endpoint_pick and is never hedged.
+ * reqp is heap allocated and must be destroyed with sa_request_destroy.
+*/
+sa_err sa_request_start(const struct sa_client_s* c, const char* path, sa_request** reqp);
+
+/*
+ * sa_request_start_framed begins sending the framed request req to the
+ * agent at ep, one of c's endpoints picked by sa_endpoint_pick, bypassing the
+ * cache. The request must complete by deadline_ms and is driven as for
+ * sa_request_start. It ends the pick, even on failure.
+*/
+sa_err sa_request_start_framed(const struct sa_client_s* c, sa_endpoint* ep, const char* req, uint32_t req_sz, uint64_t deadline_ms, sa_request** reqp);
+
+/*
+ * sa_request_fd returns the fd the request is waiting on and sets events
+ * to the poll events, POLLIN or POLLOUT, to wait for.
+ * Returns -1 once the request is complete.
+*/
+int sa_request_fd(const sa_request* req, short* events);
+
+/*
+ * sa_request_timeout returns the milliseconds left before the request
+ * times out, callers should call sa_request_advance after this long
+ * even if the fd is not ready.
+*/
+int sa_request_timeout(const sa_request* req);
+
+/*
+ * sa_request_advance moves the request forward as far as it can go
+ * without blocking. Returns true once the request is complete.
+*/
+bool sa_request_advance(sa_request* req);
+
+/*
+ * sa_request_result returns the outcome of a complete request.
+ * On success r is set to the secret, which the caller is responsible for
+ * freeing as with sa_secret_get_bytes, and size_r to its size.
+ * As with sa_secret_get_bytes r has an extra byte for null termination.
+*/
+sa_err sa_request_result(sa_request* req, uint8_t** r, size_t* size_r);
+
+// sa_request_destroy abandons the request if incomplete and frees req
+void sa_request_destroy(sa_request* req);
@@ -0,0 +1,135 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include "sa_error.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// addresses of agents listening on unix domain sockets start with this
+#define SA_UNIX_ADDR_PREFIX "unix:"
+
+/*
+ * sa_addrs is a resolved address list shared by the resolver cache and
+ * the connects using it. The list and its addresses are one allocation.
+*/
+typedef struct sa_addrs_s {
+	int refs;
+	struct addrinfo* ai;
+} sa_addrs;
+
+/*
+ * sa_resolve is an asynchronous host lookup.
+ * Numeric addresses are resolved immediately, host names are
+ * resolved by a helper thread which signals completion through a pipe.
+*/
+typedef struct sa_resolve_s {
+	int refs; // owner and helper thread
+	int pipe_fds[2]; // helper thread writes a byte to pipe_fds[1] when done
+	char* addr;
+	char* port;
+	int rv; // getaddrinfo result
+	sa_addrs* addrs;
+} sa_resolve;
+
+typedef struct sa_resolver_entry_s {
+	struct sa_resolver_entry_s* next;
+	char* addr;
+	char* port;
+	sa_addrs* addrs;
+	uint64_t expires_ms;
+} sa_resolver_entry;
+
+/*
+ * sa_resolver caches resolved addresses per addr and port for ttl
+ * milliseconds. Addresses pinned to an addr and port never expire.
+*/
+typedef struct sa_resolver_s {
+	pthread_mutex_t lock;
+	int ttl; // 0 caches only pinned addresses
+	sa_resolver_entry* entries;
+} sa_resolver;
+
+/*
+ * sa_lookup_host points res to a heap allocated
+ * addrinfo struct containing host information for
+ * host at hostname and port
+ * SUCCESS: 0 is returned.
+ * FAILURE: A value other than 0 is returned.
+*/
+int sa_lookup_host(const char* hostname, const char* port, struct addrinfo** res);
+
+/*
+ * sa_is_unix_addr returns true if addr is "unix:" followed by a socket path,
+ * or on linux by @ and the name of an abstract socket. These need no lookup.
+*/
+bool sa_is_unix_addr(const char* addr);
+
+// sa_addrs_release drops a reference to addrs, freeing it with the last one
+void sa_addrs_release(sa_addrs* addrs);
+
+// sa_resolve_start begins looking up addr and port
+sa_err sa_resolve_start(const char* addr, const char* port, sa_resolve** rp);
+
+/*
+ * sa_resolve_fd returns the fd which becomes readable when the lookup
+ * completes, or -1 if the lookup completed immediately.
+*/
+int sa_resolve_fd(sa_resolve* r);
+
+/*
+ * sa_resolve_finish collects the result of a completed lookup.
+ * On success addrsp holds a reference the caller must release.
+ * r is destroyed unless the lookup is not complete yet, in which case
+ * SA_OK is returned with addrsp set to NULL.
+*/
+sa_err sa_resolve_finish(sa_resolve* r, sa_addrs** addrsp);
+
+// sa_resolve_cancel abandons a lookup, r is destroyed
+void sa_resolve_cancel(sa_resolve* r);
+
+// sa_resolver_new creates a resolver caching addresses for ttl milliseconds
+sa_resolver* sa_resolver_new(int ttl);
+
+void sa_resolver_destroy(sa_resolver* resolver);
+
+/*
+ * sa_resolver_get returns a reference to the pinned or unexpired cached
+ * addresses for addr and port, or NULL if they must be looked up.
+*/
+sa_addrs* sa_resolver_get(sa_resolver* resolver, const char* addr, const char* port);
+
+// sa_resolver_put caches addrs, taking its own reference
+void sa_resolver_put(sa_resolver* resolver, const char* addr, const char* port, sa_addrs* addrs);
+
+/*
+ * sa_resolver_pin makes the comma separated numeric addresses in
+ * pinned_addrs the addresses of addr and port, never looking addr up.
+ * If none of them are usable addr is looked up as usual.
+*/
+void sa_resolver_pin(sa_resolver* resolver, const char* addr, const char* port, const char* pinned_addrs);
+
+/*
+ * sa_resolver_lookup resolves addr and port, from resolver's cache if
+ * possible, waiting for a lookup until deadline_ms at the latest.
+ * resolver may be NULL. On success addrsp holds a reference the caller must release.
+*/
+sa_err sa_resolver_lookup(sa_resolver* resolver, const char* addr, const char* port, uint64_t deadline_ms, sa_addrs** addrsp);
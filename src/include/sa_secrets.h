@@ -17,11 +17,125 @@
 
 #pragma once
 
+#include "sa_alloc.h"
 #include "sa_error.h"
 #include "sa_socket.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
+#define SA_HEADER_SIZE 8
+
+/*
+ * sa_scratch is a buffer big enough for any response, allocated when first
+ * needed. A caller takes it for the whole read without locking, so a slow
+ * agent can't hold up other callers - one that finds it taken allocates a
+ * buffer of its own for the call.
+*/
+typedef struct sa_scratch_s {
+	const sa_allocator* alloc;
+	char* buf; // NULL until first needed, and while taken
+} sa_scratch;
+
+// a secret path split into its parts, pointing into the path string
+typedef struct sa_secret_ref_s {
+	const char* secret_request; // path without the "secrets:" prefix, used as the cache key
+	uint32_t secret_request_len;
+	const char* res;
+	uint32_t res_len;
+	const char* key;
+	uint32_t key_len;
+} sa_secret_ref;
+
+// splits path, "secrets[:resource_substring]:key", into its parts
+sa_err sa_parse_secret_path(const char* path, sa_secret_ref* ref);
+
+/*
+ * sa_parse_json decodes the secret in an agent response. On success the
+ * secret is heap allocated, with room for a null terminator after size_r
+ * bytes. Logs and returns NULL if the response is an error or invalid.
+*/
 uint8_t* sa_parse_json(const char* json_buf, size_t* size_r);
 
-sa_err sa_request_secret(char** resp, sa_socket* sock, const char* rsrc_sub, uint32_t rsrc_sub_len, const char* secret_key, uint32_t secret_key_len, int timeout_ms);
+/*
+ * sa_parse_json_in_place is sa_parse_json without the copy - the secret is
+ * decoded where it is in the null terminated json_buf, json_sz bytes long,
+ * then moved to its start and the rest of the json zeroed. On success
+ * json_buf is returned, otherwise its contents are lost and may hold part
+ * of the secret.
+*/
+uint8_t* sa_parse_json_in_place(char* json_buf, size_t json_sz, size_t* size_r);
+
+#ifdef SA_USE_JANSSON
+// sa_parse_json built on jansson, the reference for tests and benchmarks
+uint8_t* sa_parse_json_jansson(const char* json_buf, size_t* size_r);
+#endif
+
+sa_err sa_request_secret(char** resp, sa_socket* sock, const char* rsrc_sub, uint32_t rsrc_sub_len, const char* secret_key, uint32_t secret_key_len, const sa_allocator* alloc, uint64_t deadline_ms);
+
+// upper bound on the size of a framed request built by sa_build_secret_request
+uint32_t sa_secret_request_max_size(uint32_t rsrc_sub_len, uint32_t secret_key_len);
+
+/*
+ * sa_build_secret_request writes the framed request, header followed by json,
+ * for a secret into req, which must be at least sa_secret_request_max_size bytes.
+ * The resource and key are json escaped. Returns the number of bytes written.
+*/
+uint32_t sa_build_secret_request(char* req, const char* rsrc_sub, uint32_t rsrc_sub_len, const char* secret_key, uint32_t secret_key_len);
+
+/*
+ * sa_recv_secret_response reads one framed response from sock.
+ * On success resp is a null terminated json string, allocated with alloc, which
+ * may be NULL, that the caller must free.
+*/
+sa_err sa_recv_secret_response(char** resp, sa_socket* sock, const sa_allocator* alloc, uint64_t deadline_ms);
+
+/*
+ * sa_request_secret_value requests a secret and reads the response with
+ * sa_recv_secret_value.
+*/
+sa_err sa_request_secret_value(uint8_t** r, size_t* size_r, sa_socket* sock, const char* rsrc_sub, uint32_t rsrc_sub_len, const char* secret_key, uint32_t secret_key_len, const sa_allocator* alloc, uint64_t deadline_ms);
+
+/*
+ * sa_request_secret_framed sends req, a request built by sa_build_secret_request,
+ * and reads the response with sa_recv_secret_value.
+*/
+sa_err sa_request_secret_framed(uint8_t** r, size_t* size_r, sa_socket* sock, const char* req, uint32_t req_sz, const sa_allocator* alloc, uint64_t deadline_ms);
+
+/*
+ * sa_recv_secret_value reads one framed response from sock, base64 decoding
+ * the secret as it arrives instead of buffering the json first. On success r
+ * is the secret, allocated with alloc, which may be NULL, with room for a null
+ * terminator after size_r bytes. If the agent returned an error, or the secret is invalid, the whole
+ * response is still read and SA_FAILED_BAD_REQUEST is returned.
+*/
+sa_err sa_recv_secret_value(uint8_t** r, size_t* size_r, sa_socket* sock, const sa_allocator* alloc, uint64_t deadline_ms);
+
+/*
+ * sa_request_secret_into sends req, a request built by sa_build_secret_request,
+ * and reads the response with sa_recv_secret_into.
+*/
+sa_err sa_request_secret_into(uint8_t* buf, size_t cap, size_t* size_r, sa_socket* sock, const char* req, uint32_t req_sz, sa_scratch* scratch, uint64_t deadline_ms);
+
+/*
+ * sa_recv_secret_into is sa_recv_secret_value decoding into the cap bytes at
+ * buf instead of allocating. Exactly size_r bytes are written, there is no
+ * room kept for a null terminator. If the secret is bigger than cap the
+ * response is still read whole, buf is zeroed, size_r is set to the size
+ * needed and SA_FAILED_BUFFER_TOO_SMALL is returned. A response which is
+ * not streamed, like an error, is parsed in buf if it fits, otherwise in
+ * scratch.
+*/
+sa_err sa_recv_secret_into(uint8_t* buf, size_t cap, size_t* size_r, sa_socket* sock, sa_scratch* scratch, uint64_t deadline_ms);
+
+// alloc, which may be NULL, allocates the buffer and must outlive scratch
+void sa_scratch_init(sa_scratch* scratch, const sa_allocator* alloc);
+
+// frees the scratch buffer, if it was needed
+void sa_scratch_destroy(sa_scratch* scratch);
+
+/*
+ * sa_parse_secret_header checks the magic of a response header
+ * and sets json_sz to the size of the json that follows it.
+*/
+sa_err sa_parse_secret_header(const char* header, uint32_t* json_sz);
@@ -18,40 +18,143 @@
 #pragma once
 
 #include "sa_error.h"
+#include "sa_resolve.h"
 
+#include <netdb.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include <openssl/ssl.h>
 
+// holds all of a typical response, so the header and json arrive in one recv
+#define SA_SOCKET_RECV_BUF_SIZE 4096
+
+// tls sessions saved per endpoint for resumption, defined in sa_tls.c
+typedef struct sa_tls_session_cache_s sa_tls_session_cache;
+
 typedef struct sa_tls_cfg_s {
 	char* ca_string;
 	bool enabled;
+	SSL_CTX* ctx; // built from ca_string on first use and shared by all connections
+	sa_tls_session_cache* sessions; // created along with ctx
 } sa_tls_cfg;
 
+typedef struct sa_tls_stats_s {
+	uint64_t handshakes; // completed tls handshakes
+	uint64_t resumed; // completed tls handshakes that resumed a saved session
+} sa_tls_stats;
+
 typedef struct sa_socket_s {
 	int fd;
 	SSL* ssl;
 	sa_tls_cfg* tls_cfg;
+	const char* addr; // endpoint, tls sessions are saved and resumed per endpoint
+	const char* port;
+	bool tls_resumed; // true if the tls handshake resumed a saved session
+	bool sent; // a request was just sent, so a blocking read waits before its first recv
+	uint32_t recv_pos; // plain connections only, recv_buf[recv_pos, recv_len) is yet to be read
+	uint32_t recv_len;
+	char recv_buf[SA_SOCKET_RECV_BUF_SIZE];
 } sa_socket;
 
 // destroys ssl and frees sock, does not close the socket
 // associated with fd or destroy tls_cfg
 void sa_socket_destroy(sa_socket* sock);
 
-sa_err sa_connect_addr_port(sa_socket** sockp, const char* addr, const char* port, sa_tls_cfg* tls_cfg, int timeout_ms);
+/*
+ * sa_connect_addr_port connects to the agent at addr and port by deadline_ms,
+ * looking addr up through resolver, which may be NULL to always look it up.
+ * For unix: addresses port is ignored and, if peer_uid is not -1, the
+ * agent must be running as peer_uid.
+*/
+sa_err sa_connect_addr_port(sa_socket** sockp, sa_resolver* resolver, const char* addr, const char* port, sa_tls_cfg* tls_cfg, int peer_uid, uint64_t deadline_ms);
+
+// checks port is a number in the valid port range
+sa_err sa_validate_port(const char* port);
+
+/*
+ * sa_socket_new wraps a connected fd in a heap allocated sa_socket,
+ * creating the SSL connection if tls is enabled. The tls handshake is not started.
+ * Connections to unix: addresses never use tls. fd is not closed on failure.
+*/
+sa_err sa_socket_new(sa_socket** sockp, int fd, const char* addr, const char* port, sa_tls_cfg* tls_cfg);
+
+/*
+ * sa_connect_start creates a non-blocking socket and starts connecting it to ai.
+ * If in_progress is set the connect completes once the fd is writable,
+ * check the outcome with sa_connect_finish.
+*/
+sa_err sa_connect_start(const struct addrinfo* ai, int* fdp, bool* in_progress);
+
+/*
+ * sa_connect_race connects to the first of ai_list's addresses that accepts
+ * by deadline_ms. As in RFC 8305 attempts alternate address families and
+ * each gets a 250ms head start before the next is started alongside it.
+ * The losing attempts are closed. fdp is set to the connected non-blocking fd.
+*/
+sa_err sa_connect_race(const struct addrinfo* ai_list, uint64_t deadline_ms, int* fdp);
+
+// sa_connect_finish checks the outcome of a non-blocking connect
+sa_err sa_connect_finish(int fd);
+
+/*
+ * sa_check_peer_uid checks the process at the other end of the
+ * connected unix domain socket fd runs as uid. -1 skips the check.
+*/
+sa_err sa_check_peer_uid(int fd, int uid);
+
+/*
+ * sa_read_nb and sa_write_nb make a single non-blocking attempt to
+ * transfer up to n bytes, setting n_read or n_written to the number transferred.
+ * If nothing could be transferred yet, events is set to POLLIN or POLLOUT,
+ * otherwise events is 0. sa_read_nb serves buffered bytes without a syscall.
+*/
+sa_err sa_read_nb(sa_socket* sock, size_t n, void* buffer, size_t* n_read, short* events);
+
+sa_err sa_write_nb(sa_socket* sock, size_t n, const void* buffer, size_t* n_written, short* events);
 
-// This assumes buffer is at least n bytes long.
-sa_err sa_read_n_bytes(sa_socket* sock, unsigned int n, void* buffer, int timeout_ms);
+/*
+ * sa_read_n_bytes reads n bytes into buffer, which must be at least n bytes
+ * long. Plain connections recv as much as fits recv_buf and serve later reads
+ * from it, and only poll once a recv comes up empty or right after a send.
+*/
+sa_err sa_read_n_bytes(sa_socket* sock, unsigned int n, void* buffer, uint64_t deadline_ms);
+
+/*
+ * sa_write_n_bytes writes the n bytes at buffer, sending before polling.
+ * A peer that closed the connection is reported, never raised as SIGPIPE.
+*/
+sa_err sa_write_n_bytes(sa_socket* sock, unsigned int n, const void* buffer, uint64_t deadline_ms);
 
-// This assumes buffer is at least n bytes long.
-sa_err sa_write_n_bytes(sa_socket* sock, unsigned int n, void* buffer, int timeout_ms);
+/*
+ * sa_socket_wait waits for a socket to be ready to read or write.
+ * Blocking calls take a deadline_ms on the sa_now_ms() clock rather than
+ * a timeout, so the steps of a request share the time they are given.
+*/
+sa_err sa_socket_wait(sa_socket* sock, uint64_t deadline_ms, bool read, short* poll_res);
 
 /*
- * sa_socket_wait waits for a socket to be
- * ready to read or write.
+ * sa_socket_is_alive checks, without blocking, that an idle
+ * connection has not been closed by the peer and has no
+ * unexpected data waiting to be read.
 */
-sa_err sa_socket_wait(sa_socket* sock, int timeout_ms, bool read, short* poll_res);
+bool sa_socket_is_alive(sa_socket* sock);
 
 sa_tls_cfg* sa_tls_cfg_init(sa_tls_cfg* cfg);
 
-sa_tls_cfg* sa_tls_cfg_new();
\ No newline at end of file
+sa_tls_cfg* sa_tls_cfg_new();
+
+/*
+ * sa_tls_cfg_destroy releases the SSL context and tls sessions cached in cfg.
+ * Connections still using the context keep it alive until they are destroyed.
+ * Does not free cfg or ca_string. Call this before changing ca_string
+ * on a cfg that has already been used.
+*/
+void sa_tls_cfg_destroy(sa_tls_cfg* cfg);
+
+/*
+ * sa_tls_get_stats fills stats with the handshake counters
+ * of connections made using cfg.
+*/
+void sa_tls_get_stats(sa_tls_cfg* cfg, sa_tls_stats* stats);
\ No newline at end of file
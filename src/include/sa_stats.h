@@ -0,0 +1,225 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include "sa_clock.h"
+#include "sa_error.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SA_ERROR_CODES (SA_FAILED_BUFFER_TOO_SMALL + 1)
+
+// each power of 2 is split into 2^SA_HISTOGRAM_SUB_BITS buckets, within 12.5% of each other
+#define SA_HISTOGRAM_SUB_BITS 3
+#define SA_HISTOGRAM_MAX_BITS 40 // longer durations, over 18 minutes, go in the last bucket
+#define SA_HISTOGRAM_BUCKETS ((SA_HISTOGRAM_MAX_BITS - SA_HISTOGRAM_SUB_BITS + 1) << SA_HISTOGRAM_SUB_BITS)
+
+/*
+ * sa_phase is a step of fetching a secret that is timed. Phases a fetch
+ * doesn't go through, like the lookup and connect on a pooled connection,
+ * are not recorded.
+*/
+typedef enum sa_phase_e {
+	SA_PHASE_RESOLVE, // looking up the agent's address
+	SA_PHASE_CONNECT,
+	SA_PHASE_TLS_HANDSHAKE,
+	SA_PHASE_SEND, // writing the request
+	SA_PHASE_FIRST_BYTE, // waiting for the agent, until the response header is read
+	SA_PHASE_BODY, // reading the response, including any decoding as it is received
+	SA_PHASE_PARSE, // scanning a whole response's json
+	SA_PHASE_DECODE, // base64 decoding the secret
+	SA_PHASE_REQUEST, // a request to one agent, from connecting to the decoded secret
+	SA_PHASES
+} sa_phase;
+
+/*
+ * sa_histogram counts durations, in nanoseconds, in buckets whose width
+ * grows with the duration, as HdrHistogram does, so percentiles are
+ * accurate to within 12.5% over any range of latencies.
+*/
+typedef struct sa_histogram_s {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[SA_HISTOGRAM_BUCKETS];
+} sa_histogram;
+
+/*
+ * sa_stats are the counters of a client. They are updated without locks
+ * and can be read with sa_client_get_stats.
+*/
+typedef struct sa_stats_s {
+	uint64_t fetches; // secrets asked for, by any call, including those served from the cache
+	uint64_t cache_hits;
+	uint64_t reused; // pooled connections requests were sent on
+	uint64_t tls_resumed; // tls handshakes which resumed a session
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	uint64_t errors[SA_ERROR_CODES]; // outcomes of the fetches by sa_error_code, errors[SA_OK] succeeded
+	sa_histogram phases[SA_PHASES];
+} sa_stats;
+
+/*
+ * sa_trace_event is passed to the sa_trace hooks as a phase starts or ends.
+ * Phases are never nested in another phase of the same request, except
+ * for SA_PHASE_REQUEST, which spans the others.
+*/
+typedef struct sa_trace_event_s {
+	uint64_t request_id; // unique in the process, the same for every phase of a request
+	sa_phase phase;
+	uint64_t time_ns; // CLOCK_MONOTONIC, as sa_now_ns
+	uint64_t bytes; // sent in SA_PHASE_SEND, received in the first byte and body phases, set at the end
+	bool resumed; // the tls handshake resumed a session, set at the end
+} sa_trace_event;
+
+// sa_trace_func is called on the thread doing the fetch, and must not block
+typedef void (*sa_trace_func)(void* udata, const sa_trace_event* event);
+
+// sa_trace are the hooks on sa_cfg fired around each phase of a request
+typedef struct sa_trace_s {
+	sa_trace_func start; // NULL if not wanted
+	sa_trace_func end; // NULL if not wanted
+	void* udata;
+} sa_trace;
+
+/*
+ * sa_probe times the phases of a request for a client's stats and trace
+ * hooks. Code that doesn't know which client it is working for, like the
+ * socket and json functions, records phases with sa_phase_start and
+ * sa_phase_end, against the probe the client entered on the thread, if any.
+*/
+typedef struct sa_probe_s {
+	sa_stats* stats; // NULL when the client keeps no stats
+	const sa_trace* trace; // NULL when no hooks are set
+	uint64_t request_id;
+	uint64_t start_ns[SA_PHASES];
+} sa_probe;
+
+extern __thread sa_probe* sa_g_probe;
+
+sa_stats* sa_stats_new();
+
+void sa_stats_destroy(sa_stats* stats);
+
+/*
+ * sa_stats_snapshot copies stats into snap, and if reset is true zeroes
+ * them, each counter atomically. Counters updated while the snapshot is
+ * taken may be included in it or left for the next.
+*/
+void sa_stats_snapshot(sa_stats* stats, sa_stats* snap, bool reset);
+
+// sa_stats_fetched counts a secret asked for, with its outcome
+void sa_stats_fetched(sa_stats* stats, enum sa_error_code code, bool cache_hit);
+
+// sa_stats_add adds n to a counter of stats
+static inline void
+sa_stats_add(uint64_t* counter, uint64_t n)
+{
+	__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+void sa_histogram_record(sa_histogram* h, uint64_t ns);
+
+/*
+ * sa_histogram_percentile returns the duration, in nanoseconds, which
+ * percentile of those recorded took no longer than, 0 if there are none.
+*/
+uint64_t sa_histogram_percentile(const sa_histogram* h, double percentile);
+
+/*
+ * sa_probe_init sets up probe for stats and trace, either of which may be
+ * NULL, giving it a request id if any hooks are set.
+*/
+void sa_probe_init(sa_probe* probe, sa_stats* stats, const sa_trace* trace);
+
+// sa_probe_begin starts phase, probe must be active
+void sa_probe_begin(sa_probe* probe, sa_phase phase);
+
+/*
+ * sa_probe_end records the phase started at probe->start_ns[phase], bytes
+ * are sent or received, resumed is for SA_PHASE_TLS_HANDSHAKE. probe must
+ * be active.
+*/
+void sa_probe_end(sa_probe* probe, sa_phase phase, uint64_t bytes, bool resumed);
+
+// an inactive probe, with neither stats nor hooks, records nothing
+static inline bool
+sa_probe_active(const sa_probe* probe)
+{
+	return probe->stats != NULL || probe->trace != NULL;
+}
+
+static inline void
+sa_probe_start(sa_probe* probe, sa_phase phase)
+{
+	if (sa_probe_active(probe)) {
+		sa_probe_begin(probe, phase);
+	}
+}
+
+/*
+ * sa_probe_enter makes probe the one the thread's phases are recorded
+ * against, returning the previous one to pass to sa_probe_leave. While an
+ * inactive probe is entered the thread records nothing.
+*/
+static inline sa_probe*
+sa_probe_enter(sa_probe* probe)
+{
+	sa_probe* prev = sa_g_probe;
+	sa_g_probe = sa_probe_active(probe) ? probe : NULL;
+	return prev;
+}
+
+static inline void
+sa_probe_leave(sa_probe* prev)
+{
+	sa_g_probe = prev;
+}
+
+static inline void
+sa_phase_start(sa_phase phase)
+{
+	sa_probe* probe = sa_g_probe;
+
+	if (probe != NULL) {
+		sa_probe_begin(probe, phase);
+	}
+}
+
+static inline void
+sa_phase_end(sa_phase phase, uint64_t bytes)
+{
+	sa_probe* probe = sa_g_probe;
+
+	if (probe != NULL) {
+		sa_probe_end(probe, phase, bytes, false);
+	}
+}
+
+// sa_phase_end for SA_PHASE_TLS_HANDSHAKE
+static inline void
+sa_phase_end_tls(bool resumed)
+{
+	sa_probe* probe = sa_g_probe;
+
+	if (probe != NULL) {
+		sa_probe_end(probe, SA_PHASE_TLS_HANDSHAKE, 0, resumed);
+	}
+}
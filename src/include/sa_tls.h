@@ -23,8 +23,9 @@
 void sa_init_openssl();
 
 /*
- * sa_wrap_socket creates an SSL context
- * for the sa_socket
+ * sa_wrap_socket creates an SSL connection for the sa_socket
+ * from the SSL context cached in its tls_cfg.
+ * The context is built on first use.
  * SUCCESS: 0 is returned.
  * FAILURE: A value other than 0 is returned.
 */
@@ -32,18 +33,33 @@ int sa_wrap_socket(sa_socket* sock);
 
 /*
  * sa_tls_connect attempts to perform a tls
- * connection over sock for timeout_ms milliseconds.
+ * connection over sock, giving up at deadline_ms.
 */
-sa_err sa_tls_connect(sa_socket* sock, int timeout_ms);
+sa_err sa_tls_connect(sa_socket* sock, uint64_t deadline_ms);
 
 /*
  * sa_tls_read_n_bytes reads n bytes from
  * tls connected socket.
 */
-sa_err sa_tls_read_n_bytes(sa_socket* sock, size_t len, void* buf, int timeout_ms);
+sa_err sa_tls_read_n_bytes(sa_socket* sock, size_t len, void* buf, uint64_t deadline_ms);
 
 /*
- * sa_tls_write_n_bytes reads n bytes from
+ * sa_tls_write_n_bytes writes n bytes to
  * tls connected socket.
 */
-sa_err sa_tls_write_n_bytes(sa_socket* sock, size_t len, void* buf, int timeout_ms);
\ No newline at end of file
+sa_err sa_tls_write_n_bytes(sa_socket* sock, size_t len, const void* buf, uint64_t deadline_ms);
+
+/*
+ * The _nb functions make a single attempt without blocking.
+ * If the attempt must be retried once the socket is ready, SA_OK is
+ * returned with events set to POLLIN or POLLOUT, otherwise events is 0.
+*/
+
+// sa_tls_connect_nb attempts the tls handshake, it is complete when events is 0
+sa_err sa_tls_connect_nb(sa_socket* sock, short* events);
+
+// sa_tls_read_nb reads up to n bytes, n_read is set to the number read
+sa_err sa_tls_read_nb(sa_socket* sock, size_t n, void* buf, size_t* n_read, short* events);
+
+// sa_tls_write_nb writes up to n bytes, n_written is set to the number written
+sa_err sa_tls_write_nb(sa_socket* sock, size_t n, const void* buf, size_t* n_written, short* events);
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#pragma once
+
+#include "sa_alloc.h"
+#include "sa_error.h"
+#include "sa_resolve.h"
+#include "sa_socket.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The io_uring I/O backend is an alternative to the poll() and read()/write()
+ * loops in sa_socket.c for blocking requests. It is only built on Linux
+ * with "make IO_URING=1", and needs no library beyond the kernel headers.
+ * Connect, send and recv are submitted as linked SQEs so a request on a new
+ * connection usually costs a single io_uring_enter. TLS is run over memory
+ * BIOs with io_uring moving the records, so each handshake flight and the
+ * request and response also take one io_uring_enter each.
+ * Each thread lazily creates its own small ring.
+*/
+
+// true if the backend was built in and the running kernel supports it
+bool sa_uring_available();
+
+/*
+ * sa_uring_request sends the framed request req on the connected sock and
+ * reads one framed response. On success resp is a null terminated json
+ * string, allocated with alloc which may be NULL, the caller must free.
+*/
+sa_err sa_uring_request(sa_socket* sock, const char* req, uint32_t req_sz, const sa_allocator* alloc, char** resp, uint64_t deadline_ms);
+
+/*
+ * sa_uring_connect_request is sa_uring_request on a new connection to addr
+ * and port, looked up through resolver which may be NULL. The connection is
+ * returned through sockp on success. The connect is linked ahead of the request.
+*/
+sa_err sa_uring_connect_request(sa_socket** sockp, sa_resolver* resolver, const char* addr, const char* port, sa_tls_cfg* tls_cfg, const char* req, uint32_t req_sz, const sa_allocator* alloc, char** resp, uint64_t deadline_ms);
@@ -0,0 +1,241 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#define _DEFAULT_SOURCE // explicit_bzero, MAP_ANONYMOUS
+
+#include "sa_alloc.h"
+#include "sa_logging.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+//==========================================================
+// Typedefs & constants.
+//
+
+#define SA_SLAB_MIN_SHIFT 6 // smallest class is 64 bytes
+#define SA_SLAB_MAGIC 0x51ab51ab
+
+// precedes each block, keeping the blocks 16 byte aligned
+typedef struct sa_slab_header_s {
+	uint32_t cls;
+	uint32_t magic;
+	uint64_t pad;
+} sa_slab_header;
+
+//==========================================================
+// Globals.
+//
+
+#if ! defined(__GLIBC__) || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 25)
+// Calling memset through a volatile pointer stops the compiler from
+// optimizing away the zeroing of buffers that are about to be freed.
+static void* (*volatile secure_memset)(void*, int, size_t) = memset;
+#endif
+
+//==========================================================
+// Forward declarations.
+//
+
+static int size_class(size_t size);
+
+//==========================================================
+// Public API.
+//
+
+void*
+sa_alloc(const sa_allocator* a, size_t size)
+{
+	if (a == NULL || a->alloc == NULL || a->free == NULL) {
+		return malloc(size);
+	}
+
+	return a->alloc(size, a->udata);
+}
+
+void
+sa_free(const sa_allocator* a, void* p)
+{
+	if (p == NULL) {
+		return;
+	}
+
+	if (a == NULL || a->alloc == NULL || a->free == NULL) {
+		free(p);
+		return;
+	}
+
+	a->free(p, a->udata);
+}
+
+void
+sa_zero(void* p, size_t size)
+{
+#if ! defined(__GLIBC__) || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 25)
+	secure_memset(p, 0, size);
+#else
+	explicit_bzero(p, size);
+#endif
+}
+
+sa_slab*
+sa_slab_new(size_t size)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size = (size + page - 1) & ~(page - 1);
+
+	sa_slab* slab = (sa_slab*) malloc(sizeof(sa_slab));
+	if (slab == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for secret slab");
+		return NULL;
+	}
+
+	void* region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) {
+		sa_g_log_function("ERR: failed to map %zu byte secret slab, errno: %d", size, errno);
+		free(slab);
+		return NULL;
+	}
+
+	if (mlock(region, size) != 0) {
+		sa_g_log_function("ERR: failed to lock %zu byte secret slab, errno: %d", size, errno);
+		munmap(region, size);
+		free(slab);
+		return NULL;
+	}
+
+#ifdef MADV_DONTDUMP
+	madvise(region, size, MADV_DONTDUMP);
+#endif
+
+	pthread_mutex_init(&slab->lock, NULL);
+	slab->region = (uint8_t*)region;
+	slab->size = size;
+	slab->used = 0;
+
+	for (int i = 0; i < SA_SLAB_CLASSES; i++) {
+		slab->free_lists[i] = NULL;
+	}
+
+	return slab;
+}
+
+void
+sa_slab_destroy(sa_slab* slab)
+{
+	sa_zero(slab->region, slab->used);
+	munlock(slab->region, slab->size);
+	munmap(slab->region, slab->size);
+	pthread_mutex_destroy(&slab->lock);
+	free(slab);
+}
+
+void
+sa_slab_allocator(sa_slab* slab, sa_allocator* a)
+{
+	a->alloc = sa_slab_alloc;
+	a->free = sa_slab_free;
+	a->udata = slab;
+}
+
+void*
+sa_slab_alloc(size_t size, void* udata)
+{
+	sa_slab* slab = (sa_slab*)udata;
+	int cls = size_class(size);
+
+	if (cls < 0) {
+		sa_g_log_function("ERR: %zu bytes is too big for the secret slab", size);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&slab->lock);
+
+	void* p = slab->free_lists[cls];
+
+	if (p != NULL) {
+		slab->free_lists[cls] = *(void**)p;
+		*(void**)p = NULL;
+	}
+	else {
+		size_t block = sizeof(sa_slab_header) + ((size_t)1 << (cls + SA_SLAB_MIN_SHIFT));
+
+		if (slab->size - slab->used >= block) {
+			sa_slab_header* header = (sa_slab_header*)(slab->region + slab->used);
+			header->cls = (uint32_t)cls;
+			header->magic = SA_SLAB_MAGIC;
+			p = header + 1;
+			slab->used += block;
+		}
+	}
+
+	pthread_mutex_unlock(&slab->lock);
+
+	if (p == NULL) {
+		sa_g_log_function("ERR: secret slab exhausted");
+	}
+
+	return p;
+}
+
+void
+sa_slab_free(void* p, void* udata)
+{
+	sa_slab* slab = (sa_slab*)udata;
+	sa_slab_header* header = (sa_slab_header*)p - 1;
+
+	if ((uint8_t*)p < slab->region + sizeof(sa_slab_header) ||
+			(uint8_t*)p >= slab->region + slab->used || header->magic != SA_SLAB_MAGIC) {
+		sa_g_log_function("ERR: freeing %p which is not from the secret slab", p);
+		return;
+	}
+
+	sa_zero(p, (size_t)1 << (header->cls + SA_SLAB_MIN_SHIFT));
+
+	pthread_mutex_lock(&slab->lock);
+	*(void**)p = slab->free_lists[header->cls];
+	slab->free_lists[header->cls] = p;
+	pthread_mutex_unlock(&slab->lock);
+}
+
+//==========================================================
+// Local helpers.
+//
+
+// returns the smallest class holding size bytes, or -1
+static int
+size_class(size_t size)
+{
+	for (int cls = 0; cls < SA_SLAB_CLASSES; cls++) {
+		if (size <= (size_t)1 << (cls + SA_SLAB_MIN_SHIFT)) {
+			return cls;
+		}
+	}
+
+	return -1;
+}
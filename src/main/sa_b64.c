@@ -16,6 +16,15 @@
  */
 #include "sa_b64.h"
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SA_B64_X86
+#include <immintrin.h>
+#endif
+
 /******************************************************************************
  * CONSTANTS
  ******************************************************************************/
@@ -73,6 +82,70 @@ static const uint8_t base64_decode_a[] = {
 #define VA base64_valid_a
 #define DA base64_decode_a
 
+#ifdef SA_B64_X86
+
+// Decode values for the 7-bit ASCII range, 0x80 marks invalid characters.
+static const uint8_t base64_decode_vbmi_a[] = {
+		/*00*/ /*01*/ /*02*/ /*03*/ /*04*/ /*05*/ /*06*/ /*07*/   /*08*/ /*09*/ /*0A*/ /*0B*/ /*0C*/ /*0D*/ /*0E*/ /*0F*/
+/*00*/	 0x80,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,    0x80,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,
+/*10*/	 0x80,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,    0x80,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,
+/*20*/	 0x80,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,    0x80,  0x80,  0x80,    62,  0x80,  0x80,  0x80,    63,
+/*30*/	   52,    53,    54,    55,    56,    57,    58,    59,      60,    61,  0x80,  0x80,  0x80,  0x80,  0x80,  0x80,
+/*40*/	 0x80,     0,     1,     2,     3,     4,     5,     6,       7,     8,     9,    10,    11,    12,    13,    14,
+/*50*/	   15,    16,    17,    18,    19,    20,    21,    22,      23,    24,    25,  0x80,  0x80,  0x80,  0x80,  0x80,
+/*60*/	 0x80,    26,    27,    28,    29,    30,    31,    32,      33,    34,    35,    36,    37,    38,    39,    40,
+/*70*/	   41,    42,    43,    44,    45,    46,    47,    48,      49,    50,    51,  0x80,  0x80,  0x80,  0x80,  0x80
+};
+
+// Gathers the 3 decoded bytes held big-end-last in each 32-bit lane.
+static const uint8_t base64_pack_vbmi_a[] = {
+	 2,  1,  0,  6,  5,  4, 10,  9,  8, 14, 13, 12, 18, 17, 16, 22,
+	21, 20, 26, 25, 24, 30, 29, 28, 34, 33, 32, 38, 37, 36, 42, 41,
+	40, 46, 45, 44, 50, 49, 48, 54, 53, 52, 58, 57, 56, 62, 61, 60,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0
+};
+
+#endif // SA_B64_X86
+
+// A block kernel decodes whole blocks from the start of 'in', validating as
+// it goes, and returns the number of input bytes consumed. It stops at the
+// first block holding anything but base64 characters - including '=' - and
+// always leaves at least the final 4 bytes, so padding is only ever seen by
+// the scalar code. 'in' and 'out' may be the same buffer.
+typedef uint32_t (*decode_blocks_fn)(const uint8_t* in, uint32_t in_len,
+		uint8_t* out);
+
+static uint32_t decode_blocks_scalar(const uint8_t* in, uint32_t in_len,
+		uint8_t* out);
+
+#ifdef SA_B64_X86
+static uint32_t decode_blocks_sse41(const uint8_t* in, uint32_t in_len,
+		uint8_t* out);
+static uint32_t decode_blocks_avx2(const uint8_t* in, uint32_t in_len,
+		uint8_t* out);
+static uint32_t decode_blocks_avx512vbmi(const uint8_t* in, uint32_t in_len,
+		uint8_t* out);
+#endif
+
+static const decode_blocks_fn decode_blocks_a[] = {
+	[SA_B64_SCALAR] = decode_blocks_scalar,
+#ifdef SA_B64_X86
+	[SA_B64_SSE41] = decode_blocks_sse41,
+	[SA_B64_AVX2] = decode_blocks_avx2,
+	[SA_B64_AVX512VBMI] = decode_blocks_avx512vbmi
+#endif
+};
+
+// Selected on first use - SA_B64_AUTO until then.
+static sa_b64_kernel g_kernel = SA_B64_AUTO;
+
+static uint32_t decode_scalar(const uint8_t* in, uint32_t in_len, uint32_t i,
+		uint8_t* out);
+static bool stream_decode_quad(sa_b64_stream* s, const uint8_t* q,
+		uint8_t* out, uint32_t* j);
+static decode_blocks_fn get_decode_blocks();
+static bool kernel_supported(sa_b64_kernel kernel);
+
 
 /******************************************************************************
  * FUNCTIONS
@@ -128,30 +201,16 @@ sa_b64_encode(const uint8_t* in, uint32_t in_size, char* out)
 void
 sa_b64_decode(const char* in, uint32_t in_len, uint8_t* out, uint32_t* out_size)
 {
-	uint32_t i = 0;
-	uint32_t j = 0;
-
-	while (i < in_len) {
-		uint8_t i0 = (uint8_t)in[i];
-		uint8_t i1 = (uint8_t)in[i + 1];
-		uint8_t i2 = (uint8_t)in[i + 2];
-		uint8_t i3 = (uint8_t)in[i + 3];
-
-		out[j]     = (DA[i0] << 2) | (DA[i1] >> 4);
-		out[j + 1] = (DA[i1] << 4) | (DA[i2] >> 2);
-		out[j + 2] = (DA[i2] << 6) |  DA[i3];
-
-		i += 4;
-		j += 3;
-	}
+	uint32_t i = get_decode_blocks()((const uint8_t*)in, in_len, out);
+	uint32_t j = decode_scalar((const uint8_t*)in, in_len, i, out);
 
 	if (out_size) {
-		if (i != 0) {
-			if (in[i - 1] == '=') {
+		if (in_len != 0) {
+			if (in[in_len - 1] == '=') {
 				j--;
 			}
 
-			if (in[i - 2] == '=') {
+			if (in[in_len - 2] == '=') {
 				j--;
 			}
 		}
@@ -164,9 +223,6 @@ sa_b64_decode(const char* in, uint32_t in_len, uint8_t* out, uint32_t* out_size)
 void
 sa_b64_decode_in_place(uint8_t* in_out, uint32_t in_len, uint32_t* out_size)
 {
-	uint32_t i = 0;
-	uint32_t j = 0;
-
 	uint32_t d = 0;
 
 	if (out_size && in_len != 0) {
@@ -179,23 +235,8 @@ sa_b64_decode_in_place(uint8_t* in_out, uint32_t in_len, uint32_t* out_size)
 		}
 	}
 
-	while (i < in_len) {
-		uint8_t i0 = in_out[i];
-		uint8_t i1 = in_out[i + 1];
-		uint8_t i2 = in_out[i + 2];
-		uint8_t i3 = in_out[i + 3];
-
-		uint8_t b0 = (DA[i0] << 2) | (DA[i1] >> 4);
-		uint8_t b1 = (DA[i1] << 4) | (DA[i2] >> 2);
-		uint8_t b2 = (DA[i2] << 6) |  DA[i3];
-
-		in_out[j]     = b0;
-		in_out[j + 1] = b1;
-		in_out[j + 2] = b2;
-
-		i += 4;
-		j += 3;
-	}
+	uint32_t i = get_decode_blocks()(in_out, in_len, in_out);
+	uint32_t j = decode_scalar(in_out, in_len, i, in_out);
 
 	if (out_size) {
 		*out_size = j - d;
@@ -232,30 +273,480 @@ is_valid_encoded(const char* in, uint32_t in_len)
 	return *read == '=' || VA[*read];
 }
 
-// Same as sa_b64_decode() but validates input as ok to decode.
+// Same as sa_b64_decode() but validates input as ok to decode. The block
+// kernels validate as they decode, so only the rest is checked separately. If
+// false is returned 'out' may have been partly written.
 bool
 sa_b64_validate_and_decode(const char* in, uint32_t in_len, uint8_t* out,
 		uint32_t* out_size)
 {
-	if (! is_valid_encoded(in, in_len)) {
+	if (! in || in_len == 0 || (in_len & 3) != 0) {
 		return false;
 	}
 
-	sa_b64_decode(in, in_len, out, out_size);
+	uint32_t i = get_decode_blocks()((const uint8_t*)in, in_len, out);
+
+	if (! is_valid_encoded(in + i, in_len - i)) {
+		return false;
+	}
+
+	uint32_t j = decode_scalar((const uint8_t*)in, in_len, i, out);
+
+	if (out_size) {
+		if (in[in_len - 1] == '=') {
+			j--;
+		}
+
+		if (in[in_len - 2] == '=') {
+			j--;
+		}
+
+		*out_size = j;
+	}
 
 	return true;
 }
 
-// Same as sa_b64_decode_in_place() but validates input as ok to decode.
+// Same as sa_b64_decode_in_place() but validates input as ok to decode. If
+// false is returned 'in_out' may have been partly decoded.
 bool
 sa_b64_validate_and_decode_in_place(uint8_t* in_out, uint32_t in_len,
 		uint32_t* out_size)
 {
-	if (! is_valid_encoded((const char*)in_out, in_len)) {
+	if (! in_out || in_len == 0 || (in_len & 3) != 0) {
+		return false;
+	}
+
+	uint32_t i = get_decode_blocks()(in_out, in_len, in_out);
+
+	if (! is_valid_encoded((const char*)in_out + i, in_len - i)) {
+		return false;
+	}
+
+	uint32_t d = 0;
+
+	if (in_out[in_len - 1] == '=') {
+		d++;
+	}
+
+	if (in_out[in_len - 2] == '=') {
+		d++;
+	}
+
+	uint32_t j = decode_scalar(in_out, in_len, i, in_out);
+
+	if (out_size) {
+		*out_size = j - d;
+	}
+
+	return true;
+}
+
+void
+sa_b64_stream_init(sa_b64_stream* s)
+{
+	s->n_carry = 0;
+	s->decoded = false;
+	s->padded = false;
+	s->failed = false;
+}
+
+// Decodes the next 'in_len' characters. Must have allocated big enough 'out' -
+// e.g. use sa_b64_stream_out_size(). 'out_size' returns the number of bytes
+// written. Once false is returned every later call fails too.
+bool
+sa_b64_stream_update(sa_b64_stream* s, const char* in, uint32_t in_len,
+		uint8_t* out, uint32_t* out_size)
+{
+	const uint8_t* read = (const uint8_t*)in;
+	const uint8_t* end = read + in_len;
+	uint32_t j = 0;
+
+	*out_size = 0;
+
+	if (s->failed) {
+		return false;
+	}
+
+	// Complete a quad left over from the previous update.
+	while (s->n_carry != 0 && read < end) {
+		s->carry[s->n_carry++] = *read++;
+
+		if (s->n_carry == 4) {
+			s->n_carry = 0;
+
+			if (! stream_decode_quad(s, s->carry, out, &j)) {
+				return false;
+			}
+		}
+	}
+
+	uint32_t n = (uint32_t)(end - read) & ~3u;
+
+	if (n != 0 && ! s->padded) {
+		uint32_t i = get_decode_blocks()(read, n, out + j);
+
+		if (i != 0) {
+			s->decoded = true;
+		}
+
+		read += i;
+		j += (i >> 2) * 3;
+	}
+
+	while (end - read >= 4) {
+		if (! stream_decode_quad(s, read, out, &j)) {
+			return false;
+		}
+
+		read += 4;
+	}
+
+	while (read < end) {
+		s->carry[s->n_carry++] = *read++;
+	}
+
+	*out_size = j;
+
+	return true;
+}
+
+// Returns true if everything passed to sa_b64_stream_update() was valid, and
+// made up a complete, non-empty encoding.
+bool
+sa_b64_stream_finish(sa_b64_stream* s)
+{
+	return ! s->failed && s->n_carry == 0 && s->decoded;
+}
+
+// Overrides the kernel selected from the CPU's features. SA_B64_AUTO restores
+// the default. Returns false, leaving the kernel unchanged, if this CPU or
+// build can't run 'kernel'.
+bool
+sa_b64_set_kernel(sa_b64_kernel kernel)
+{
+	if (kernel == SA_B64_AUTO) {
+		// Fastest first.
+		static const sa_b64_kernel order[] = {
+				SA_B64_AVX512VBMI, SA_B64_AVX2, SA_B64_SSE41
+		};
+
+		kernel = SA_B64_SCALAR;
+
+		for (uint32_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+			if (kernel_supported(order[i])) {
+				kernel = order[i];
+				break;
+			}
+		}
+	}
+	else if (! kernel_supported(kernel)) {
+		return false;
+	}
+
+	__atomic_store_n(&g_kernel, kernel, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+sa_b64_kernel
+sa_b64_get_kernel()
+{
+	get_decode_blocks();
+
+	return __atomic_load_n(&g_kernel, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+ * LOCAL HELPERS
+ ******************************************************************************/
+
+// Decodes quads from offset 'i' to the end with the lookup tables. Returns the
+// total decoded size before padding is accounted for.
+static uint32_t
+decode_scalar(const uint8_t* in, uint32_t in_len, uint32_t i, uint8_t* out)
+{
+	uint32_t j = (i >> 2) * 3;
+
+	while (i < in_len) {
+		uint8_t i0 = in[i];
+		uint8_t i1 = in[i + 1];
+		uint8_t i2 = in[i + 2];
+		uint8_t i3 = in[i + 3];
+
+		uint8_t b0 = (DA[i0] << 2) | (DA[i1] >> 4);
+		uint8_t b1 = (DA[i1] << 4) | (DA[i2] >> 2);
+		uint8_t b2 = (DA[i2] << 6) |  DA[i3];
+
+		out[j]     = b0;
+		out[j + 1] = b1;
+		out[j + 2] = b2;
+
+		i += 4;
+		j += 3;
+	}
+
+	return j;
+}
+
+// Validates and decodes one quad for the stream decoder - only the last quad
+// may have padding.
+static bool
+stream_decode_quad(sa_b64_stream* s, const uint8_t* q, uint8_t* out,
+		uint32_t* j)
+{
+	uint8_t i0 = q[0];
+	uint8_t i1 = q[1];
+	uint8_t i2 = q[2];
+	uint8_t i3 = q[3];
+
+	if (s->padded || ! VA[i0] || ! VA[i1]) {
+		s->failed = true;
 		return false;
 	}
 
-	sa_b64_decode_in_place(in_out, in_len, out_size);
+	uint32_t n = 3;
+
+	if (i2 == '=') {
+		if (i3 != '=') {
+			s->failed = true;
+			return false;
+		}
+
+		n = 1;
+	}
+	else if (! VA[i2]) {
+		s->failed = true;
+		return false;
+	}
+	else if (i3 == '=') {
+		n = 2;
+	}
+	else if (! VA[i3]) {
+		s->failed = true;
+		return false;
+	}
+
+	uint8_t b[3];
+
+	b[0] = (DA[i0] << 2) | (DA[i1] >> 4);
+	b[1] = (DA[i1] << 4) | (DA[i2] >> 2);
+	b[2] = (DA[i2] << 6) |  DA[i3];
+
+	memcpy(out + *j, b, n);
+	*j += n;
+
+	s->decoded = true;
+	s->padded = n != 3;
 
 	return true;
 }
+
+// Selects the kernel on first use. Racing threads select the same kernel.
+static decode_blocks_fn
+get_decode_blocks()
+{
+	sa_b64_kernel kernel = __atomic_load_n(&g_kernel, __ATOMIC_RELAXED);
+
+	if (kernel == SA_B64_AUTO) {
+		sa_b64_set_kernel(SA_B64_AUTO);
+		kernel = __atomic_load_n(&g_kernel, __ATOMIC_RELAXED);
+	}
+
+	return decode_blocks_a[kernel];
+}
+
+static bool
+kernel_supported(sa_b64_kernel kernel)
+{
+	switch (kernel) {
+	case SA_B64_SCALAR:
+		return true;
+#ifdef SA_B64_X86
+	case SA_B64_SSE41:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse4.1");
+	case SA_B64_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	case SA_B64_AVX512VBMI:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx512bw") &&
+				__builtin_cpu_supports("avx512vbmi");
+#endif
+	default:
+		return false;
+	}
+}
+
+static uint32_t
+decode_blocks_scalar(const uint8_t* in, uint32_t in_len, uint8_t* out)
+{
+	(void)in;
+	(void)in_len;
+	(void)out;
+
+	return 0;
+}
+
+#ifdef SA_B64_X86
+
+// The SSE4.1 and AVX2 kernels classify each character by its high and low
+// nibbles with pshufb lookups - a character is valid if the two lookups share
+// no bits - then add a per-range offset to get its 6-bit value. Then pmaddubsw
+// and pmaddwd pack four 6-bit values into three bytes in each 32-bit lane.
+
+__attribute__((target("sse4.1")))
+static uint32_t
+decode_blocks_sse41(const uint8_t* in, uint32_t in_len, uint8_t* out)
+{
+	const __m128i lut_lo = _mm_setr_epi8(
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2F);
+	const __m128i pack = _mm_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+	uint32_t i = 0;
+	uint32_t j = 0;
+
+	while (in_len - i > 16) {
+		__m128i str = _mm_loadu_si128((const __m128i*)(in + i));
+
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+		__m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+
+		if (! _mm_testz_si128(lo, hi)) {
+			break;
+		}
+
+		__m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+		__m128i roll = _mm_shuffle_epi8(lut_roll,
+				_mm_add_epi8(eq_2f, hi_nibbles));
+
+		str = _mm_add_epi8(str, roll);
+		str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+		str = _mm_shuffle_epi8(str, pack);
+
+		// Write exactly 12 bytes - 'out' may have no slack.
+		uint32_t last = (uint32_t)_mm_extract_epi32(str, 2);
+
+		_mm_storel_epi64((__m128i*)(out + j), str);
+		memcpy(out + j + 8, &last, 4);
+
+		i += 16;
+		j += 12;
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static uint32_t
+decode_blocks_avx2(const uint8_t* in, uint32_t in_len, uint8_t* out)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+	const __m256i pack = _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+	uint32_t i = 0;
+	uint32_t j = 0;
+
+	while (in_len - i > 32) {
+		__m256i str = _mm256_loadu_si256((const __m256i*)(in + i));
+
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4),
+				mask_2f);
+		__m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+
+		if (! _mm256_testz_si256(lo, hi)) {
+			break;
+		}
+
+		__m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+		__m256i roll = _mm256_shuffle_epi8(lut_roll,
+				_mm256_add_epi8(eq_2f, hi_nibbles));
+
+		str = _mm256_add_epi8(str, roll);
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, pack);
+		str = _mm256_permutevar8x32_epi32(str, join);
+
+		// Write exactly 24 bytes - 'out' may have no slack.
+		_mm_storeu_si128((__m128i*)(out + j), _mm256_castsi256_si128(str));
+		_mm_storel_epi64((__m128i*)(out + j + 16),
+				_mm256_extracti128_si256(str, 1));
+
+		i += 32;
+		j += 24;
+	}
+
+	return i;
+}
+
+// VBMI looks up all 64 characters at once in a 128-entry table, with invalid
+// characters - and anything outside ASCII - showing up in the high bit.
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static uint32_t
+decode_blocks_avx512vbmi(const uint8_t* in, uint32_t in_len, uint8_t* out)
+{
+	const __m512i lut_0 = _mm512_loadu_si512(base64_decode_vbmi_a);
+	const __m512i lut_1 = _mm512_loadu_si512(base64_decode_vbmi_a + 64);
+	const __m512i pack = _mm512_loadu_si512(base64_pack_vbmi_a);
+
+	uint32_t i = 0;
+	uint32_t j = 0;
+
+	while (in_len - i > 64) {
+		__m512i str = _mm512_loadu_si512(in + i);
+		__m512i values = _mm512_permutex2var_epi8(lut_0, str, lut_1);
+
+		if (_mm512_movepi8_mask(_mm512_or_si512(values, str)) != 0) {
+			break;
+		}
+
+		values = _mm512_maddubs_epi16(values, _mm512_set1_epi32(0x01400140));
+		values = _mm512_madd_epi16(values, _mm512_set1_epi32(0x00011000));
+		values = _mm512_permutexvar_epi8(pack, values);
+
+		// Write exactly 48 bytes - 'out' may have no slack.
+		_mm512_mask_storeu_epi8(out + j, 0x0000FFFFFFFFFFFFULL, values);
+
+		i += 64;
+		j += 48;
+	}
+
+	return i;
+}
+
+#endif // SA_B64_X86
@@ -0,0 +1,382 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_alloc.h"
+#include "sa_cache.h"
+#include "sa_clock.h"
+#include "sa_error.h"
+#include "sa_logging.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+//==========================================================
+// Typedefs & constants.
+//
+
+#define SA_CACHE_MIN_BUCKETS 16
+
+//==========================================================
+// Forward declarations.
+//
+
+static uint32_t hash_key(const char* key, uint32_t key_len);
+static sa_cache_entry** find_entry(sa_cache* cache, const char* key, uint32_t key_len);
+static uint8_t* copy_value(const sa_cache* cache, const uint8_t* value, size_t size);
+static void lru_unlink(sa_cache* cache, sa_cache_entry* entry);
+static void lru_push_head(sa_cache* cache, sa_cache_entry* entry);
+static void remove_entry(sa_cache* cache, sa_cache_entry** link);
+static void free_entry(const sa_cache* cache, sa_cache_entry* entry);
+static void evict(sa_cache* cache);
+
+//==========================================================
+// Public API.
+//
+
+sa_cache_cfg*
+sa_cache_cfg_init(sa_cache_cfg* cfg)
+{
+	cfg->ttl = 0;
+	cfg->stale_ttl = 0;
+	cfg->max_entries = 1024;
+	cfg->max_bytes = 1024 * 1024;
+	return cfg;
+}
+
+sa_cache*
+sa_cache_new(const sa_cache_cfg* cfg, const sa_allocator* alloc)
+{
+	sa_cache* cache = (sa_cache*) malloc(sizeof(sa_cache));
+	if (cache == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_cache");
+		return NULL;
+	}
+
+	uint32_t n_buckets = SA_CACHE_MIN_BUCKETS;
+	while (n_buckets < cfg->max_entries && n_buckets < (1u << 31)) {
+		n_buckets <<= 1;
+	}
+
+	cache->buckets = (sa_cache_entry**) calloc(n_buckets, sizeof(sa_cache_entry*));
+	if (cache->buckets == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_cache buckets");
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->cfg = *cfg;
+	cache->alloc = alloc;
+	cache->n_buckets = n_buckets;
+	cache->lru_head = NULL;
+	cache->lru_tail = NULL;
+	cache->n_entries = 0;
+	cache->n_bytes = 0;
+
+	return cache;
+}
+
+void
+sa_cache_destroy(sa_cache* cache)
+{
+	sa_cache_entry* entry = cache->lru_head;
+	while (entry != NULL) {
+		sa_cache_entry* next = entry->lru_next;
+		free_entry(cache, entry);
+		entry = next;
+	}
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
+
+sa_cache_result
+sa_cache_get(sa_cache* cache, const char* key, uint32_t key_len, uint8_t** r, size_t* size_r)
+{
+	uint64_t now = sa_now_ms();
+	sa_cache_result res = SA_CACHE_MISS;
+
+	pthread_mutex_lock(&cache->lock);
+
+	sa_cache_entry** link = find_entry(cache, key, key_len);
+	sa_cache_entry* entry = *link;
+
+	if (entry == NULL) {
+		pthread_mutex_unlock(&cache->lock);
+		return SA_CACHE_MISS;
+	}
+
+	uint64_t age = now - entry->fetched_ms;
+
+	if (age <= (uint64_t)cache->cfg.ttl) {
+		res = SA_CACHE_HIT;
+	}
+	else if (age <= (uint64_t)cache->cfg.ttl + (uint64_t)cache->cfg.stale_ttl) {
+		if (entry->refreshing) {
+			// another caller is already refreshing, serve the stale value
+			res = SA_CACHE_HIT;
+		}
+		else {
+			entry->refreshing = true;
+			res = SA_CACHE_REFRESH;
+		}
+	}
+	else {
+		// too old to serve at all
+		remove_entry(cache, link);
+		pthread_mutex_unlock(&cache->lock);
+		return SA_CACHE_MISS;
+	}
+
+	uint8_t* value = copy_value(cache, entry->value, entry->size);
+	if (value == NULL) {
+		if (res == SA_CACHE_REFRESH) {
+			entry->refreshing = false;
+		}
+
+		pthread_mutex_unlock(&cache->lock);
+		return SA_CACHE_MISS;
+	}
+
+	lru_unlink(cache, entry);
+	lru_push_head(cache, entry);
+
+	*r = value;
+	*size_r = entry->size;
+
+	pthread_mutex_unlock(&cache->lock);
+	return res;
+}
+
+void
+sa_cache_put(sa_cache* cache, const char* key, uint32_t key_len, const uint8_t* value, size_t size)
+{
+	if (size > cache->cfg.max_bytes || cache->cfg.max_entries == 0) {
+		return;
+	}
+
+	sa_cache_entry* entry = (sa_cache_entry*) malloc(sizeof(sa_cache_entry));
+	char* key_copy = (char*) malloc(key_len);
+	uint8_t* value_copy = copy_value(cache, value, size);
+
+	if (entry == NULL || key_copy == NULL || value_copy == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_cache entry");
+		free(entry);
+		free(key_copy);
+
+		sa_free(cache->alloc, value_copy);
+
+		return;
+	}
+
+	memcpy(key_copy, key, key_len);
+
+	entry->key = key_copy;
+	entry->key_len = key_len;
+	entry->value = value_copy;
+	entry->size = size;
+	entry->fetched_ms = sa_now_ms();
+	entry->refreshing = false;
+
+	pthread_mutex_lock(&cache->lock);
+
+	sa_cache_entry** link = find_entry(cache, key, key_len);
+	if (*link != NULL) {
+		remove_entry(cache, link);
+		link = find_entry(cache, key, key_len);
+	}
+
+	entry->next = NULL;
+	*link = entry;
+	lru_push_head(cache, entry);
+	cache->n_entries++;
+	cache->n_bytes += size;
+
+	evict(cache);
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void
+sa_cache_free_value(const sa_cache* cache, uint8_t* value, size_t size)
+{
+	sa_zero(value, size);
+	sa_free(cache->alloc, value);
+}
+
+void
+sa_cache_refresh_failed(sa_cache* cache, const char* key, uint32_t key_len)
+{
+	pthread_mutex_lock(&cache->lock);
+
+	sa_cache_entry* entry = *find_entry(cache, key, key_len);
+	if (entry != NULL) {
+		entry->refreshing = false;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+sa_err
+sa_cache_finish(sa_cache* cache, const char* key, uint32_t key_len, sa_cache_result cache_res,
+		uint8_t* stale, size_t stale_size, sa_err err, uint8_t** r, size_t* size_r)
+{
+	if (err.code == SA_OK) {
+		sa_cache_put(cache, key, key_len, *r, *size_r);
+	}
+
+	if (cache_res == SA_CACHE_REFRESH) {
+		if (err.code != SA_OK) {
+			// keep serving the stale secret until a refresh succeeds
+			sa_g_log_function("ERR: failed to refresh cached secret, serving stale value");
+			sa_cache_refresh_failed(cache, key, key_len);
+
+			*r = stale;
+			*size_r = stale_size;
+			err.code = SA_OK;
+			return err;
+		}
+
+		sa_cache_free_value(cache, stale, stale_size);
+	}
+
+	return err;
+}
+
+//==========================================================
+// Local helpers.
+//
+
+// FNV-1a
+static uint32_t
+hash_key(const char* key, uint32_t key_len)
+{
+	uint32_t h = 2166136261u;
+
+	for (uint32_t i = 0; i < key_len; i++) {
+		h ^= (uint8_t)key[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+// returns the link pointing at the entry for key, or at the NULL ending its bucket
+static sa_cache_entry**
+find_entry(sa_cache* cache, const char* key, uint32_t key_len)
+{
+	uint32_t bucket = hash_key(key, key_len) & (cache->n_buckets - 1);
+	sa_cache_entry** link = &cache->buckets[bucket];
+
+	while (*link != NULL) {
+		sa_cache_entry* entry = *link;
+		if (entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+			break;
+		}
+
+		link = &entry->next;
+	}
+
+	return link;
+}
+
+// extra byte - if this is a string, the caller will add '\0'
+static uint8_t*
+copy_value(const sa_cache* cache, const uint8_t* value, size_t size)
+{
+	uint8_t* copy = (uint8_t*) sa_alloc(cache->alloc, size + 1);
+	if (copy != NULL) {
+		memcpy(copy, value, size);
+	}
+
+	return copy;
+}
+
+static void
+lru_unlink(sa_cache* cache, sa_cache_entry* entry)
+{
+	if (entry->lru_prev != NULL) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	}
+	else {
+		cache->lru_head = entry->lru_next;
+	}
+
+	if (entry->lru_next != NULL) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	}
+	else {
+		cache->lru_tail = entry->lru_prev;
+	}
+}
+
+static void
+lru_push_head(sa_cache* cache, sa_cache_entry* entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+
+	if (cache->lru_head != NULL) {
+		cache->lru_head->lru_prev = entry;
+	}
+	else {
+		cache->lru_tail = entry;
+	}
+
+	cache->lru_head = entry;
+}
+
+static void
+remove_entry(sa_cache* cache, sa_cache_entry** link)
+{
+	sa_cache_entry* entry = *link;
+
+	*link = entry->next;
+	lru_unlink(cache, entry);
+	cache->n_entries--;
+	cache->n_bytes -= entry->size;
+
+	free_entry(cache, entry);
+}
+
+static void
+free_entry(const sa_cache* cache, sa_cache_entry* entry)
+{
+	sa_cache_free_value(cache, entry->value, entry->size);
+	free(entry->key);
+	free(entry);
+}
+
+static void
+evict(sa_cache* cache)
+{
+	while (cache->lru_tail != NULL &&
+			(cache->n_entries > cache->cfg.max_entries ||
+			cache->n_bytes > cache->cfg.max_bytes)) {
+		sa_cache_entry* lru = cache->lru_tail;
+		remove_entry(cache, find_entry(cache, lru->key, lru->key_len));
+	}
+}
@@ -19,14 +19,21 @@
 // Includes.
 //
 
+#include "sa_alloc.h"
 #include "sa_secrets.h"
 #include "sa_socket.h"
 #include "sa_logging.h"
 #include "sa_client.h"
+#include "sa_endpoint.h"
 #include "sa_error.h"
+#include "sa_pool.h"
+#include "sa_cache.h"
+#include "sa_uring.h"
+#include "sa_request.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -37,7 +44,51 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
-#include "jansson.h"
+//==========================================================
+// Typedefs & constants.
+//
+
+// max requests sent ahead of their responses on one connection
+#define SA_PIPELINE_WINDOW 16
+
+// a path in a sa_secret_get_many batch
+typedef struct sa_batch_item_s {
+	sa_secret_ref ref;
+	sa_cache_result cache_res;
+	uint8_t* stale; // cached value served if a refresh fails
+	size_t stale_size;
+} sa_batch_item;
+
+struct sa_secret_handle_s {
+	const sa_client* client;
+	char* path; // owned copy, ref points into it
+	sa_secret_ref ref;
+	char* req; // framed request
+	uint32_t req_sz;
+};
+
+//==========================================================
+// Forward declarations.
+//
+
+static uint8_t* buf_or_none(uint8_t* buf, size_t cap);
+static sa_err get_secret(const sa_client* c, const sa_secret_ref* ref, const char* req, uint32_t req_sz, uint8_t** r, size_t* size_r, uint64_t deadline_ms);
+static sa_err fetch_shared(const sa_client* c, const sa_secret_ref* ref, const char* req, uint32_t req_sz, uint8_t** r, size_t* size_r, uint64_t deadline_ms);
+static sa_err fetch_ref(const sa_client* c, const sa_secret_ref* ref, const char* req, uint32_t req_sz, uint8_t* buf, size_t cap, uint8_t** r, size_t* size_r, uint64_t deadline_ms);
+static sa_err fetch_secret(const sa_client* c, const char* req, uint32_t req_sz, uint8_t* buf, size_t cap, uint8_t** r, size_t* size_r, uint64_t deadline_ms);
+static sa_err fetch_from(const sa_client* c, const sa_endpoint* ep, const char* req, uint32_t req_sz, uint8_t* buf, size_t cap, uint8_t** r, size_t* size_r, uint64_t deadline_ms);
+static sa_err fetch_hedged(const sa_client* c, const char* req, uint32_t req_sz, uint8_t** r, size_t* size_r, uint64_t deadline_ms);
+static sa_err fetch_value(const sa_client* c, const sa_endpoint* ep, const char* req, uint32_t req_sz, uint8_t* buf, size_t cap, uint8_t** r, size_t* size_r, uint64_t deadline_ms);
+static sa_err request_value(const sa_client* c, sa_socket* sock, const char* req, uint32_t req_sz, uint8_t* buf, size_t cap, uint8_t** r, size_t* size_r, uint64_t deadline_ms);
+static sa_err fetch_json_uring(const sa_client* c, const sa_endpoint* ep, const char* req, uint32_t req_sz, char** json_buf, uint64_t deadline_ms);
+static sa_err fetch_pipelined(const sa_client* c, sa_batch_item* items, size_t* pending, size_t n_pending, sa_secret_result* results, uint64_t deadline_ms);
+static sa_err pipeline_requests(const sa_client* c, sa_socket* sock, sa_batch_item* items, size_t* pending, size_t n_pending, sa_secret_result* results, size_t* n_done, uint64_t deadline_ms);
+static bool answered(sa_err err);
+static sa_err counted(const sa_client* c, sa_err err, bool cache_hit);
+static uint64_t client_deadline(const sa_client* c);
+static sa_err client_connect(const sa_client* c, const sa_endpoint* ep, sa_socket** sockp, bool* reused, uint64_t deadline_ms);
+static void client_release(const sa_endpoint* ep, sa_socket* sock, bool healthy);
+static const char* endpoint_pins(const sa_client* c, const sa_cfg* cfg, uint32_t i);
 
 //==========================================================
 // Public API.
@@ -46,75 +97,393 @@
 sa_client*
 sa_client_init(sa_client* c, sa_cfg* cfg) {
 	c->cfg = cfg;
+	c->endpoints = &c->endpoint;
+	c->n_endpoints = 1;
+	sa_endpoint_init(&c->endpoint, cfg->addr, cfg->port);
+	c->picks = NULL;
+	c->hedge = NULL;
+	c->flights = NULL;
+	c->stats = NULL;
+	c->cache = NULL;
+	c->resolver = NULL;
+	sa_scratch_init(&c->scratch, &cfg->alloc);
+	c->heap = false;
+
+	if (cfg->n_endpoints > 0) {
+		uint32_t n = (uint32_t)cfg->n_endpoints;
+		if (n > SA_MAX_ENDPOINTS) {
+			sa_g_log_function("ERR: %u endpoints, only the first %d are used", n, SA_MAX_ENDPOINTS);
+			n = SA_MAX_ENDPOINTS;
+		}
+
+		sa_endpoint* endpoints = (sa_endpoint*) malloc(n * sizeof(sa_endpoint));
+		uint64_t* picks = (uint64_t*) malloc(sizeof(uint64_t));
+		if (endpoints == NULL || picks == NULL) {
+			sa_g_log_function("ERR: could not allocate memory for endpoints, using addr and port");
+			free(endpoints);
+			free(picks);
+		}
+		else {
+			for (uint32_t i = 0; i < n; i++) {
+				sa_endpoint_init(&endpoints[i], cfg->endpoints[i].addr, cfg->endpoints[i].port);
+			}
+
+			// so that processes, and clients, don't all pick the same endpoints
+			*picks = sa_now_ns() ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)c;
+
+			c->endpoints = endpoints;
+			c->n_endpoints = n;
+			c->picks = picks;
+		}
+	}
+
+	if (cfg->pool_size > 0) {
+		for (uint32_t i = 0; i < c->n_endpoints; i++) {
+			c->endpoints[i].pool = sa_pool_new((uint32_t)cfg->pool_size,
+					(uint32_t)cfg->pool_idle_timeout);
+			if (c->endpoints[i].pool == NULL) {
+				sa_g_log_function("ERR: failed to create connection pool, pooling disabled");
+			}
+		}
+	}
+
+	if (cfg->hedge_percentile > 0) {
+		if (c->n_endpoints < 2) {
+			sa_g_log_function("ERR: hedging needs more than one endpoint, hedging disabled");
+		}
+		else {
+			c->hedge = sa_hedge_new((uint32_t)cfg->hedge_percentile,
+					(uint32_t)cfg->hedge_min_delay);
+			if (c->hedge == NULL) {
+				sa_g_log_function("ERR: failed to create hedge, hedging disabled");
+			}
+		}
+	}
+
+	if (cfg->coalesce) {
+		c->flights = sa_flights_new(&cfg->alloc);
+		if (c->flights == NULL) {
+			sa_g_log_function("ERR: failed to create flights, coalescing disabled");
+		}
+	}
+
+	if (cfg->stats) {
+		c->stats = sa_stats_new();
+		if (c->stats == NULL) {
+			sa_g_log_function("ERR: failed to create stats, stats disabled");
+		}
+	}
+
+	if (cfg->cache.ttl > 0) {
+		c->cache = sa_cache_new(&cfg->cache, &cfg->alloc);
+		if (c->cache == NULL) {
+			sa_g_log_function("ERR: failed to create secret cache, caching disabled");
+		}
+	}
+
+	if (cfg->pinned_addrs != NULL && cfg->n_endpoints > 0) {
+		sa_g_log_function("ERR: pinned_addrs is ignored with endpoints, pin each endpoint's instead");
+	}
+
+	bool pinned = false;
+	for (uint32_t i = 0; i < c->n_endpoints; i++) {
+		pinned = pinned || endpoint_pins(c, cfg, i) != NULL;
+	}
+
+	if (cfg->dns_ttl > 0 || pinned) {
+		c->resolver = sa_resolver_new(cfg->dns_ttl);
+		if (c->resolver == NULL) {
+			sa_g_log_function("ERR: failed to create resolver, addresses are looked up per connection");
+		}
+		else {
+			for (uint32_t i = 0; i < c->n_endpoints; i++) {
+				const char* pins = endpoint_pins(c, cfg, i);
+				if (pins != NULL) {
+					sa_resolver_pin(c->resolver, c->endpoints[i].addr, c->endpoints[i].port, pins);
+				}
+			}
+		}
+	}
+
+	if (cfg->io_uring && ! sa_uring_available()) {
+		sa_g_log_function("ERR: io_uring backend unavailable, using poll");
+	}
+
 	return c;
 }
 
 sa_client*
 sa_client_new(sa_cfg* cfg) {
 	sa_client* c = (sa_client*) malloc(sizeof(sa_client));
-	return sa_client_init(c, cfg);
+	sa_client_init(c, cfg);
+	c->heap = true;
+	return c;
+}
+
+void
+sa_client_destroy(sa_client* c) {
+	for (uint32_t i = 0; i < c->n_endpoints; i++) {
+		if (c->endpoints[i].pool != NULL) {
+			sa_pool_destroy(c->endpoints[i].pool);
+			c->endpoints[i].pool = NULL;
+		}
+
+		if (c->endpoints != &c->endpoint) {
+			sa_endpoint_destroy(&c->endpoints[i]);
+		}
+	}
+
+
+	if (c->endpoints != &c->endpoint) {
+		free(c->endpoints);
+		free(c->picks);
+		c->endpoints = &c->endpoint;
+		c->n_endpoints = 1;
+		c->picks = NULL;
+	}
+
+	sa_endpoint_destroy(&c->endpoint);
+
+	if (c->hedge != NULL) {
+		sa_hedge_destroy(c->hedge);
+		c->hedge = NULL;
+	}
+
+	if (c->flights != NULL) {
+		sa_flights_destroy(c->flights);
+		c->flights = NULL;
+	}
+
+	if (c->stats != NULL) {
+		sa_stats_destroy(c->stats);
+		c->stats = NULL;
+	}
+
+	if (c->cache != NULL) {
+		sa_cache_destroy(c->cache);
+		c->cache = NULL;
+	}
+
+	if (c->resolver != NULL) {
+		sa_resolver_destroy(c->resolver);
+		c->resolver = NULL;
+	}
+
+	sa_scratch_destroy(&c->scratch);
+
+	if (c->heap) {
+		free(c);
+	}
 }
 
 sa_err
 sa_secret_get_bytes(const sa_client* c, const char* path, uint8_t** r, size_t* size_r) {
-	sa_err err;
-	err.code = SA_OK;
-
-	sa_cfg* cfg = c->cfg;
+	sa_secret_ref ref;
+	sa_err err = sa_parse_secret_path(path, &ref);
+	if (err.code != SA_OK) {
+		return err;
+	}
 
-	// path format will be "secrets[:resource_substring]:key"
-	const char* secret_request = path + sizeof(SA_SECRETS_PATH_REFIX) - 1;
-	uint32_t secret_request_len = (uint32_t)strlen(secret_request);
+	return get_secret(c, &ref, NULL, 0, r, size_r, client_deadline(c));
+}
 
-	if (secret_request_len == 0) {
-		sa_g_log_function("ERR: empty secret key");
-		err.code = SA_FAILED_BAD_REQUEST;
+sa_err
+sa_secret_get_bytes_by(const sa_client* c, const char* path, uint64_t deadline_ms, uint8_t** r,
+		size_t* size_r) {
+	sa_secret_ref ref;
+	sa_err err = sa_parse_secret_path(path, &ref);
+	if (err.code != SA_OK) {
 		return err;
 	}
 
-	const char* res = NULL;
-	uint32_t res_len = 0;
-	const char* key = strrchr(secret_request, ':');
+	return get_secret(c, &ref, NULL, 0, r, size_r, deadline_ms);
+}
 
-	if (key == NULL) {
-		// no resource name
-		key = secret_request;
+void
+sa_client_get_coalesce_stats(const sa_client* c, sa_coalesce_stats* stats) {
+	if (c->flights == NULL) {
+		stats->fetches = 0;
+		stats->coalesced = 0;
+		return;
 	}
-	else {
-		res = secret_request;
-		res_len = (uint32_t)(key - secret_request);
-		key++;
+
+	sa_flights_get_stats(c->flights, stats);
+}
+
+void
+sa_client_get_stats(const sa_client* c, sa_stats* stats, bool reset) {
+	if (c->stats == NULL) {
+		memset(stats, 0, sizeof(sa_stats));
+		return;
 	}
 
-	sa_socket* sock = NULL;
-	err = sa_connect_addr_port(&sock, cfg->addr, cfg->port, &cfg->tls, cfg->timeout);
+	sa_stats_snapshot(c->stats, stats, reset);
+}
+
+void
+sa_secret_free(const sa_client* c, uint8_t* secret, size_t size) {
+	if (secret == NULL) {
+		return;
+	}
+
+	sa_zero(secret, size);
+	sa_free(&c->cfg->alloc, secret);
+}
+
+sa_err
+sa_secret_get_into(const sa_client* c, const char* path, uint8_t* buf, size_t cap, size_t* size_r) {
+	sa_secret_ref ref;
+	sa_err err = sa_parse_secret_path(path, &ref);
 	if (err.code != SA_OK) {
-		sa_g_log_function("ERR: failed to create socket");
 		return err;
 	}
 
-	uint32_t key_len = (uint32_t)strlen(key);
-	char* json_buf = NULL;
-	err = sa_request_secret(&json_buf, sock, res, res_len, key, key_len, cfg->timeout);
+	return counted(c, fetch_ref(c, &ref, NULL, 0, buf_or_none(buf, cap), cap, NULL, size_r,
+			client_deadline(c)), false);
+}
 
-	close(sock->fd);
-	sa_socket_destroy(sock);
+sa_err
+sa_secret_prepare(const sa_client* c, const char* path, sa_secret_handle** hp) {
+	sa_err err;
+	err.code = SA_OK;
 
+	sa_secret_handle* h = (sa_secret_handle*) malloc(sizeof(sa_secret_handle));
+	char* path_copy = strdup(path);
+	if (h == NULL || path_copy == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for secret handle");
+		free(h);
+		free(path_copy);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	err = sa_parse_secret_path(path_copy, &h->ref);
 	if (err.code != SA_OK) {
-		sa_g_log_function("ERR: empty secret json response");
+		free(h);
+		free(path_copy);
 		return err;
 	}
 
-	uint8_t* buf = sa_parse_json(json_buf, size_r);
-	free(json_buf);
+	h->req = (char*) malloc(sa_secret_request_max_size(h->ref.res_len, h->ref.key_len));
+	if (h->req == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for secret handle");
+		free(h);
+		free(path_copy);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
 
-	if (buf == NULL) {
-		sa_g_log_function("ERR: unable to fetch secret");
-		err.code = SA_FAILED_BAD_REQUEST;
+	h->req_sz = sa_build_secret_request(h->req, h->ref.res, h->ref.res_len, h->ref.key,
+			h->ref.key_len);
+	h->client = c;
+	h->path = path_copy;
+
+	*hp = h;
+	return err;
+}
+
+sa_err
+sa_secret_get_prepared(const sa_secret_handle* h, uint8_t** r, size_t* size_r) {
+	return get_secret(h->client, &h->ref, h->req, h->req_sz, r, size_r,
+			client_deadline(h->client));
+}
+
+sa_err
+sa_secret_get_prepared_into(const sa_secret_handle* h, uint8_t* buf, size_t cap, size_t* size_r) {
+	return counted(h->client, fetch_ref(h->client, &h->ref, h->req, h->req_sz,
+			buf_or_none(buf, cap), cap, NULL, size_r, client_deadline(h->client)), false);
+}
+
+void
+sa_secret_handle_destroy(sa_secret_handle* h) {
+	if (h == NULL) {
+		return;
+	}
+
+	free(h->req);
+	free(h->path);
+	free(h);
+}
+
+sa_err
+sa_secret_get_many(const sa_client* c, const char** paths, size_t n, sa_secret_result* results) {
+	sa_err err;
+	err.code = SA_OK;
+
+	if (n == 0) {
 		return err;
 	}
 
-	*r = buf;
+	sa_batch_item* items = (sa_batch_item*) malloc(n * sizeof(sa_batch_item));
+	size_t* pending = (size_t*) malloc(n * sizeof(size_t));
+	if (items == NULL || pending == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for secret batch");
+		free(items);
+		free(pending);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	size_t n_pending = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		sa_secret_result* result = &results[i];
+		sa_batch_item* item = &items[i];
+
+		result->value = NULL;
+		result->size = 0;
+		result->err = sa_parse_secret_path(paths[i], &item->ref);
+		item->cache_res = SA_CACHE_MISS;
+		item->stale = NULL;
+		item->stale_size = 0;
+
+		if (result->err.code != SA_OK) {
+			continue;
+		}
+
+		if (c->cache != NULL) {
+			item->cache_res = sa_cache_get(c->cache, item->ref.secret_request,
+					item->ref.secret_request_len, &item->stale, &item->stale_size);
+
+			if (item->cache_res == SA_CACHE_HIT) {
+				result->value = item->stale;
+				result->size = item->stale_size;
+				counted(c, result->err, true);
+				continue;
+			}
+		}
+
+		pending[n_pending++] = i;
+	}
+
+	if (n_pending != 0) {
+		fetch_pipelined(c, items, pending, n_pending, results, client_deadline(c));
+	}
+
+	if (c->cache != NULL) {
+		for (size_t i = 0; i < n_pending; i++) {
+			sa_batch_item* item = &items[pending[i]];
+			sa_secret_result* result = &results[pending[i]];
+
+			result->err = sa_cache_finish(c->cache, item->ref.secret_request,
+					item->ref.secret_request_len, item->cache_res, item->stale,
+					item->stale_size, result->err, &result->value, &result->size);
+		}
+	}
+
+	for (size_t i = 0; i < n_pending; i++) {
+		counted(c, results[pending[i]].err, false);
+	}
+
+	free(items);
+	free(pending);
+
+	for (size_t i = 0; i < n; i++) {
+		if (results[i].err.code != SA_OK) {
+			return results[i].err;
+		}
+	}
+
 	return err;
 }
 
@@ -124,6 +493,25 @@ sa_cfg_init(sa_cfg* cfg) {
 	cfg->port = NULL;
 	cfg->timeout = 1000;
 	sa_tls_cfg_init(&cfg->tls);
+	cfg->pool_size = 0;
+	cfg->pool_idle_timeout = 30000;
+	sa_cache_cfg_init(&cfg->cache);
+	cfg->io_uring = false;
+	cfg->dns_ttl = 0;
+	cfg->pinned_addrs = NULL;
+	cfg->peer_uid = -1;
+	cfg->alloc.alloc = NULL;
+	cfg->alloc.free = NULL;
+	cfg->alloc.udata = NULL;
+	cfg->endpoints = NULL;
+	cfg->n_endpoints = 0;
+	cfg->hedge_percentile = 0;
+	cfg->hedge_min_delay = 10;
+	cfg->coalesce = false;
+	cfg->stats = false;
+	cfg->trace.start = NULL;
+	cfg->trace.end = NULL;
+	cfg->trace.udata = NULL;
 	return cfg;
 }
 
@@ -131,4 +519,623 @@ sa_cfg*
 sa_cfg_new() {
 	sa_cfg* cfg = (sa_cfg*) malloc(sizeof(sa_cfg));
 	return sa_cfg_init(cfg);
-}
\ No newline at end of file
+}
+
+//==========================================================
+// Local helpers.
+//
+
+// buf may be NULL when cap is 0, to learn the size of a secret
+static uint8_t*
+buf_or_none(uint8_t* buf, size_t cap) {
+	static uint8_t none;
+	return buf == NULL && cap == 0 ? &none : buf;
+}
+
+/*
+ * get_secret serves the secret from the cache, or requests it with req.
+ * If req is NULL the request is built from ref, only when it is needed.
+*/
+static sa_err
+get_secret(const sa_client* c, const sa_secret_ref* ref, const char* req, uint32_t req_sz,
+		uint8_t** r, size_t* size_r, uint64_t deadline_ms) {
+	if (c->cache == NULL) {
+		return counted(c, fetch_shared(c, ref, req, req_sz, r, size_r, deadline_ms), false);
+	}
+
+	uint8_t* stale = NULL;
+	size_t stale_size = 0;
+	sa_cache_result cache_res = sa_cache_get(c->cache, ref->secret_request,
+			ref->secret_request_len, &stale, &stale_size);
+
+	if (cache_res == SA_CACHE_HIT) {
+		sa_err err;
+		err.code = SA_OK;
+		*r = stale;
+		*size_r = stale_size;
+		return counted(c, err, true);
+	}
+
+	sa_err err = fetch_shared(c, ref, req, req_sz, r, size_r, deadline_ms);
+
+	return counted(c, sa_cache_finish(c->cache, ref->secret_request, ref->secret_request_len,
+			cache_res, stale, stale_size, err, r, size_r), false);
+}
+
+/*
+ * fetch_shared fetches the secret with fetch_ref, unless coalescing is enabled
+ * and another caller is already fetching it, in which case it waits for, and
+ * returns a copy of, that caller's result.
+*/
+static sa_err
+fetch_shared(const sa_client* c, const sa_secret_ref* ref, const char* req, uint32_t req_sz,
+		uint8_t** r, size_t* size_r, uint64_t deadline_ms) {
+	if (c->flights == NULL) {
+		return fetch_ref(c, ref, req, req_sz, NULL, 0, r, size_r, deadline_ms);
+	}
+
+	sa_flight* f;
+	if (! sa_flight_join(c->flights, ref->secret_request, ref->secret_request_len, &f)) {
+		return sa_flight_wait(c->flights, f, deadline_ms, r, size_r);
+	}
+
+	sa_err err = fetch_ref(c, ref, req, req_sz, NULL, 0, r, size_r, deadline_ms);
+
+	sa_flight_land(c->flights, f, err, err.code == SA_OK ? *r : NULL,
+			err.code == SA_OK ? *size_r : 0);
+
+	return err;
+}
+
+// fetch_secret with req, or if it is NULL a request built from ref
+static sa_err
+fetch_ref(const sa_client* c, const sa_secret_ref* ref, const char* req, uint32_t req_sz,
+		uint8_t* buf, size_t cap, uint8_t** r, size_t* size_r, uint64_t deadline_ms) {
+	if (req != NULL) {
+		return fetch_secret(c, req, req_sz, buf, cap, r, size_r, deadline_ms);
+	}
+
+	char built[sa_secret_request_max_size(ref->res_len, ref->key_len)];
+	uint32_t built_sz = sa_build_secret_request(built, ref->res, ref->res_len, ref->key,
+			ref->key_len);
+
+	return fetch_secret(c, built, built_sz, buf, cap, r, size_r, deadline_ms);
+}
+
+/*
+ * fetch_secret requests the secret from the agent with the framed request req,
+ * bypassing the cache. If buf is not NULL the secret is decoded into its cap
+ * bytes, using the poll backend, otherwise r is set to an allocated secret.
+ * Endpoints are picked by sa_endpoint_pick until one answers, or hedged if configured.
+*/
+static sa_err
+fetch_secret(const sa_client* c, const char* req, uint32_t req_sz, uint8_t* buf, size_t cap,
+		uint8_t** r, size_t* size_r, uint64_t deadline_ms) {
+	if (buf == NULL && c->hedge != NULL) {
+		sa_err err = fetch_hedged(c, req, req_sz, r, size_r, deadline_ms);
+
+		if (err.code == SA_FAILED_BAD_REQUEST) {
+			sa_g_log_function("ERR: unable to fetch secret");
+		}
+		else if (err.code != SA_OK) {
+			sa_g_log_function("ERR: empty secret json response");
+		}
+
+		return err;
+	}
+
+	sa_err err;
+	err.code = SA_FAILED_INTERNAL;
+
+	// the phases below are recorded against the client's stats and trace hooks
+	sa_probe probe;
+	sa_probe_init(&probe, c->stats, &c->cfg->trace);
+	sa_probe* prev = sa_probe_enter(&probe);
+
+	uint64_t tried = 0;
+	sa_endpoint* ep;
+
+	while ((ep = sa_endpoint_pick(c->endpoints, c->n_endpoints, tried, c->picks)) != NULL) {
+		tried |= (uint64_t)1 << (ep - c->endpoints);
+
+		uint64_t start_ns = sa_now_ns();
+		sa_phase_start(SA_PHASE_REQUEST);
+		err = fetch_from(c, ep, req, req_sz, buf, cap, r, size_r, deadline_ms);
+		sa_phase_end(SA_PHASE_REQUEST, 0);
+		sa_endpoint_done(ep, (sa_now_ns() - start_ns) / 1000, err.code);
+
+		if (answered(err) || err.code == SA_FAILED_TIMEOUT) {
+			break;
+		}
+
+		sa_g_log_function("ERR: agent %s unavailable", ep->addr);
+	}
+
+	sa_probe_leave(prev);
+
+	return err;
+}
+
+// fetch_secret from the agent at ep
+static sa_err
+fetch_from(const sa_client* c, const sa_endpoint* ep, const char* req, uint32_t req_sz,
+		uint8_t* buf, size_t cap, uint8_t** r, size_t* size_r, uint64_t deadline_ms) {
+	sa_err err;
+
+	if (buf != NULL || ! c->cfg->io_uring || ! sa_uring_available()) {
+		err = fetch_value(c, ep, req, req_sz, buf, cap, r, size_r, deadline_ms);
+
+		if (err.code == SA_FAILED_BAD_REQUEST) {
+			sa_g_log_function("ERR: unable to fetch secret");
+		}
+		else if (err.code != SA_OK && err.code != SA_FAILED_BUFFER_TOO_SMALL) {
+			sa_g_log_function("ERR: empty secret json response");
+		}
+
+		return err;
+	}
+
+	char* json_buf = NULL;
+	err = fetch_json_uring(c, ep, req, req_sz, &json_buf, deadline_ms);
+
+	if (err.code != SA_OK) {
+		sa_g_log_function("ERR: empty secret json response");
+		return err;
+	}
+
+	size_t json_sz = strlen(json_buf);
+	uint8_t* secret = sa_parse_json_in_place(json_buf, json_sz, size_r);
+
+	if (secret == NULL) {
+		// may hold part of the secret
+		sa_zero(json_buf, json_sz + 1);
+		sa_free(&c->cfg->alloc, json_buf);
+		sa_g_log_function("ERR: unable to fetch secret");
+		err.code = SA_FAILED_BAD_REQUEST;
+		return err;
+	}
+
+	*r = secret;
+	return err;
+}
+
+/*
+ * fetch_hedged sends req to a picked endpoint and, if it has not answered
+ * within the hedge delay, to another as well, returning whichever answer
+ * arrives first. The other request is abandoned and its connection closed.
+ * An endpoint that fails without answering is replaced by another at once.
+*/
+static sa_err
+fetch_hedged(const sa_client* c, const char* req, uint32_t req_sz, uint8_t** r, size_t* size_r,
+		uint64_t deadline_ms) {
+	sa_request* reqs[2] = { NULL, NULL };
+	uint64_t starts_ns[2] = { 0, 0 };
+	uint64_t tried = 0;
+	uint64_t all = c->n_endpoints == 64 ? UINT64_MAX : ((uint64_t)1 << c->n_endpoints) - 1;
+	bool hedged = false;
+	uint64_t hedge_ms = sa_now_ms() + sa_hedge_delay_ms(c->hedge);
+
+	sa_err err;
+	err.code = SA_FAILED_TIMEOUT;
+
+	while (true) {
+		int n_active = (reqs[0] != NULL) + (reqs[1] != NULL);
+		uint64_t now_ms = sa_now_ms();
+
+		// start on the next endpoint when nothing is in flight, or to hedge a slow one
+		if (tried != all && now_ms < deadline_ms &&
+				(n_active == 0 || (n_active == 1 && ! hedged && now_ms >= hedge_ms))) {
+			int slot = reqs[0] == NULL ? 0 : 1;
+			sa_endpoint* ep = sa_endpoint_pick(c->endpoints, c->n_endpoints, tried, c->picks);
+			tried |= (uint64_t)1 << (ep - c->endpoints);
+
+			if (n_active == 1) {
+				sa_g_log_function("hedging request to %s", ep->addr);
+				hedged = true;
+			}
+
+			starts_ns[slot] = sa_now_ns();
+			err = sa_request_start_framed(c, ep, req, req_sz, deadline_ms, &reqs[slot]);
+			if (err.code != SA_OK) {
+				reqs[slot] = NULL;
+			}
+
+			continue;
+		}
+
+		if (n_active == 0) {
+			// every endpoint failed, or the deadline passed, err is the last failure
+			return err;
+		}
+
+		bool finished = false;
+
+		for (int i = 0; i < 2; i++) {
+			if (reqs[i] == NULL || reqs[i]->state != SA_REQUEST_DONE) {
+				continue;
+			}
+
+			err = sa_request_result(reqs[i], r, size_r);
+
+			if (answered(err)) {
+				sa_hedge_record(c->hedge, (sa_now_ns() - starts_ns[i]) / 1000);
+
+				// abandon the other request, if any
+				sa_request_destroy(reqs[i]);
+				if (reqs[1 - i] != NULL) {
+					sa_request_destroy(reqs[1 - i]);
+				}
+
+				return err;
+			}
+
+			sa_request_destroy(reqs[i]);
+			reqs[i] = NULL;
+			finished = true;
+		}
+
+		if (finished) {
+			continue;
+		}
+
+		struct pollfd pfds[2];
+		sa_request* polled[2];
+		int n_pfds = 0;
+		int timeout = -1;
+
+		for (int i = 0; i < 2; i++) {
+			if (reqs[i] == NULL) {
+				continue;
+			}
+
+			pfds[n_pfds].fd = sa_request_fd(reqs[i], &pfds[n_pfds].events);
+			pfds[n_pfds].revents = 0;
+			polled[n_pfds++] = reqs[i];
+
+			int req_timeout = sa_request_timeout(reqs[i]);
+			if (timeout < 0 || req_timeout < timeout) {
+				timeout = req_timeout;
+			}
+		}
+
+		if (! hedged && tried != all && sa_remaining_ms(hedge_ms) < timeout) {
+			timeout = sa_remaining_ms(hedge_ms);
+		}
+
+		if (poll(pfds, (nfds_t)n_pfds, timeout) < 0 && errno != EINTR) {
+			sa_g_log_function("ERR: poll failed while hedging, errno: %d", errno);
+		}
+
+		for (int i = 0; i < n_pfds; i++) {
+			sa_request_advance(polled[i]);
+		}
+	}
+}
+
+// fetch_secret from ep using the poll backend, decoding the secret as it is received
+static sa_err
+fetch_value(const sa_client* c, const sa_endpoint* ep, const char* req, uint32_t req_sz,
+		uint8_t* buf, size_t cap, uint8_t** r, size_t* size_r, uint64_t deadline_ms) {
+	sa_cfg* cfg = c->cfg;
+
+	sa_socket* sock = NULL;
+	bool reused = false;
+	sa_err err = client_connect(c, ep, &sock, &reused, deadline_ms);
+	if (err.code != SA_OK) {
+		sa_g_log_function("ERR: failed to create socket");
+		return err;
+	}
+
+	err = request_value(c, sock, req, req_sz, buf, cap, r, size_r, deadline_ms);
+
+	if (! answered(err) && err.code != SA_FAILED_TIMEOUT && reused) {
+		// The agent may have closed the pooled connection after it passed
+		// its liveness check. Retry once on a fresh connection.
+		sa_g_log_function("retrying request on a new connection");
+		sa_pool_close(sock);
+
+		err = sa_connect_addr_port(&sock, c->resolver, ep->addr, ep->port, &cfg->tls, cfg->peer_uid,
+				deadline_ms);
+		if (err.code != SA_OK) {
+			sa_g_log_function("ERR: failed to create socket");
+			return err;
+		}
+
+		err = request_value(c, sock, req, req_sz, buf, cap, r, size_r, deadline_ms);
+	}
+
+	client_release(ep, sock, answered(err));
+	return err;
+}
+
+// sends req on sock and reads the secret into buf, or if buf is NULL into an allocated r
+static sa_err
+request_value(const sa_client* c, sa_socket* sock, const char* req, uint32_t req_sz,
+		uint8_t* buf, size_t cap, uint8_t** r, size_t* size_r, uint64_t deadline_ms) {
+	if (buf != NULL) {
+		// the client is const to callers, its scratch buffer is taken atomically
+		return sa_request_secret_into(buf, cap, size_r, sock, req, req_sz,
+				(sa_scratch*)&c->scratch, deadline_ms);
+	}
+
+	return sa_request_secret_framed(r, size_r, sock, req, req_sz, &c->cfg->alloc, deadline_ms);
+}
+
+// requests the secret json from ep using the io_uring backend
+static sa_err
+fetch_json_uring(const sa_client* c, const sa_endpoint* ep, const char* req, uint32_t req_sz,
+		char** json_buf, uint64_t deadline_ms) {
+	sa_cfg* cfg = c->cfg;
+
+	sa_err err;
+	sa_socket* sock = ep->pool != NULL ? sa_pool_get(ep->pool) : NULL;
+
+	if (sock != NULL) {
+		if (c->stats != NULL) {
+			sa_stats_add(&c->stats->reused, 1);
+		}
+
+		err = sa_uring_request(sock, req, req_sz, &cfg->alloc, json_buf, deadline_ms);
+		client_release(ep, sock, err.code == SA_OK);
+
+		if (err.code == SA_OK || err.code == SA_FAILED_TIMEOUT) {
+			return err;
+		}
+
+		// as in fetch_value, retry once on a fresh connection
+		sa_g_log_function("retrying request on a new connection");
+	}
+
+	if (sa_is_unix_addr(ep->addr)) {
+		// local connects complete at once, and the agent is checked before it is sent anything
+		err = sa_connect_addr_port(&sock, c->resolver, ep->addr, ep->port, &cfg->tls, cfg->peer_uid,
+				deadline_ms);
+		if (err.code != SA_OK) {
+			return err;
+		}
+
+		err = sa_uring_request(sock, req, req_sz, &cfg->alloc, json_buf, deadline_ms);
+		client_release(ep, sock, err.code == SA_OK);
+		return err;
+	}
+
+	err = sa_uring_connect_request(&sock, c->resolver, ep->addr, ep->port, &cfg->tls, req, req_sz,
+			&cfg->alloc, json_buf, deadline_ms);
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	client_release(ep, sock, true);
+	return err;
+}
+
+/*
+ * fetch_pipelined requests the pending batch items on a single connection.
+ * Per item results, including agent errors, are set in results. If the
+ * connection fails the items without a response get the connection error.
+ * Those are sent to another endpoint, if there is one.
+*/
+static sa_err
+fetch_pipelined(const sa_client* c, sa_batch_item* items, size_t* pending, size_t n_pending,
+		sa_secret_result* results, uint64_t deadline_ms) {
+	size_t n_done = 0;
+	uint64_t tried = 0;
+	sa_endpoint* ep = sa_endpoint_pick(c->endpoints, c->n_endpoints, tried, c->picks);
+	bool retried = false;
+	sa_err err;
+
+	sa_probe probe;
+	sa_probe_init(&probe, c->stats, &c->cfg->trace);
+	sa_probe* prev = sa_probe_enter(&probe);
+
+	while (true) {
+		uint64_t start_ns = sa_now_ns();
+		sa_phase_start(SA_PHASE_REQUEST);
+		sa_socket* sock = NULL;
+		bool reused = false;
+		err = client_connect(c, ep, &sock, &reused, deadline_ms);
+
+		if (err.code == SA_OK) {
+			size_t n = 0;
+			err = pipeline_requests(c, sock, items, pending + n_done, n_pending - n_done, results,
+					&n, deadline_ms);
+			n_done += n;
+
+			client_release(ep, sock, err.code == SA_OK);
+		}
+		else {
+			sa_g_log_function("ERR: failed to create socket");
+		}
+
+		sa_phase_end(SA_PHASE_REQUEST, 0);
+
+		if (err.code == SA_OK || err.code == SA_FAILED_TIMEOUT) {
+			sa_endpoint_done(ep, (sa_now_ns() - start_ns) / 1000, err.code);
+			break;
+		}
+
+		if (reused && ! retried) {
+			// The agent may have closed the pooled connection after it passed
+			// its liveness check. Retry the rest once on a fresh connection.
+			sa_g_log_function("retrying %zu batched requests on a new connection",
+					n_pending - n_done);
+			retried = true;
+			continue;
+		}
+
+		sa_endpoint_done(ep, (sa_now_ns() - start_ns) / 1000, err.code);
+		sa_g_log_function("ERR: agent %s unavailable", ep->addr);
+
+		tried |= (uint64_t)1 << (ep - c->endpoints);
+		ep = sa_endpoint_pick(c->endpoints, c->n_endpoints, tried, c->picks);
+		if (ep == NULL) {
+			break;
+		}
+
+		retried = false;
+	}
+
+	sa_probe_leave(prev);
+
+	for (size_t i = n_done; i < n_pending; i++) {
+		results[pending[i]].err = err;
+	}
+
+	return err;
+}
+
+/*
+ * pipeline_requests writes the framed requests back to back, up to
+ * SA_PIPELINE_WINDOW ahead of the responses, and reads the responses
+ * which the agent sends in request order. n_done is set to the number
+ * of responses received.
+*/
+static sa_err
+pipeline_requests(const sa_client* c, sa_socket* sock, sa_batch_item* items, size_t* pending,
+		size_t n_pending, sa_secret_result* results, size_t* n_done, uint64_t deadline_ms) {
+	size_t sent = 0;
+	size_t received = 0;
+	char* req = NULL;
+	size_t req_cap = 0;
+
+	sa_err err;
+	err.code = SA_OK;
+
+	while (received < n_pending) {
+		// top the window back up once half of it has been answered
+		if (sent < n_pending && sent - received <= SA_PIPELINE_WINDOW / 2) {
+			size_t end = received + SA_PIPELINE_WINDOW;
+			if (end > n_pending) {
+				end = n_pending;
+			}
+
+			size_t req_max = 0;
+			for (size_t i = sent; i < end; i++) {
+				sa_secret_ref* ref = &items[pending[i]].ref;
+				req_max += sa_secret_request_max_size(ref->res_len, ref->key_len);
+			}
+
+			if (req_max > req_cap) {
+				char* tmp = (char*) realloc(req, req_max);
+				if (tmp == NULL) {
+					sa_g_log_function("ERR: could not allocate memory for batched requests");
+					err.code = SA_FAILED_INTERNAL;
+					break;
+				}
+
+				req = tmp;
+				req_cap = req_max;
+			}
+
+			uint32_t req_sz = 0;
+			for (; sent < end; sent++) {
+				sa_secret_ref* ref = &items[pending[sent]].ref;
+				req_sz += sa_build_secret_request(req + req_sz, ref->res, ref->res_len,
+						ref->key, ref->key_len);
+			}
+
+			sa_phase_start(SA_PHASE_SEND);
+			err = sa_write_n_bytes(sock, req_sz, req, deadline_ms);
+			sa_phase_end(SA_PHASE_SEND, req_sz);
+			if (err.code != SA_OK) {
+				sa_g_log_function("ERR: failed writing batched secret requests");
+				break;
+			}
+		}
+
+		char* json_buf = NULL;
+		err = sa_recv_secret_response(&json_buf, sock, &c->cfg->alloc, deadline_ms);
+		if (err.code != SA_OK) {
+			sa_g_log_function("ERR: failed reading batched secret response");
+			break;
+		}
+
+		sa_secret_result* result = &results[pending[received]];
+		size_t json_sz = strlen(json_buf);
+		result->value = sa_parse_json_in_place(json_buf, json_sz, &result->size);
+
+		if (result->value == NULL) {
+			sa_zero(json_buf, json_sz + 1);
+			sa_free(&c->cfg->alloc, json_buf);
+			sa_g_log_function("ERR: unable to fetch secret %s", items[pending[received]].ref.secret_request);
+			result->err.code = SA_FAILED_BAD_REQUEST;
+		}
+
+		received++;
+	}
+
+	free(req);
+	*n_done = received;
+	return err;
+}
+
+// true if the agent answered, so the connection is still good
+static bool
+answered(sa_err err) {
+	return err.code == SA_OK || err.code == SA_FAILED_BAD_REQUEST ||
+			err.code == SA_FAILED_BUFFER_TOO_SMALL;
+}
+
+// counts a secret asked for in the client's stats, returning its outcome
+static sa_err
+counted(const sa_client* c, sa_err err, bool cache_hit) {
+	if (c->stats != NULL) {
+		sa_stats_fetched(c->stats, err.code, cache_hit);
+	}
+
+	return err;
+}
+
+// the deadline of a call given the configured timeout
+static uint64_t
+client_deadline(const sa_client* c) {
+	return sa_deadline_ms(c->cfg->timeout);
+}
+
+// reuses a pooled connection to ep if one is available, otherwise connects
+static sa_err
+client_connect(const sa_client* c, const sa_endpoint* ep, sa_socket** sockp, bool* reused,
+		uint64_t deadline_ms) {
+	sa_cfg* cfg = c->cfg;
+
+	if (ep->pool != NULL) {
+		sa_socket* sock = sa_pool_get(ep->pool);
+		if (sock != NULL) {
+			*sockp = sock;
+			*reused = true;
+
+			if (c->stats != NULL) {
+				sa_stats_add(&c->stats->reused, 1);
+			}
+
+			sa_err err;
+			err.code = SA_OK;
+			return err;
+		}
+	}
+
+	*reused = false;
+	return sa_connect_addr_port(sockp, c->resolver, ep->addr, ep->port, &cfg->tls, cfg->peer_uid,
+			deadline_ms);
+}
+
+// pools healthy connections to ep, closes the rest
+static void
+client_release(const sa_endpoint* ep, sa_socket* sock, bool healthy) {
+	if (ep->pool != NULL && healthy) {
+		sa_pool_put(ep->pool, sock);
+		return;
+	}
+
+	sa_pool_close(sock);
+}
+
+// the addresses pinned for endpoint i, sa_cfg's apply only without endpoints
+static const char*
+endpoint_pins(const sa_client* c, const sa_cfg* cfg, uint32_t i) {
+	if (c->endpoints == &c->endpoint) {
+		return cfg->n_endpoints > 0 ? NULL : cfg->pinned_addrs;
+	}
+
+	return cfg->endpoints[i].pinned_addrs;
+}
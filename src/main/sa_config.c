@@ -0,0 +1,423 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_alloc.h"
+#include "sa_client.h"
+#include "sa_config.h"
+#include "sa_error.h"
+#include "sa_logging.h"
+#include "sa_secrets.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+//==========================================================
+// Typedefs & constants.
+//
+
+#define PREFIX_LEN (sizeof(SA_SECRETS_PATH_REFIX) - 1)
+
+// a reference being sorted, to find the references to the same secret
+typedef struct sort_entry_s {
+	const char* res;
+	uint32_t res_len;
+	const char* key;
+	uint32_t key_len;
+	size_t ref;
+} sort_entry;
+
+// sa_config_substitute's output
+typedef struct out_buf_s {
+	uint8_t* buf;
+	size_t pos;
+} out_buf;
+
+//==========================================================
+// Forward declarations.
+//
+
+static bool path_char(char ch);
+static sa_err add_ref(sa_config_refs* refs, size_t* cap, size_t offset, size_t len);
+static sa_err dedup(sa_config_refs* refs, const char* text);
+static void split(const char* token, size_t len, sort_entry* e);
+static int compare_entries(const void* a, const void* b);
+static int compare_bytes(const char* a, uint32_t a_len, const char* b, uint32_t b_len);
+static void write_size(void* udata, const uint8_t* data, size_t size, bool secret);
+static void write_out(void* udata, const uint8_t* data, size_t size, bool secret);
+
+//==========================================================
+// Public API.
+//
+
+sa_err
+sa_config_scan(const char* text, size_t len, sa_config_refs* refs)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	refs->client = NULL;
+	refs->secrets = NULL;
+	refs->n_secrets = 0;
+	refs->refs = NULL;
+	refs->n_refs = 0;
+
+	size_t cap = 0;
+	size_t i = 0;
+
+	// a reference has at least one character after the prefix
+	while (i + PREFIX_LEN < len) {
+		const char* s = (const char*) memchr(text + i, SA_SECRETS_PATH_REFIX[0],
+				len - PREFIX_LEN - i);
+		if (s == NULL) {
+			break;
+		}
+
+		size_t at = (size_t)(s - text);
+
+		if (memcmp(s, SA_SECRETS_PATH_REFIX, PREFIX_LEN) != 0 ||
+				(at != 0 && path_char(text[at - 1]))) {
+			i = at + 1;
+			continue;
+		}
+
+		size_t end = at + PREFIX_LEN;
+
+		while (end < len && path_char(text[end])) {
+			end++;
+		}
+
+		while (end > at + PREFIX_LEN && text[end - 1] == ':') {
+			end--;
+		}
+
+		if (end == at + PREFIX_LEN) {
+			i = end;
+			continue;
+		}
+
+		err = add_ref(refs, &cap, at, end - at);
+		if (err.code != SA_OK) {
+			return err;
+		}
+
+		i = end;
+	}
+
+	if (refs->n_refs == 0) {
+		return err;
+	}
+
+	return dedup(refs, text);
+}
+
+sa_err
+sa_config_fetch(const sa_client* c, sa_config_refs* refs)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	refs->client = c;
+
+	if (refs->n_secrets == 0) {
+		return err;
+	}
+
+	const char** paths = (const char**) malloc(refs->n_secrets * sizeof(const char*));
+	sa_secret_result* results = (sa_secret_result*) malloc(refs->n_secrets * sizeof(sa_secret_result));
+	if (paths == NULL || results == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for config secrets");
+		free(paths);
+		free(results);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	for (size_t i = 0; i < refs->n_secrets; i++) {
+		paths[i] = refs->secrets[i].path;
+	}
+
+	err = sa_client_prefetch(c, paths, refs->n_secrets, 0, results, NULL);
+
+	for (size_t i = 0; i < refs->n_secrets; i++) {
+		refs->secrets[i].result = results[i];
+	}
+
+	free(paths);
+	free(results);
+
+	return err;
+}
+
+sa_err
+sa_config_write(const sa_config_refs* refs, const char* text, size_t len,
+		sa_config_write_func func, void* udata)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	for (size_t i = 0; i < refs->n_secrets; i++) {
+		if (refs->secrets[i].result.err.code != SA_OK) {
+			return refs->secrets[i].result.err;
+		}
+	}
+
+	size_t pos = 0;
+
+	for (size_t i = 0; i < refs->n_refs; i++) {
+		const sa_config_ref* ref = &refs->refs[i];
+		const sa_secret_result* result = &refs->secrets[ref->secret].result;
+
+		if (ref->offset != pos) {
+			func(udata, (const uint8_t*)text + pos, ref->offset - pos, false);
+		}
+
+		func(udata, result->value, result->size, true);
+		pos = ref->offset + ref->len;
+	}
+
+	if (pos != len) {
+		func(udata, (const uint8_t*)text + pos, len - pos, false);
+	}
+
+	return err;
+}
+
+sa_err
+sa_config_substitute(const sa_client* c, const char* text, size_t len, uint8_t** out,
+		size_t* out_len)
+{
+	sa_config_refs refs;
+	sa_err err = sa_config_scan(text, len, &refs);
+
+	if (err.code == SA_OK) {
+		err = sa_config_fetch(c, &refs);
+	}
+
+	size_t size = 0;
+
+	if (err.code == SA_OK) {
+		err = sa_config_write(&refs, text, len, write_size, &size);
+	}
+
+	if (err.code == SA_OK) {
+		out_buf ob;
+		ob.buf = (uint8_t*) sa_alloc(&c->cfg->alloc, size + 1);
+		ob.pos = 0;
+
+		if (ob.buf == NULL) {
+			sa_g_log_function("ERR: could not allocate memory for substituted config");
+			err.code = SA_FAILED_INTERNAL;
+		}
+		else {
+			sa_config_write(&refs, text, len, write_out, &ob);
+			ob.buf[size] = 0;
+
+			*out = ob.buf;
+			*out_len = size;
+		}
+	}
+
+	sa_config_refs_destroy(&refs);
+
+	return err;
+}
+
+void
+sa_config_refs_destroy(sa_config_refs* refs)
+{
+	for (size_t i = 0; i < refs->n_secrets; i++) {
+		sa_config_secret* secret = &refs->secrets[i];
+
+		if (refs->client != NULL && secret->result.err.code == SA_OK) {
+			sa_secret_free(refs->client, secret->result.value, secret->result.size);
+		}
+
+		free(secret->path);
+	}
+
+	free(refs->secrets);
+	free(refs->refs);
+
+	refs->secrets = NULL;
+	refs->n_secrets = 0;
+	refs->refs = NULL;
+	refs->n_refs = 0;
+}
+
+//==========================================================
+// Local helpers.
+//
+
+// the characters of a secret path
+static bool
+path_char(char ch)
+{
+	return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') ||
+			ch == '_' || ch == '-' || ch == '.' || ch == '/' || ch == ':';
+}
+
+static sa_err
+add_ref(sa_config_refs* refs, size_t* cap, size_t offset, size_t len)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	if (refs->n_refs == *cap) {
+		size_t new_cap = *cap == 0 ? 16 : *cap * 2;
+		sa_config_ref* grown = (sa_config_ref*) realloc(refs->refs, new_cap * sizeof(sa_config_ref));
+
+		if (grown == NULL) {
+			sa_g_log_function("ERR: could not allocate memory for config references");
+			err.code = SA_FAILED_INTERNAL;
+			return err;
+		}
+
+		refs->refs = grown;
+		*cap = new_cap;
+	}
+
+	sa_config_ref* ref = &refs->refs[refs->n_refs++];
+	ref->offset = offset;
+	ref->len = len;
+	ref->secret = 0;
+
+	return err;
+}
+
+/*
+ * dedup sorts the references by resource and key, and makes a secret of each
+ * run referencing the same one, so each is fetched once.
+*/
+static sa_err
+dedup(sa_config_refs* refs, const char* text)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	sort_entry* entries = (sort_entry*) malloc(refs->n_refs * sizeof(sort_entry));
+	refs->secrets = (sa_config_secret*) calloc(refs->n_refs, sizeof(sa_config_secret));
+	if (entries == NULL || refs->secrets == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for config secrets");
+		free(entries);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	for (size_t i = 0; i < refs->n_refs; i++) {
+		const sa_config_ref* ref = &refs->refs[i];
+		split(text + ref->offset + PREFIX_LEN, ref->len - PREFIX_LEN, &entries[i]);
+		entries[i].ref = i;
+	}
+
+	qsort(entries, refs->n_refs, sizeof(sort_entry), compare_entries);
+
+	for (size_t i = 0; i < refs->n_refs; i++) {
+		sa_config_ref* ref = &refs->refs[entries[i].ref];
+
+		if (i == 0 || compare_entries(&entries[i - 1], &entries[i]) != 0) {
+			sa_config_secret* secret = &refs->secrets[refs->n_secrets++];
+
+			secret->path = (char*) malloc(ref->len + 1);
+			if (secret->path == NULL) {
+				sa_g_log_function("ERR: could not allocate memory for config secret path");
+				refs->n_secrets--;
+				err.code = SA_FAILED_INTERNAL;
+				break;
+			}
+
+			memcpy(secret->path, text + ref->offset, ref->len);
+			secret->path[ref->len] = 0;
+			sa_parse_secret_path(secret->path, &secret->ref);
+			secret->result.err.code = SA_FAILED_INTERNAL;
+		}
+
+		ref->secret = refs->n_secrets - 1;
+		refs->secrets[ref->secret].n_refs++;
+	}
+
+	free(entries);
+
+	return err;
+}
+
+// splits the path after the prefix into its resource and key, as sa_parse_secret_path does
+static void
+split(const char* token, size_t len, sort_entry* e)
+{
+	size_t colon = len;
+
+	while (colon > 0 && token[colon - 1] != ':') {
+		colon--;
+	}
+
+	e->res = token;
+	e->res_len = colon == 0 ? 0 : (uint32_t)(colon - 1);
+	e->key = token + colon;
+	e->key_len = (uint32_t)(len - colon);
+}
+
+static int
+compare_entries(const void* a, const void* b)
+{
+	const sort_entry* x = (const sort_entry*)a;
+	const sort_entry* y = (const sort_entry*)b;
+
+	int res = compare_bytes(x->res, x->res_len, y->res, y->res_len);
+	if (res != 0) {
+		return res;
+	}
+
+	return compare_bytes(x->key, x->key_len, y->key, y->key_len);
+}
+
+static int
+compare_bytes(const char* a, uint32_t a_len, const char* b, uint32_t b_len)
+{
+	int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+	if (res != 0) {
+		return res;
+	}
+
+	return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static void
+write_size(void* udata, const uint8_t* data, size_t size, bool secret)
+{
+	(void)data;
+	(void)secret;
+
+	*(size_t*)udata += size;
+}
+
+static void
+write_out(void* udata, const uint8_t* data, size_t size, bool secret)
+{
+	(void)secret;
+
+	out_buf* ob = (out_buf*)udata;
+
+	memcpy(ob->buf + ob->pos, data, size);
+	ob->pos += size;
+}
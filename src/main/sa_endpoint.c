@@ -0,0 +1,358 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_clock.h"
+#include "sa_endpoint.h"
+#include "sa_error.h"
+#include "sa_logging.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+//==========================================================
+// Typedefs & constants.
+//
+
+// the delay is recomputed after this many fetches are recorded
+#define SA_HEDGE_UPDATE_INTERVAL (SA_HEDGE_WINDOW / 8)
+
+#define SA_EWMA_SHIFT 3 // each request moves the averages an eighth of the way
+#define SA_ERROR_WEIGHT 16 // an endpoint failing every request costs this many times more
+#define SA_DECAY_MS 1000 // an endpoint's cost halves for each of these it goes unused
+
+//==========================================================
+// Forward declarations.
+//
+
+static bool pickable(sa_endpoint* ep, uint64_t now_ms, uint64_t* ejected_until_ms);
+static uint64_t cost(sa_endpoint* ep, uint64_t now_ms);
+static bool claim(sa_endpoint* ep, uint64_t now_ms, bool ejected);
+static uint64_t next_random(uint64_t* picks);
+static void update_delay(sa_hedge* hedge);
+static int compare_samples(const void* a, const void* b);
+
+//==========================================================
+// Public API.
+//
+
+void
+sa_endpoint_init(sa_endpoint* ep, const char* addr, const char* port)
+{
+	ep->addr = addr;
+	ep->port = port;
+	ep->pool = NULL;
+
+	pthread_mutex_init(&ep->lock, NULL);
+	ep->in_flight = 0;
+	ep->latency_us = 0;
+	ep->error_rate = 0;
+	ep->failures = 0;
+	ep->ejections = 0;
+	ep->ejected_until_ms = 0;
+	ep->probing = false;
+	ep->last_done_ms = 0;
+}
+
+void
+sa_endpoint_destroy(sa_endpoint* ep)
+{
+	pthread_mutex_destroy(&ep->lock);
+}
+
+sa_endpoint*
+sa_endpoint_pick(sa_endpoint* endpoints, uint32_t n, uint64_t tried, uint64_t* picks)
+{
+	uint64_t now_ms = sa_now_ms();
+
+	while (true) {
+		uint32_t candidates[SA_MAX_ENDPOINTS];
+		uint32_t n_candidates = 0;
+		sa_endpoint* soonest = NULL;
+		uint64_t soonest_ms = 0;
+
+		for (uint32_t i = 0; i < n; i++) {
+			if ((tried & ((uint64_t)1 << i)) != 0) {
+				continue;
+			}
+
+			sa_endpoint* ep = &endpoints[i];
+			uint64_t ejected_until_ms;
+
+			if (pickable(ep, now_ms, &ejected_until_ms)) {
+				candidates[n_candidates++] = i;
+			}
+			else if (soonest == NULL || ejected_until_ms < soonest_ms) {
+				soonest = ep;
+				soonest_ms = ejected_until_ms;
+			}
+		}
+
+		if (n_candidates == 0) {
+			if (soonest != NULL) {
+				// every endpoint left is ejected, rather than fail try the first to recover
+				claim(soonest, now_ms, true);
+			}
+
+			return soonest;
+		}
+
+		sa_endpoint* ep = &endpoints[candidates[0]];
+
+		if (n_candidates > 1) {
+			uint64_t r = next_random(picks);
+			uint32_t a = (uint32_t)(r % n_candidates);
+			uint32_t b = (uint32_t)((r >> 32) % (n_candidates - 1));
+
+			// b is any candidate other than a
+			if (b >= a) {
+				b++;
+			}
+
+			sa_endpoint* ep_a = &endpoints[candidates[a]];
+			sa_endpoint* ep_b = &endpoints[candidates[b]];
+
+			ep = cost(ep_a, now_ms) <= cost(ep_b, now_ms) ? ep_a : ep_b;
+		}
+
+		// another thread may have claimed the probe of a recovering endpoint since
+		if (claim(ep, now_ms, false)) {
+			return ep;
+		}
+	}
+}
+
+void
+sa_endpoint_done(sa_endpoint* ep, uint64_t latency_us, enum sa_error_code code)
+{
+	bool ok = code == SA_OK || code == SA_FAILED_BAD_REQUEST || code == SA_FAILED_BUFFER_TOO_SMALL;
+
+	pthread_mutex_lock(&ep->lock);
+
+	ep->in_flight--;
+	ep->last_done_ms = sa_now_ms();
+
+	// failures count their latency too, so an agent that hangs looks slow
+	if (ep->latency_us == 0) {
+		ep->latency_us = latency_us;
+	}
+	else {
+		ep->latency_us = ep->latency_us - (ep->latency_us >> SA_EWMA_SHIFT) +
+				(latency_us >> SA_EWMA_SHIFT);
+	}
+
+	ep->error_rate = ep->error_rate - (ep->error_rate >> SA_EWMA_SHIFT) +
+			(ok ? 0 : SA_EWMA_ONE >> SA_EWMA_SHIFT);
+
+	bool probe = ep->probing;
+	ep->probing = false;
+
+	if (ok) {
+		ep->failures = 0;
+
+		if (ep->ejected_until_ms != 0) {
+			sa_g_log_function("agent %s recovered", ep->addr);
+		}
+
+		ep->ejections = 0;
+		ep->ejected_until_ms = 0;
+	}
+	else if (++ep->failures >= SA_EJECT_FAILURES || probe) {
+		uint32_t shift = ep->ejections < 6 ? ep->ejections : 6;
+		uint64_t eject_ms = (uint64_t)SA_EJECT_BASE_MS << shift;
+
+		if (eject_ms > SA_EJECT_MAX_MS) {
+			eject_ms = SA_EJECT_MAX_MS;
+		}
+
+		sa_g_log_function("ERR: ejecting agent %s for %lu ms", ep->addr, (unsigned long)eject_ms);
+
+		ep->ejections++;
+		ep->ejected_until_ms = sa_now_ms() + eject_ms;
+		ep->failures = 0;
+	}
+
+	pthread_mutex_unlock(&ep->lock);
+}
+
+void
+sa_endpoint_abandon(sa_endpoint* ep)
+{
+	pthread_mutex_lock(&ep->lock);
+	ep->in_flight--;
+	ep->probing = false;
+	pthread_mutex_unlock(&ep->lock);
+}
+
+sa_hedge*
+sa_hedge_new(uint32_t percentile, uint32_t min_delay_ms)
+{
+	sa_hedge* hedge = (sa_hedge*) malloc(sizeof(sa_hedge));
+	if (hedge == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_hedge");
+		return NULL;
+	}
+
+	pthread_mutex_init(&hedge->lock, NULL);
+	hedge->percentile = percentile > 100 ? 100 : percentile;
+	hedge->min_delay_us = min_delay_ms * 1000;
+	hedge->delay_us = hedge->min_delay_us;
+	hedge->n_samples = 0;
+
+	return hedge;
+}
+
+void
+sa_hedge_destroy(sa_hedge* hedge)
+{
+	pthread_mutex_destroy(&hedge->lock);
+	free(hedge);
+}
+
+uint32_t
+sa_hedge_delay_ms(const sa_hedge* hedge)
+{
+	uint32_t delay_us = __atomic_load_n(&hedge->delay_us, __ATOMIC_RELAXED);
+
+	// round up, poll can't wait for less than a millisecond
+	return (delay_us + 999) / 1000;
+}
+
+void
+sa_hedge_record(sa_hedge* hedge, uint64_t latency_us)
+{
+	pthread_mutex_lock(&hedge->lock);
+
+	hedge->samples[hedge->n_samples % SA_HEDGE_WINDOW] =
+			latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t)latency_us;
+	hedge->n_samples++;
+
+	if (hedge->n_samples >= SA_HEDGE_MIN_SAMPLES &&
+			hedge->n_samples % SA_HEDGE_UPDATE_INTERVAL == 0) {
+		update_delay(hedge);
+	}
+
+	pthread_mutex_unlock(&hedge->lock);
+}
+
+//==========================================================
+// Local helpers.
+//
+
+// true if ep is not ejected, or its ejection expired and nothing is probing it
+static bool
+pickable(sa_endpoint* ep, uint64_t now_ms, uint64_t* ejected_until_ms)
+{
+	pthread_mutex_lock(&ep->lock);
+	bool ok = ep->ejected_until_ms == 0 || (now_ms >= ep->ejected_until_ms && ! ep->probing);
+	*ejected_until_ms = ep->ejected_until_ms;
+	pthread_mutex_unlock(&ep->lock);
+
+	return ok;
+}
+
+/*
+ * the latency expected of another request to ep, decaying while ep is
+ * unused so that an endpoint which was slow, or failing, is tried again
+*/
+static uint64_t
+cost(sa_endpoint* ep, uint64_t now_ms)
+{
+	pthread_mutex_lock(&ep->lock);
+
+	uint64_t idle_ms = now_ms > ep->last_done_ms ? now_ms - ep->last_done_ms : 0;
+	uint32_t shift = idle_ms / SA_DECAY_MS < 31 ? (uint32_t)(idle_ms / SA_DECAY_MS) : 31;
+
+	uint64_t c = ((ep->latency_us >> shift) + 1) * (ep->in_flight + 1) *
+			(SA_EWMA_ONE + (uint64_t)SA_ERROR_WEIGHT * (ep->error_rate >> shift));
+
+	pthread_mutex_unlock(&ep->lock);
+
+	return c;
+}
+
+/*
+ * claim counts a request in flight to ep, as its probe if its ejection expired.
+ * Fails if ep has since become unpickable, unless ejected is true.
+*/
+static bool
+claim(sa_endpoint* ep, uint64_t now_ms, bool ejected)
+{
+	pthread_mutex_lock(&ep->lock);
+
+	if (! ejected && ep->ejected_until_ms != 0 &&
+			(now_ms < ep->ejected_until_ms || ep->probing)) {
+		pthread_mutex_unlock(&ep->lock);
+		return false;
+	}
+
+	if (ep->ejected_until_ms != 0) {
+		ep->probing = true;
+	}
+
+	ep->in_flight++;
+
+	pthread_mutex_unlock(&ep->lock);
+	return true;
+}
+
+// splitmix64 of the next value of picks, which is shared by threads
+static uint64_t
+next_random(uint64_t* picks)
+{
+	uint64_t z = __atomic_add_fetch(picks, 0x9e3779b97f4a7c15, __ATOMIC_RELAXED);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+// sets the delay to the percentile of the window, called with the lock held
+static void
+update_delay(sa_hedge* hedge)
+{
+	uint32_t n = hedge->n_samples < SA_HEDGE_WINDOW ? hedge->n_samples : SA_HEDGE_WINDOW;
+	uint32_t sorted[SA_HEDGE_WINDOW];
+
+	memcpy(sorted, hedge->samples, n * sizeof(uint32_t));
+	qsort(sorted, n, sizeof(uint32_t), compare_samples);
+
+	// the smallest latency at least percentile of the fetches took no longer than
+	uint32_t rank = (n * hedge->percentile + 99) / 100;
+	uint32_t delay_us = sorted[rank == 0 ? 0 : rank - 1];
+
+	if (delay_us < hedge->min_delay_us) {
+		delay_us = hedge->min_delay_us;
+	}
+
+	__atomic_store_n(&hedge->delay_us, delay_us, __ATOMIC_RELAXED);
+}
+
+static int
+compare_samples(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+
+	return x < y ? -1 : x > y;
+}
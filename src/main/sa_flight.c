@@ -0,0 +1,264 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_alloc.h"
+#include "sa_error.h"
+#include "sa_flight.h"
+#include "sa_logging.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//==========================================================
+// Forward declarations.
+//
+
+static uint32_t hash_key(const char* key, uint32_t key_len);
+static sa_flight** find_flight(sa_flights* flights, const char* key, uint32_t key_len);
+static void release_flight(sa_flights* flights, sa_flight* f);
+
+//==========================================================
+// Public API.
+//
+
+sa_flights*
+sa_flights_new(const sa_allocator* alloc)
+{
+	sa_flights* flights = (sa_flights*) calloc(1, sizeof(sa_flights));
+	if (flights == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_flights");
+		return NULL;
+	}
+
+	pthread_mutex_init(&flights->lock, NULL);
+	flights->alloc = alloc;
+
+	return flights;
+}
+
+void
+sa_flights_destroy(sa_flights* flights)
+{
+	pthread_mutex_destroy(&flights->lock);
+	free(flights);
+}
+
+bool
+sa_flight_join(sa_flights* flights, const char* key, uint32_t key_len, sa_flight** fp)
+{
+	pthread_mutex_lock(&flights->lock);
+
+	sa_flight** link = find_flight(flights, key, key_len);
+	sa_flight* f = *link;
+
+	if (f != NULL) {
+		f->refs++;
+		flights->stats.coalesced++;
+		pthread_mutex_unlock(&flights->lock);
+
+		*fp = f;
+		return false;
+	}
+
+	f = (sa_flight*) malloc(sizeof(sa_flight));
+	if (f == NULL) {
+		pthread_mutex_unlock(&flights->lock);
+		sa_g_log_function("ERR: could not allocate memory for sa_flight, fetching alone");
+
+		*fp = NULL;
+		return true;
+	}
+
+	f->next = NULL;
+	f->key = key;
+	f->key_len = key_len;
+	f->refs = 1;
+	f->landed = false;
+	f->err.code = SA_OK;
+	f->value = NULL;
+	f->size = 0;
+
+	// waiters' deadlines are on the sa_now_ms() clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&f->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	*link = f;
+	flights->stats.fetches++;
+
+	pthread_mutex_unlock(&flights->lock);
+
+	*fp = f;
+	return true;
+}
+
+void
+sa_flight_land(sa_flights* flights, sa_flight* f, sa_err err, const uint8_t* value, size_t size)
+{
+	if (f == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&flights->lock);
+
+	// later callers start a new flight
+	sa_flight** link = find_flight(flights, f->key, f->key_len);
+	*link = f->next;
+	f->key = NULL;
+
+	if (f->refs > 1 && err.code == SA_OK) {
+		f->value = (uint8_t*) sa_alloc(flights->alloc, size + 1);
+
+		if (f->value == NULL) {
+			sa_g_log_function("ERR: could not allocate memory for coalesced secret");
+			err.code = SA_FAILED_INTERNAL;
+		}
+		else {
+			memcpy(f->value, value, size + 1);
+			f->size = size;
+		}
+	}
+
+	f->err = err;
+	f->landed = true;
+	pthread_cond_broadcast(&f->cond);
+
+	release_flight(flights, f);
+
+	pthread_mutex_unlock(&flights->lock);
+}
+
+sa_err
+sa_flight_wait(sa_flights* flights, sa_flight* f, uint64_t deadline_ms, uint8_t** r, size_t* size_r)
+{
+	struct timespec ts = {
+		.tv_sec = (time_t)(deadline_ms / 1000),
+		.tv_nsec = (long)(deadline_ms % 1000) * 1000000
+	};
+
+	sa_err err;
+	err.code = SA_OK;
+
+	pthread_mutex_lock(&flights->lock);
+
+	while (! f->landed) {
+		if (pthread_cond_timedwait(&f->cond, &flights->lock, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+
+	if (! f->landed) {
+		sa_g_log_function("ERR: timed out waiting for a coalesced request");
+		err.code = SA_FAILED_TIMEOUT;
+	}
+	else if (f->err.code != SA_OK) {
+		err = f->err;
+	}
+	else {
+		uint8_t* value = (uint8_t*) sa_alloc(flights->alloc, f->size + 1);
+
+		if (value == NULL) {
+			sa_g_log_function("ERR: could not allocate memory for coalesced secret");
+			err.code = SA_FAILED_INTERNAL;
+		}
+		else {
+			memcpy(value, f->value, f->size + 1);
+			*r = value;
+			*size_r = f->size;
+		}
+	}
+
+	release_flight(flights, f);
+
+	pthread_mutex_unlock(&flights->lock);
+
+	return err;
+}
+
+void
+sa_flights_get_stats(sa_flights* flights, sa_coalesce_stats* stats)
+{
+	pthread_mutex_lock(&flights->lock);
+	*stats = flights->stats;
+	pthread_mutex_unlock(&flights->lock);
+}
+
+//==========================================================
+// Local helpers.
+//
+
+// FNV-1a
+static uint32_t
+hash_key(const char* key, uint32_t key_len)
+{
+	uint32_t h = 2166136261u;
+
+	for (uint32_t i = 0; i < key_len; i++) {
+		h ^= (uint8_t)key[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+// returns the link pointing at the flight for key, or at the NULL ending its bucket
+static sa_flight**
+find_flight(sa_flights* flights, const char* key, uint32_t key_len)
+{
+	uint32_t bucket = hash_key(key, key_len) & (SA_FLIGHT_BUCKETS - 1);
+	sa_flight** link = &flights->buckets[bucket];
+
+	while (*link != NULL) {
+		sa_flight* f = *link;
+		if (f->key_len == key_len && memcmp(f->key, key, key_len) == 0) {
+			break;
+		}
+
+		link = &f->next;
+	}
+
+	return link;
+}
+
+// drops a reference to a landed flight, the last frees it, called with the lock held
+static void
+release_flight(sa_flights* flights, sa_flight* f)
+{
+	if (--f->refs != 0) {
+		return;
+	}
+
+	if (f->value != NULL) {
+		sa_zero(f->value, f->size);
+		sa_free(flights->alloc, f->value);
+	}
+
+	pthread_cond_destroy(&f->cond);
+	free(f);
+}
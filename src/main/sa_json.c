@@ -0,0 +1,601 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_json.h"
+#include "sa_logging.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+//==========================================================
+// Typedefs & constants.
+//
+
+#define SA_JSON_MAX_DEPTH 2048 // as json_loads(), counting scalars too
+
+typedef enum {
+	SA_JSON_EXPECT_VALUE,
+	SA_JSON_EXPECT_KEY,
+	SA_JSON_EXPECT_NEXT // ',' or the end of the container
+} sa_json_expect;
+
+typedef enum {
+	SA_JSON_MEMBER_OTHER,
+	SA_JSON_MEMBER_ERROR,
+	SA_JSON_MEMBER_SECRET_VALUE
+} sa_json_member;
+
+//==========================================================
+// Forward declarations.
+//
+
+static bool fail(const char* json, const char* p, const char* reason);
+static const char* skip_ws(const char* p);
+static const char* scan_string(char* p, char** str, uint32_t* len, const char** reason);
+static const char* scan_escape(const char* p, char** w, const char** reason);
+static const char* scan_utf8(const char* p, char** w);
+static const char* scan_number(const char* p, const char** reason);
+static const char* scan_literal(const char* p);
+static int32_t hex4(const char* p);
+static sa_json_member classify(const char* key, uint32_t len);
+static void set_member(sa_json_response* res, sa_json_member member, char* str, uint32_t len);
+
+//==========================================================
+// Public API.
+//
+
+bool
+sa_json_scan_response(char* json, sa_json_response* res)
+{
+	res->error = NULL;
+	res->error_len = 0;
+	res->secret_value = NULL;
+	res->secret_value_len = 0;
+
+	// one bit per open container, set for objects
+	uint8_t objects[SA_JSON_MAX_DEPTH / 8];
+	uint32_t depth = 0;
+
+	sa_json_expect expect = SA_JSON_EXPECT_VALUE;
+	sa_json_member member = SA_JSON_MEMBER_OTHER;
+	const char* reason = NULL;
+	char* p = (char*)skip_ws(json);
+
+	if (*p != '{' && *p != '[') {
+		return fail(json, p, "'[' or '{' expected");
+	}
+
+	while (true) {
+		p = (char*)skip_ws(p);
+
+		if (expect == SA_JSON_EXPECT_KEY) {
+			char* key;
+			uint32_t key_len;
+
+			if (*p != '"') {
+				return fail(json, p, "string or '}' expected");
+			}
+
+			if ((p = (char*)scan_string(p, &key, &key_len, &reason)) == NULL) {
+				return fail(json, key, reason);
+			}
+
+			// only the top level object's members are of interest
+			if (depth == 1) {
+				member = classify(key, key_len);
+			}
+
+			p = (char*)skip_ws(p);
+
+			if (*p != ':') {
+				return fail(json, p, "':' expected");
+			}
+
+			p++;
+			expect = SA_JSON_EXPECT_VALUE;
+			continue;
+		}
+
+		if (expect == SA_JSON_EXPECT_NEXT) {
+			if (depth == 0) {
+				if (*p != '\0') {
+					return fail(json, p, "end of file expected");
+				}
+
+				return true;
+			}
+
+			bool object = (objects[(depth - 1) / 8] & (1 << ((depth - 1) % 8))) != 0;
+
+			if (*p == ',') {
+				p++;
+				expect = object ? SA_JSON_EXPECT_KEY : SA_JSON_EXPECT_VALUE;
+				continue;
+			}
+
+			if (*p != (object ? '}' : ']')) {
+				return fail(json, p, object ? "'}' expected" : "']' expected");
+			}
+
+			p++;
+			depth--;
+			continue;
+		}
+
+		if (depth == SA_JSON_MAX_DEPTH) {
+			return fail(json, p, "maximum parsing depth reached");
+		}
+
+		if (*p == '{' || *p == '[') {
+			bool object = *p == '{';
+
+			// a container is not a string
+			if (depth == 1) {
+				set_member(res, member, NULL, 0);
+			}
+
+			if (object) {
+				objects[depth / 8] |= (uint8_t)(1 << (depth % 8));
+			}
+			else {
+				objects[depth / 8] &= (uint8_t)~(1 << (depth % 8));
+			}
+
+			depth++;
+			p = (char*)skip_ws(p + 1);
+
+			if (*p == (object ? '}' : ']')) {
+				p++;
+				depth--;
+				expect = SA_JSON_EXPECT_NEXT;
+				continue;
+			}
+
+			expect = object ? SA_JSON_EXPECT_KEY : SA_JSON_EXPECT_VALUE;
+			continue;
+		}
+
+		char* str = NULL;
+		uint32_t len = 0;
+		char* start = p;
+
+		if (*p == '"') {
+			p = (char*)scan_string(p, &str, &len, &reason);
+		}
+		else if (*p == '-' || (*p >= '0' && *p <= '9')) {
+			p = (char*)scan_number(p, &reason);
+		}
+		else {
+			p = (char*)scan_literal(p);
+			reason = "invalid token";
+		}
+
+		if (p == NULL) {
+			return fail(json, start, reason);
+		}
+
+		if (depth == 1) {
+			set_member(res, member, str, len);
+		}
+
+		expect = SA_JSON_EXPECT_NEXT;
+	}
+}
+
+//==========================================================
+// Local helpers.
+//
+
+static bool
+fail(const char* json, const char* p, const char* reason)
+{
+	sa_g_log_function("ERR: failed to parse response JSON at byte %u (%s)",
+			(uint32_t)(p - json), reason);
+	return false;
+}
+
+static const char*
+skip_ws(const char* p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+		p++;
+	}
+
+	return p;
+}
+
+/*
+ * scan_string unescapes the string at p, which starts with its opening quote,
+ * in place. On success str is set to the null terminated result and the
+ * position after the closing quote is returned. On failure NULL is returned,
+ * with str set to where the problem is.
+*/
+static const char*
+scan_string(char* p, char** str, uint32_t* len, const char** reason)
+{
+	char* start = p + 1;
+	char* w = start;
+	const char* r = start;
+
+	while (true) {
+		// runs of plain characters, all of a base64 secret, are only copied
+		// once an escape has made the string shorter
+		const char* run = r;
+		while ((uint8_t)*r >= 0x20 && (uint8_t)*r < 0x80 && *r != '"' && *r != '\\') {
+			r++;
+		}
+
+		if (w != run) {
+			memmove(w, run, (size_t)(r - run));
+		}
+
+		w += r - run;
+
+		const char* next;
+		uint8_t c = (uint8_t)*r;
+
+		if (c == '"') {
+			break;
+		}
+
+		if (c == '\0') {
+			*reason = "premature end of input";
+			next = NULL;
+		}
+		else if (c < 0x20) {
+			*reason = "control character in string";
+			next = NULL;
+		}
+		else if (c == '\\') {
+			next = scan_escape(r + 1, &w, reason);
+		}
+		else if (c < 0x80) {
+			*w++ = (char)c;
+			next = r + 1;
+		}
+		else {
+			*reason = "invalid UTF-8";
+			next = scan_utf8(r, &w);
+		}
+
+		if (next == NULL) {
+			*str = (char*)r;
+			return NULL;
+		}
+
+		r = next;
+	}
+
+	// the unescaped string is never longer, so there is room for this
+	*w = '\0';
+
+	*str = start;
+	*len = (uint32_t)(w - start);
+	return r + 1;
+}
+
+// writes the character escaped at p, after the backslash, to w
+static const char*
+scan_escape(const char* p, char** w, const char** reason)
+{
+	static const char ESCAPES[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+
+	if (*p != 'u') {
+		for (uint32_t i = 0; i < sizeof(ESCAPES) - 1; i += 2) {
+			if (*p == ESCAPES[i]) {
+				*(*w)++ = ESCAPES[i + 1];
+				return p + 1;
+			}
+		}
+
+		*reason = "invalid escape";
+		return NULL;
+	}
+
+	*reason = "invalid \\u escape";
+
+	int32_t u = hex4(p + 1);
+	p += 5;
+
+	if (u < 0 || (u >= 0xDC00 && u <= 0xDFFF)) {
+		return NULL;
+	}
+
+	if (u >= 0xD800 && u <= 0xDBFF) {
+		// a high surrogate must be followed by an escaped low surrogate
+		int32_t low = p[0] == '\\' && p[1] == 'u' ? hex4(p + 2) : -1;
+
+		if (low < 0xDC00 || low > 0xDFFF) {
+			return NULL;
+		}
+
+		u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+		p += 6;
+	}
+
+	if (u == 0) {
+		*reason = "\\u0000 is not allowed";
+		return NULL;
+	}
+
+	// encoded in fewer bytes than the escape, so never overtakes p
+	char* out = *w;
+
+	if (u < 0x80) {
+		*out++ = (char)u;
+	}
+	else if (u < 0x800) {
+		*out++ = (char)(0xC0 | (u >> 6));
+		*out++ = (char)(0x80 | (u & 0x3F));
+	}
+	else if (u < 0x10000) {
+		*out++ = (char)(0xE0 | (u >> 12));
+		*out++ = (char)(0x80 | ((u >> 6) & 0x3F));
+		*out++ = (char)(0x80 | (u & 0x3F));
+	}
+	else {
+		*out++ = (char)(0xF0 | (u >> 18));
+		*out++ = (char)(0x80 | ((u >> 12) & 0x3F));
+		*out++ = (char)(0x80 | ((u >> 6) & 0x3F));
+		*out++ = (char)(0x80 | (u & 0x3F));
+	}
+
+	*w = out;
+	return p;
+}
+
+// copies the multi-byte UTF-8 sequence at p to w, rejecting invalid ones
+static const char*
+scan_utf8(const char* p, char** w)
+{
+	const uint8_t* u = (const uint8_t*)p;
+	uint32_t n;
+	int32_t cp;
+
+	if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+		n = 2;
+		cp = u[0] & 0x1F;
+	}
+	else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+		n = 3;
+		cp = u[0] & 0x0F;
+	}
+	else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+		n = 4;
+		cp = u[0] & 0x07;
+	}
+	else {
+		return NULL;
+	}
+
+	// a null terminator fails this before anything past it is read
+	for (uint32_t i = 1; i < n; i++) {
+		if ((u[i] & 0xC0) != 0x80) {
+			return NULL;
+		}
+
+		cp = (cp << 6) | (u[i] & 0x3F);
+	}
+
+	if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+			(cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+		return NULL;
+	}
+
+	memmove(*w, p, n);
+	*w += n;
+
+	return p + n;
+}
+
+/*
+ * scan_number checks the number at p follows the json grammar and, as
+ * json_loads() requires, fits a long long if it is an integer or does not
+ * overflow a double otherwise. Returns the position after it, or NULL.
+*/
+static const char*
+scan_number(const char* p, const char** reason)
+{
+	const char* start = p;
+	bool negative = *p == '-';
+
+	*reason = "invalid token";
+
+	if (negative) {
+		p++;
+	}
+
+	const char* int_start = p;
+
+	if (*p == '0') {
+		p++;
+
+		if (*p >= '0' && *p <= '9') {
+			return NULL;
+		}
+	}
+	else if (*p >= '1' && *p <= '9') {
+		while (*p >= '0' && *p <= '9') {
+			p++;
+		}
+	}
+	else {
+		return NULL;
+	}
+
+	uint32_t int_digits = (uint32_t)(p - int_start);
+
+	if (*p != '.' && *p != 'e' && *p != 'E') {
+		const char* max = negative ? "9223372036854775808" : "9223372036854775807";
+
+		if (int_digits > 19 || (int_digits == 19 && memcmp(int_start, max, 19) > 0)) {
+			*reason = negative ? "too big negative integer" : "too big integer";
+			return NULL;
+		}
+
+		return p;
+	}
+
+	// The value is below 10^magnitude and at least a tenth of that, where
+	// magnitude counts from the first non-zero digit.
+	int64_t magnitude = 0;
+	bool zero = true;
+
+	for (const char* d = int_start; d < int_start + int_digits; d++) {
+		if (*d != '0') {
+			magnitude = (int64_t)(int_start + int_digits - d);
+			zero = false;
+			break;
+		}
+	}
+
+	if (*p == '.') {
+		p++;
+
+		if (*p < '0' || *p > '9') {
+			return NULL;
+		}
+
+		for (int64_t i = 0; *p >= '0' && *p <= '9'; i++, p++) {
+			if (zero && *p != '0') {
+				magnitude = -i;
+				zero = false;
+			}
+		}
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		p++;
+
+		bool negative_exp = *p == '-';
+
+		if (*p == '-' || *p == '+') {
+			p++;
+		}
+
+		if (*p < '0' || *p > '9') {
+			return NULL;
+		}
+
+		int64_t exp = 0;
+
+		for (; *p >= '0' && *p <= '9'; p++) {
+			if (exp < 1000000) {
+				exp = exp * 10 + (*p - '0');
+			}
+		}
+
+		magnitude += negative_exp ? -exp : exp;
+	}
+
+	// DBL_MAX is 1.8e308 - only values from 1e308 to 1e309 need a closer look.
+	// Underflow is not an error.
+	bool overflow = ! zero && magnitude > 309;
+
+	if (! zero && magnitude == 309) {
+		errno = 0;
+		double d = strtod(start, NULL);
+		overflow = errno == ERANGE && (d == HUGE_VAL || d == -HUGE_VAL);
+	}
+
+	if (overflow) {
+		*reason = "real number overflow";
+		return NULL;
+	}
+
+	return p;
+}
+
+static const char*
+scan_literal(const char* p)
+{
+	static const char* LITERALS[] = { "true", "false", "null" };
+
+	for (uint32_t i = 0; i < sizeof(LITERALS) / sizeof(LITERALS[0]); i++) {
+		size_t len = strlen(LITERALS[i]);
+
+		if (strncmp(p, LITERALS[i], len) == 0) {
+			return p + len;
+		}
+	}
+
+	return NULL;
+}
+
+// returns the value of 4 hex digits at p, or -1
+static int32_t
+hex4(const char* p)
+{
+	int32_t v = 0;
+
+	for (uint32_t i = 0; i < 4; i++) {
+		char c = p[i];
+
+		if (c >= '0' && c <= '9') {
+			v = (v << 4) | (c - '0');
+		}
+		else if (c >= 'a' && c <= 'f') {
+			v = (v << 4) | (c - 'a' + 10);
+		}
+		else if (c >= 'A' && c <= 'F') {
+			v = (v << 4) | (c - 'A' + 10);
+		}
+		else {
+			// stops at a null terminator
+			return -1;
+		}
+	}
+
+	return v;
+}
+
+static sa_json_member
+classify(const char* key, uint32_t len)
+{
+	if (len == sizeof("Error") - 1 && memcmp(key, "Error", len) == 0) {
+		return SA_JSON_MEMBER_ERROR;
+	}
+
+	if (len == sizeof("SecretValue") - 1 && memcmp(key, "SecretValue", len) == 0) {
+		return SA_JSON_MEMBER_SECRET_VALUE;
+	}
+
+	return SA_JSON_MEMBER_OTHER;
+}
+
+// the last of duplicate members wins, as with json_loads()
+static void
+set_member(sa_json_response* res, sa_json_member member, char* str, uint32_t len)
+{
+	if (member == SA_JSON_MEMBER_ERROR) {
+		res->error = str;
+		res->error_len = len;
+	}
+	else if (member == SA_JSON_MEMBER_SECRET_VALUE) {
+		res->secret_value = str;
+		res->secret_value_len = len;
+	}
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_clock.h"
+#include "sa_pool.h"
+#include "sa_socket.h"
+#include "sa_logging.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+//==========================================================
+// Public API.
+//
+
+sa_conn_pool*
+sa_pool_new(uint32_t capacity, uint32_t idle_timeout_ms)
+{
+	sa_conn_pool* pool = (sa_conn_pool*) malloc(sizeof(sa_conn_pool));
+	if (pool == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_conn_pool");
+		return NULL;
+	}
+
+	pool->conns = (sa_pool_conn*) malloc(sizeof(sa_pool_conn) * capacity);
+	if (pool->conns == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_conn_pool connections");
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->size = 0;
+	pool->capacity = capacity;
+	pool->idle_timeout_ms = idle_timeout_ms;
+
+	return pool;
+}
+
+void
+sa_pool_destroy(sa_conn_pool* pool)
+{
+	for (uint32_t i = 0; i < pool->size; i++) {
+		sa_pool_close(pool->conns[i].sock);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->conns);
+	free(pool);
+}
+
+sa_socket*
+sa_pool_get(sa_conn_pool* pool)
+{
+	uint64_t now = sa_now_ms();
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+
+		if (pool->size == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+
+		sa_pool_conn conn = pool->conns[--pool->size];
+		pthread_mutex_unlock(&pool->lock);
+
+		// check outside the lock, liveness checks make syscalls
+		if (now - conn.last_used_ms > pool->idle_timeout_ms) {
+			sa_pool_close(conn.sock);
+			continue;
+		}
+
+		if (! sa_socket_is_alive(conn.sock)) {
+			sa_g_log_function("evicting dead pooled connection fd: %d", conn.sock->fd);
+			sa_pool_close(conn.sock);
+			continue;
+		}
+
+		return conn.sock;
+	}
+}
+
+void
+sa_pool_put(sa_conn_pool* pool, sa_socket* sock)
+{
+	uint64_t now = sa_now_ms();
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->size < pool->capacity) {
+		pool->conns[pool->size].sock = sock;
+		pool->conns[pool->size].last_used_ms = now;
+		pool->size++;
+		sock = NULL;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (sock != NULL) {
+		// pool is full
+		sa_pool_close(sock);
+	}
+}
+
+void
+sa_pool_close(sa_socket* sock)
+{
+	close(sock->fd);
+	sa_socket_destroy(sock);
+}
+
+uint32_t
+sa_pool_idle_count(sa_conn_pool* pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	uint32_t size = pool->size;
+	pthread_mutex_unlock(&pool->lock);
+
+	return size;
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_client.h"
+#include "sa_clock.h"
+#include "sa_error.h"
+#include "sa_logging.h"
+#include "sa_request.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+
+//==========================================================
+// Typedefs & constants.
+//
+
+// a request in progress, one per connection the prefetch may have open
+typedef struct prefetch_slot_s {
+	sa_request* req; // NULL when the slot is free
+	size_t index; // of the path being fetched
+	int fd; // the request is waiting on, -1 if none
+} prefetch_slot;
+
+/*
+ * poller waits for the slots' fds with epoll where it is available, so each
+ * wait costs the same however many connections are open, and poll elsewhere.
+*/
+typedef struct poller_s {
+#if defined(__linux__)
+	int epfd;
+	struct epoll_event* events;
+#else
+	struct pollfd* pfds;
+	uint32_t* owners; // slot of each pollfd
+#endif
+	uint32_t* ready; // slots ready after poller_wait
+} poller;
+
+//==========================================================
+// Forward declarations.
+//
+
+static void start_next(const sa_client* c, const char** paths, size_t n, size_t* next, sa_secret_result* results, poller* p, prefetch_slot* slots, uint32_t i);
+static void finish(sa_secret_result* results, poller* p, prefetch_slot* slot);
+static int next_timeout(const prefetch_slot* slots, uint32_t n_slots);
+static bool poller_init(poller* p, uint32_t n_slots);
+static void poller_destroy(poller* p);
+static void poller_arm(poller* p, prefetch_slot* slots, uint32_t i);
+static void poller_disarm(poller* p, prefetch_slot* slot);
+static uint32_t poller_wait(poller* p, const prefetch_slot* slots, uint32_t n_slots, int timeout);
+
+//==========================================================
+// Public API.
+//
+
+sa_err
+sa_client_prefetch(const sa_client* c, const char** paths, size_t n, uint32_t concurrency,
+		sa_secret_result* results, uint64_t* elapsed_us)
+{
+	uint64_t start_ns = sa_now_ns();
+
+	sa_err err;
+	err.code = SA_OK;
+
+	for (size_t i = 0; i < n; i++) {
+		results[i].err.code = SA_FAILED_INTERNAL;
+		results[i].value = NULL;
+		results[i].size = 0;
+	}
+
+	if (concurrency == 0) {
+		concurrency = SA_PREFETCH_CONCURRENCY;
+	}
+
+	if (concurrency > n) {
+		concurrency = (uint32_t)n;
+	}
+
+	prefetch_slot* slots = NULL;
+	poller p;
+
+	if (n != 0) {
+		slots = (prefetch_slot*) calloc(concurrency, sizeof(prefetch_slot));
+
+		if (slots == NULL || ! poller_init(&p, concurrency)) {
+			sa_g_log_function("ERR: could not set up secret prefetch");
+			free(slots);
+			err.code = SA_FAILED_INTERNAL;
+			goto done;
+		}
+	}
+
+	size_t next = 0;
+
+	for (uint32_t i = 0; i < concurrency; i++) {
+		slots[i].fd = -1;
+		start_next(c, paths, n, &next, results, &p, slots, i);
+	}
+
+	while (true) {
+		int timeout = next_timeout(slots, concurrency);
+		if (timeout < 0) {
+			// every path is done
+			break;
+		}
+
+		uint32_t n_ready = poller_wait(&p, slots, concurrency, timeout);
+
+		for (uint32_t r = 0; r < n_ready; r++) {
+			uint32_t i = p.ready[r];
+			prefetch_slot* slot = &slots[i];
+
+			// skip stale events for a slot freed earlier in this batch
+			if (slot->req == NULL) {
+				continue;
+			}
+
+			if (! sa_request_advance(slot->req)) {
+				poller_arm(&p, slots, i);
+				continue;
+			}
+
+			finish(results, &p, slot);
+			start_next(c, paths, n, &next, results, &p, slots, i);
+		}
+
+		// requests whose fd never became ready time out
+		for (uint32_t i = 0; i < concurrency; i++) {
+			prefetch_slot* slot = &slots[i];
+
+			if (slot->req != NULL && sa_request_timeout(slot->req) == 0 &&
+					sa_request_advance(slot->req)) {
+				finish(results, &p, slot);
+				start_next(c, paths, n, &next, results, &p, slots, i);
+			}
+		}
+	}
+
+	if (n != 0) {
+		poller_destroy(&p);
+		free(slots);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		if (results[i].err.code != SA_OK) {
+			err = results[i].err;
+			break;
+		}
+	}
+
+done:
+	if (elapsed_us != NULL) {
+		*elapsed_us = (sa_now_ns() - start_ns) / 1000;
+	}
+
+	return err;
+}
+
+//==========================================================
+// Local helpers.
+//
+
+// starts the next paths in slot i until one has to wait for its fd, or none are left
+static void
+start_next(const sa_client* c, const char** paths, size_t n, size_t* next,
+		sa_secret_result* results, poller* p, prefetch_slot* slots, uint32_t i)
+{
+	prefetch_slot* slot = &slots[i];
+
+	while (*next < n) {
+		size_t index = (*next)++;
+
+		sa_request* req;
+		sa_err err = sa_request_start(c, paths[index], &req);
+		if (err.code != SA_OK) {
+			results[index].err = err;
+			continue;
+		}
+
+		slot->req = req;
+		slot->index = index;
+
+		// a cached secret, or a failure to start, is complete already
+		if (sa_request_advance(req)) {
+			finish(results, p, slot);
+			continue;
+		}
+
+		poller_arm(p, slots, i);
+		return;
+	}
+}
+
+// collects the result of slot's complete request and frees the slot
+static void
+finish(sa_secret_result* results, poller* p, prefetch_slot* slot)
+{
+	sa_secret_result* result = &results[slot->index];
+
+	result->err = sa_request_result(slot->req, &result->value, &result->size);
+
+	poller_disarm(p, slot);
+	sa_request_destroy(slot->req);
+	slot->req = NULL;
+}
+
+// milliseconds until the first request times out, -1 if none are in progress
+static int
+next_timeout(const prefetch_slot* slots, uint32_t n_slots)
+{
+	int timeout = -1;
+
+	for (uint32_t i = 0; i < n_slots; i++) {
+		if (slots[i].req == NULL) {
+			continue;
+		}
+
+		int t = sa_request_timeout(slots[i].req);
+		if (timeout < 0 || t < timeout) {
+			timeout = t;
+		}
+	}
+
+	return timeout;
+}
+
+#if defined(__linux__)
+
+static bool
+poller_init(poller* p, uint32_t n_slots)
+{
+	p->epfd = epoll_create1(EPOLL_CLOEXEC);
+	p->events = (struct epoll_event*) malloc(n_slots * sizeof(struct epoll_event));
+	p->ready = (uint32_t*) malloc(n_slots * sizeof(uint32_t));
+
+	if (p->epfd < 0 || p->events == NULL || p->ready == NULL) {
+		poller_destroy(p);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+poller_destroy(poller* p)
+{
+	if (p->epfd >= 0) {
+		close(p->epfd);
+	}
+
+	free(p->events);
+	free(p->ready);
+}
+
+/*
+ * poller_arm waits for the fd and events slot i's request is blocked on.
+ * The fd is armed for one event at a time, and re-armed after every advance,
+ * because an advance may close the fd and open another with the same number.
+*/
+static void
+poller_arm(poller* p, prefetch_slot* slots, uint32_t i)
+{
+	prefetch_slot* slot = &slots[i];
+
+	short events;
+	int fd = sa_request_fd(slot->req, &events);
+
+	if (slot->fd >= 0 && slot->fd != fd) {
+		poller_disarm(p, slot);
+	}
+
+	slot->fd = fd;
+
+	if (fd < 0) {
+		return;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLONESHOT | ((events & POLLIN) != 0 ? EPOLLIN : 0) |
+			((events & POLLOUT) != 0 ? EPOLLOUT : 0);
+	ev.data.u32 = i;
+
+	if (epoll_ctl(p->epfd, EPOLL_CTL_MOD, fd, &ev) != 0 &&
+			(errno != ENOENT || epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)) {
+		// left to time out
+		sa_g_log_function("ERR: failed to wait for request fd %d, errno %d", fd, errno);
+	}
+}
+
+// an fd closed since it was armed is gone already, the error is ignored
+static void
+poller_disarm(poller* p, prefetch_slot* slot)
+{
+	if (slot->fd >= 0) {
+		epoll_ctl(p->epfd, EPOLL_CTL_DEL, slot->fd, NULL);
+		slot->fd = -1;
+	}
+}
+
+static uint32_t
+poller_wait(poller* p, const prefetch_slot* slots, uint32_t n_slots, int timeout)
+{
+	(void)slots;
+
+	int n_events = epoll_wait(p->epfd, p->events, (int)n_slots, timeout);
+
+	for (int e = 0; e < n_events; e++) {
+		p->ready[e] = p->events[e].data.u32;
+	}
+
+	return n_events < 0 ? 0 : (uint32_t)n_events;
+}
+
+#else
+
+static bool
+poller_init(poller* p, uint32_t n_slots)
+{
+	p->pfds = (struct pollfd*) malloc(n_slots * sizeof(struct pollfd));
+	p->owners = (uint32_t*) malloc(n_slots * sizeof(uint32_t));
+	p->ready = (uint32_t*) malloc(n_slots * sizeof(uint32_t));
+
+	if (p->pfds == NULL || p->owners == NULL || p->ready == NULL) {
+		poller_destroy(p);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+poller_destroy(poller* p)
+{
+	free(p->pfds);
+	free(p->owners);
+	free(p->ready);
+}
+
+// the fds are gathered by poller_wait
+static void
+poller_arm(poller* p, prefetch_slot* slots, uint32_t i)
+{
+	(void)p;
+
+	short events;
+	slots[i].fd = sa_request_fd(slots[i].req, &events);
+}
+
+static void
+poller_disarm(poller* p, prefetch_slot* slot)
+{
+	(void)p;
+	slot->fd = -1;
+}
+
+static uint32_t
+poller_wait(poller* p, const prefetch_slot* slots, uint32_t n_slots, int timeout)
+{
+	nfds_t n_pfds = 0;
+
+	for (uint32_t i = 0; i < n_slots; i++) {
+		if (slots[i].req == NULL || slots[i].fd < 0) {
+			continue;
+		}
+
+		short events;
+		p->pfds[n_pfds].fd = sa_request_fd(slots[i].req, &events);
+		p->pfds[n_pfds].events = events;
+		p->pfds[n_pfds].revents = 0;
+		p->owners[n_pfds] = i;
+		n_pfds++;
+	}
+
+	uint32_t n_ready = 0;
+
+	if (poll(p->pfds, n_pfds, timeout) > 0) {
+		for (nfds_t i = 0; i < n_pfds; i++) {
+			if (p->pfds[i].revents != 0) {
+				p->ready[n_ready++] = p->owners[i];
+			}
+		}
+	}
+
+	return n_ready;
+}
+
+#endif
@@ -0,0 +1,735 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_alloc.h"
+#include "sa_cache.h"
+#include "sa_client.h"
+#include "sa_clock.h"
+#include "sa_error.h"
+#include "sa_logging.h"
+#include "sa_pool.h"
+#include "sa_request.h"
+#include "sa_resolve.h"
+#include "sa_secrets.h"
+#include "sa_socket.h"
+#include "sa_stats.h"
+#include "sa_tls.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//==========================================================
+// Forward declarations.
+//
+
+static sa_err request_new(const sa_client* c, uint64_t deadline_ms, sa_request** reqp);
+static sa_err validate_port(const sa_endpoint* ep);
+static sa_err step_resolve(sa_request* req);
+static sa_err step_connect(sa_request* req);
+static sa_err step_tls_handshake(sa_request* req);
+static sa_err step_send(sa_request* req);
+static sa_err step_recv_header(sa_request* req);
+static sa_err step_recv_body(sa_request* req);
+static sa_err connected(sa_request* req, int fd);
+static void start_exchange(sa_request* req);
+static void request_failed(sa_request* req, sa_err err);
+static void request_complete(sa_request* req, sa_err err);
+static void release_resources(sa_request* req);
+static void free_body(sa_request* req);
+static bool fd_ready(int fd, short events);
+
+//==========================================================
+// Public API.
+//
+
+sa_err
+sa_request_start(const sa_client* c, const char* path, sa_request** reqp)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	for (uint32_t i = 0; i < c->n_endpoints; i++) {
+		err = validate_port(&c->endpoints[i]);
+		if (err.code != SA_OK) {
+			return err;
+		}
+	}
+
+	sa_request* req;
+	err = request_new(c, sa_deadline_ms(c->cfg->timeout), &req);
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	req->cached = true;
+	req->path = strdup(path);
+	if (req->path == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_request path");
+		sa_request_destroy(req);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	err = sa_parse_secret_path(req->path, &req->ref);
+	if (err.code != SA_OK) {
+		sa_request_destroy(req);
+		return err;
+	}
+
+	*reqp = req;
+
+	if (c->cache != NULL) {
+		req->cache_res = sa_cache_get(c->cache, req->ref.secret_request,
+				req->ref.secret_request_len, &req->stale, &req->stale_size);
+
+		if (req->cache_res == SA_CACHE_HIT) {
+			req->value = req->stale;
+			req->size = req->stale_size;
+			req->stale = NULL;
+			request_complete(req, err);
+			return err;
+		}
+	}
+
+	req->req = (char*) malloc(sa_secret_request_max_size(req->ref.res_len, req->ref.key_len));
+	if (req->req == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_request frame");
+		err.code = SA_FAILED_INTERNAL;
+		request_complete(req, err);
+		err.code = SA_OK;
+		return err;
+	}
+
+	req->req_sz = sa_build_secret_request(req->req, req->ref.res, req->ref.res_len,
+			req->ref.key, req->ref.key_len);
+
+	req->endpoint = sa_endpoint_pick(c->endpoints, c->n_endpoints, 0, c->picks);
+	req->start_ns = sa_now_ns();
+	start_exchange(req);
+
+	// do as much as possible before the caller first waits
+	sa_request_advance(req);
+	return err;
+}
+
+sa_err
+sa_request_start_framed(const sa_client* c, sa_endpoint* ep, const char* req_frame,
+		uint32_t req_sz, uint64_t deadline_ms, sa_request** reqp)
+{
+	sa_err err = validate_port(ep);
+	if (err.code != SA_OK) {
+		sa_endpoint_done(ep, 0, err.code);
+		return err;
+	}
+
+	sa_request* req;
+	err = request_new(c, deadline_ms, &req);
+	if (err.code != SA_OK) {
+		sa_endpoint_abandon(ep);
+		return err;
+	}
+
+	req->endpoint = ep;
+	req->start_ns = sa_now_ns();
+
+	req->req = (char*) malloc(req_sz);
+	if (req->req == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_request frame");
+		sa_request_destroy(req);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	memcpy(req->req, req_frame, req_sz);
+	req->req_sz = req_sz;
+	start_exchange(req);
+
+	*reqp = req;
+
+	sa_request_advance(req);
+	return err;
+}
+
+int
+sa_request_fd(const sa_request* req, short* events)
+{
+	*events = req->events;
+
+	switch (req->state) {
+	case SA_REQUEST_RESOLVE:
+		return req->resolve == NULL ? -1 : sa_resolve_fd(req->resolve);
+	case SA_REQUEST_CONNECT:
+		return req->connect_fd;
+	case SA_REQUEST_TLS_HANDSHAKE:
+	case SA_REQUEST_SEND:
+	case SA_REQUEST_RECV_HEADER:
+	case SA_REQUEST_RECV_BODY:
+		return req->sock->fd;
+	default:
+		*events = 0;
+		return -1;
+	}
+}
+
+int
+sa_request_timeout(const sa_request* req)
+{
+	if (req->state == SA_REQUEST_DONE) {
+		return 0;
+	}
+
+	return sa_remaining_ms(req->deadline_ms);
+}
+
+bool
+sa_request_advance(sa_request* req)
+{
+	// the steps below, and the socket and json functions, record phases against req
+	sa_probe* prev = sa_probe_enter(&req->probe);
+
+	while (req->state != SA_REQUEST_DONE) {
+		if (sa_now_ms() >= req->deadline_ms) {
+			sa_g_log_function("ERR: request timed out in state %d", req->state);
+
+			sa_err err;
+			err.code = SA_FAILED_TIMEOUT;
+			request_failed(req, err);
+			continue;
+		}
+
+		req->events = 0;
+
+		sa_err err;
+		switch (req->state) {
+		case SA_REQUEST_RESOLVE:
+			err = step_resolve(req);
+			break;
+		case SA_REQUEST_CONNECT:
+			err = step_connect(req);
+			break;
+		case SA_REQUEST_TLS_HANDSHAKE:
+			err = step_tls_handshake(req);
+			break;
+		case SA_REQUEST_SEND:
+			err = step_send(req);
+			break;
+		case SA_REQUEST_RECV_HEADER:
+			err = step_recv_header(req);
+			break;
+		case SA_REQUEST_RECV_BODY:
+			err = step_recv_body(req);
+			break;
+		default:
+			err.code = SA_FAILED_INTERNAL;
+			break;
+		}
+
+		if (err.code != SA_OK) {
+			request_failed(req, err);
+			continue;
+		}
+
+		if (req->events != 0) {
+			// blocked, wait for the fd
+			sa_probe_leave(prev);
+			return false;
+		}
+	}
+
+	sa_probe_leave(prev);
+	return true;
+}
+
+sa_err
+sa_request_result(sa_request* req, uint8_t** r, size_t* size_r)
+{
+	if (req->state != SA_REQUEST_DONE) {
+		sa_err err;
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	if (req->err.code == SA_OK) {
+		*r = req->value;
+		*size_r = req->size;
+		req->value = NULL;
+	}
+
+	return req->err;
+}
+
+void
+sa_request_destroy(sa_request* req)
+{
+	if (req->endpoint != NULL) {
+		// abandoned before it completed
+		sa_endpoint_abandon(req->endpoint);
+	}
+
+	release_resources(req);
+
+	if (req->stale != NULL) {
+		sa_secret_free(req->client, req->stale, req->stale_size);
+	}
+
+	if (req->value != NULL) {
+		sa_secret_free(req->client, req->value, req->size);
+	}
+
+	free(req->path);
+	free(req);
+}
+
+//==========================================================
+// Local helpers.
+//
+
+// allocates a request, the caller picks its endpoint
+static sa_err
+request_new(const sa_client* c, uint64_t deadline_ms, sa_request** reqp)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	sa_request* req = (sa_request*) calloc(1, sizeof(sa_request));
+	if (req == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_request");
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	req->client = c;
+	req->state = SA_REQUEST_RESOLVE;
+	req->err.code = SA_OK;
+	req->deadline_ms = deadline_ms;
+	req->cache_res = SA_CACHE_MISS;
+	req->connect_fd = -1;
+	sa_probe_init(&req->probe, c->stats, &c->cfg->trace);
+
+	*reqp = req;
+	return err;
+}
+
+static sa_err
+validate_port(const sa_endpoint* ep)
+{
+	if (sa_is_unix_addr(ep->addr)) {
+		sa_err err;
+		err.code = SA_OK;
+		return err;
+	}
+
+	return sa_validate_port(ep->port);
+}
+
+static sa_err
+step_resolve(sa_request* req)
+{
+	const sa_client* c = req->client;
+	const sa_endpoint* ep = req->endpoint;
+	sa_err err;
+	err.code = SA_OK;
+
+	if (req->resolve == NULL && c->resolver != NULL) {
+		req->addrs = sa_resolver_get(c->resolver, ep->addr, ep->port);
+	}
+
+	if (req->addrs == NULL) {
+		if (req->resolve == NULL) {
+			err = sa_resolve_start(ep->addr, ep->port, &req->resolve);
+			if (err.code != SA_OK) {
+				return err;
+			}
+		}
+
+		err = sa_resolve_finish(req->resolve, &req->addrs);
+		if (err.code != SA_OK) {
+			// sa_resolve_finish destroyed resolve
+			req->resolve = NULL;
+			return err;
+		}
+
+		if (req->addrs == NULL) {
+			// still resolving
+			req->events = POLLIN;
+			return err;
+		}
+
+		req->resolve = NULL;
+
+		if (c->resolver != NULL) {
+			sa_resolver_put(c->resolver, ep->addr, ep->port, req->addrs);
+		}
+	}
+
+	sa_phase_end(SA_PHASE_RESOLVE, 0);
+	sa_phase_start(SA_PHASE_CONNECT);
+
+	req->next_addr = req->addrs->ai;
+	req->state = SA_REQUEST_CONNECT;
+	return err;
+}
+
+static sa_err
+step_connect(sa_request* req)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	if (req->connect_fd != -1) {
+		if (! fd_ready(req->connect_fd, POLLOUT)) {
+			req->events = POLLOUT;
+			return err;
+		}
+
+		int fd = req->connect_fd;
+		req->connect_fd = -1;
+
+		if (sa_connect_finish(fd).code == SA_OK) {
+			return connected(req, fd);
+		}
+
+		// try the next address
+		close(fd);
+	}
+
+	while (req->next_addr != NULL) {
+		struct addrinfo* ai = req->next_addr;
+		req->next_addr = ai->ai_next;
+
+		int fd;
+		bool in_progress;
+		if (sa_connect_start(ai, &fd, &in_progress).code != SA_OK) {
+			continue;
+		}
+
+		if (in_progress) {
+			req->connect_fd = fd;
+			req->events = POLLOUT;
+			return err;
+		}
+
+		return connected(req, fd);
+	}
+
+	sa_g_log_function("ERR: failed to connect to any address");
+	err.code = SA_FAILED_INTERNAL;
+	return err;
+}
+
+static sa_err
+step_tls_handshake(sa_request* req)
+{
+	sa_err err = sa_tls_connect_nb(req->sock, &req->events);
+
+	if (err.code == SA_OK && req->events == 0) {
+		sa_phase_end_tls(req->sock->tls_resumed);
+		sa_phase_start(SA_PHASE_SEND);
+		req->state = SA_REQUEST_SEND;
+	}
+
+	return err;
+}
+
+static sa_err
+step_send(sa_request* req)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	while (req->req_pos < req->req_sz) {
+		size_t n = 0;
+		err = sa_write_nb(req->sock, req->req_sz - req->req_pos, req->req + req->req_pos,
+				&n, &req->events);
+		if (err.code != SA_OK || req->events != 0) {
+			return err;
+		}
+
+		req->req_pos += (uint32_t)n;
+	}
+
+	sa_phase_end(SA_PHASE_SEND, req->req_sz);
+	sa_phase_start(SA_PHASE_FIRST_BYTE);
+
+	req->state = SA_REQUEST_RECV_HEADER;
+	return err;
+}
+
+static sa_err
+step_recv_header(sa_request* req)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	while (req->header_pos < SA_HEADER_SIZE) {
+		size_t n = 0;
+		err = sa_read_nb(req->sock, SA_HEADER_SIZE - req->header_pos,
+				req->header + req->header_pos, &n, &req->events);
+		if (err.code != SA_OK || req->events != 0) {
+			return err;
+		}
+
+		req->header_pos += (uint32_t)n;
+	}
+
+	sa_phase_end(SA_PHASE_FIRST_BYTE, SA_HEADER_SIZE);
+
+	err = sa_parse_secret_header(req->header, &req->body_sz);
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	req->body = (char*) sa_alloc(&req->client->cfg->alloc, req->body_sz + 1);
+	if (req->body == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for secret response");
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	sa_phase_start(SA_PHASE_BODY);
+
+	req->state = SA_REQUEST_RECV_BODY;
+	return err;
+}
+
+static sa_err
+step_recv_body(sa_request* req)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	while (req->body_pos < req->body_sz) {
+		size_t n = 0;
+		err = sa_read_nb(req->sock, req->body_sz - req->body_pos,
+				req->body + req->body_pos, &n, &req->events);
+		if (err.code != SA_OK || req->events != 0) {
+			return err;
+		}
+
+		req->body_pos += (uint32_t)n;
+	}
+
+	req->body[req->body_sz] = '\0';
+
+	sa_phase_end(SA_PHASE_BODY, req->body_sz);
+
+	// the exchange is complete, the connection can be reused
+	if (req->endpoint->pool != NULL) {
+		sa_pool_put(req->endpoint->pool, req->sock);
+	}
+	else {
+		sa_pool_close(req->sock);
+	}
+	req->sock = NULL;
+
+	// on success the secret is decoded into the body, which it now owns
+	req->value = sa_parse_json_in_place(req->body, req->body_sz, &req->size);
+	if (req->value == NULL) {
+		sa_g_log_function("ERR: unable to fetch secret");
+		err.code = SA_FAILED_BAD_REQUEST;
+	}
+	else {
+		req->body = NULL;
+	}
+
+	request_complete(req, err);
+
+	err.code = SA_OK;
+	return err;
+}
+
+// wraps a newly connected fd and moves on to the tls handshake or request
+static sa_err
+connected(sa_request* req, int fd)
+{
+	sa_cfg* cfg = req->client->cfg;
+	const sa_endpoint* ep = req->endpoint;
+	sa_err err;
+
+	if (sa_is_unix_addr(ep->addr)) {
+		err = sa_check_peer_uid(fd, cfg->peer_uid);
+		if (err.code != SA_OK) {
+			close(fd);
+			return err;
+		}
+	}
+
+	err = sa_socket_new(&req->sock, fd, ep->addr, ep->port, &cfg->tls);
+	if (err.code != SA_OK) {
+		close(fd);
+		return err;
+	}
+
+	sa_addrs_release(req->addrs);
+	req->addrs = NULL;
+	req->next_addr = NULL;
+
+	sa_phase_end(SA_PHASE_CONNECT, 0);
+
+	req->state = req->sock->tls_cfg->enabled ? SA_REQUEST_TLS_HANDSHAKE : SA_REQUEST_SEND;
+	sa_phase_start(req->state == SA_REQUEST_SEND ? SA_PHASE_SEND : SA_PHASE_TLS_HANDSHAKE);
+	return err;
+}
+
+// sends the request on a pooled connection if there is one, or starts the lookup
+static void
+start_exchange(sa_request* req)
+{
+	sa_stats* stats = req->client->stats;
+
+	sa_probe_start(&req->probe, SA_PHASE_REQUEST);
+
+	if (req->endpoint->pool != NULL) {
+		req->sock = sa_pool_get(req->endpoint->pool);
+		if (req->sock != NULL) {
+			req->reused = true;
+			req->state = SA_REQUEST_SEND;
+			sa_probe_start(&req->probe, SA_PHASE_SEND);
+
+			if (stats != NULL) {
+				sa_stats_add(&stats->reused, 1);
+			}
+
+			return;
+		}
+	}
+
+	sa_probe_start(&req->probe, SA_PHASE_RESOLVE);
+}
+
+static void
+request_failed(sa_request* req, sa_err err)
+{
+	bool exchanging = req->state == SA_REQUEST_SEND ||
+			req->state == SA_REQUEST_RECV_HEADER ||
+			req->state == SA_REQUEST_RECV_BODY;
+
+	if (req->reused && ! req->retried && exchanging && err.code != SA_FAILED_TIMEOUT) {
+		// The agent may have closed the pooled connection after it passed
+		// its liveness check. Retry once on a fresh connection.
+		sa_g_log_function("retrying request on a new connection");
+		sa_pool_close(req->sock);
+		req->sock = NULL;
+		req->reused = false;
+		req->retried = true;
+
+		req->req_pos = 0;
+		req->header_pos = 0;
+		req->body_pos = 0;
+		free_body(req);
+
+		req->state = SA_REQUEST_RESOLVE;
+		sa_phase_start(SA_PHASE_RESOLVE);
+		return;
+	}
+
+	request_complete(req, err);
+}
+
+static void
+request_complete(sa_request* req, sa_err err)
+{
+	const sa_client* c = req->client;
+
+	if (req->endpoint != NULL) {
+		sa_endpoint_done(req->endpoint, (sa_now_ns() - req->start_ns) / 1000, err.code);
+		req->endpoint = NULL;
+		sa_phase_end(SA_PHASE_REQUEST, 0);
+	}
+
+	release_resources(req);
+
+	if (req->cached && c->cache != NULL && req->cache_res != SA_CACHE_HIT) {
+		err = sa_cache_finish(c->cache, req->ref.secret_request, req->ref.secret_request_len,
+				req->cache_res, req->stale, req->stale_size, err, &req->value, &req->size);
+
+		// stale was either returned through value or freed
+		req->stale = NULL;
+	}
+
+	if (req->cached && c->stats != NULL) {
+		sa_stats_fetched(c->stats, err.code, req->cache_res == SA_CACHE_HIT);
+	}
+
+	req->err = err;
+	req->events = 0;
+	req->state = SA_REQUEST_DONE;
+}
+
+// releases everything but the result, failed connections are closed
+static void
+release_resources(sa_request* req)
+{
+	if (req->resolve != NULL) {
+		sa_resolve_cancel(req->resolve);
+		req->resolve = NULL;
+	}
+
+	if (req->addrs != NULL) {
+		sa_addrs_release(req->addrs);
+		req->addrs = NULL;
+		req->next_addr = NULL;
+	}
+
+	if (req->connect_fd != -1) {
+		close(req->connect_fd);
+		req->connect_fd = -1;
+	}
+
+	if (req->sock != NULL) {
+		sa_pool_close(req->sock);
+		req->sock = NULL;
+	}
+
+	free(req->req);
+	req->req = NULL;
+
+	free_body(req);
+}
+
+// a partly read or unparsed response may hold part of the secret
+static void
+free_body(sa_request* req)
+{
+	if (req->body != NULL) {
+		sa_zero(req->body, req->body_sz + 1);
+		sa_free(&req->client->cfg->alloc, req->body);
+		req->body = NULL;
+	}
+}
+
+// checks without blocking whether fd is ready for events
+static bool
+fd_ready(int fd, short events)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = events
+	};
+
+	return poll(&pfd, 1, 0) == 1 && pfd.revents != 0;
+}
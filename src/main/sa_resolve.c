@@ -0,0 +1,652 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_clock.h"
+#include "sa_error.h"
+#include "sa_resolve.h"
+#include "sa_logging.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//==========================================================
+// Typedefs & constants.
+//
+
+#define SA_MAX_PINNED_ADDRS 16
+
+//==========================================================
+// Forward declarations.
+//
+
+static bool is_numeric_host(const char* hostname);
+static void* resolve_worker(void* udata);
+static void resolve_release(sa_resolve* r);
+static sa_addrs* addrs_new(struct addrinfo** lists, uint32_t n_lists);
+static sa_err unix_addrs(const char* path, sa_addrs** addrsp);
+static sa_addrs* resolve_pinned(const char* pinned_addrs, const char* port);
+static sa_resolver_entry** find_entry(sa_resolver* resolver, const char* addr, const char* port);
+static void free_entry(sa_resolver_entry* entry);
+static void put_entry(sa_resolver* resolver, const char* addr, const char* port, sa_addrs* addrs, uint64_t expires_ms);
+
+//==========================================================
+// Public API.
+//
+
+int
+sa_lookup_host(const char* hostname, const char* port, struct addrinfo** res)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	// Check if hostname is really an IPv4 address.
+	struct in_addr ipv4;
+
+	if (inet_pton(AF_INET, hostname, &ipv4) == 1) {
+		hints.ai_family = AF_INET;
+		hints.ai_flags = AI_NUMERICHOST;
+	}
+	else {
+		// Check if hostname is really an IPv6 address.
+		struct in6_addr ipv6;
+		
+		if (inet_pton(AF_INET6, hostname, &ipv6) == 1) {
+			hints.ai_family = AF_INET6;
+			hints.ai_flags = AI_NUMERICHOST;
+		}
+	}
+
+	int ret = getaddrinfo(hostname, port, &hints, res);
+	return ret;
+}
+
+bool
+sa_is_unix_addr(const char* addr)
+{
+	return strncmp(addr, SA_UNIX_ADDR_PREFIX, strlen(SA_UNIX_ADDR_PREFIX)) == 0;
+}
+
+void
+sa_addrs_release(sa_addrs* addrs)
+{
+	if (__atomic_sub_fetch(&addrs->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(addrs);
+	}
+}
+
+sa_err
+sa_resolve_start(const char* addr, const char* port, sa_resolve** rp)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	sa_resolve* r = (sa_resolve*) calloc(1, sizeof(sa_resolve));
+	if (r == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_resolve");
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	r->refs = 1;
+	r->pipe_fds[0] = -1;
+	r->pipe_fds[1] = -1;
+
+	if (sa_is_unix_addr(addr)) {
+		err = unix_addrs(addr + strlen(SA_UNIX_ADDR_PREFIX), &r->addrs);
+		if (err.code != SA_OK) {
+			resolve_release(r);
+			return err;
+		}
+
+		*rp = r;
+		return err;
+	}
+
+	if (is_numeric_host(addr)) {
+		// no need for a thread, getaddrinfo won't block
+		struct addrinfo* res = NULL;
+		r->rv = sa_lookup_host(addr, port, &res);
+		if (r->rv == 0) {
+			r->addrs = addrs_new(&res, 1);
+			freeaddrinfo(res);
+		}
+
+		*rp = r;
+		return err;
+	}
+
+	r->addr = strdup(addr);
+	r->port = strdup(port);
+
+	if (r->addr == NULL || r->port == NULL || pipe(r->pipe_fds) != 0) {
+		sa_g_log_function("ERR: failed to set up host lookup, errno: %d", errno);
+		resolve_release(r);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	fcntl(r->pipe_fds[0], F_SETFL, O_NONBLOCK);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	// the worker holds its own reference in case the lookup is cancelled
+	r->refs = 2;
+
+	pthread_t thread;
+	int rv = pthread_create(&thread, &attr, resolve_worker, r);
+	pthread_attr_destroy(&attr);
+
+	if (rv != 0) {
+		sa_g_log_function("ERR: failed to start host lookup thread: %d", rv);
+		r->refs = 1;
+		resolve_release(r);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	*rp = r;
+	return err;
+}
+
+int
+sa_resolve_fd(sa_resolve* r)
+{
+	if (r->pipe_fds[0] == -1) {
+		return -1;
+	}
+
+	return r->pipe_fds[0];
+}
+
+sa_err
+sa_resolve_finish(sa_resolve* r, sa_addrs** addrsp)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	*addrsp = NULL;
+
+	if (r->pipe_fds[0] != -1) {
+		char b;
+		ssize_t rv = read(r->pipe_fds[0], &b, 1);
+		if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			// not done yet
+			return err;
+		}
+
+		if (rv != 1) {
+			sa_g_log_function("ERR: failed to read host lookup completion, errno: %d", errno);
+			resolve_release(r);
+			err.code = SA_FAILED_INTERNAL;
+			return err;
+		}
+	}
+
+	// reading the byte synchronizes with the worker's writes
+	if (r->rv != 0) {
+		sa_g_log_function("ERR: failed to lookup address: %s", gai_strerror(r->rv));
+		err.code = SA_FAILED_BAD_CONFIG;
+	}
+	else if (r->addrs == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for resolved addresses");
+		err.code = SA_FAILED_INTERNAL;
+	}
+	else {
+		*addrsp = r->addrs;
+		r->addrs = NULL;
+	}
+
+	resolve_release(r);
+	return err;
+}
+
+void
+sa_resolve_cancel(sa_resolve* r)
+{
+	resolve_release(r);
+}
+
+sa_resolver*
+sa_resolver_new(int ttl)
+{
+	sa_resolver* resolver = (sa_resolver*) calloc(1, sizeof(sa_resolver));
+	if (resolver == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_resolver");
+		return NULL;
+	}
+
+	pthread_mutex_init(&resolver->lock, NULL);
+	resolver->ttl = ttl;
+	return resolver;
+}
+
+void
+sa_resolver_destroy(sa_resolver* resolver)
+{
+	sa_resolver_entry* entry = resolver->entries;
+	while (entry != NULL) {
+		sa_resolver_entry* next = entry->next;
+		free_entry(entry);
+		entry = next;
+	}
+
+	pthread_mutex_destroy(&resolver->lock);
+	free(resolver);
+}
+
+sa_addrs*
+sa_resolver_get(sa_resolver* resolver, const char* addr, const char* port)
+{
+	if (sa_is_unix_addr(addr)) {
+		// never looked up
+		return NULL;
+	}
+
+	uint64_t now = sa_now_ms();
+	sa_addrs* addrs = NULL;
+
+	pthread_mutex_lock(&resolver->lock);
+
+	sa_resolver_entry** link = find_entry(resolver, addr, port);
+	sa_resolver_entry* entry = *link;
+
+	if (entry != NULL && now >= entry->expires_ms) {
+		*link = entry->next;
+		free_entry(entry);
+		entry = NULL;
+	}
+
+	if (entry != NULL) {
+		addrs = entry->addrs;
+		__atomic_add_fetch(&addrs->refs, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&resolver->lock);
+
+	return addrs;
+}
+
+void
+sa_resolver_put(sa_resolver* resolver, const char* addr, const char* port, sa_addrs* addrs)
+{
+	if (resolver->ttl <= 0 || sa_is_unix_addr(addr)) {
+		return;
+	}
+
+	put_entry(resolver, addr, port, addrs, sa_now_ms() + (uint64_t)resolver->ttl);
+}
+
+void
+sa_resolver_pin(sa_resolver* resolver, const char* addr, const char* port, const char* pinned_addrs)
+{
+	if (sa_is_unix_addr(addr)) {
+		sa_g_log_function("ERR: ignoring pinned addresses of %s, it is never looked up", addr);
+		return;
+	}
+
+	// numeric, so resolving never blocks
+	sa_addrs* addrs = resolve_pinned(pinned_addrs, port);
+	if (addrs == NULL) {
+		return;
+	}
+
+	put_entry(resolver, addr, port, addrs, UINT64_MAX);
+	sa_addrs_release(addrs);
+}
+
+sa_err
+sa_resolver_lookup(sa_resolver* resolver, const char* addr, const char* port, uint64_t deadline_ms,
+		sa_addrs** addrsp)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	if (resolver != NULL) {
+		sa_addrs* addrs = sa_resolver_get(resolver, addr, port);
+		if (addrs != NULL) {
+			*addrsp = addrs;
+			return err;
+		}
+	}
+
+	sa_resolve* r = NULL;
+	err = sa_resolve_start(addr, port, &r);
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	sa_addrs* addrs = NULL;
+
+	while (true) {
+		int fd = sa_resolve_fd(r);
+		if (fd != -1) {
+			uint64_t now = sa_now_ms();
+			if (now >= deadline_ms) {
+				sa_g_log_function("ERR: timed out looking up address: %s", addr);
+				sa_resolve_cancel(r);
+				err.code = SA_FAILED_TIMEOUT;
+				return err;
+			}
+
+			struct pollfd pfd = {
+				.fd = fd,
+				.events = POLLIN
+			};
+
+			// the lookup thread is left to finish on its own if this times out
+			poll(&pfd, 1, sa_remaining_ms(deadline_ms));
+		}
+
+		err = sa_resolve_finish(r, &addrs);
+		if (err.code != SA_OK || addrs != NULL) {
+			break;
+		}
+	}
+
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	if (resolver != NULL) {
+		sa_resolver_put(resolver, addr, port, addrs);
+	}
+
+	*addrsp = addrs;
+	return err;
+}
+
+//==========================================================
+// Local helpers.
+//
+
+static bool
+is_numeric_host(const char* hostname)
+{
+	struct in_addr ipv4;
+	struct in6_addr ipv6;
+
+	return inet_pton(AF_INET, hostname, &ipv4) == 1 ||
+			inet_pton(AF_INET6, hostname, &ipv6) == 1;
+}
+
+static void*
+resolve_worker(void* udata)
+{
+	sa_resolve* r = (sa_resolve*)udata;
+
+	struct addrinfo* res = NULL;
+	r->rv = sa_lookup_host(r->addr, r->port, &res);
+	if (r->rv == 0) {
+		r->addrs = addrs_new(&res, 1);
+		freeaddrinfo(res);
+	}
+
+	char b = 1;
+	if (write(r->pipe_fds[1], &b, 1) != 1) {
+		sa_g_log_function("ERR: failed to signal host lookup completion, errno: %d", errno);
+	}
+
+	resolve_release(r);
+	return NULL;
+}
+
+static void
+resolve_release(sa_resolve* r)
+{
+	if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	if (r->pipe_fds[0] != -1) {
+		close(r->pipe_fds[0]);
+	}
+
+	if (r->pipe_fds[1] != -1) {
+		close(r->pipe_fds[1]);
+	}
+
+	if (r->addrs != NULL) {
+		sa_addrs_release(r->addrs);
+	}
+
+	free(r->addr);
+	free(r->port);
+	free(r);
+}
+
+/*
+ * addrs_new copies the addresses in lists into one allocation,
+ * so the copy can be freed without freeaddrinfo.
+*/
+static sa_addrs*
+addrs_new(struct addrinfo** lists, uint32_t n_lists)
+{
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < n_lists; i++) {
+		for (struct addrinfo* ai = lists[i]; ai != NULL; ai = ai->ai_next) {
+			n++;
+		}
+	}
+
+	sa_addrs* addrs = (sa_addrs*) malloc(sizeof(sa_addrs) +
+			n * (sizeof(struct addrinfo) + sizeof(struct sockaddr_storage)));
+	if (addrs == NULL) {
+		return NULL;
+	}
+
+	struct addrinfo* copies = (struct addrinfo*)(addrs + 1);
+	struct sockaddr_storage* sas = (struct sockaddr_storage*)(copies + n);
+	uint32_t j = 0;
+
+	for (uint32_t i = 0; i < n_lists; i++) {
+		for (struct addrinfo* ai = lists[i]; ai != NULL; ai = ai->ai_next, j++) {
+			copies[j] = *ai;
+			copies[j].ai_canonname = NULL;
+			copies[j].ai_addr = (struct sockaddr*)&sas[j];
+			copies[j].ai_next = j + 1 < n ? &copies[j + 1] : NULL;
+			memcpy(&sas[j], ai->ai_addr, ai->ai_addrlen);
+		}
+	}
+
+	addrs->refs = 1;
+	addrs->ai = n != 0 ? copies : NULL;
+	return addrs;
+}
+
+/*
+ * unix_addrs makes the address of the unix domain socket at path.
+ * Abstract socket names are written @name, the @ is replaced with the
+ * leading null byte and the name is not null terminated.
+*/
+static sa_err
+unix_addrs(const char* path, sa_addrs** addrsp)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	struct sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+
+	bool abstract = path[0] == '@';
+	size_t len = strlen(path);
+
+	if (len == (abstract ? 1 : 0) || len > sizeof(sun.sun_path) - (abstract ? 0 : 1)) {
+		sa_g_log_function("ERR: invalid unix socket path: %s", path);
+		err.code = SA_FAILED_BAD_CONFIG;
+		return err;
+	}
+
+	memcpy(sun.sun_path, path, len);
+
+	if (abstract) {
+		sun.sun_path[0] = '\0';
+	}
+
+	struct addrinfo ai;
+	memset(&ai, 0, sizeof(ai));
+	ai.ai_family = AF_UNIX;
+	ai.ai_socktype = SOCK_STREAM;
+	ai.ai_addr = (struct sockaddr*)&sun;
+	ai.ai_addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len + (abstract ? 0 : 1));
+
+	struct addrinfo* list = &ai;
+	*addrsp = addrs_new(&list, 1);
+
+	if (*addrsp == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for resolved addresses");
+		err.code = SA_FAILED_INTERNAL;
+	}
+
+	return err;
+}
+
+// resolves the comma separated numeric addresses in pinned_addrs
+static sa_addrs*
+resolve_pinned(const char* pinned_addrs, const char* port)
+{
+	struct addrinfo* lists[SA_MAX_PINNED_ADDRS];
+	uint32_t n_lists = 0;
+
+	const char* p = pinned_addrs;
+
+	while (*p != '\0' && n_lists < SA_MAX_PINNED_ADDRS) {
+		size_t len = strcspn(p, ",");
+		char host[INET6_ADDRSTRLEN];
+
+		if (len != 0 && len < sizeof(host)) {
+			memcpy(host, p, len);
+			host[len] = '\0';
+
+			if (is_numeric_host(host) && sa_lookup_host(host, port, &lists[n_lists]) == 0) {
+				n_lists++;
+			}
+			else {
+				sa_g_log_function("ERR: ignoring pinned address: %s", host);
+			}
+		}
+
+		p += len;
+		if (*p == ',') {
+			p++;
+		}
+	}
+
+	sa_addrs* addrs = NULL;
+
+	if (n_lists == 0) {
+		sa_g_log_function("ERR: no usable pinned addresses");
+	}
+	else {
+		addrs = addrs_new(lists, n_lists);
+		if (addrs == NULL) {
+			sa_g_log_function("ERR: could not allocate memory for pinned addresses");
+		}
+	}
+
+	for (uint32_t i = 0; i < n_lists; i++) {
+		freeaddrinfo(lists[i]);
+	}
+
+	return addrs;
+}
+
+static sa_resolver_entry**
+find_entry(sa_resolver* resolver, const char* addr, const char* port)
+{
+	sa_resolver_entry** link = &resolver->entries;
+
+	while (*link != NULL) {
+		sa_resolver_entry* entry = *link;
+		if (strcmp(entry->addr, addr) == 0 && strcmp(entry->port, port) == 0) {
+			break;
+		}
+
+		link = &entry->next;
+	}
+
+	return link;
+}
+
+static void
+free_entry(sa_resolver_entry* entry)
+{
+	sa_addrs_release(entry->addrs);
+	free(entry->addr);
+	free(entry->port);
+	free(entry);
+}
+
+// caches addrs for addr and port until expires_ms, taking its own reference
+static void
+put_entry(sa_resolver* resolver, const char* addr, const char* port, sa_addrs* addrs,
+		uint64_t expires_ms)
+{
+	sa_resolver_entry* entry = (sa_resolver_entry*) malloc(sizeof(sa_resolver_entry));
+	char* addr_copy = strdup(addr);
+	char* port_copy = strdup(port);
+
+	if (entry == NULL || addr_copy == NULL || port_copy == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_resolver entry");
+		free(entry);
+		free(addr_copy);
+		free(port_copy);
+		return;
+	}
+
+	__atomic_add_fetch(&addrs->refs, 1, __ATOMIC_RELAXED);
+
+	entry->addr = addr_copy;
+	entry->port = port_copy;
+	entry->addrs = addrs;
+	entry->expires_ms = expires_ms;
+
+	pthread_mutex_lock(&resolver->lock);
+
+	sa_resolver_entry** link = find_entry(resolver, addr, port);
+	if (*link != NULL) {
+		sa_resolver_entry* old = *link;
+		*link = old->next;
+		free_entry(old);
+	}
+
+	entry->next = resolver->entries;
+	resolver->entries = entry;
+
+	pthread_mutex_unlock(&resolver->lock);
+}
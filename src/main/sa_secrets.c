@@ -19,10 +19,14 @@
 // Includes.
 //
 
+#include "sa_alloc.h"
 #include "sa_b64.h"
+#include "sa_client.h"
 #include "sa_error.h"
+#include "sa_json.h"
 #include "sa_secrets.h"
 #include "sa_socket.h"
+#include "sa_stats.h"
 #include "sa_logging.h"
 
 #include <assert.h>
@@ -38,16 +42,54 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#ifdef SA_USE_JANSSON
 #include "jansson.h"
+#endif
 
 
 //==========================================================
 // Typedefs & constants.
 //
 
-#define SA_HEADER_SIZE 8
 #define SA_MAGIC 0x51dec1cc // "sidekick" in hexspeak
 #define SA_MAX_RECV_JSON_SIZE (100 * 1024) // 100KB
+#define SA_RECV_CHUNK_SIZE (16 * 1024) // one tls record
+#define SA_MAX_ESCAPED 6 // a control character becomes \u00XX
+
+// stands in for the streamed SecretValue string when the rest of a response is parsed whole
+#define SA_VALUE_TAIL_PREFIX "{\"SecretValue\":\"\""
+#define SA_VALUE_TAIL_PREFIX_LEN (sizeof(SA_VALUE_TAIL_PREFIX) - 1)
+
+// where sa_recv_secret_value is in the SecretValue string
+typedef enum {
+	SA_VALUE_CHARS,
+	SA_VALUE_ESCAPE, // after a backslash
+	SA_VALUE_UNICODE, // in the hex digits of a \u escape
+	SA_VALUE_DONE, // after the closing quote, before the object's closing brace
+	SA_VALUE_CLOSED, // after the object's closing brace, only whitespace may follow
+	SA_VALUE_MORE // anything else follows, the rest is buffered in tail and parsed whole
+} sa_value_state;
+
+typedef struct sa_value_scan_s {
+	sa_value_state state;
+	bool trailing_ws; // only whitespace may follow
+	bool failed;
+	bool bad_json; // the string isn't valid json, so neither is the response
+	bool too_small; // out_size is still counted once out is full
+	bool replaced; // a later SecretValue member was decoded instead
+	bool low_surrogate; // a \u escaped low surrogate must come next
+	uint32_t n_hex; // hex digits of the \u escape seen so far
+	uint32_t code; // their value
+	sa_b64_stream b64;
+	uint8_t* out;
+	size_t cap;
+	size_t out_size;
+
+	const sa_allocator* alloc; // allocates tail
+	char* tail; // SA_VALUE_TAIL_PREFIX then what follows the SecretValue string
+	uint32_t tail_sz;
+	uint32_t tail_cap;
+} sa_value_scan;
 
 //==========================================================
 // Globals.
@@ -55,50 +97,197 @@
 
 static const char TRAILING_WHITESPACE[] = " \t\n\r\f\v";
 
+//==========================================================
+// Forward declarations.
+//
+
+static sa_err send_request(sa_socket* sock, const char* req, uint32_t req_sz, uint64_t deadline_ms);
+static char* append(char* p, const char* s);
+static char* append_escaped(char* p, const char* s, uint32_t len);
+static uint32_t value_start(const char* json, uint32_t json_sz);
+static void value_scan(sa_value_scan* scan, const char* p, const char* end);
+static void value_feed(sa_value_scan* scan, const char* p, const char* end);
+static void value_unicode(sa_value_scan* scan, char c);
+static void value_overflow(sa_value_scan* scan, const char* p, uint32_t len);
+static void value_tail(sa_value_scan* scan, const char* p, const char* end);
+static bool value_more(sa_value_scan* scan);
+static sa_err recv_value(uint8_t** r, size_t cap, size_t* size_r, sa_socket* sock, sa_scratch* scratch, const sa_allocator* alloc, uint64_t deadline_ms);
+static sa_err recv_buffered_value(uint8_t** r, size_t* size_r, sa_socket* sock, const sa_allocator* alloc, const char* head, uint32_t head_sz, uint32_t json_sz, uint64_t deadline_ms);
+static char* scratch_take(sa_scratch* scratch);
+static void scratch_put(sa_scratch* scratch, char* buf);
+static sa_err recv_buffered_into(uint8_t* buf, size_t cap, size_t* size_r, sa_socket* sock, sa_scratch* scratch, const char* head, uint32_t head_sz, uint32_t json_sz, uint64_t deadline_ms);
+
 //==========================================================
 // Public API.
 //
 
 sa_err
 sa_request_secret(char** resp, sa_socket* sock, const char* rsrc_substr, uint32_t rsrc_substr_len,
-		const char* secret_key, uint32_t secret_key_len, int timeout_ms)
+		const char* secret_key, uint32_t secret_key_len, const sa_allocator* alloc, uint64_t deadline_ms)
 {
-	sa_err err;
-	err.code = SA_OK;
+	char req[sa_secret_request_max_size(rsrc_substr_len, secret_key_len)];
+	uint32_t req_sz = sa_build_secret_request(req, rsrc_substr, rsrc_substr_len,
+			secret_key, secret_key_len);
+
+	sa_err err = send_request(sock, req, req_sz, deadline_ms);
+	if (err.code != SA_OK) {
+		return err;
+	}
 
-	char req[100 + rsrc_substr_len + secret_key_len];
+	return sa_recv_secret_response(resp, sock, alloc, deadline_ms);
+}
+
+sa_err
+sa_request_secret_value(uint8_t** r, size_t* size_r, sa_socket* sock, const char* rsrc_substr,
+		uint32_t rsrc_substr_len, const char* secret_key, uint32_t secret_key_len,
+		const sa_allocator* alloc, uint64_t deadline_ms)
+{
+	char req[sa_secret_request_max_size(rsrc_substr_len, secret_key_len)];
+	uint32_t req_sz = sa_build_secret_request(req, rsrc_substr, rsrc_substr_len,
+			secret_key, secret_key_len);
+
+	return sa_request_secret_framed(r, size_r, sock, req, req_sz, alloc, deadline_ms);
+}
+
+sa_err
+sa_request_secret_framed(uint8_t** r, size_t* size_r, sa_socket* sock, const char* req,
+		uint32_t req_sz, const sa_allocator* alloc, uint64_t deadline_ms)
+{
+	sa_err err = send_request(sock, req, req_sz, deadline_ms);
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	return sa_recv_secret_value(r, size_r, sock, alloc, deadline_ms);
+}
+
+sa_err
+sa_request_secret_into(uint8_t* buf, size_t cap, size_t* size_r, sa_socket* sock,
+		const char* req, uint32_t req_sz, sa_scratch* scratch, uint64_t deadline_ms)
+{
+	sa_err err = send_request(sock, req, req_sz, deadline_ms);
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	return sa_recv_secret_into(buf, cap, size_r, sock, scratch, deadline_ms);
+}
+
+void
+sa_scratch_init(sa_scratch* scratch, const sa_allocator* alloc)
+{
+	scratch->alloc = alloc;
+	scratch->buf = NULL;
+}
+
+void
+sa_scratch_destroy(sa_scratch* scratch)
+{
+	sa_free(scratch->alloc, scratch->buf);
+	scratch->buf = NULL;
+}
+
+uint32_t
+sa_secret_request_max_size(uint32_t rsrc_substr_len, uint32_t secret_key_len)
+{
+	return 100 + SA_MAX_ESCAPED * (rsrc_substr_len + secret_key_len);
+}
+
+uint32_t
+sa_build_secret_request(char* req, const char* rsrc_substr, uint32_t rsrc_substr_len,
+		const char* secret_key, uint32_t secret_key_len)
+{
 	char* json = &req[SA_HEADER_SIZE]; // json starts after 8 byte header
+	char* p = json;
 
-	if (rsrc_substr_len == 0) {
-		sprintf(json, "{\"SecretKey\":\"%.*s\"}", secret_key_len, secret_key);
+	if (rsrc_substr_len != 0) {
+		p = append(p, "{\"Resource\":\"");
+		p = append_escaped(p, rsrc_substr, rsrc_substr_len);
+		p = append(p, "\",\"SecretKey\":\"");
 	}
 	else {
-		sprintf(json,
-				"{\"Resource\":\"%.*s\",\"SecretKey\":\"%.*s\"}",
-				rsrc_substr_len, rsrc_substr, secret_key_len, secret_key);
+		p = append(p, "{\"SecretKey\":\"");
 	}
 
-	uint32_t json_sz = (uint32_t)strlen(json);
+	p = append_escaped(p, secret_key, secret_key_len);
+	p = append(p, "\"}");
+
+	uint32_t json_sz = (uint32_t)(p - json);
 
-	assert(SA_HEADER_SIZE + json_sz <= sizeof(req));
+	assert(SA_HEADER_SIZE + json_sz <= sa_secret_request_max_size(rsrc_substr_len, secret_key_len));
 
 	*(uint32_t*)&req[0] = ntohl(SA_MAGIC);
 	*(uint32_t*)&req[4] = ntohl(json_sz);
 
-	err = sa_write_n_bytes(sock, SA_HEADER_SIZE + json_sz, req, timeout_ms);
+	return SA_HEADER_SIZE + json_sz;
+}
+
+sa_err
+sa_recv_secret_response(char** resp, sa_socket* sock, const sa_allocator* alloc, uint64_t deadline_ms)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	char header[SA_HEADER_SIZE];
+
+	sa_phase_start(SA_PHASE_FIRST_BYTE);
+	err = sa_read_n_bytes(sock, SA_HEADER_SIZE, header, deadline_ms);
+	sa_phase_end(SA_PHASE_FIRST_BYTE, SA_HEADER_SIZE);
 	if (err.code != SA_OK) {
-		sa_g_log_function("ERR: failed asking for secret - %s", req);
+		sa_g_log_function("ERR: failed reading secret header, errno: %d", errno);
 		return err;
 	}
 
-	char header[SA_HEADER_SIZE];
+	uint32_t recv_json_sz = 0;
 
-	err = sa_read_n_bytes(sock, SA_HEADER_SIZE, header, timeout_ms);
+	err = sa_parse_secret_header(header, &recv_json_sz);
 	if (err.code != SA_OK) {
-		sa_g_log_function("ERR: failed reading secret header, errno: %d", errno);
 		return err;
 	}
 
+	char *recv_json = sa_alloc(alloc, recv_json_sz + 1);
+	if (recv_json == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for secret response");
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	sa_phase_start(SA_PHASE_BODY);
+	err = sa_read_n_bytes(sock, recv_json_sz, recv_json, deadline_ms);
+	sa_phase_end(SA_PHASE_BODY, recv_json_sz);
+	if (err.code != SA_OK) {
+		sa_g_log_function("ERR: failed reading secret errno: %d", errno);
+		sa_free(alloc, recv_json);
+		return err;
+	}
+
+	recv_json[recv_json_sz] = '\0';
+	*resp = recv_json;
+
+	return err;
+}
+
+sa_err
+sa_recv_secret_value(uint8_t** r, size_t* size_r, sa_socket* sock, const sa_allocator* alloc,
+		uint64_t deadline_ms)
+{
+	*r = NULL;
+	return recv_value(r, 0, size_r, sock, NULL, alloc, deadline_ms);
+}
+
+sa_err
+sa_recv_secret_into(uint8_t* buf, size_t cap, size_t* size_r, sa_socket* sock,
+		sa_scratch* scratch, uint64_t deadline_ms)
+{
+	return recv_value(&buf, cap, size_r, sock, scratch, NULL, deadline_ms);
+}
+
+sa_err
+sa_parse_secret_header(const char* header, uint32_t* json_sz)
+{
+	sa_err err;
+	err.code = SA_OK;
+
 	uint32_t recv_magic = ntohl(*(uint32_t*)&header[0]);
 
 	if (recv_magic != SA_MAGIC) {
@@ -115,16 +304,44 @@ sa_request_secret(char** resp, sa_socket* sock, const char* rsrc_substr, uint32_
 		return err;
 	}
 
-	char *recv_json = malloc(recv_json_sz + 1);
+	*json_sz = recv_json_sz;
+	return err;
+}
+
+sa_err
+sa_parse_secret_path(const char* path, sa_secret_ref* ref)
+{
+	sa_err err;
+	err.code = SA_OK;
 
-	err = sa_read_n_bytes(sock, recv_json_sz, recv_json, timeout_ms);
-	if (err.code != SA_OK) {
-		sa_g_log_function("ERR: failed reading secret errno: %d", errno);
+	const char* secret_request = path + sizeof(SA_SECRETS_PATH_REFIX) - 1;
+	uint32_t secret_request_len = (uint32_t)strlen(secret_request);
+
+	if (secret_request_len == 0) {
+		sa_g_log_function("ERR: empty secret key");
+		err.code = SA_FAILED_BAD_REQUEST;
 		return err;
 	}
 
-	recv_json[recv_json_sz] = '\0';
-	*resp = recv_json;
+	ref->secret_request = secret_request;
+	ref->secret_request_len = secret_request_len;
+	ref->res = NULL;
+	ref->res_len = 0;
+
+	const char* key = strrchr(secret_request, ':');
+
+	if (key == NULL) {
+		// no resource name
+		key = secret_request;
+	}
+	else {
+		ref->res = secret_request;
+		ref->res_len = (uint32_t)(key - secret_request);
+		key++;
+	}
+
+	ref->key = key;
+	ref->key_len = (uint32_t)(secret_request_len - (key - secret_request));
 
 	return err;
 }
@@ -136,6 +353,95 @@ sa_parse_json(const char* json_buf, size_t* size_r)
 		return NULL;
 	}
 
+	char* json = strdup(json_buf);
+	if (json == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for secret response");
+		return NULL;
+	}
+
+	size_t json_sz = strlen(json);
+
+	uint8_t* buf = sa_parse_json_in_place(json, json_sz, size_r);
+	if (buf == NULL) {
+		sa_zero(json, json_sz);
+		free(json);
+	}
+
+	return buf;
+}
+
+uint8_t*
+sa_parse_json_in_place(char* json_buf, size_t json_sz, size_t* size_r)
+{
+	sa_json_response res;
+
+	sa_phase_start(SA_PHASE_PARSE);
+	bool scanned = sa_json_scan_response(json_buf, &res);
+	sa_phase_end(SA_PHASE_PARSE, 0);
+
+	if (! scanned) {
+		return NULL;
+	}
+
+	// If secret agent faced an error it will convey the reason.
+	if (res.error != NULL) {
+		sa_g_log_function("ERR: response: %.*s", (int)res.error_len, res.error);
+		return NULL;
+	}
+
+	if (res.secret_value == NULL) {
+		sa_g_log_function("ERR: failed to find \"SecretValue\" in response");
+		return NULL;
+	}
+
+	uint32_t payload_len = res.secret_value_len;
+
+	if (payload_len == 0) {
+		sa_g_log_function("ERR: empty secret");
+		return NULL;
+	}
+
+	while (strchr(TRAILING_WHITESPACE, res.secret_value[payload_len - 1]) != NULL) {
+		payload_len--;
+
+		if (payload_len == 0) {
+			sa_g_log_function("ERR: whitespace-only secret");
+			return NULL;
+		}
+	}
+
+	uint32_t size;
+
+	sa_phase_start(SA_PHASE_DECODE);
+	bool decoded = sa_b64_validate_and_decode_in_place((uint8_t*)res.secret_value, payload_len,
+			&size);
+	sa_phase_end(SA_PHASE_DECODE, 0);
+
+	if (! decoded) {
+		sa_g_log_function("ERR: failed to base64-decode secret");
+		return NULL;
+	}
+
+	// The decoded secret is shorter than the json, so there is room for the
+	// caller's '\0' if it is a string.
+	memmove(json_buf, res.secret_value, size);
+
+	// the rest still holds the encoded secret and what was decoded past size
+	sa_zero(json_buf + size, json_sz - size);
+
+	*size_r = size;
+	return (uint8_t*)json_buf;
+}
+
+#ifdef SA_USE_JANSSON
+
+uint8_t*
+sa_parse_json_jansson(const char* json_buf, size_t* size_r)
+{
+	if (json_buf == NULL) {
+		return NULL;
+	}
+
 	json_error_t err;
 
 	json_t* doc = json_loads(json_buf, 0, &err);
@@ -202,4 +508,707 @@ sa_parse_json(const char* json_buf, size_t* size_r)
 
 	*size_r = size;
 	return buf;
-}
\ No newline at end of file
+}
+
+#endif
+
+//==========================================================
+// Local helpers.
+//
+
+static sa_err
+send_request(sa_socket* sock, const char* req, uint32_t req_sz, uint64_t deadline_ms)
+{
+	sa_phase_start(SA_PHASE_SEND);
+	sa_err err = sa_write_n_bytes(sock, req_sz, req, deadline_ms);
+	sa_phase_end(SA_PHASE_SEND, req_sz);
+	if (err.code != SA_OK) {
+		sa_g_log_function("ERR: failed asking for secret - %.*s",
+				(int)(req_sz - SA_HEADER_SIZE), req + SA_HEADER_SIZE);
+	}
+
+	return err;
+}
+
+static char*
+append(char* p, const char* s)
+{
+	size_t len = strlen(s);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+// appends s as the inside of a json string
+static char*
+append_escaped(char* p, const char* s, uint32_t len)
+{
+	static const char HEX[] = "0123456789abcdef";
+
+	for (uint32_t i = 0; i < len; i++) {
+		uint8_t c = (uint8_t)s[i];
+
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = (char)c;
+		}
+		else if (c < 0x20) {
+			p = append(p, "\\u00");
+			*p++ = HEX[c >> 4];
+			*p++ = HEX[c & 0xF];
+		}
+		else {
+			*p++ = (char)c;
+		}
+	}
+
+	return p;
+}
+
+// returns the offset of the SecretValue string if json starts with it, otherwise 0
+static uint32_t
+value_start(const char* json, uint32_t json_sz)
+{
+	static const char* tokens[] = { "{", "\"SecretValue\"", ":", "\"" };
+
+	uint32_t i = 0;
+
+	for (uint32_t t = 0; t < sizeof(tokens) / sizeof(tokens[0]); t++) {
+		while (i < json_sz && strchr(" \t\n\r", json[i]) != NULL && json[i] != '\0') {
+			i++;
+		}
+
+		uint32_t len = (uint32_t)strlen(tokens[t]);
+		if (json_sz - i < len || memcmp(json + i, tokens[t], len) != 0) {
+			return 0;
+		}
+
+		i += len;
+	}
+
+	return i;
+}
+
+/*
+ * value_scan decodes the part of the SecretValue string in p to end. As when
+ * parsing the whole response, trailing whitespace is dropped and, as base64
+ * has no other characters json needs to escape, \/ is the only other escape.
+ * The string is scanned to its end even once decoding fails, so what follows
+ * it is checked by value_tail.
+*/
+static void
+value_scan(sa_value_scan* scan, const char* p, const char* end)
+{
+	while (p < end && scan->state < SA_VALUE_DONE) {
+		if (scan->state == SA_VALUE_UNICODE) {
+			value_unicode(scan, *p++);
+			continue;
+		}
+
+		if (scan->low_surrogate && (scan->state == SA_VALUE_ESCAPE ? *p != 'u' : *p != '\\')) {
+			// a high surrogate not followed by a low one
+			scan->bad_json = true;
+			scan->low_surrogate = false;
+		}
+
+		if (scan->state == SA_VALUE_ESCAPE) {
+			scan->state = SA_VALUE_CHARS;
+
+			if (*p == 'u') {
+				// the escaped character is decoded once its digits are in
+				scan->state = SA_VALUE_UNICODE;
+				scan->n_hex = 0;
+				scan->code = 0;
+			}
+			else if (*p == '/') {
+				value_feed(scan, p, p + 1);
+			}
+			else if (strchr("ntrf", *p) != NULL && *p != '\0') {
+				scan->trailing_ws = true;
+			}
+			else {
+				// valid escapes decode to characters base64 doesn't have
+				scan->bad_json |= strchr("\"\\b", *p) == NULL || *p == '\0';
+				scan->failed = true;
+			}
+
+			p++;
+			continue;
+		}
+
+		// hand runs of plain characters to the decoder whole
+		const char* q = p;
+		while (q < end && *q != '"' && *q != '\\') {
+			scan->bad_json |= (uint8_t)*q < 0x20;
+			q++;
+		}
+
+		value_feed(scan, p, q);
+
+		if (q < end) {
+			scan->state = *q == '"' ? SA_VALUE_DONE : SA_VALUE_ESCAPE;
+			q++;
+		}
+
+		p = q;
+	}
+
+	if (p < end) {
+		value_tail(scan, p, end);
+	}
+}
+
+// decodes the unescaped characters p to end, setting aside trailing whitespace
+static void
+value_feed(sa_value_scan* scan, const char* p, const char* end)
+{
+	if (scan->failed) {
+		return;
+	}
+
+	const char* content_end = end;
+	while (content_end > p && content_end[-1] != '\0' &&
+			strchr(TRAILING_WHITESPACE, content_end[-1]) != NULL) {
+		content_end--;
+	}
+
+	if (content_end != p) {
+		if (scan->trailing_ws) {
+			// whitespace before more of the secret
+			scan->failed = true;
+			return;
+		}
+
+		uint32_t len = (uint32_t)(content_end - p);
+
+		if (scan->out_size + sa_b64_stream_out_size(&scan->b64, len) > scan->cap) {
+			value_overflow(scan, p, len);
+		}
+		else {
+			uint32_t n = 0;
+			if (! sa_b64_stream_update(&scan->b64, p, len, scan->out + scan->out_size, &n)) {
+				scan->failed = true;
+				return;
+			}
+
+			scan->out_size += n;
+		}
+	}
+
+	if (content_end != end) {
+		scan->trailing_ws = true;
+	}
+}
+
+/*
+ * recv_value is sa_recv_secret_value if r points to NULL, otherwise
+ * sa_recv_secret_into the cap bytes at r.
+*/
+static sa_err
+recv_value(uint8_t** r, size_t cap, size_t* size_r, sa_socket* sock, sa_scratch* scratch,
+		const sa_allocator* alloc, uint64_t deadline_ms)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	char header[SA_HEADER_SIZE];
+
+	sa_phase_start(SA_PHASE_FIRST_BYTE);
+	err = sa_read_n_bytes(sock, SA_HEADER_SIZE, header, deadline_ms);
+	sa_phase_end(SA_PHASE_FIRST_BYTE, SA_HEADER_SIZE);
+	if (err.code != SA_OK) {
+		sa_g_log_function("ERR: failed reading secret header, errno: %d", errno);
+		return err;
+	}
+
+	uint32_t json_sz = 0;
+
+	err = sa_parse_secret_header(header, &json_sz);
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	// ended by whichever of the functions below reads the rest
+	sa_phase_start(SA_PHASE_BODY);
+
+	char chunk[SA_RECV_CHUNK_SIZE];
+	uint32_t chunk_sz = json_sz < sizeof(chunk) ? json_sz : sizeof(chunk);
+	uint32_t chunk_used = chunk_sz; // no later read is longer
+
+	if (chunk_sz != 0) {
+		err = sa_read_n_bytes(sock, chunk_sz, chunk, deadline_ms);
+		if (err.code != SA_OK) {
+			sa_zero(chunk, chunk_sz);
+			sa_phase_end(SA_PHASE_BODY, json_sz);
+			sa_g_log_function("ERR: failed reading secret errno: %d", errno);
+			return err;
+		}
+	}
+
+	// The agent's responses start {"SecretValue":" - anything else, like an
+	// error, is read whole and parsed as json.
+	uint32_t start = value_start(chunk, chunk_sz);
+	if (start == 0) {
+		if (*r == NULL) {
+			err = recv_buffered_value(r, size_r, sock, alloc, chunk, chunk_sz, json_sz,
+					deadline_ms);
+		}
+		else {
+			err = recv_buffered_into(*r, cap, size_r, sock, scratch, chunk, chunk_sz, json_sz,
+					deadline_ms);
+		}
+
+		// the chunk isn't mlock'd, don't leave the response on the stack
+		sa_zero(chunk, chunk_sz);
+		return err;
+	}
+
+	sa_value_scan scan;
+	scan.state = SA_VALUE_CHARS;
+	scan.trailing_ws = false;
+	scan.failed = false;
+	scan.bad_json = false;
+	scan.too_small = false;
+	scan.replaced = false;
+	scan.low_surrogate = false;
+	sa_b64_stream_init(&scan.b64);
+	scan.out = *r;
+	scan.cap = cap;
+	scan.out_size = 0;
+	scan.alloc = alloc != NULL || scratch == NULL ? alloc : scratch->alloc;
+	scan.tail = NULL;
+	scan.tail_sz = 0;
+	// with room for the prefix, a closing brace already seen and '\0'
+	scan.tail_cap = json_sz + (uint32_t)SA_VALUE_TAIL_PREFIX_LEN + 2;
+
+	if (scan.out == NULL) {
+		scan.cap = sa_b64_decoded_buf_size(json_sz);
+
+		// Extra byte - if this is a string, the caller will add '\0'.
+		scan.out = sa_alloc(alloc, scan.cap + 1);
+		if (scan.out == NULL) {
+			sa_zero(chunk, chunk_sz);
+			sa_g_log_function("ERR: could not allocate memory for secret");
+			err.code = SA_FAILED_INTERNAL;
+			return err;
+		}
+	}
+
+	sa_phase_start(SA_PHASE_DECODE);
+	value_scan(&scan, chunk + start, chunk + chunk_sz);
+	sa_phase_end(SA_PHASE_DECODE, 0);
+
+	uint32_t json_read = chunk_sz;
+
+	while (json_read < json_sz) {
+		chunk_sz = json_sz - json_read < sizeof(chunk) ? json_sz - json_read : sizeof(chunk);
+
+		err = sa_read_n_bytes(sock, chunk_sz, chunk, deadline_ms);
+		if (err.code != SA_OK) {
+			sa_g_log_function("ERR: failed reading secret errno: %d", errno);
+			scan.failed = true;
+			break;
+		}
+
+		sa_phase_start(SA_PHASE_DECODE);
+		value_scan(&scan, chunk, chunk + chunk_sz);
+		sa_phase_end(SA_PHASE_DECODE, 0);
+		json_read += chunk_sz;
+	}
+
+	// the chunk isn't mlock'd, don't leave the response on the stack
+	sa_zero(chunk, chunk_used);
+	sa_phase_end(SA_PHASE_BODY, json_sz);
+
+	if (err.code != SA_OK) {
+		// the read failure is already logged
+		scan.failed = true;
+	}
+	else if (scan.state < SA_VALUE_DONE) {
+		sa_g_log_function("ERR: failed to parse response JSON, unterminated secret");
+		scan.failed = true;
+	}
+	else if (scan.bad_json) {
+		sa_g_log_function("ERR: failed to parse response JSON, invalid secret string");
+		scan.failed = true;
+	}
+	else if (scan.state == SA_VALUE_DONE) {
+		sa_g_log_function("ERR: failed to parse response JSON, unterminated object");
+		scan.failed = true;
+	}
+	else if (scan.state == SA_VALUE_MORE && ! value_more(&scan)) {
+		// value_more logged why
+		scan.failed = true;
+	}
+	else if (scan.replaced) {
+		// decoded whole by value_more
+	}
+	else if (! scan.failed && ! scan.b64.decoded && ! scan.b64.failed && scan.b64.n_carry == 0) {
+		sa_g_log_function(scan.trailing_ws ? "ERR: whitespace-only secret" : "ERR: empty secret");
+		scan.failed = true;
+	}
+	else if (scan.failed || ! sa_b64_stream_finish(&scan.b64)) {
+		sa_g_log_function("ERR: failed to base64-decode secret");
+		scan.failed = true;
+	}
+
+	if (scan.tail != NULL) {
+		sa_zero(scan.tail, scan.tail_cap);
+		sa_free(scan.alloc, scan.tail);
+	}
+
+	if (! scan.failed && scan.too_small) {
+		sa_g_log_function("ERR: secret of %zu bytes does not fit buffer of %zu",
+				scan.out_size, scan.cap);
+		*size_r = scan.out_size;
+		err.code = SA_FAILED_BUFFER_TOO_SMALL;
+	}
+
+	if (scan.failed || scan.too_small) {
+		// don't leave part of the secret behind
+		sa_zero(scan.out, scan.out_size < scan.cap ? scan.out_size : scan.cap);
+
+		if (*r == NULL) {
+			sa_free(alloc, scan.out);
+		}
+
+		if (err.code == SA_OK) {
+			err.code = SA_FAILED_BAD_REQUEST;
+		}
+
+		return err;
+	}
+
+	*r = scan.out;
+	*size_r = scan.out_size;
+	return err;
+}
+
+/*
+ * value_unicode takes the next hex digit c of a \u escape. Once all four are
+ * in, an ASCII character is decoded like any other. The rest, and surrogate
+ * pairs, are valid json but never base64.
+*/
+static void
+value_unicode(sa_value_scan* scan, char c)
+{
+	uint32_t digit;
+
+	if (c >= '0' && c <= '9') {
+		digit = (uint32_t)(c - '0');
+	}
+	else if (c >= 'a' && c <= 'f') {
+		digit = (uint32_t)(c - 'a' + 10);
+	}
+	else if (c >= 'A' && c <= 'F') {
+		digit = (uint32_t)(c - 'A' + 10);
+	}
+	else {
+		scan->bad_json = true;
+		scan->failed = true;
+		scan->state = SA_VALUE_CHARS;
+		return;
+	}
+
+	scan->code = (scan->code << 4) | digit;
+
+	if (++scan->n_hex < 4) {
+		return;
+	}
+
+	scan->state = SA_VALUE_CHARS;
+
+	bool low = scan->code >= 0xDC00 && scan->code <= 0xDFFF;
+
+	if (low != scan->low_surrogate || scan->code == 0) {
+		// a lone low surrogate, or a high one followed by something else
+		scan->bad_json = true;
+		scan->failed = true;
+	}
+	else if (scan->code < 0x80) {
+		char ch = (char)scan->code;
+		value_feed(scan, &ch, &ch + 1);
+	}
+	else {
+		scan->failed = true;
+	}
+
+	scan->low_surrogate = scan->code >= 0xD800 && scan->code <= 0xDBFF;
+}
+
+/*
+ * value_overflow decodes what may not fit what is left of out a piece at a
+ * time, keeping what still fits. The rest is only counted, so the size
+ * needed can be reported.
+*/
+static void
+value_overflow(sa_value_scan* scan, const char* p, uint32_t len)
+{
+	uint8_t piece[1024];
+
+	while (len != 0 && ! scan->failed) {
+		uint32_t in_len = len < sizeof(piece) ? len : (uint32_t)sizeof(piece);
+		uint32_t n = 0;
+
+		if (! sa_b64_stream_update(&scan->b64, p, in_len, piece, &n)) {
+			scan->failed = true;
+			break;
+		}
+
+		if (! scan->too_small && scan->out_size + n <= scan->cap) {
+			memcpy(scan->out + scan->out_size, piece, n);
+		}
+		else {
+			scan->too_small = true;
+		}
+
+		scan->out_size += n;
+		p += in_len;
+		len -= in_len;
+	}
+
+	sa_zero(piece, sizeof(piece));
+}
+
+/*
+ * value_tail checks what follows the SecretValue string. A closing brace, and
+ * whitespace, is all the agent sends - anything else is buffered for
+ * value_more, after the brace if there was one.
+*/
+static void
+value_tail(sa_value_scan* scan, const char* p, const char* end)
+{
+	for (; p < end && scan->state != SA_VALUE_MORE; p++) {
+		if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+			continue;
+		}
+
+		if (scan->state == SA_VALUE_DONE && *p == '}') {
+			scan->state = SA_VALUE_CLOSED;
+			continue;
+		}
+
+		scan->tail = sa_alloc(scan->alloc, scan->tail_cap);
+		if (scan->tail == NULL) {
+			sa_g_log_function("ERR: could not allocate memory for secret response");
+			scan->state = SA_VALUE_MORE;
+			return;
+		}
+
+		memcpy(scan->tail, SA_VALUE_TAIL_PREFIX, SA_VALUE_TAIL_PREFIX_LEN);
+		scan->tail_sz = (uint32_t)SA_VALUE_TAIL_PREFIX_LEN;
+
+		if (scan->state == SA_VALUE_CLOSED) {
+			scan->tail[scan->tail_sz++] = '}';
+		}
+
+		scan->state = SA_VALUE_MORE;
+		break;
+	}
+
+	if (scan->tail != NULL) {
+		// bounded by the json size, which tail_cap allows for
+		memcpy(scan->tail + scan->tail_sz, p, (size_t)(end - p));
+		scan->tail_sz += (uint32_t)(end - p);
+	}
+}
+
+/*
+ * value_more parses the response with the streamed SecretValue string left
+ * empty, so the rest of it is checked as sa_parse_json_in_place would. If a
+ * later SecretValue member wins, as the last of duplicates does, it is
+ * decoded instead. Returns false, after logging why, if the response is
+ * rejected.
+*/
+static bool
+value_more(sa_value_scan* scan)
+{
+	if (scan->tail == NULL) {
+		// the allocation failure is already logged
+		return false;
+	}
+
+	scan->tail[scan->tail_sz] = '\0';
+
+	// scanning unescapes in place, keep tail for sa_parse_json_in_place
+	char* json = sa_alloc(scan->alloc, scan->tail_sz + 1);
+	if (json == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for secret response");
+		return false;
+	}
+
+	memcpy(json, scan->tail, scan->tail_sz + 1);
+
+	sa_json_response res;
+	bool scanned = sa_json_scan_response(json, &res);
+	bool streamed = scanned && res.secret_value == json + SA_VALUE_TAIL_PREFIX_LEN - 1;
+
+	if (scanned && res.error != NULL) {
+		sa_g_log_function("ERR: response: %.*s", (int)res.error_len, res.error);
+	}
+
+	bool ok = scanned && res.error == NULL;
+
+	sa_zero(json, scan->tail_sz + 1);
+	sa_free(scan->alloc, json);
+
+	if (! ok || streamed) {
+		return ok;
+	}
+
+	size_t size;
+	uint8_t* value = sa_parse_json_in_place(scan->tail, scan->tail_sz, &size);
+	if (value == NULL) {
+		return false;
+	}
+
+	sa_zero(scan->out, scan->out_size < scan->cap ? scan->out_size : scan->cap);
+
+	scan->too_small = size > scan->cap;
+	if (! scan->too_small) {
+		memcpy(scan->out, value, size);
+	}
+
+	scan->out_size = size;
+	scan->failed = false;
+	scan->replaced = true;
+	return true;
+}
+
+// reads the rest of a response that isn't streamed and parses it whole
+static sa_err
+recv_buffered_value(uint8_t** r, size_t* size_r, sa_socket* sock, const sa_allocator* alloc,
+		const char* head, uint32_t head_sz, uint32_t json_sz, uint64_t deadline_ms)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	char* json = sa_alloc(alloc, json_sz + 1);
+	if (json == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for secret response");
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	memcpy(json, head, head_sz);
+
+	if (json_sz > head_sz) {
+		err = sa_read_n_bytes(sock, json_sz - head_sz, json + head_sz, deadline_ms);
+	}
+
+	sa_phase_end(SA_PHASE_BODY, json_sz);
+
+	if (err.code != SA_OK) {
+		sa_g_log_function("ERR: failed reading secret errno: %d", errno);
+		sa_zero(json, json_sz + 1);
+		sa_free(alloc, json);
+		return err;
+	}
+
+	json[json_sz] = '\0';
+
+	*r = sa_parse_json_in_place(json, json_sz, size_r);
+
+	if (*r == NULL) {
+		// may hold part of the secret
+		sa_zero(json, json_sz + 1);
+		sa_free(alloc, json);
+		err.code = SA_FAILED_BAD_REQUEST;
+	}
+
+	return err;
+}
+
+// takes the scratch buffer, or if another caller has it allocates one
+static char*
+scratch_take(sa_scratch* scratch)
+{
+	char* buf = __atomic_exchange_n(&scratch->buf, NULL, __ATOMIC_ACQUIRE);
+
+	if (buf == NULL) {
+		buf = sa_alloc(scratch->alloc, SA_MAX_RECV_JSON_SIZE + 1);
+	}
+
+	return buf;
+}
+
+// returns buf to scratch, unless another caller's buffer was returned first
+static void
+scratch_put(sa_scratch* scratch, char* buf)
+{
+	char* expected = NULL;
+
+	if (! __atomic_compare_exchange_n(&scratch->buf, &expected, buf, false, __ATOMIC_RELEASE,
+			__ATOMIC_RELAXED)) {
+		sa_free(scratch->alloc, buf);
+	}
+}
+
+/*
+ * recv_buffered_value for sa_recv_secret_into. The json is read into buf
+ * if it fits, otherwise into the scratch buffer.
+*/
+static sa_err
+recv_buffered_into(uint8_t* buf, size_t cap, size_t* size_r, sa_socket* sock,
+		sa_scratch* scratch, const char* head, uint32_t head_sz, uint32_t json_sz,
+		uint64_t deadline_ms)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	char* json = (char*)buf;
+
+	if ((size_t)json_sz + 1 > cap) {
+		json = scratch_take(scratch);
+		if (json == NULL) {
+			sa_g_log_function("ERR: could not allocate memory for secret response");
+			err.code = SA_FAILED_INTERNAL;
+			return err;
+		}
+	}
+
+	memcpy(json, head, head_sz);
+
+	if (json_sz > head_sz) {
+		err = sa_read_n_bytes(sock, json_sz - head_sz, json + head_sz, deadline_ms);
+		if (err.code != SA_OK) {
+			sa_g_log_function("ERR: failed reading secret errno: %d", errno);
+		}
+	}
+
+	sa_phase_end(SA_PHASE_BODY, json_sz);
+
+	size_t size = 0;
+
+	if (err.code == SA_OK) {
+		json[json_sz] = '\0';
+
+		if (sa_parse_json_in_place(json, json_sz, &size) == NULL) {
+			err.code = SA_FAILED_BAD_REQUEST;
+		}
+		else if (json != (char*)buf) {
+			if (size <= cap) {
+				memcpy(buf, json, size);
+			}
+			else {
+				sa_g_log_function("ERR: secret of %zu bytes does not fit buffer of %zu",
+						size, cap);
+				*size_r = size;
+				err.code = SA_FAILED_BUFFER_TOO_SMALL;
+			}
+		}
+	}
+
+	if (json != (char*)buf) {
+		sa_zero(json, json_sz + 1);
+		scratch_put(scratch, json);
+	}
+	else if (err.code != SA_OK) {
+		sa_zero(buf, json_sz + 1);
+	}
+
+	if (err.code == SA_OK) {
+		*size_r = size;
+	}
+
+	return err;
+}
@@ -19,8 +19,14 @@
 // Includes.
 //
 
+#define _GNU_SOURCE // struct ucred
+
+#include "sa_alloc.h"
+#include "sa_clock.h"
 #include "sa_error.h"
+#include "sa_resolve.h"
 #include "sa_socket.h"
+#include "sa_stats.h"
 #include "sa_tls.h"
 #include "sa_logging.h"
 
@@ -34,11 +40,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/types.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <fcntl.h>
 #include <netdb.h>
 
+#include <openssl/err.h>
+
 //==========================================================
 // Typedefs & constants.
 //
@@ -46,98 +55,148 @@
 #define SA_MAX_PORT 65535
 #define SA_MIN_PORT 1
 
+// RFC 8305 connection attempt delay before racing the next address
+#define SA_CONNECT_ATTEMPT_DELAY_MS 250
+#define SA_CONNECT_MAX_ATTEMPTS 16
+
+//==========================================================
+// Globals.
+//
+
+// used by connections to unix: addresses, which are local and checked with sa_check_peer_uid
+static sa_tls_cfg SA_NO_TLS = { .enabled = false };
+
 //==========================================================
 // Forward Declarations.
 //
 
 static sa_socket* sa_socket_init(sa_socket* sock);
-static sa_err _read_n_bytes(sa_socket* sock, unsigned int n, void* buffer, int timeout_ms);
-static sa_err _write_n_bytes(sa_socket* sock, unsigned int n, void* buffer, int timeout_ms);
-static int lookup_host(const char* hostname, const char* port, struct addrinfo** res);
+static uint32_t interleave_families(const struct addrinfo* ai_list, const struct addrinfo** ais, uint32_t max);
+static sa_err _read_n_bytes(sa_socket* sock, unsigned int n, void* buffer, uint64_t deadline_ms);
+static sa_err _write_n_bytes(sa_socket* sock, unsigned int n, const void* buffer, uint64_t deadline_ms);
+static size_t recv_buffered(sa_socket* sock, size_t n, void* buffer);
+static sa_err recv_some(sa_socket* sock, size_t n, void* buffer, size_t* n_read, bool* again);
+static sa_err send_some(sa_socket* sock, size_t n, const void* buffer, size_t* n_written, bool* again);
 
 //==========================================================
 // Public API.
 //
 
-// This assumes buffer is at least n bytes long.
 sa_err
-sa_read_n_bytes(sa_socket* sock, unsigned int n, void* buffer, int timeout_ms)
+sa_read_n_bytes(sa_socket* sock, unsigned int n, void* buffer, uint64_t deadline_ms)
 {
 	if (sock->tls_cfg->enabled) {
-		return sa_tls_read_n_bytes(sock, n, buffer, timeout_ms);
+		return sa_tls_read_n_bytes(sock, n, buffer, deadline_ms);
 	}
 	else {
-		return _read_n_bytes(sock, n, buffer, timeout_ms);
+		return _read_n_bytes(sock, n, buffer, deadline_ms);
 	}
 }
 
-// This assumes buffer is at least n bytes long.
 sa_err
-sa_write_n_bytes(sa_socket* sock, unsigned int n, void* buffer, int timeout_ms)
+sa_write_n_bytes(sa_socket* sock, unsigned int n, const void* buffer, uint64_t deadline_ms)
 {
+	sa_err err;
+
 	if (sock->tls_cfg->enabled) {
-		return sa_tls_write_n_bytes(sock, n, buffer, timeout_ms);
+		err = sa_tls_write_n_bytes(sock, n, buffer, deadline_ms);
 	}
 	else {
-		return _write_n_bytes(sock, n, buffer, timeout_ms);
+		err = _write_n_bytes(sock, n, buffer, deadline_ms);
 	}
+
+	sock->sent = err.code == SA_OK;
+	return err;
 }
 
 sa_err 
-sa_connect_addr_port(sa_socket** sockp, const char* addr, const char* port, sa_tls_cfg* tls_cfg, int timeout_ms)
+sa_connect_addr_port(sa_socket** sockp, sa_resolver* resolver, const char* addr, const char* port, sa_tls_cfg* tls_cfg, int peer_uid, uint64_t deadline_ms)
 {
 	sa_err err;
 	err.code = SA_OK;
 
-	long port_num = strtol(port, NULL, 10);
-	if (port_num < SA_MIN_PORT || port_num > SA_MAX_PORT) {
-		sa_g_log_function("ERR: port: %ld is outside the valid port range %d - %d", port_num, SA_MIN_PORT, SA_MAX_PORT);
-		err.code = SA_FAILED_BAD_CONFIG;
-		return err;
+	bool unix_addr = sa_is_unix_addr(addr);
+
+	if (! unix_addr) {
+		err = sa_validate_port(port);
+		if (err.code != SA_OK) {
+			return err;
+		}
 	}
 
-	struct addrinfo *host_info, *p;
-	int lookup_res = lookup_host(addr, port, &host_info);
-	if (lookup_res != 0) {
-		sa_g_log_function("ERR: failed to lookup address: %s", addr);
-		err.code = SA_FAILED_BAD_CONFIG;
+	// the lookup, connect and tls handshake share the deadline
+	sa_addrs* addrs = NULL;
+	sa_phase_start(SA_PHASE_RESOLVE);
+	err = sa_resolver_lookup(resolver, addr, port, deadline_ms, &addrs);
+	sa_phase_end(SA_PHASE_RESOLVE, 0);
+	if (err.code != SA_OK) {
 		return err;
 	}
 
-	int sock_fd;
-	// loop through all the results and connect to the first we can
-	for(p = host_info; p != NULL; p = p->ai_next) {
-		if ((sock_fd = socket(p->ai_family, p->ai_socktype,
-				p->ai_protocol)) == -1) {
-			continue;
-		}
+	int sock_fd = -1;
+	sa_phase_start(SA_PHASE_CONNECT);
+	err = sa_connect_race(addrs->ai, deadline_ms, &sock_fd);
+	sa_phase_end(SA_PHASE_CONNECT, 0);
+	sa_addrs_release(addrs);
 
-		if (connect(sock_fd, p->ai_addr, p->ai_addrlen) == -1) {
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	if (unix_addr) {
+		err = sa_check_peer_uid(sock_fd, peer_uid);
+		if (err.code != SA_OK) {
 			close(sock_fd);
-			continue;
+			return err;
 		}
-
-		break; // successfully connected
 	}
 
-	if (p == NULL) {
-		// looped off the end of the list with no connection
-		sa_g_log_function("ERR: connect failed: %d, errno: %d", sock_fd, errno);
-		err.code = SA_FAILED_INTERNAL;
-		freeaddrinfo(host_info);
+	sa_socket* sock = NULL;
+	err = sa_socket_new(&sock, sock_fd, addr, port, tls_cfg);
+	if (err.code != SA_OK) {
+		close(sock_fd);
 		return err;
 	}
 
-	freeaddrinfo(host_info);
+	if (sock->tls_cfg->enabled) {
+		sa_phase_start(SA_PHASE_TLS_HANDSHAKE);
+		err = sa_tls_connect(sock, deadline_ms);
+		sa_phase_end_tls(sock->tls_resumed);
 
-	// mark the socket as non-blocking
-	int fcntl_res = fcntl(sock_fd, F_SETFL, O_NONBLOCK);
-	if (fcntl_res < 0) {
-		sa_g_log_function("ERR: could not set socket to non-blocking: %d", fcntl_res);
-		err.code = SA_FAILED_INTERNAL;
+		if (err.code != SA_OK) {
+			sa_g_log_function("ERR: tls connection failed: %d", err.code);
+			close(sock_fd);
+			sa_socket_destroy(sock);
+			return err;
+		}
+	}
+
+	*sockp = sock;
+	return err; 
+}
+
+sa_err
+sa_validate_port(const char* port)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	long port_num = strtol(port, NULL, 10);
+	if (port_num < SA_MIN_PORT || port_num > SA_MAX_PORT) {
+		sa_g_log_function("ERR: port: %ld is outside the valid port range %d - %d", port_num, SA_MIN_PORT, SA_MAX_PORT);
+		err.code = SA_FAILED_BAD_CONFIG;
 		return err;
 	}
 
+	return err;
+}
+
+sa_err
+sa_socket_new(sa_socket** sockp, int fd, const char* addr, const char* port, sa_tls_cfg* tls_cfg)
+{
+	sa_err err;
+	err.code = SA_OK;
+
 	// wrap the socket, must be freed by caller
 	sa_socket* sock = (sa_socket*) malloc(sizeof(sa_socket));
 	if (sock == NULL) {
@@ -147,37 +206,270 @@ sa_connect_addr_port(sa_socket** sockp, const char* addr, const char* port, sa_t
 	}
 
 	sock = sa_socket_init(sock);
-	sock->fd = sock_fd;
+	sock->fd = fd;
+
+	if (sa_is_unix_addr(addr)) {
+		tls_cfg = &SA_NO_TLS;
+	}
 
 	sock->tls_cfg = tls_cfg;
+	sock->addr = addr;
+	sock->port = port;
 	if (tls_cfg->enabled) {
 		sa_init_openssl();
 		if (sa_wrap_socket(sock) < 0) {
 			sa_g_log_function("ERR: failed to wrap socket for tls");
 			err.code = SA_FAILED_INTERNAL;
 
-			close(sock_fd);
 			free(sock);
 
 			return err;
 		}
+	}
 
-		err = sa_tls_connect(sock, timeout_ms);
+	*sockp = sock;
+	return err;
+}
 
-		if (err.code != SA_OK) {
-			sa_g_log_function("ERR: tls connection failed: %d", err.code);
-			close(sock_fd);
-			sa_socket_destroy(sock);
+sa_err
+sa_connect_start(const struct addrinfo* ai, int* fdp, bool* in_progress)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd == -1) {
+		sa_g_log_function("ERR: could not create socket, errno: %d", errno);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	// mark the socket as non-blocking
+	int fcntl_res = fcntl(fd, F_SETFL, O_NONBLOCK);
+	if (fcntl_res < 0) {
+		sa_g_log_function("ERR: could not set socket to non-blocking: %d", fcntl_res);
+		close(fd);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	*in_progress = false;
+
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+		if (errno != EINPROGRESS) {
+			sa_g_log_function("ERR: connect failed, errno: %d", errno);
+			close(fd);
+			err.code = SA_FAILED_INTERNAL;
 			return err;
 		}
+
+		*in_progress = true;
 	}
 
-	*sockp = sock;
-	return err; 
+	*fdp = fd;
+	return err;
+}
+
+sa_err
+sa_connect_race(const struct addrinfo* ai_list, uint64_t deadline_ms, int* fdp)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	const struct addrinfo* ais[SA_CONNECT_MAX_ATTEMPTS];
+	uint32_t n_ais = interleave_families(ai_list, ais, SA_CONNECT_MAX_ATTEMPTS);
+
+	struct pollfd pfds[SA_CONNECT_MAX_ATTEMPTS];
+	uint32_t n_active = 0;
+	uint32_t next = 0;
+	int fd = -1;
+
+	uint64_t next_attempt_ms = 0;
+
+	while (fd == -1) {
+		uint64_t now = sa_now_ms();
+
+		// start the next attempt once the last has had its head start
+		if (next < n_ais && (n_active == 0 || now >= next_attempt_ms)) {
+			int new_fd;
+			bool in_progress;
+			if (sa_connect_start(ais[next++], &new_fd, &in_progress).code != SA_OK) {
+				continue;
+			}
+
+			if (! in_progress) {
+				fd = new_fd;
+				break;
+			}
+
+			pfds[n_active].fd = new_fd;
+			pfds[n_active].events = POLLOUT;
+			pfds[n_active].revents = 0;
+			n_active++;
+			next_attempt_ms = now + SA_CONNECT_ATTEMPT_DELAY_MS;
+		}
+
+		if (n_active == 0) {
+			sa_g_log_function("ERR: failed to connect to any address");
+			err.code = SA_FAILED_INTERNAL;
+			return err;
+		}
+
+		if (now >= deadline_ms) {
+			sa_g_log_function("ERR: connect timed out");
+			err.code = SA_FAILED_TIMEOUT;
+			break;
+		}
+
+		uint64_t wake_ms = deadline_ms;
+		if (next < n_ais && next_attempt_ms < wake_ms) {
+			wake_ms = next_attempt_ms;
+		}
+
+		int rv = poll(pfds, n_active, sa_remaining_ms(wake_ms));
+		if (rv < 0 && errno != EINTR) {
+			sa_g_log_function("ERR: connect poll failed, errno: %d", errno);
+			err.code = SA_FAILED_INTERNAL;
+			break;
+		}
+
+		uint32_t i = 0;
+		while (rv > 0 && i < n_active) {
+			if (pfds[i].revents == 0) {
+				i++;
+				continue;
+			}
+
+			if (sa_connect_finish(pfds[i].fd).code == SA_OK) {
+				fd = pfds[i].fd;
+				pfds[i] = pfds[--n_active];
+				break;
+			}
+
+			// failed, the next address may start without waiting
+			close(pfds[i].fd);
+			pfds[i] = pfds[--n_active];
+			next_attempt_ms = now;
+		}
+	}
+
+	// cancel the losing attempts
+	for (uint32_t i = 0; i < n_active; i++) {
+		close(pfds[i].fd);
+	}
+
+	if (fd != -1) {
+		*fdp = fd;
+	}
+
+	return err;
+}
+
+sa_err
+sa_connect_finish(int fd)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	int so_err = 0;
+	socklen_t len = sizeof(so_err);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_err, &len) != 0 || so_err != 0) {
+		sa_g_log_function("ERR: connect failed, errno: %d", so_err != 0 ? so_err : errno);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	return err;
+}
+
+sa_err
+sa_check_peer_uid(int fd, int uid)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	if (uid == -1) {
+		return err;
+	}
+
+	uid_t peer_uid;
+
+#if defined(__linux__)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		sa_g_log_function("ERR: could not get agent credentials, errno: %d", errno);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	peer_uid = cred.uid;
+#else
+	gid_t peer_gid;
+
+	if (getpeereid(fd, &peer_uid, &peer_gid) != 0) {
+		sa_g_log_function("ERR: could not get agent credentials, errno: %d", errno);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+#endif
+
+	if (peer_uid != (uid_t)uid) {
+		sa_g_log_function("ERR: agent is running as uid %u, expected %d", (unsigned int)peer_uid, uid);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	return err;
 }
 
 sa_err
-sa_socket_wait(sa_socket* sock, int timeout_ms, bool read, short* poll_res)
+sa_read_nb(sa_socket* sock, size_t n, void* buffer, size_t* n_read, short* events)
+{
+	if (sock->tls_cfg->enabled) {
+		return sa_tls_read_nb(sock, n, buffer, n_read, events);
+	}
+
+	sa_err err;
+	err.code = SA_OK;
+	*events = 0;
+
+	*n_read = recv_buffered(sock, n, buffer);
+	if (*n_read != 0) {
+		return err;
+	}
+
+	bool again = false;
+	err = recv_some(sock, n, buffer, n_read, &again);
+	if (err.code == SA_OK && again) {
+		*events = POLLIN;
+	}
+
+	return err;
+}
+
+sa_err
+sa_write_nb(sa_socket* sock, size_t n, const void* buffer, size_t* n_written, short* events)
+{
+	if (sock->tls_cfg->enabled) {
+		return sa_tls_write_nb(sock, n, buffer, n_written, events);
+	}
+
+	*events = 0;
+
+	bool again = false;
+	sa_err err = send_some(sock, n, buffer, n_written, &again);
+	if (err.code == SA_OK && again) {
+		*events = POLLOUT;
+	}
+
+	return err;
+}
+
+sa_err
+sa_socket_wait(sa_socket* sock, uint64_t deadline_ms, bool read, short* poll_res)
 {
 	sa_err err;
 	err.code = SA_OK;
@@ -194,7 +486,7 @@ sa_socket_wait(sa_socket* sock, int timeout_ms, bool read, short* poll_res)
 	};
 
 	nfds_t fd_count = 1;
-	int p_res = poll(&pfd, fd_count, (int)timeout_ms);
+	int p_res = poll(&pfd, fd_count, sa_remaining_ms(deadline_ms));
 
 	if (p_res == 0) {
 		sa_g_log_function("ERR: socket poll timed out");
@@ -226,11 +518,58 @@ sa_socket_wait(sa_socket* sock, int timeout_ms, bool read, short* poll_res)
 	return err;
 }
 
+bool
+sa_socket_is_alive(sa_socket* sock)
+{
+	if (sock->recv_pos != sock->recv_len) {
+		// unexpected data already received
+		return false;
+	}
+
+	struct pollfd pfd = {
+		.fd = sock->fd,
+		.events = POLLIN
+	};
+
+	int p_res = poll(&pfd, 1, 0);
+
+	if (p_res == 0 && (sock->ssl == NULL || SSL_has_pending(sock->ssl) == 0)) {
+		// nothing to read, connection is idle as expected, and openssl
+		// hasn't read ahead any records
+		return true;
+	}
+
+	if (p_res < 0 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0) {
+		return false;
+	}
+
+	if (sock->ssl != NULL) {
+		// Readable tls connections may just have a post handshake message,
+		// like a session ticket, pending. Let openssl consume it.
+		char b;
+		int rv = SSL_peek(sock->ssl, &b, 1);
+
+		if (rv > 0) {
+			// unexpected application data
+			return false;
+		}
+
+		int sslerr = SSL_get_error(sock->ssl, rv);
+		ERR_clear_error();
+		return sslerr == SSL_ERROR_WANT_READ;
+	}
+
+	// Readable plain connections are either closed or hold unexpected data.
+	return false;
+}
+
 sa_tls_cfg*
 sa_tls_cfg_init(sa_tls_cfg* cfg)
 {
 	cfg->ca_string = NULL;
 	cfg->enabled = false;
+	cfg->ctx = NULL;
+	cfg->sessions = NULL;
 	return cfg;
 }
 
@@ -249,6 +588,8 @@ sa_socket_destroy(sa_socket* sock)
 		SSL_free(sock->ssl);
 	}
 
+	// responses, so secrets, pass through recv_buf
+	sa_zero(sock->recv_buf, sizeof(sock->recv_buf));
 	free(sock);
 }
 
@@ -262,66 +603,67 @@ sa_socket_init(sa_socket* sock)
 	sock->fd = -2; // -2 so we can distinguish from -1 error and valid FDs
 	sock->ssl = NULL;
 	sock->tls_cfg = NULL;
+	sock->addr = NULL;
+	sock->port = NULL;
+	sock->tls_resumed = false;
+	sock->sent = false;
+	sock->recv_pos = 0;
+	sock->recv_len = 0;
 
 	return sock;
 }
 
 sa_err
-_read_n_bytes(sa_socket* sock, unsigned int n, void* buffer, int timeout_ms)
+_read_n_bytes(sa_socket* sock, unsigned int n, void* buffer, uint64_t deadline_ms)
 {
 	sa_err err;
 	err.code = SA_OK;
 
-	int total_bytes_read = 0;
-	short poll_res = 0;
-	while (true)
-	{
-		err = sa_socket_wait(sock, timeout_ms, true, &poll_res);
-		if (err.code != SA_OK) {
-			sa_g_log_function("ERR: socket poll failed on read, return value: %d, revent: %d, errno: %d", err.code, poll_res, errno);
-			return err;
-		}
+	size_t total_bytes_read = recv_buffered(sock, n, buffer);
 
-		int bytes_read = read(sock->fd, buffer + total_bytes_read, n - total_bytes_read);
-		if (bytes_read < 0 ) {
-			sa_g_log_function("ERR: socket read failed, return value: %d, errno: %d", bytes_read, errno);
-			err.code = SA_FAILED_INTERNAL;
-			return err;
+	// Right after a send the response can't have arrived, so wait for it.
+	// Otherwise recv first, there may be more of the response already.
+	bool wait = sock->sent;
+
+	while (total_bytes_read < n) {
+		if (wait) {
+			short poll_res = 0;
+			err = sa_socket_wait(sock, deadline_ms, true, &poll_res);
+			if (err.code != SA_OK) {
+				sa_g_log_function("ERR: socket poll failed on read, return value: %d, revent: %d, errno: %d", err.code, poll_res, errno);
+				return err;
+			}
 		}
 
-		if (bytes_read == 0) {
-			// end of transmission
+		size_t bytes_read = 0;
+		err = recv_some(sock, n - total_bytes_read, (uint8_t*)buffer + total_bytes_read,
+				&bytes_read, &wait);
+		if (err.code != SA_OK) {
 			return err;
 		}
 
 		total_bytes_read += bytes_read;
-		if (total_bytes_read >= n) {
-			return err;
-		}
 	}
+
+	return err;
 }
 
 sa_err
-_write_n_bytes(sa_socket* sock, unsigned int n, void* buffer, int timeout_ms)
+_write_n_bytes(sa_socket* sock, unsigned int n, const void* buffer, uint64_t deadline_ms)
 {
 	sa_err err;
 	err.code = SA_OK;
 
-	int total_bytes_written = 0;
-	short poll_res = 0;
+	size_t total_bytes_written = 0;
+
+	// the socket is usually writable, so send first and only poll if it is full
 	while (true)
 	{
-		err = sa_socket_wait(sock, timeout_ms, false, &poll_res);
+		size_t bytes_written = 0;
+		bool again = false;
+		err = send_some(sock, n - total_bytes_written,
+				(const uint8_t*)buffer + total_bytes_written, &bytes_written, &again);
 		if (err.code != SA_OK) {
-			sa_g_log_function("ERR: socket poll failed on write, return value: %d, revent: %d, errno: %d", err.code, poll_res, errno);
-			return err;
-		}
-
-		int bytes_written = write(sock->fd, buffer + total_bytes_written, n - total_bytes_written);
-		if (bytes_written < 0 )
-		{
-			sa_g_log_function("ERR: socket write failed, return value: %d, errno: %d", bytes_written, errno);
-			err.code = SA_FAILED_INTERNAL;
 			return err;
 		}
 
@@ -329,41 +671,150 @@ _write_n_bytes(sa_socket* sock, unsigned int n, void* buffer, int timeout_ms)
 		if (total_bytes_written >= n) {
 			return err;
 		}
+
+		if (again) {
+			short poll_res = 0;
+			err = sa_socket_wait(sock, deadline_ms, false, &poll_res);
+			if (err.code != SA_OK) {
+				sa_g_log_function("ERR: socket poll failed on write, return value: %d, revent: %d, errno: %d", err.code, poll_res, errno);
+				return err;
+			}
+		}
 	}
 }
 
+// copies up to n already received bytes into buffer, returns the number copied
+static size_t
+recv_buffered(sa_socket* sock, size_t n, void* buffer)
+{
+	size_t avail = sock->recv_len - sock->recv_pos;
+	if (avail == 0) {
+		return 0;
+	}
+
+	if (n > avail) {
+		n = avail;
+	}
+
+	memcpy(buffer, sock->recv_buf + sock->recv_pos, n);
+	sock->recv_pos += (uint32_t)n;
+
+	if (sock->recv_pos == sock->recv_len) {
+		// don't leave responses behind
+		memset(sock->recv_buf, 0, sock->recv_len);
+		sock->recv_pos = 0;
+		sock->recv_len = 0;
+	}
+
+	return n;
+}
+
 /*
- * lookup_host points res to a heap allocated
- * addrinfo struct containing host information for
- * host at hostname and port
- * SUCCESS: 0 is returned.
- * FAILURE: A value other than 0 is returned.
+ * recv_some makes one recv without blocking, into buffer if n would fill
+ * recv_buf, otherwise into recv_buf to keep what is beyond n for later
+ * reads. Sets again if nothing was received yet.
 */
-int
-lookup_host(const char* hostname, const char* port, struct addrinfo** res)
+static sa_err
+recv_some(sa_socket* sock, size_t n, void* buffer, size_t* n_read, bool* again)
 {
-	struct addrinfo hints;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
+	sa_err err;
+	err.code = SA_OK;
+	*n_read = 0;
+	*again = false;
+
+	bool direct = n >= sizeof(sock->recv_buf);
+	ssize_t rv = recv(sock->fd, direct ? buffer : sock->recv_buf,
+			direct ? n : sizeof(sock->recv_buf), MSG_DONTWAIT);
+
+	if (rv > 0) {
+		sock->sent = false;
 
-	// Check if hostname is really an IPv4 address.
-	struct in_addr ipv4;
+		if (direct) {
+			*n_read = (size_t)rv;
+		}
+		else {
+			sock->recv_len = (uint32_t)rv;
+			*n_read = recv_buffered(sock, n, buffer);
+		}
 
-	if (inet_pton(AF_INET, hostname, &ipv4) == 1) {
-		hints.ai_family = AF_INET;
-		hints.ai_flags = AI_NUMERICHOST;
+		return err;
 	}
-	else {
-		// Check if hostname is really an IPv6 address.
-		struct in6_addr ipv6;
-		
-		if (inet_pton(AF_INET6, hostname, &ipv6) == 1) {
-			hints.ai_family = AF_INET6;
-			hints.ai_flags = AI_NUMERICHOST;
+
+	if (rv == 0) {
+		sa_g_log_function("ERR: socket closed by peer");
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+		*again = true;
+		return err;
+	}
+
+	sa_g_log_function("ERR: socket read failed, errno: %d", errno);
+	err.code = SA_FAILED_INTERNAL;
+	return err;
+}
+
+// send_some makes one send without blocking, sets again if nothing was sent
+static sa_err
+send_some(sa_socket* sock, size_t n, const void* buffer, size_t* n_written, bool* again)
+{
+	sa_err err;
+	err.code = SA_OK;
+	*n_written = 0;
+	*again = false;
+
+	// MSG_NOSIGNAL, a peer that closed the connection is an error, not SIGPIPE
+	ssize_t rv = send(sock->fd, buffer, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	if (rv >= 0) {
+		*n_written = (size_t)rv;
+		return err;
+	}
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+		*again = true;
+		return err;
+	}
+
+	sa_g_log_function("ERR: socket write failed, errno: %d", errno);
+	err.code = SA_FAILED_INTERNAL;
+	return err;
+}
+
+/*
+ * interleave_families orders addresses for racing as RFC 8305 suggests,
+ * alternating address families starting with the family getaddrinfo
+ * preferred. Returns the number of addresses stored in ais.
+*/
+static uint32_t
+interleave_families(const struct addrinfo* ai_list, const struct addrinfo** ais, uint32_t max)
+{
+	const struct addrinfo* first = ai_list;
+	const struct addrinfo* other = ai_list;
+	int family = ai_list != NULL ? ai_list->ai_family : AF_UNSPEC;
+	uint32_t n = 0;
+
+	while (n < max && (first != NULL || other != NULL)) {
+		while (first != NULL && first->ai_family != family) {
+			first = first->ai_next;
+		}
+
+		if (first != NULL) {
+			ais[n++] = first;
+			first = first->ai_next;
+		}
+
+		while (other != NULL && other->ai_family == family) {
+			other = other->ai_next;
+		}
+
+		if (other != NULL && n < max) {
+			ais[n++] = other;
+			other = other->ai_next;
 		}
 	}
 
-	int ret = getaddrinfo(hostname, port, &hints, res);
-	return ret;
-}
\ No newline at end of file
+	return n;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_clock.h"
+#include "sa_error.h"
+#include "sa_logging.h"
+#include "sa_stats.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+//==========================================================
+// Globals.
+//
+
+__thread sa_probe* sa_g_probe = NULL;
+
+static uint64_t g_request_ids = 0;
+
+//==========================================================
+// Forward declarations.
+//
+
+static uint32_t bucket_of(uint64_t ns);
+static uint64_t bucket_max(uint32_t bucket);
+static uint64_t take(uint64_t* counter, bool reset);
+static void fire(const sa_probe* probe, sa_trace_func func, sa_phase phase, uint64_t now_ns, uint64_t bytes, bool resumed);
+
+//==========================================================
+// Public API.
+//
+
+sa_stats*
+sa_stats_new()
+{
+	sa_stats* stats = (sa_stats*) calloc(1, sizeof(sa_stats));
+	if (stats == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_stats");
+	}
+
+	return stats;
+}
+
+void
+sa_stats_destroy(sa_stats* stats)
+{
+	free(stats);
+}
+
+void
+sa_stats_snapshot(sa_stats* stats, sa_stats* snap, bool reset)
+{
+	snap->fetches = take(&stats->fetches, reset);
+	snap->cache_hits = take(&stats->cache_hits, reset);
+	snap->reused = take(&stats->reused, reset);
+	snap->tls_resumed = take(&stats->tls_resumed, reset);
+	snap->bytes_sent = take(&stats->bytes_sent, reset);
+	snap->bytes_received = take(&stats->bytes_received, reset);
+
+	for (uint32_t i = 0; i < SA_ERROR_CODES; i++) {
+		snap->errors[i] = take(&stats->errors[i], reset);
+	}
+
+	for (uint32_t p = 0; p < SA_PHASES; p++) {
+		sa_histogram* h = &stats->phases[p];
+		sa_histogram* s = &snap->phases[p];
+
+		s->count = take(&h->count, reset);
+		s->sum_ns = take(&h->sum_ns, reset);
+		s->max_ns = take(&h->max_ns, reset);
+
+		for (uint32_t b = 0; b < SA_HISTOGRAM_BUCKETS; b++) {
+			s->buckets[b] = take(&h->buckets[b], reset);
+		}
+	}
+}
+
+void
+sa_stats_fetched(sa_stats* stats, enum sa_error_code code, bool cache_hit)
+{
+	sa_stats_add(&stats->fetches, 1);
+	sa_stats_add(&stats->errors[code], 1);
+
+	if (cache_hit) {
+		sa_stats_add(&stats->cache_hits, 1);
+	}
+}
+
+void
+sa_histogram_record(sa_histogram* h, uint64_t ns)
+{
+	sa_stats_add(&h->buckets[bucket_of(ns)], 1);
+	sa_stats_add(&h->count, 1);
+	sa_stats_add(&h->sum_ns, ns);
+
+	uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+
+	while (ns > max && ! __atomic_compare_exchange_n(&h->max_ns, &max, ns, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+uint64_t
+sa_histogram_percentile(const sa_histogram* h, double percentile)
+{
+	uint64_t total = 0;
+
+	for (uint32_t b = 0; b < SA_HISTOGRAM_BUCKETS; b++) {
+		total += h->buckets[b];
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	// the rank of the duration wanted, counting from 1
+	uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+	else if (rank > total) {
+		rank = total;
+	}
+
+	uint64_t seen = 0;
+
+	for (uint32_t b = 0; b < SA_HISTOGRAM_BUCKETS; b++) {
+		seen += h->buckets[b];
+
+		if (seen >= rank) {
+			// no duration recorded is above the max
+			uint64_t ns = bucket_max(b);
+			return h->max_ns != 0 && ns > h->max_ns ? h->max_ns : ns;
+		}
+	}
+
+	return h->max_ns;
+}
+
+void
+sa_probe_init(sa_probe* probe, sa_stats* stats, const sa_trace* trace)
+{
+	probe->stats = stats;
+	probe->trace = NULL;
+	probe->request_id = 0;
+
+	if (trace != NULL && (trace->start != NULL || trace->end != NULL)) {
+		probe->trace = trace;
+		probe->request_id = __atomic_add_fetch(&g_request_ids, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void
+sa_probe_begin(sa_probe* probe, sa_phase phase)
+{
+	uint64_t now_ns = sa_now_ns();
+
+	probe->start_ns[phase] = now_ns;
+
+	if (probe->trace != NULL) {
+		fire(probe, probe->trace->start, phase, now_ns, 0, false);
+	}
+}
+
+void
+sa_probe_end(sa_probe* probe, sa_phase phase, uint64_t bytes, bool resumed)
+{
+	uint64_t now_ns = sa_now_ns();
+	sa_stats* stats = probe->stats;
+
+	if (stats != NULL) {
+		sa_histogram_record(&stats->phases[phase], now_ns - probe->start_ns[phase]);
+
+		if (resumed) {
+			sa_stats_add(&stats->tls_resumed, 1);
+		}
+
+		if (bytes != 0) {
+			sa_stats_add(phase == SA_PHASE_SEND ? &stats->bytes_sent : &stats->bytes_received,
+					bytes);
+		}
+	}
+
+	if (probe->trace != NULL) {
+		fire(probe, probe->trace->end, phase, now_ns, bytes, resumed);
+	}
+}
+
+//==========================================================
+// Local helpers.
+//
+
+/*
+ * Durations below 2^SA_HISTOGRAM_SUB_BITS have a bucket each. Above that
+ * each power of 2 is split into 2^SA_HISTOGRAM_SUB_BITS buckets by the
+ * bits after the highest set.
+*/
+static uint32_t
+bucket_of(uint64_t ns)
+{
+	const uint32_t sub_count = 1 << SA_HISTOGRAM_SUB_BITS;
+
+	if (ns >= (uint64_t)1 << SA_HISTOGRAM_MAX_BITS) {
+		return SA_HISTOGRAM_BUCKETS - 1;
+	}
+
+	if (ns < sub_count) {
+		return (uint32_t)ns;
+	}
+
+	uint32_t msb = 63 - (uint32_t)__builtin_clzll(ns);
+	uint32_t sub = (uint32_t)(ns >> (msb - SA_HISTOGRAM_SUB_BITS)) & (sub_count - 1);
+
+	return ((msb - SA_HISTOGRAM_SUB_BITS + 1) << SA_HISTOGRAM_SUB_BITS) + sub;
+}
+
+// the longest duration counted in bucket
+static uint64_t
+bucket_max(uint32_t bucket)
+{
+	const uint32_t sub_count = 1 << SA_HISTOGRAM_SUB_BITS;
+
+	if (bucket < sub_count) {
+		return bucket;
+	}
+
+	uint32_t msb = (bucket >> SA_HISTOGRAM_SUB_BITS) + SA_HISTOGRAM_SUB_BITS - 1;
+	uint64_t sub = bucket & (sub_count - 1);
+	uint32_t shift = msb - SA_HISTOGRAM_SUB_BITS;
+
+	return ((sub_count + sub + 1) << shift) - 1;
+}
+
+static void
+fire(const sa_probe* probe, sa_trace_func func, sa_phase phase, uint64_t now_ns,
+		uint64_t bytes, bool resumed)
+{
+	if (func == NULL) {
+		return;
+	}
+
+	sa_trace_event event;
+	event.request_id = probe->request_id;
+	event.phase = phase;
+	event.time_ns = now_ns;
+	event.bytes = bytes;
+	event.resumed = resumed;
+
+	func(probe->trace->udata, &event);
+}
+
+// reads counter, zeroing it if reset is true
+static uint64_t
+take(uint64_t* counter, bool reset)
+{
+	if (reset) {
+		return __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED);
+	}
+
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
@@ -17,6 +17,7 @@
 
 #include "sa_error.h"
 #include "sa_socket.h"
+#include "sa_tls.h"
 #include "sa_logging.h"
 
 #include <openssl/conf.h>
@@ -24,7 +25,12 @@
 #include <openssl/engine.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
 
@@ -32,6 +38,23 @@
 // Typedefs & constants.
 //
 
+#define SA_TLS_MAX_SESSIONS 16
+
+typedef struct sa_tls_session_s {
+	char* addr;
+	char* port;
+	SSL_SESSION* session;
+} sa_tls_session;
+
+struct sa_tls_session_cache_s {
+	pthread_mutex_t lock;
+	sa_tls_session entries[SA_TLS_MAX_SESSIONS];
+	uint32_t size;
+	uint32_t next_evict; // entries are replaced round robin once full
+	uint64_t handshakes;
+	uint64_t resumed;
+};
+
 //==========================================================
 // Globals.
 //
@@ -39,12 +62,22 @@
 static pthread_mutex_t SA_TLS_INIT_MUTEX = PTHREAD_MUTEX_INITIALIZER;
 static bool SA_TLS_INITIALIZED = false;
 
+// guards the SSL_CTX cached in each sa_tls_cfg
+static pthread_mutex_t SA_TLS_CTX_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
 //==========================================================
 // Forward declarations.
 //
 
 static SSL_CTX* create_context();
+static sa_err tls_check(sa_socket* sock, int rv, const char* op, short* events);
+static SSL_CTX* tls_cfg_get_context(sa_tls_cfg* cfg);
 static bool tls_load_ca_str(SSL_CTX* ctx, const char* cert_str);
+static int tls_new_session_cb(SSL* ssl, SSL_SESSION* session);
+static sa_tls_session_cache* session_cache_new();
+static void session_cache_destroy(sa_tls_session_cache* cache);
+static SSL_SESSION* session_cache_get(sa_tls_session_cache* cache, const char* addr, const char* port);
+static void session_cache_put(sa_tls_session_cache* cache, const char* addr, const char* port, SSL_SESSION* session);
 
 //==========================================================
 // Public API.
@@ -69,16 +102,8 @@ sa_init_openssl()
 int
 sa_wrap_socket(sa_socket* sock)
 {
-	SSL_CTX* ctx = create_context();
+	SSL_CTX* ctx = tls_cfg_get_context(sock->tls_cfg);
 	if (ctx == NULL) {
-		sa_g_log_function("ERR: unable to create SSL context");
-		return -1;
-	}
-
-	const char* ca_string = sock->tls_cfg->ca_string;
-	if (ca_string && !tls_load_ca_str(ctx, ca_string)) {
-		SSL_CTX_free(ctx);
-		sa_g_log_function("ERR: unable to load ca certificate from ca_string");
 		return -1;
 	}
 
@@ -95,212 +120,209 @@ sa_wrap_socket(sa_socket* sock)
 		return -1;
 	}
 
+	// lets tls_new_session_cb find the endpoint new sessions belong to
+	SSL_set_app_data(ssl, sock);
+
+	// read whole records, and any that follow, in one read instead of
+	// the record header then its body
+	SSL_set_read_ahead(ssl, 1);
+
+	sa_tls_session_cache* cache = sock->tls_cfg->sessions;
+	if (cache != NULL && sock->addr != NULL && sock->port != NULL) {
+		SSL_SESSION* session = session_cache_get(cache, sock->addr, sock->port);
+		if (session != NULL) {
+			// failure here just means a full handshake
+			SSL_set_session(ssl, session);
+			SSL_SESSION_free(session);
+		}
+	}
+
 	sock->ssl = ssl;
 	return 0;
 }
 
-sa_err
-sa_tls_connect(sa_socket* sock, int timeout_ms)
+void
+sa_tls_cfg_destroy(sa_tls_cfg* cfg)
 {
-	sa_err err;
-	int rv;
+	pthread_mutex_lock(&SA_TLS_CTX_MUTEX);
+	if (cfg->ctx != NULL) {
+		SSL_CTX_free(cfg->ctx);
+		cfg->ctx = NULL;
+	}
+
+	if (cfg->sessions != NULL) {
+		session_cache_destroy(cfg->sessions);
+		cfg->sessions = NULL;
+	}
+	pthread_mutex_unlock(&SA_TLS_CTX_MUTEX);
+}
+
+void
+sa_tls_get_stats(sa_tls_cfg* cfg, sa_tls_stats* stats)
+{
+	stats->handshakes = 0;
+	stats->resumed = 0;
+
+	pthread_mutex_lock(&SA_TLS_CTX_MUTEX);
+	sa_tls_session_cache* cache = cfg->sessions;
+	if (cache != NULL) {
+		stats->handshakes = __atomic_load_n(&cache->handshakes, __ATOMIC_RELAXED);
+		stats->resumed = __atomic_load_n(&cache->resumed, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&SA_TLS_CTX_MUTEX);
+}
 
+sa_err
+sa_tls_connect(sa_socket* sock, uint64_t deadline_ms)
+{
 	while (true) {
-		err.code = SA_OK;
-		rv = SSL_connect(sock->ssl);
-		if (rv == 1) {
-			// TODO log_session_info(sock);
+		short events = 0;
+		sa_err err = sa_tls_connect_nb(sock, &events);
+		if (err.code != SA_OK || events == 0) {
 			return err;
 		}
 
-		int sslerr = SSL_get_error(sock->ssl, rv);
 		short pollres = 0;
-		unsigned long errcode;
-		char errbuf[1024];
-		switch (sslerr) {
-		case SSL_ERROR_WANT_READ:
-			err = sa_socket_wait(sock, timeout_ms, true, &pollres);
-			if (err.code != SA_OK) {
-				sa_g_log_function("ERR: socket poll failed on tls connect, return value: %d, revent: %d, errno: %d", err.code, pollres, errno);
-				return err;
-			}
-			// loop back around and retry
-			break;
-		case SSL_ERROR_WANT_WRITE:
-			err = sa_socket_wait(sock, timeout_ms, false, &pollres);
-			if (err.code != SA_OK) {
-				sa_g_log_function("ERR: socket poll failed on tls connect, return value: %d, revent: %d, errno: %d", err.code, pollres, errno);
-				return err;
-			}
-			// loop back around and retry
-			break;
-		case SSL_ERROR_SSL:
-			// TODO log_verify_details(sock);
-			errcode = ERR_get_error();
-			ERR_error_string_n(errcode, errbuf, sizeof(errbuf));
-			sa_g_log_function("ERR: SSL_connect failed: %s", errbuf);
-			err.code = SA_FAILED_INTERNAL;
-			return err;
-		case SSL_ERROR_SYSCALL:
-			errcode = ERR_get_error();
-			if (errcode != 0) {
-				ERR_error_string_n(errcode, errbuf, sizeof(errbuf));
-				sa_g_log_function("ERR: SSL_connect I/O error: %s", errbuf);
-			}
-			else {
-				if (rv == 0) {
-					sa_g_log_function("ERR: SSL_connect I/O error: unexpected EOF");
-				}
-				else {
-					sa_g_log_function("ERR: SSL_connect I/O error: %d", errno);
-				}
-			}
-			err.code = SA_FAILED_INTERNAL;
-			return err;
-		default:
-			sa_g_log_function("ERR: SSL_connect: unexpected ssl error: %d", sslerr);
-			err.code = SA_FAILED_INTERNAL;
+		err = sa_socket_wait(sock, deadline_ms, events == POLLIN, &pollres);
+		if (err.code != SA_OK) {
+			sa_g_log_function("ERR: socket poll failed on tls connect, return value: %d, revent: %d, errno: %d", err.code, pollres, errno);
 			return err;
 		}
+		// loop back around and retry
 	}
 }
 
 sa_err
-sa_tls_read_n_bytes(sa_socket* sock, size_t n, void* buf, int timeout_ms)
+sa_tls_read_n_bytes(sa_socket* sock, size_t n, void* buf, uint64_t deadline_ms)
 {
-	sa_err err;
 	size_t bytes_read = 0;
 
+	// right after a send the response can't have arrived, wait before reading
+	if (sock->sent && SSL_pending(sock->ssl) == 0) {
+		short pollres = 0;
+		sa_err err = sa_socket_wait(sock, deadline_ms, true, &pollres);
+		if (err.code != SA_OK) {
+			sa_g_log_function("ERR: socket poll failed on tls read, return value: %d, revent: %d, errno: %d", err.code, pollres, errno);
+			return err;
+		}
+	}
+
+	sock->sent = false;
+
 	while (true) {
-		err.code = SA_OK;
-		int rv = SSL_read(sock->ssl, buf + bytes_read, (int)(n - bytes_read));
-		if (rv > 0) {
-			bytes_read += rv;
-			if (bytes_read >= n) {
-				return err;
-			}
+		size_t rv = 0;
+		short events = 0;
+		sa_err err = sa_tls_read_nb(sock, n - bytes_read, buf + bytes_read, &rv, &events);
+		if (err.code != SA_OK) {
+			return err;
 		}
-		else {
-			int sslerr = SSL_get_error(sock->ssl, rv);
+
+		bytes_read += rv;
+		if (bytes_read >= n) {
+			return err;
+		}
+
+		if (events != 0) {
 			short pollres = 0;
-			unsigned long errcode;
-			char errbuf[1024];
-			switch (sslerr) {
-			case SSL_ERROR_WANT_READ:
-				err = sa_socket_wait(sock, timeout_ms, true, &pollres);
-				if (err.code != SA_OK) {
-					sa_g_log_function("ERR: socket poll failed on tls read, return value: %d, revent: %d, errno: %d", err.code, pollres, errno);
-					return err;
-				}
-				// loop back around and retry
-				break;
-			case SSL_ERROR_WANT_WRITE:
-				err = sa_socket_wait(sock, timeout_ms, false, &pollres);
-				if (err.code != SA_OK) {
-					sa_g_log_function("ERR: socket poll failed on tls read, return value: %d, revent: %d, errno: %d", err.code, pollres, errno);
-					return err;
-				}
-				// loop back around and retry
-				break;
-			case SSL_ERROR_SSL:
-				// TODO log_verify_details(sock);
-				errcode = ERR_get_error();
-				ERR_error_string_n(errcode, errbuf, sizeof(errbuf));
-				sa_g_log_function("ERR: SSL_read failed: %s", errbuf);
-				err.code = SA_FAILED_INTERNAL;
-				return err;
-			case SSL_ERROR_SYSCALL:
-				errcode = ERR_get_error();
-				if (errcode != 0) {
-					ERR_error_string_n(errcode, errbuf, sizeof(errbuf));
-					sa_g_log_function("ERR: SSL_read I/O error: %s", errbuf);
-				}
-				else {
-					if (rv == 0) {
-						sa_g_log_function("ERR: SSL_read I/O error: unexpected EOF");
-					}
-					else {
-						sa_g_log_function("ERR: SSL_read I/O error: %d", errno);
-					}
-				}
-				err.code = SA_FAILED_INTERNAL;
-				return err;
-			default:
-				sa_g_log_function("ERR: SSL_read: unexpected ssl error: %d", sslerr);
-				err.code = SA_FAILED_INTERNAL;
+			err = sa_socket_wait(sock, deadline_ms, events == POLLIN, &pollres);
+			if (err.code != SA_OK) {
+				sa_g_log_function("ERR: socket poll failed on tls read, return value: %d, revent: %d, errno: %d", err.code, pollres, errno);
 				return err;
 			}
+			// loop back around and retry
 		}
 	}
 }
 
 sa_err
-sa_tls_write_n_bytes(sa_socket* sock, size_t n, void* buf, int timeout_ms)
+sa_tls_write_n_bytes(sa_socket* sock, size_t n, const void* buf, uint64_t deadline_ms)
 {
-	sa_err err;
 	size_t pos = 0;
 
 	while (true) {
-		err.code = SA_OK;
-		int rv = SSL_write(sock->ssl, buf + pos, (int)(n - pos));
-		if (rv > 0) {
-			pos += rv;
-			if (pos >= n) {
-				return err;
-			}
+		size_t rv = 0;
+		short events = 0;
+		sa_err err = sa_tls_write_nb(sock, n - pos, buf + pos, &rv, &events);
+		if (err.code != SA_OK) {
+			return err;
 		}
-		else {
-			int sslerr = SSL_get_error(sock->ssl, rv);
+
+		pos += rv;
+		if (pos >= n) {
+			return err;
+		}
+
+		if (events != 0) {
 			short pollres = 0;
-			unsigned long errcode;
-			char errbuf[1024];
-			switch (sslerr) {
-			case SSL_ERROR_WANT_READ:
-				err = sa_socket_wait(sock, timeout_ms, true, &pollres);
-				if (err.code != SA_OK) {
-					sa_g_log_function("ERR: socket poll failed on tls write, return value: %d, revent: %d, errno: %d", err.code, pollres, errno);
-					return err;
-				}
-				// loop back around and retry
-				break;
-			case SSL_ERROR_WANT_WRITE:
-				err = sa_socket_wait(sock, timeout_ms, false, &pollres);
-				if (err.code != SA_OK) {
-					sa_g_log_function("ERR: socket poll failed on tls write, return value: %d, revent: %d, errno: %d", err.code, pollres, errno);
-					return err;
-				}
-				// loop back around and retry
-				break;
-			case SSL_ERROR_SSL:
-				// TODO log_verify_details(sock);
-				errcode = ERR_get_error();
-				ERR_error_string_n(errcode, errbuf, sizeof(errbuf));
-				sa_g_log_function("ERR: SSL_write failed: %s", errbuf);
-				err.code = SA_FAILED_INTERNAL;
-				return err;
-			case SSL_ERROR_SYSCALL:
-				errcode = ERR_get_error();
-				if (errcode != 0) {
-					ERR_error_string_n(errcode, errbuf, sizeof(errbuf));
-					sa_g_log_function("ERR: SSL_write I/O error: %s", errbuf);
-				}
-				else {
-					if (rv == 0) {
-						sa_g_log_function("ERR: SSL_write I/O error: unexpected EOF");
-					}
-					else {
-						sa_g_log_function("ERR: SSL_write I/O error: %d", errno);
-					}
-				}
-				err.code = SA_FAILED_INTERNAL;
-				return err;
-			default:
-				sa_g_log_function("ERR: SSL_write: unexpected ssl error: %d", sslerr);
-				err.code = SA_FAILED_INTERNAL;
+			err = sa_socket_wait(sock, deadline_ms, events == POLLIN, &pollres);
+			if (err.code != SA_OK) {
+				sa_g_log_function("ERR: socket poll failed on tls write, return value: %d, revent: %d, errno: %d", err.code, pollres, errno);
 				return err;
 			}
+			// loop back around and retry
+		}
+	}
+}
+
+sa_err
+sa_tls_connect_nb(sa_socket* sock, short* events)
+{
+	sa_err err;
+	err.code = SA_OK;
+	*events = 0;
+
+	int rv = SSL_connect(sock->ssl);
+	if (rv == 1) {
+		// TODO log_session_info(sock);
+		sock->tls_resumed = SSL_session_reused(sock->ssl) == 1;
+
+		sa_tls_session_cache* cache = sock->tls_cfg->sessions;
+		if (cache != NULL) {
+			__atomic_fetch_add(&cache->handshakes, 1, __ATOMIC_RELAXED);
+			if (sock->tls_resumed) {
+				__atomic_fetch_add(&cache->resumed, 1, __ATOMIC_RELAXED);
+			}
 		}
+
+		sa_g_log_function("tls handshake complete, resumed: %d", sock->tls_resumed);
+		return err;
+	}
+
+	return tls_check(sock, rv, "SSL_connect", events);
+}
+
+sa_err
+sa_tls_read_nb(sa_socket* sock, size_t n, void* buf, size_t* n_read, short* events)
+{
+	sa_err err;
+	err.code = SA_OK;
+	*n_read = 0;
+	*events = 0;
+
+	int rv = SSL_read(sock->ssl, buf, (int)n);
+	if (rv > 0) {
+		*n_read = (size_t)rv;
+		return err;
 	}
+
+	return tls_check(sock, rv, "SSL_read", events);
+}
+
+sa_err
+sa_tls_write_nb(sa_socket* sock, size_t n, const void* buf, size_t* n_written, short* events)
+{
+	sa_err err;
+	err.code = SA_OK;
+	*n_written = 0;
+	*events = 0;
+
+	int rv = SSL_write(sock->ssl, buf, (int)n);
+	if (rv > 0) {
+		*n_written = (size_t)rv;
+		return err;
+	}
+
+	return tls_check(sock, rv, "SSL_write", events);
 }
 
 //==========================================================
@@ -323,6 +345,99 @@ create_context()
 	return ctx;
 }
 
+/*
+ * tls_check classifies the failed result rv of SSL call op on sock.
+ * If the call must be retried once the socket is ready, SA_OK is
+ * returned and events is set to POLLIN or POLLOUT.
+*/
+static sa_err
+tls_check(sa_socket* sock, int rv, const char* op, short* events)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	int sslerr = SSL_get_error(sock->ssl, rv);
+	unsigned long errcode;
+	char errbuf[1024];
+	switch (sslerr) {
+	case SSL_ERROR_WANT_READ:
+		*events = POLLIN;
+		return err;
+	case SSL_ERROR_WANT_WRITE:
+		*events = POLLOUT;
+		return err;
+	case SSL_ERROR_SSL:
+		// TODO log_verify_details(sock);
+		errcode = ERR_get_error();
+		ERR_error_string_n(errcode, errbuf, sizeof(errbuf));
+		sa_g_log_function("ERR: %s failed: %s", op, errbuf);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	case SSL_ERROR_SYSCALL:
+		errcode = ERR_get_error();
+		if (errcode != 0) {
+			ERR_error_string_n(errcode, errbuf, sizeof(errbuf));
+			sa_g_log_function("ERR: %s I/O error: %s", op, errbuf);
+		}
+		else {
+			if (rv == 0) {
+				sa_g_log_function("ERR: %s I/O error: unexpected EOF", op);
+			}
+			else {
+				sa_g_log_function("ERR: %s I/O error: %d", op, errno);
+			}
+		}
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	default:
+		sa_g_log_function("ERR: %s: unexpected ssl error: %d", op, sslerr);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+}
+
+/*
+ * tls_cfg_get_context returns a new reference to the SSL context
+ * shared by all connections using cfg, building it on first use.
+ * The caller must release the reference with SSL_CTX_free.
+*/
+static SSL_CTX*
+tls_cfg_get_context(sa_tls_cfg* cfg)
+{
+	pthread_mutex_lock(&SA_TLS_CTX_MUTEX);
+
+	if (cfg->ctx == NULL) {
+		SSL_CTX* ctx = create_context();
+		if (ctx == NULL) {
+			pthread_mutex_unlock(&SA_TLS_CTX_MUTEX);
+			sa_g_log_function("ERR: unable to create SSL context");
+			return NULL;
+		}
+
+		if (cfg->ca_string && !tls_load_ca_str(ctx, cfg->ca_string)) {
+			pthread_mutex_unlock(&SA_TLS_CTX_MUTEX);
+			SSL_CTX_free(ctx);
+			sa_g_log_function("ERR: unable to load ca certificate from ca_string");
+			return NULL;
+		}
+
+		// Sessions are saved by tls_new_session_cb rather than openssl's
+		// internal cache, which clients can not look sessions up in.
+		SSL_CTX_set_session_cache_mode(ctx,
+				SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, tls_new_session_cb);
+
+		cfg->ctx = ctx;
+		cfg->sessions = session_cache_new();
+	}
+
+	SSL_CTX* ctx = cfg->ctx;
+	SSL_CTX_up_ref(ctx);
+
+	pthread_mutex_unlock(&SA_TLS_CTX_MUTEX);
+	return ctx;
+}
+
 static bool
 tls_load_ca_str(SSL_CTX* ctx, const char* cert_str)
 {
@@ -360,4 +475,140 @@ tls_load_ca_str(SSL_CTX* ctx, const char* cert_str)
 		return false;
 	}
 	return true;
-}
\ No newline at end of file
+}
+
+/*
+ * tls_new_session_cb is called by openssl whenever the server issues
+ * a session, or with tls 1.3 a session ticket, which may happen after
+ * the handshake while reading. A copy is saved for the socket's endpoint.
+ * Returns 0 as openssl keeps ownership of session.
+*/
+static int
+tls_new_session_cb(SSL* ssl, SSL_SESSION* session)
+{
+	sa_socket* sock = (sa_socket*)SSL_get_app_data(ssl);
+	if (sock == NULL || sock->addr == NULL || sock->port == NULL ||
+			sock->tls_cfg->sessions == NULL) {
+		return 0;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if (! SSL_SESSION_is_resumable(session)) {
+		return 0;
+	}
+
+	// Save a copy, openssl marks the session itself as not resumable
+	// if the connection is freed without a tls shutdown.
+	SSL_SESSION* copy = SSL_SESSION_dup(session);
+	if (copy == NULL) {
+		return 0;
+	}
+#else
+	SSL_SESSION* copy = session;
+	SSL_SESSION_up_ref(copy);
+#endif
+
+	session_cache_put(sock->tls_cfg->sessions, sock->addr, sock->port, copy);
+	return 0;
+}
+
+static sa_tls_session_cache*
+session_cache_new()
+{
+	sa_tls_session_cache* cache = (sa_tls_session_cache*) calloc(1, sizeof(sa_tls_session_cache));
+	if (cache == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for tls session cache");
+		return NULL;
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+static void
+session_cache_destroy(sa_tls_session_cache* cache)
+{
+	for (uint32_t i = 0; i < cache->size; i++) {
+		free(cache->entries[i].addr);
+		free(cache->entries[i].port);
+		SSL_SESSION_free(cache->entries[i].session);
+	}
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+// returns a new reference to the session saved for addr and port, or NULL
+static SSL_SESSION*
+session_cache_get(sa_tls_session_cache* cache, const char* addr, const char* port)
+{
+	SSL_SESSION* session = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	for (uint32_t i = 0; i < cache->size; i++) {
+		sa_tls_session* entry = &cache->entries[i];
+		if (strcmp(entry->addr, addr) == 0 && strcmp(entry->port, port) == 0) {
+			session = entry->session;
+			SSL_SESSION_up_ref(session);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return session;
+}
+
+// takes ownership of session, replacing any session saved for addr and port
+static void
+session_cache_put(sa_tls_session_cache* cache, const char* addr, const char* port, SSL_SESSION* session)
+{
+	SSL_SESSION* old = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+
+	sa_tls_session* entry = NULL;
+	for (uint32_t i = 0; i < cache->size; i++) {
+		if (strcmp(cache->entries[i].addr, addr) == 0 &&
+				strcmp(cache->entries[i].port, port) == 0) {
+			entry = &cache->entries[i];
+			break;
+		}
+	}
+
+	if (entry != NULL) {
+		old = entry->session;
+		entry->session = session;
+	}
+	else {
+		char* addr_copy = strdup(addr);
+		char* port_copy = strdup(port);
+
+		if (addr_copy == NULL || port_copy == NULL) {
+			free(addr_copy);
+			free(port_copy);
+			old = session;
+		}
+		else {
+			if (cache->size < SA_TLS_MAX_SESSIONS) {
+				entry = &cache->entries[cache->size++];
+			}
+			else {
+				entry = &cache->entries[cache->next_evict];
+				cache->next_evict = (cache->next_evict + 1) % SA_TLS_MAX_SESSIONS;
+				free(entry->addr);
+				free(entry->port);
+				old = entry->session;
+			}
+
+			entry->addr = addr_copy;
+			entry->port = port_copy;
+			entry->session = session;
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	if (old != NULL) {
+		SSL_SESSION_free(old);
+	}
+}
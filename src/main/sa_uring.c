@@ -0,0 +1,889 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+//==========================================================
+// Includes.
+//
+
+#include "sa_error.h"
+#include "sa_logging.h"
+#include "sa_uring.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef SA_USE_IO_URING
+
+#include "sa_alloc.h"
+#include "sa_clock.h"
+#include "sa_resolve.h"
+#include "sa_secrets.h"
+#include "sa_socket.h"
+#include "sa_stats.h"
+#include "sa_tls.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <openssl/bio.h>
+#include <openssl/ssl.h>
+
+//==========================================================
+// Typedefs & constants.
+//
+
+// enough for the longest chain, poll + connect + poll + send + poll + recv
+#define SA_URING_ENTRIES 8
+#define SA_URING_RECV_SIZE (16 * 1024)
+
+// user_data of submitted operations, at most one of each is in flight
+typedef enum uring_op_e {
+	URING_OP_CONNECT,
+	URING_OP_POLL_OUT,
+	URING_OP_SEND,
+	URING_OP_POLL_IN,
+	URING_OP_RECV,
+	URING_OP_MAX,
+	URING_OP_CANCEL = URING_OP_MAX
+} uring_op;
+
+typedef struct sa_uring_s {
+	int fd;
+	void* rings; // sq and cq rings share one mapping
+	size_t rings_sz;
+	struct io_uring_sqe* sqes;
+	size_t sqes_sz;
+
+	uint32_t* sq_head;
+	uint32_t* sq_tail;
+	uint32_t sq_mask;
+	uint32_t* sq_array;
+	uint32_t sq_local_tail;
+
+	uint32_t* cq_head;
+	uint32_t* cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe* cqes;
+
+	bool abandoned; // operations may still be in flight, see ring_abandon
+
+	// the buffers operations send from and receive into, which live as long as the ring
+	char in[SA_URING_RECV_SIZE];
+	char out[SA_URING_RECV_SIZE];
+} sa_uring;
+
+// one framed response, the header followed by json
+typedef struct uring_response_s {
+	char header[SA_HEADER_SIZE];
+	uint32_t header_pos;
+	const sa_allocator* alloc; // allocates json
+	char* json;
+	uint32_t json_sz;
+	uint32_t json_pos;
+} uring_response;
+
+//==========================================================
+// Globals.
+//
+
+static pthread_once_t SA_URING_KEY_ONCE = PTHREAD_ONCE_INIT;
+static pthread_key_t SA_URING_KEY;
+
+static __thread sa_uring* t_ring = NULL;
+static __thread bool t_ring_failed = false;
+
+//==========================================================
+// Forward declarations.
+//
+
+static sa_uring* ring_get();
+static void ring_key_init();
+static void ring_atfork_child();
+static sa_uring* ring_new();
+static void ring_destroy(void* udata);
+static struct io_uring_sqe* ring_sqe(sa_uring* ring, uring_op op, int fd, uint8_t flags);
+static int ring_enter(sa_uring* ring, uint32_t flags, void* arg, size_t arg_sz);
+static sa_err ring_wait(sa_uring* ring, uint32_t* in_flight, int32_t* res, uint64_t deadline_ms);
+static bool ring_cancel(sa_uring* ring, uint32_t in_flight, int32_t* res);
+static void ring_abandon(sa_uring* ring);
+static sa_err uring_round(sa_uring* ring, int fd, const struct addrinfo* ai, const char* out, size_t out_len, char* in, size_t in_cap, size_t* n_in, uint64_t deadline_ms, bool* connect_failed);
+static sa_err exchange(sa_uring* ring, sa_socket* sock, const struct addrinfo* ai, const char* req, uint32_t req_sz, const sa_allocator* alloc, char** resp, uint64_t deadline_ms, bool* connect_failed);
+static sa_err exchange_plain(sa_uring* ring, sa_socket* sock, const struct addrinfo* ai, const char* req, uint32_t req_sz, uring_response* r, uint64_t deadline_ms, bool* connect_failed);
+static sa_err exchange_tls(sa_uring* ring, sa_socket* sock, const struct addrinfo* ai, const char* req, uint32_t req_sz, uring_response* r, uint64_t deadline_ms, bool* connect_failed);
+static sa_err response_consume(uring_response* r, const char* data, size_t n);
+static size_t response_remaining(const uring_response* r);
+
+//==========================================================
+// Public API.
+//
+
+bool
+sa_uring_available()
+{
+	return ring_get() != NULL;
+}
+
+sa_err
+sa_uring_request(sa_socket* sock, const char* req, uint32_t req_sz, const sa_allocator* alloc,
+		char** resp, uint64_t deadline_ms)
+{
+	sa_err err;
+
+	sa_uring* ring = ring_get();
+	if (ring == NULL) {
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	bool connect_failed = false;
+	return exchange(ring, sock, NULL, req, req_sz, alloc, resp, deadline_ms, &connect_failed);
+}
+
+sa_err
+sa_uring_connect_request(sa_socket** sockp, sa_resolver* resolver, const char* addr, const char* port, sa_tls_cfg* tls_cfg,
+		const char* req, uint32_t req_sz, const sa_allocator* alloc, char** resp, uint64_t deadline_ms)
+{
+	sa_err err;
+
+	sa_uring* ring = ring_get();
+	if (ring == NULL) {
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	err = sa_validate_port(port);
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	sa_addrs* addrs = NULL;
+	sa_phase_start(SA_PHASE_RESOLVE);
+	err = sa_resolver_lookup(resolver, addr, port, deadline_ms, &addrs);
+	sa_phase_end(SA_PHASE_RESOLVE, 0);
+	if (err.code != SA_OK) {
+		return err;
+	}
+
+	err.code = SA_FAILED_INTERNAL;
+
+	// connect to the first address we can
+	for (struct addrinfo* p = addrs->ai; p != NULL; p = p->ai_next) {
+		// non-blocking so the connection can be pooled and used by the poll paths
+		int fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+
+		sa_socket* sock = NULL;
+		err = sa_socket_new(&sock, fd, addr, port, tls_cfg);
+		if (err.code != SA_OK) {
+			close(fd);
+			break;
+		}
+
+		bool connect_failed = false;
+		err = exchange(ring, sock, p, req, req_sz, alloc, resp, deadline_ms, &connect_failed);
+		if (err.code == SA_OK) {
+			*sockp = sock;
+			break;
+		}
+
+		close(fd);
+		sa_socket_destroy(sock);
+
+		if (! connect_failed) {
+			break;
+		}
+	}
+
+	sa_addrs_release(addrs);
+	return err;
+}
+
+//==========================================================
+// Local helpers.
+//
+
+// returns this thread's ring, creating it on first use
+static sa_uring*
+ring_get()
+{
+	if (t_ring != NULL || t_ring_failed) {
+		return t_ring;
+	}
+
+	pthread_once(&SA_URING_KEY_ONCE, ring_key_init);
+
+	t_ring = ring_new();
+	if (t_ring == NULL) {
+		t_ring_failed = true;
+		return NULL;
+	}
+
+	// destroys the ring when the thread exits
+	pthread_setspecific(SA_URING_KEY, t_ring);
+	return t_ring;
+}
+
+static void
+ring_key_init()
+{
+	pthread_key_create(&SA_URING_KEY, ring_destroy);
+	pthread_atfork(NULL, NULL, ring_atfork_child);
+}
+
+// a forked child shares the parent's ring mappings, it must make its own
+static void
+ring_atfork_child()
+{
+	if (t_ring != NULL) {
+		ring_destroy(t_ring);
+		t_ring = NULL;
+		pthread_setspecific(SA_URING_KEY, NULL);
+	}
+}
+
+static sa_uring*
+ring_new()
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int fd = (int)syscall(__NR_io_uring_setup, SA_URING_ENTRIES, &params);
+	if (fd < 0) {
+		sa_g_log_function("ERR: io_uring_setup failed, errno: %d", errno);
+		return NULL;
+	}
+
+	// deadlines are passed to io_uring_enter, which needs EXT_ARG (5.11)
+	uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG;
+	if ((params.features & required) != required) {
+		sa_g_log_function("ERR: kernel io_uring lacks required features: %x", params.features);
+		close(fd);
+		return NULL;
+	}
+
+	sa_uring* ring = (sa_uring*) calloc(1, sizeof(sa_uring));
+	if (ring == NULL) {
+		sa_g_log_function("ERR: could not allocate memory for sa_uring");
+		close(fd);
+		return NULL;
+	}
+
+	size_t sq_sz = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	size_t cq_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	ring->fd = fd;
+	ring->rings_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+	ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->rings = mmap(NULL, ring->rings_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		sa_g_log_function("ERR: failed to map io_uring, errno: %d", errno);
+		ring_destroy(ring);
+		return NULL;
+	}
+
+	char* base = (char*)ring->rings;
+
+	ring->sq_head = (uint32_t*)(base + params.sq_off.head);
+	ring->sq_tail = (uint32_t*)(base + params.sq_off.tail);
+	ring->sq_mask = *(uint32_t*)(base + params.sq_off.ring_mask);
+	ring->sq_array = (uint32_t*)(base + params.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->cq_head = (uint32_t*)(base + params.cq_off.head);
+	ring->cq_tail = (uint32_t*)(base + params.cq_off.tail);
+	ring->cq_mask = *(uint32_t*)(base + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+	return ring;
+}
+
+static void
+ring_destroy(void* udata)
+{
+	sa_uring* ring = (sa_uring*)udata;
+
+	if (ring->rings != NULL && ring->rings != MAP_FAILED) {
+		munmap(ring->rings, ring->rings_sz);
+	}
+
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_sz);
+	}
+
+	close(ring->fd);
+	free(ring);
+}
+
+// queues a zeroed sqe for op, it is submitted by the next ring_wait
+static struct io_uring_sqe*
+ring_sqe(sa_uring* ring, uring_op op, int fd, uint8_t flags)
+{
+	uint32_t idx = ring->sq_local_tail & ring->sq_mask;
+
+	struct io_uring_sqe* sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = fd;
+	sqe->flags = flags;
+	sqe->user_data = (uint64_t)op;
+
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+// submits sqes the kernel hasn't consumed yet and waits for at least one completion
+static int
+ring_enter(sa_uring* ring, uint32_t flags, void* arg, size_t arg_sz)
+{
+	uint32_t to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+			IORING_ENTER_GETEVENTS | flags, arg, arg_sz);
+}
+
+/*
+ * ring_wait submits queued sqes and waits until every operation in the
+ * in_flight bitmask has completed, storing each result in res.
+ * Past the deadline the remaining operations are cancelled, and waited
+ * for since they reference the caller's buffers, before SA_FAILED_TIMEOUT
+ * is returned, or SA_FAILED_INTERNAL if the ring had to be abandoned.
+*/
+static sa_err
+ring_wait(sa_uring* ring, uint32_t* in_flight, int32_t* res, uint64_t deadline_ms)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	while (*in_flight != 0) {
+		uint64_t now = sa_now_ms();
+		if (now >= deadline_ms) {
+			sa_g_log_function("ERR: io_uring request timed out");
+			err.code = ring_cancel(ring, *in_flight, res) ? SA_FAILED_TIMEOUT : SA_FAILED_INTERNAL;
+			*in_flight = 0;
+			return err;
+		}
+
+		uint64_t wait_ms = deadline_ms - now;
+
+		struct __kernel_timespec ts = {
+			.tv_sec = (long long)(wait_ms / 1000),
+			.tv_nsec = (long long)(wait_ms % 1000) * 1000000
+		};
+
+		struct io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+
+		int rv = ring_enter(ring, IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+		if (rv < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			sa_g_log_function("ERR: io_uring_enter failed, errno: %d", errno);
+			(void)ring_cancel(ring, *in_flight, res);
+			*in_flight = 0;
+			err.code = SA_FAILED_INTERNAL;
+			return err;
+		}
+
+		uint32_t head = *ring->cq_head;
+		uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+			uint64_t op = cqe->user_data;
+
+			if (op < URING_OP_MAX) {
+				res[op] = cqe->res;
+				*in_flight &= ~(1u << op);
+			}
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return err;
+}
+
+/*
+ * ring_cancel cancels the in_flight operations and waits for all of them to
+ * complete. If the ring fails meanwhile it is abandoned and false returned.
+*/
+static bool
+ring_cancel(sa_uring* ring, uint32_t in_flight, int32_t* res)
+{
+	for (uint32_t op = 0; op < URING_OP_MAX; op++) {
+		if ((in_flight & (1u << op)) != 0) {
+			struct io_uring_sqe* sqe = ring_sqe(ring, URING_OP_CANCEL, -1, 0);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uint64_t)op;
+		}
+	}
+
+	while (in_flight != 0) {
+		int rv = ring_enter(ring, 0, NULL, 0);
+
+		if (rv < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			sa_g_log_function("ERR: io_uring_enter failed cancelling, errno: %d", errno);
+			ring_abandon(ring);
+			return false;
+		}
+
+		uint32_t head = *ring->cq_head;
+		uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			uint64_t op = ring->cqes[head & ring->cq_mask].user_data;
+
+			if (op < URING_OP_MAX) {
+				res[op] = ring->cqes[head & ring->cq_mask].res;
+				in_flight &= ~(1u << op);
+			}
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
+
+/*
+ * ring_abandon gives up on a ring whose operations can't be waited for. The
+ * kernel may still write into the buffers they use, so the ring, with its
+ * buffers, is leaked rather than destroyed, as is the response the caller
+ * was receiving. The thread uses the poll backend from then on.
+*/
+static void
+ring_abandon(sa_uring* ring)
+{
+	ring->abandoned = true;
+
+	if (ring == t_ring) {
+		t_ring = NULL;
+		t_ring_failed = true;
+		pthread_setspecific(SA_URING_KEY, NULL);
+	}
+}
+
+/*
+ * uring_round connects to ai if not NULL, sends out and receives at
+ * least one byte into in, with the operations linked so they are
+ * submitted together. n_in is set to the number of bytes received.
+*/
+static sa_err
+uring_round(sa_uring* ring, int fd, const struct addrinfo* ai, const char* out, size_t out_len,
+		char* in, size_t in_cap, size_t* n_in, uint64_t deadline_ms, bool* connect_failed)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	// Older kernels complete operations on non-blocking sockets with
+	// -EAGAIN instead of waiting, in which case a poll is linked first.
+	bool poll_out = false;
+	bool poll_in = false;
+
+	// sent from the ring's buffer if it fits, which outlives an abandoned ring
+	if (out_len != 0 && out_len <= sizeof(ring->out)) {
+		memcpy(ring->out, out, out_len);
+		out = ring->out;
+	}
+
+	while (true) {
+		uint32_t in_flight = 0;
+		int32_t res[URING_OP_MAX];
+		struct io_uring_sqe* sqe;
+
+		if (ai != NULL) {
+			sqe = ring_sqe(ring, URING_OP_CONNECT, fd, IOSQE_IO_LINK);
+			sqe->opcode = IORING_OP_CONNECT;
+			sqe->addr = (uint64_t)(uintptr_t)ai->ai_addr;
+			sqe->off = ai->ai_addrlen;
+			in_flight |= 1u << URING_OP_CONNECT;
+		}
+
+		if (out_len != 0) {
+			if (poll_out) {
+				sqe = ring_sqe(ring, URING_OP_POLL_OUT, fd, IOSQE_IO_LINK);
+				sqe->opcode = IORING_OP_POLL_ADD;
+				sqe->poll32_events = POLLOUT;
+				in_flight |= 1u << URING_OP_POLL_OUT;
+			}
+
+			sqe = ring_sqe(ring, URING_OP_SEND, fd, IOSQE_IO_LINK);
+			sqe->opcode = IORING_OP_SEND;
+			sqe->addr = (uint64_t)(uintptr_t)out;
+			sqe->len = (uint32_t)out_len;
+			sqe->msg_flags = MSG_NOSIGNAL;
+			in_flight |= 1u << URING_OP_SEND;
+		}
+
+		if (poll_in) {
+			sqe = ring_sqe(ring, URING_OP_POLL_IN, fd, IOSQE_IO_LINK);
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->poll32_events = POLLIN;
+			in_flight |= 1u << URING_OP_POLL_IN;
+		}
+
+		sqe = ring_sqe(ring, URING_OP_RECV, fd, 0);
+		sqe->opcode = IORING_OP_RECV;
+		sqe->addr = (uint64_t)(uintptr_t)in;
+		sqe->len = (uint32_t)in_cap;
+		in_flight |= 1u << URING_OP_RECV;
+
+		err = ring_wait(ring, &in_flight, res, deadline_ms);
+		if (err.code != SA_OK) {
+			return err;
+		}
+
+		if (ai != NULL) {
+			if (res[URING_OP_CONNECT] < 0) {
+				sa_g_log_function("ERR: connect failed, errno: %d", -res[URING_OP_CONNECT]);
+				*connect_failed = true;
+				err.code = SA_FAILED_INTERNAL;
+				return err;
+			}
+
+			ai = NULL;
+		}
+
+		if (out_len != 0) {
+			int32_t rv = res[URING_OP_SEND];
+
+			if (rv > 0) {
+				out += rv;
+				out_len -= (size_t)rv;
+			}
+			else if (rv == -EAGAIN) {
+				poll_out = true;
+			}
+			else if (rv != -ECANCELED) {
+				sa_g_log_function("ERR: send failed, errno: %d", -rv);
+				err.code = SA_FAILED_INTERNAL;
+				return err;
+			}
+		}
+
+		int32_t rv = res[URING_OP_RECV];
+
+		if (rv > 0) {
+			*n_in = (size_t)rv;
+			return err;
+		}
+
+		if (rv == 0) {
+			sa_g_log_function("ERR: connection closed by peer");
+			err.code = SA_FAILED_INTERNAL;
+			return err;
+		}
+
+		if (rv == -EAGAIN) {
+			poll_in = true;
+		}
+		else if (rv != -ECANCELED) {
+			sa_g_log_function("ERR: recv failed, errno: %d", -rv);
+			err.code = SA_FAILED_INTERNAL;
+			return err;
+		}
+
+		// a short send or EAGAIN broke the chain, go around again
+	}
+}
+
+static sa_err
+exchange(sa_uring* ring, sa_socket* sock, const struct addrinfo* ai, const char* req, uint32_t req_sz,
+		const sa_allocator* alloc, char** resp, uint64_t deadline_ms, bool* connect_failed)
+{
+	uring_response r;
+	memset(&r, 0, sizeof(r));
+	r.alloc = alloc;
+
+	sa_err err = sock->ssl == NULL ?
+			exchange_plain(ring, sock, ai, req, req_sz, &r, deadline_ms, connect_failed) :
+			exchange_tls(ring, sock, ai, req, req_sz, &r, deadline_ms, connect_failed);
+
+	if (err.code != SA_OK) {
+		if (! ring->abandoned && r.json != NULL) {
+			// may hold part of the response
+			sa_zero(r.json, r.json_pos);
+			sa_free(alloc, r.json);
+		}
+
+		return err;
+	}
+
+	r.json[r.json_sz] = '\0';
+	*resp = r.json;
+	return err;
+}
+
+static sa_err
+exchange_plain(sa_uring* ring, sa_socket* sock, const struct addrinfo* ai, const char* req,
+		uint32_t req_sz, uring_response* r, uint64_t deadline_ms, bool* connect_failed)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	char* in = ring->in;
+	size_t out_len = req_sz;
+
+	while (response_remaining(r) != 0) {
+		size_t n = 0;
+
+		if (r->json != NULL) {
+			// the size is known, receive straight into the response
+			err = uring_round(ring, sock->fd, ai, req, out_len, r->json + r->json_pos,
+					response_remaining(r), &n, deadline_ms, connect_failed);
+			if (err.code != SA_OK) {
+				return err;
+			}
+
+			r->json_pos += (uint32_t)n;
+		}
+		else {
+			err = uring_round(ring, sock->fd, ai, req, out_len, in, SA_URING_RECV_SIZE, &n,
+					deadline_ms, connect_failed);
+			if (err.code != SA_OK) {
+				return err;
+			}
+
+			err = response_consume(r, in, n);
+
+			// the ring's buffer outlives the exchange
+			sa_zero(in, n);
+
+			if (err.code != SA_OK) {
+				return err;
+			}
+		}
+
+		ai = NULL;
+		out_len = 0;
+	}
+
+	return err;
+}
+
+/*
+ * exchange_tls runs OpenSSL over memory BIOs. Whenever OpenSSL needs to read,
+ * the records it has written are sent and the reply received in one round.
+ * The socket BIO is restored afterwards for the poll based paths.
+*/
+static sa_err
+exchange_tls(sa_uring* ring, sa_socket* sock, const struct addrinfo* ai, const char* req,
+		uint32_t req_sz, uring_response* r, uint64_t deadline_ms, bool* connect_failed)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	BIO* rbio = BIO_new(BIO_s_mem());
+	BIO* wbio = BIO_new(BIO_s_mem());
+	if (rbio == NULL || wbio == NULL) {
+		sa_g_log_function("ERR: could not allocate memory BIOs");
+		BIO_free(rbio);
+		BIO_free(wbio);
+		err.code = SA_FAILED_INTERNAL;
+		return err;
+	}
+
+	// an empty read BIO means retry, not EOF
+	BIO_set_mem_eof_return(rbio, -1);
+	SSL_set_bio(sock->ssl, rbio, wbio);
+
+	char* in = ring->in;
+	char plain[SA_URING_RECV_SIZE];
+	size_t plain_used = 0;
+	bool handshake = ! SSL_is_init_finished(sock->ssl);
+	uint32_t req_pos = 0;
+
+	while (response_remaining(r) != 0) {
+		short events = 0;
+
+		if (handshake) {
+			err = sa_tls_connect_nb(sock, &events);
+			handshake = events != 0;
+		}
+		else if (req_pos < req_sz) {
+			size_t n = 0;
+			err = sa_tls_write_nb(sock, req_sz - req_pos, (void*)(req + req_pos), &n, &events);
+			req_pos += (uint32_t)n;
+		}
+		else {
+			size_t want = response_remaining(r);
+			size_t n = 0;
+			err = sa_tls_read_nb(sock, want < sizeof(plain) ? want : sizeof(plain), plain, &n, &events);
+			if (err.code == SA_OK && n != 0) {
+				err = response_consume(r, plain, n);
+				plain_used = n > plain_used ? n : plain_used;
+			}
+		}
+
+		if (err.code != SA_OK) {
+			break;
+		}
+
+		if (events == 0) {
+			continue;
+		}
+
+		// memory BIOs only ever want to read, send what OpenSSL wrote and get the reply
+		char* out = NULL;
+		long out_len = BIO_get_mem_data(wbio, &out);
+
+		size_t n = 0;
+		err = uring_round(ring, sock->fd, ai, out, (size_t)out_len, in, SA_URING_RECV_SIZE, &n,
+				deadline_ms, connect_failed);
+		if (err.code != SA_OK) {
+			break;
+		}
+
+		ai = NULL;
+		(void)BIO_reset(wbio);
+		BIO_write(rbio, in, (int)n);
+		sa_zero(in, n);
+	}
+
+	sa_zero(plain, plain_used);
+
+	// records left in the memory BIOs would be lost with them
+	bool leftover = BIO_ctrl_pending(rbio) != 0 || BIO_ctrl_pending(wbio) != 0;
+
+	// frees the memory BIOs
+	SSL_set_fd(sock->ssl, sock->fd);
+
+	if (err.code == SA_OK && leftover) {
+		// fail the pool's liveness check so the connection isn't reused
+		shutdown(sock->fd, SHUT_RDWR);
+	}
+
+	return err;
+}
+
+// adds n bytes of response data, the header then json
+static sa_err
+response_consume(uring_response* r, const char* data, size_t n)
+{
+	sa_err err;
+	err.code = SA_OK;
+
+	while (n != 0) {
+		if (r->header_pos < SA_HEADER_SIZE) {
+			size_t m = SA_HEADER_SIZE - r->header_pos;
+			m = m < n ? m : n;
+
+			memcpy(r->header + r->header_pos, data, m);
+			r->header_pos += (uint32_t)m;
+			data += m;
+			n -= m;
+
+			if (r->header_pos < SA_HEADER_SIZE) {
+				break;
+			}
+
+			err = sa_parse_secret_header(r->header, &r->json_sz);
+			if (err.code != SA_OK) {
+				return err;
+			}
+
+			r->json = (char*) sa_alloc(r->alloc, r->json_sz + 1);
+			if (r->json == NULL) {
+				sa_g_log_function("ERR: could not allocate memory for secret response");
+				err.code = SA_FAILED_INTERNAL;
+				return err;
+			}
+
+			continue;
+		}
+
+		size_t m = r->json_sz - r->json_pos;
+		if (n > m) {
+			sa_g_log_function("ERR: unexpected data after secret response");
+			err.code = SA_FAILED_INTERNAL;
+			return err;
+		}
+
+		memcpy(r->json + r->json_pos, data, n);
+		r->json_pos += (uint32_t)n;
+		break;
+	}
+
+	return err;
+}
+
+// bytes of the response not yet received, the header counts until it is complete
+static size_t
+response_remaining(const uring_response* r)
+{
+	if (r->json == NULL) {
+		return SA_HEADER_SIZE - r->header_pos;
+	}
+
+	return r->json_sz - r->json_pos;
+}
+
+#else
+
+//==========================================================
+// Public API.
+//
+
+bool
+sa_uring_available()
+{
+	return false;
+}
+
+sa_err
+sa_uring_request(sa_socket* sock, const char* req, uint32_t req_sz, const sa_allocator* alloc,
+		char** resp, uint64_t deadline_ms)
+{
+	sa_g_log_function("ERR: built without io_uring support");
+
+	sa_err err;
+	err.code = SA_FAILED_INTERNAL;
+	return err;
+}
+
+sa_err
+sa_uring_connect_request(sa_socket** sockp, sa_resolver* resolver, const char* addr, const char* port, sa_tls_cfg* tls_cfg,
+		const char* req, uint32_t req_sz, const sa_allocator* alloc, char** resp, uint64_t deadline_ms)
+{
+	sa_g_log_function("ERR: built without io_uring support");
+
+	sa_err err;
+	err.code = SA_FAILED_INTERNAL;
+	return err;
+}
+
+#endif
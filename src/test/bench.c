@@ -0,0 +1,612 @@
+/*
+ * Copyright 2008-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ */
+
+#include "sa_b64.h"
+#include "sa_client.h"
+#include "sa_logging.h"
+#include "sa_secrets.h"
+#include "sa_tls.h"
+#include "sa_uring.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Micro benchmarks for the client hot paths.
+ * These do not need a running secret agent, fetches are served by
+ * a minimal stand-in agent on a local thread.
+*/
+
+#define CA_PATH "./src/test/test-data/cacert.pem"
+
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+char* readCertFile(const char* path)
+{
+	FILE* fptr;
+	long flen;
+
+	fptr = fopen(path, "rb");
+	fseek(fptr, 0, SEEK_END);
+	flen = ftell(fptr);
+	rewind(fptr);
+
+	char* buff = (char*) malloc(flen+1);
+	fread(buff, flen, 1, fptr);
+	fclose(fptr);
+
+	buff[flen] = 0;
+
+	return buff;
+}
+
+void report(const char* name, int iterations, uint64_t elapsed_ns)
+{
+	printf("%-40s %10d ops %12.2f us/op\n", name, iterations,
+			(double)elapsed_ns / iterations / 1000.0);
+}
+
+// per connection tls setup, old behaviour rebuilt the SSL_CTX and CA store every time
+void bench_tls_wrap_socket(bool cached, const char* name)
+{
+	const int iterations = 2000;
+
+	sa_tls_cfg tls;
+	sa_tls_cfg_init(&tls);
+	tls.enabled = true;
+	tls.ca_string = readCertFile(CA_PATH);
+
+	sa_init_openssl();
+
+	int fds[2];
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+	uint64_t start = now_ns();
+
+	for (int i = 0; i < iterations; i++) {
+		if (! cached) {
+			sa_tls_cfg_destroy(&tls);
+		}
+
+		sa_socket sock = { .fd = fds[0], .ssl = NULL, .tls_cfg = &tls, .addr = "127.0.0.1", .port = "3006" };
+		assert(sa_wrap_socket(&sock) == 0);
+		SSL_free(sock.ssl);
+	}
+
+	report(name, iterations, now_ns() - start);
+
+	close(fds[0]);
+	close(fds[1]);
+	sa_tls_cfg_destroy(&tls);
+	free(tls.ca_string);
+}
+
+void bench_tls_wrap_socket_uncached()
+{
+	bench_tls_wrap_socket(false, "tls wrap socket, context per connection");
+}
+
+void bench_tls_wrap_socket_cached()
+{
+	bench_tls_wrap_socket(true, "tls wrap socket, shared context");
+}
+
+// answers every request with the same secret, one connection at a time
+void* stand_in_agent(void* udata)
+{
+	int lfd = *(int*)udata;
+	const char* json = "{\"SecretValue\":\"MTI3LjAuMC4x\"}";
+	uint32_t json_sz = (uint32_t)strlen(json);
+
+	char resp[64];
+	*(uint32_t*)&resp[0] = htonl(0x51dec1cc);
+	*(uint32_t*)&resp[4] = htonl(json_sz);
+	memcpy(resp + 8, json, json_sz);
+
+	while (true) {
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+
+		char header[8];
+		char body[1024];
+
+		while (recv(fd, header, 8, MSG_WAITALL) == 8) {
+			uint32_t sz = ntohl(*(uint32_t*)&header[4]);
+			if (sz > sizeof(body) || recv(fd, body, sz, MSG_WAITALL) != (ssize_t)sz) {
+				break;
+			}
+
+			send(fd, resp, 8 + json_sz, MSG_NOSIGNAL);
+		}
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+// starts the stand-in agent, returns its port
+int start_stand_in_agent()
+{
+	static int lfd = -1;
+	static int port = 0;
+
+	if (lfd != -1) {
+		return port;
+	}
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t len = sizeof(sa);
+	assert(bind(lfd, (struct sockaddr*)&sa, sizeof(sa)) == 0);
+	assert(listen(lfd, 16) == 0);
+	assert(getsockname(lfd, (struct sockaddr*)&sa, &len) == 0);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, stand_in_agent, &lfd);
+	pthread_detach(thread);
+
+	port = ntohs(sa.sin_port);
+	return port;
+}
+
+// starts the stand-in agent on an abstract unix socket, returns its address
+const char* start_unix_stand_in_agent()
+{
+	static int lfd = -1;
+	static char addr[64];
+
+	if (lfd != -1) {
+		return addr;
+	}
+
+	snprintf(addr, sizeof(addr), "unix:@sa-bench-%d", (int)getpid());
+	const char* name = addr + strlen("unix:");
+
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	memcpy(sun.sun_path + 1, name + 1, strlen(name) - 1);
+	socklen_t len = offsetof(struct sockaddr_un, sun_path) + strlen(name);
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(bind(lfd, (struct sockaddr*)&sun, len) == 0);
+	assert(listen(lfd, 16) == 0);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, stand_in_agent, &lfd);
+	pthread_detach(thread);
+
+	return addr;
+}
+
+int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+void fetch_n(sa_client* c, int n, uint64_t* latencies)
+{
+	for (int i = 0; i < n; i++) {
+		uint64_t start = now_ns();
+
+		uint8_t* secret;
+		size_t size;
+		sa_err err = sa_secret_get_bytes(c, "secrets:pass:pass", &secret, &size);
+		assert(err.code == SA_OK);
+		free(secret);
+
+		if (latencies != NULL) {
+			latencies[i] = now_ns() - start;
+		}
+	}
+}
+
+/*
+ * Counts the syscalls made by n fetches in a child process traced with
+ * PTRACE_SYSCALL, which stops on every syscall entry and exit.
+*/
+double syscalls_per_fetch(sa_client* c, int n)
+{
+	pid_t pid = fork();
+	assert(pid >= 0);
+
+	if (pid == 0) {
+		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+
+		// warm up outside the count, rings and connections are set up lazily
+		fetch_n(c, 1, NULL);
+		raise(SIGSTOP);
+
+		fetch_n(c, n, NULL);
+		_exit(0);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	assert(WIFSTOPPED(status));
+	ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD);
+
+	uint64_t stops = 0;
+	int sig = 0;
+
+	while (true) {
+		ptrace(PTRACE_SYSCALL, pid, NULL, (void*)(intptr_t)sig);
+		waitpid(pid, &status, 0);
+		sig = 0;
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+			break;
+		}
+
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			stops++;
+		}
+		else {
+			// deliver signals, such as SIGABRT from a failed assert
+			sig = WSTOPSIG(status);
+		}
+	}
+
+	// the exit_group entry has no matching exit stop
+	return (double)(stops / 2) / n;
+}
+
+// p50 and p99 latency and syscalls per fetch for one backend
+void bench_fetch(bool io_uring, bool pooled, bool unix_socket, const char* name)
+{
+	const int iterations = 5000;
+
+	if (io_uring && ! sa_uring_available()) {
+		printf("%-40s not built, make IO_URING=1\n", name);
+		return;
+	}
+
+	char port[8];
+	snprintf(port, sizeof(port), "%d", start_stand_in_agent());
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = unix_socket ? (char*)start_unix_stand_in_agent() : "127.0.0.1";
+	cfg.port = port;
+	cfg.timeout = 1000;
+	cfg.pool_size = pooled ? 1 : 0;
+	cfg.io_uring = io_uring;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	double syscalls = syscalls_per_fetch(&c, 200);
+
+	uint64_t* latencies = (uint64_t*) malloc(iterations * sizeof(uint64_t));
+	fetch_n(&c, iterations, latencies);
+	qsort(latencies, iterations, sizeof(uint64_t), compare_u64);
+
+	printf("%-40s %10d ops %8.2f us p50 %8.2f us p99 %6.1f syscalls/op\n", name, iterations,
+			latencies[iterations / 2] / 1000.0, latencies[iterations * 99 / 100] / 1000.0,
+			syscalls);
+
+	free(latencies);
+	sa_client_destroy(&c);
+}
+
+void bench_fetch_poll()
+{
+	bench_fetch(false, false, false, "fetch, poll, new connection");
+}
+
+void bench_fetch_io_uring()
+{
+	bench_fetch(true, false, false, "fetch, io_uring, new connection");
+}
+
+void bench_fetch_poll_pooled()
+{
+	bench_fetch(false, true, false, "fetch, poll, pooled connection");
+}
+
+void bench_fetch_io_uring_pooled()
+{
+	bench_fetch(true, true, false, "fetch, io_uring, pooled connection");
+}
+
+void bench_fetch_unix()
+{
+	bench_fetch(false, false, true, "fetch, poll, new unix connection");
+}
+
+void bench_fetch_unix_pooled()
+{
+	bench_fetch(false, true, true, "fetch, poll, pooled unix connection");
+}
+
+// cache hits, where the per call path parsing and request building is most of the work
+void bench_get_cached_prepared()
+{
+	const int iterations = 1000000;
+	const char* path = "secrets:some-resource-name:some-secret-key";
+
+	char port[8];
+	snprintf(port, sizeof(port), "%d", start_stand_in_agent());
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = "127.0.0.1";
+	cfg.port = port;
+	cfg.timeout = 1000;
+	cfg.cache.ttl = 3600000;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	sa_secret_handle* h;
+	assert(sa_secret_prepare(&c, path, &h).code == SA_OK);
+
+	for (int prepared = 0; prepared < 2; prepared++) {
+		uint64_t start = now_ns();
+
+		for (int i = 0; i < iterations; i++) {
+			uint8_t* secret;
+			size_t size;
+			sa_err err = prepared ? sa_secret_get_prepared(h, &secret, &size) :
+					sa_secret_get_bytes(&c, path, &secret, &size);
+			assert(err.code == SA_OK);
+			free(secret);
+		}
+
+		report(prepared ? "get cached, prepared" : "get cached, path", iterations,
+				now_ns() - start);
+	}
+
+	sa_secret_handle_destroy(h);
+	sa_client_destroy(&c);
+}
+
+// decode throughput of each base64 kernel, in GB/s of encoded input
+void bench_b64_decode()
+{
+	const uint32_t raw_sz = 3 << 20;
+	const int iterations = 200;
+	const sa_b64_kernel kernels[] = { SA_B64_SCALAR, SA_B64_SSE41, SA_B64_AVX2, SA_B64_AVX512VBMI };
+	const char* names[] = { "scalar", "sse4.1", "avx2", "avx512 vbmi" };
+
+	uint8_t* raw = (uint8_t*) malloc(raw_sz);
+	for (uint32_t i = 0; i < raw_sz; i++) {
+		raw[i] = (uint8_t)rand();
+	}
+
+	uint32_t enc_len = sa_b64_encoded_len(raw_sz);
+	char* enc = (char*) malloc(enc_len);
+	sa_b64_encode(raw, raw_sz, enc);
+
+	for (int k = 0; k < 4; k++) {
+		char name[64];
+		snprintf(name, sizeof(name), "b64 validate and decode 4MB, %s", names[k]);
+
+		if (! sa_b64_set_kernel(kernels[k])) {
+			printf("%-40s not supported\n", name);
+			continue;
+		}
+
+		uint64_t start = now_ns();
+
+		for (int i = 0; i < iterations; i++) {
+			uint32_t size;
+			assert(sa_b64_validate_and_decode(enc, enc_len, raw, &size));
+		}
+
+		uint64_t elapsed_ns = now_ns() - start;
+
+		printf("%-40s %10d ops %12.2f GB/s\n", name, iterations,
+				(double)enc_len * iterations / elapsed_ns);
+	}
+
+	sa_b64_set_kernel(SA_B64_AUTO);
+	free(enc);
+	free(raw);
+}
+
+// parsing a response and decoding its secret, with the scanner and with jansson
+void bench_parse_response()
+{
+	const uint32_t raw_sizes[] = { 32, 48 * 1024 };
+	const int iterations[] = { 1000000, 2000 };
+
+	for (int s = 0; s < 2; s++) {
+		uint8_t* raw = (uint8_t*) malloc(raw_sizes[s]);
+		for (uint32_t i = 0; i < raw_sizes[s]; i++) {
+			raw[i] = (uint8_t)rand();
+		}
+
+		uint32_t enc_len = sa_b64_encoded_len(raw_sizes[s]);
+		char* json = (char*) malloc(enc_len + 64);
+		uint32_t json_sz = (uint32_t)sprintf(json, "{\"SecretValue\":\"");
+		sa_b64_encode(raw, raw_sizes[s], json + json_sz);
+		json_sz += enc_len;
+		json_sz += (uint32_t)sprintf(json + json_sz, "\"}");
+
+		char* buf = (char*) malloc(json_sz + 1);
+		char name[64];
+
+		// the scanner consumes its input, so each iteration starts from a fresh copy
+		snprintf(name, sizeof(name), "parse response %uB, scanner", raw_sizes[s]);
+		uint64_t start = now_ns();
+
+		for (int i = 0; i < iterations[s]; i++) {
+			memcpy(buf, json, json_sz + 1);
+			size_t size;
+			assert(sa_parse_json_in_place(buf, json_sz, &size) != NULL && size == raw_sizes[s]);
+		}
+
+		report(name, iterations[s], now_ns() - start);
+
+#ifdef SA_USE_JANSSON
+		snprintf(name, sizeof(name), "parse response %uB, jansson", raw_sizes[s]);
+		start = now_ns();
+
+		for (int i = 0; i < iterations[s]; i++) {
+			memcpy(buf, json, json_sz + 1);
+			size_t size;
+			uint8_t* secret = sa_parse_json_jansson(buf, &size);
+			assert(secret != NULL && size == raw_sizes[s]);
+			free(secret);
+		}
+
+		report(name, iterations[s], now_ns() - start);
+#endif
+
+		free(buf);
+		free(json);
+		free(raw);
+	}
+}
+
+void noop_trace(void* udata, const sa_trace_event* event)
+{
+	(void)udata;
+	(void)event;
+}
+
+/*
+ * What trace hooks, and stats, add to a fetch. Without either each phase
+ * costs a thread local load and a branch, which should not show next to the
+ * fetch. The modes take turns so drift in the machine affects them alike.
+*/
+void bench_trace_overhead()
+{
+	const int rounds = 5;
+	const int per_round = 4000;
+	const int iterations = rounds * per_round;
+	const char* names[3] = { "fetch, pooled unix, no hooks", "fetch, pooled unix, stats",
+			"fetch, pooled unix, trace hooks" };
+
+	uint64_t* latencies[3];
+	for (int mode = 0; mode < 3; mode++) {
+		latencies[mode] = (uint64_t*) malloc(iterations * sizeof(uint64_t));
+	}
+
+	for (int round = 0; round < rounds; round++) {
+		for (int mode = 0; mode < 3; mode++) {
+			sa_cfg cfg;
+			sa_cfg_init(&cfg);
+			cfg.addr = (char*)start_unix_stand_in_agent();
+			cfg.timeout = 1000;
+			cfg.pool_size = 1;
+			cfg.stats = mode == 1;
+
+			if (mode == 2) {
+				cfg.trace.start = noop_trace;
+				cfg.trace.end = noop_trace;
+			}
+
+			sa_client c;
+			sa_client_init(&c, &cfg);
+
+			fetch_n(&c, 100, NULL);
+			fetch_n(&c, per_round, latencies[mode] + round * per_round);
+
+			sa_client_destroy(&c);
+		}
+	}
+
+	for (int mode = 0; mode < 3; mode++) {
+		qsort(latencies[mode], iterations, sizeof(uint64_t), compare_u64);
+
+		printf("%-40s %10d ops %8.2f us p50 %8.2f us p99\n", names[mode], iterations,
+				latencies[mode][iterations / 2] / 1000.0,
+				latencies[mode][iterations * 99 / 100] / 1000.0);
+
+		free(latencies[mode]);
+	}
+
+	// the parse and decode phases alone, where the hooks are the largest share
+	const int parses = 1000000;
+	const char* json = "{\"SecretValue\":\"MTI3LjAuMC4x\"}";
+	size_t json_sz = strlen(json);
+	char buf[64];
+
+	sa_trace trace = { .start = noop_trace, .end = noop_trace, .udata = NULL };
+	const char* parse_names[3] = { "parse response, no probe", "parse response, no hooks",
+			"parse response, trace hooks" };
+
+	for (int mode = 0; mode < 3; mode++) {
+		sa_probe probe;
+		sa_probe_init(&probe, NULL, mode == 2 ? &trace : NULL);
+		sa_probe* prev = mode == 0 ? NULL : sa_probe_enter(&probe);
+
+		uint64_t start = now_ns();
+
+		for (int i = 0; i < parses; i++) {
+			memcpy(buf, json, json_sz + 1);
+			size_t size;
+			assert(sa_parse_json_in_place(buf, json_sz, &size) != NULL && size == 9);
+		}
+
+		report(parse_names[mode], parses, now_ns() - start);
+
+		if (mode != 0) {
+			sa_probe_leave(prev);
+		}
+	}
+}
+
+typedef void (*bench_func)();
+
+void run_bench(bench_func f)
+{
+	f();
+}
+
+int main(int argc, char const *argv[])
+{
+	run_bench(&bench_tls_wrap_socket_uncached);
+	run_bench(&bench_tls_wrap_socket_cached);
+	run_bench(&bench_fetch_poll);
+	run_bench(&bench_fetch_io_uring);
+	run_bench(&bench_fetch_poll_pooled);
+	run_bench(&bench_fetch_io_uring_pooled);
+	run_bench(&bench_fetch_unix);
+	run_bench(&bench_fetch_unix_pooled);
+	run_bench(&bench_get_cached_prepared);
+	run_bench(&bench_b64_decode);
+	run_bench(&bench_parse_response);
+	run_bench(&bench_trace_overhead);
+
+	return 0;
+}
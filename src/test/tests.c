@@ -15,15 +15,37 @@
  * the License.
  */
 
+#include "sa_b64.h"
 #include "sa_client.h"
+#include "sa_clock.h"
+#include "sa_config.h"
+#include "sa_json.h"
 #include "sa_logging.h"
+#include "sa_secrets.h"
 
+#include <arpa/inet.h>
 #include <assert.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef SA_USE_JANSSON
+#include "jansson.h"
+#endif
 
 #define AGENT_ADDR "0.0.0.0"
 #define AGENT_PORT "3005"
@@ -236,6 +258,2695 @@ void test_sa_secret_get_bytes_tls()
 	free(secret);
 }
 
+void test_sa_secret_get_bytes_pooled()
+{
+	const char* expected = "127.0.0.1";
+
+	char* addr = AGENT_ADDR;
+	char* port = AGENT_PORT;
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = addr;
+	cfg.port = port;
+	cfg.timeout = 2000;
+	cfg.pool_size = 2;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	sa_set_log_function(&mylog);
+
+	const char* path = "secrets:pass:pass";
+
+	for (int i = 0; i < 3; i++) {
+		size_t result_size = 0;
+		uint8_t* secret;
+		sa_err err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+
+		assert(err.code == SA_OK);
+
+		secret[result_size] = 0;
+		assert(!strcmp(expected, (char*)secret));
+
+		free(secret);
+
+		// the single connection is reused for every request
+		assert(sa_pool_idle_count(c.endpoints[0].pool) == 1);
+	}
+
+	sa_client_destroy(&c);
+}
+
+/*
+ * Counts the syscalls made by n fetches of path in a child process traced
+ * with PTRACE_SYSCALL, which stops on every syscall entry and exit.
+*/
+double syscalls_per_fetch(sa_client* c, const char* path, int n)
+{
+	pid_t pid = fork();
+	assert(pid >= 0);
+
+	if (pid == 0) {
+		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+
+		for (int i = 0; i <= n; i++) {
+			if (i == 1) {
+				// the first fetch connects, count only pooled fetches
+				raise(SIGSTOP);
+			}
+
+			uint8_t* secret;
+			size_t size;
+			sa_err err = sa_secret_get_bytes(c, path, &secret, &size);
+			assert(err.code == SA_OK);
+			free(secret);
+		}
+
+		_exit(0);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	assert(WIFSTOPPED(status));
+	ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD);
+
+	uint64_t stops = 0;
+	int sig = 0;
+
+	while (true) {
+		ptrace(PTRACE_SYSCALL, pid, NULL, (void*)(intptr_t)sig);
+		waitpid(pid, &status, 0);
+		sig = 0;
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+			break;
+		}
+
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			stops++;
+		}
+		else {
+			sig = WSTOPSIG(status);
+		}
+	}
+
+	// the exit_group entry has no matching exit stop
+	return (double)(stops / 2) / n;
+}
+
+void test_sa_socket_syscalls()
+{
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR;
+	cfg.port = AGENT_PORT;
+	cfg.timeout = 2000;
+	cfg.pool_size = 1;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	sa_set_log_function(&mylog);
+
+	// The pooled connection's liveness check poll, then the request in one
+	// send, a poll for the response and one recv of its header and json.
+	double n = syscalls_per_fetch(&c, "secrets:pass:pass", 50);
+	printf("%.1f syscalls per pooled fetch\n", n);
+	assert(n <= 4.0);
+
+	sa_client_destroy(&c);
+
+	cfg.addr = AGENT_ADDR_TLS;
+	cfg.port = AGENT_PORT_TLS;
+	cfg.timeout = 3000;
+	cfg.tls.ca_string = readCertFile("./src/test/test-data/cacert.pem");
+	cfg.tls.enabled = true;
+
+	sa_client_init(&c, &cfg);
+
+	n = syscalls_per_fetch(&c, "secrets:pass:pass", 50);
+	printf("%.1f syscalls per pooled tls fetch\n", n);
+	assert(n <= 4.0);
+
+	sa_client_destroy(&c);
+	sa_tls_cfg_destroy(&cfg.tls);
+	free(cfg.tls.ca_string);
+}
+
+void test_sa_secret_get_bytes_tls_shared_context()
+{
+	const char* expected = "127.0.0.1";
+
+	const char* capath = "./src/test/test-data/cacert.pem";
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR_TLS;
+	cfg.port = AGENT_PORT_TLS;
+	cfg.timeout = 3000;
+	cfg.tls.ca_string = readCertFile(capath);
+	cfg.tls.enabled = true;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	sa_set_log_function(&mylog);
+
+	const char* path = "secrets:pass:pass";
+	SSL_CTX* ctx = NULL;
+
+	for (int i = 0; i < 2; i++) {
+		size_t result_size = 0;
+		uint8_t* secret;
+		sa_err err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+
+		assert(err.code == SA_OK);
+
+		secret[result_size] = 0;
+		assert(!strcmp(expected, (char*)secret));
+		free(secret);
+
+		// the context built for the first connection is reused
+		assert(cfg.tls.ctx != NULL);
+		assert(ctx == NULL || ctx == cfg.tls.ctx);
+		ctx = cfg.tls.ctx;
+	}
+
+	sa_tls_cfg_destroy(&cfg.tls);
+	assert(cfg.tls.ctx == NULL);
+
+	free(cfg.tls.ca_string);
+}
+
+void test_sa_secret_get_bytes_tls_resumed()
+{
+	const char* expected = "127.0.0.1";
+
+	const char* capath = "./src/test/test-data/cacert.pem";
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR_TLS;
+	cfg.port = AGENT_PORT_TLS;
+	cfg.timeout = 3000;
+	cfg.tls.ca_string = readCertFile(capath);
+	cfg.tls.enabled = true;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	sa_set_log_function(&mylog);
+
+	const char* path = "secrets:pass:pass";
+
+	// without a pool each request makes a new connection
+	for (int i = 0; i < 2; i++) {
+		size_t result_size = 0;
+		uint8_t* secret;
+		sa_err err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+
+		assert(err.code == SA_OK);
+
+		secret[result_size] = 0;
+		assert(!strcmp(expected, (char*)secret));
+		free(secret);
+	}
+
+	sa_tls_stats stats;
+	sa_tls_get_stats(&cfg.tls, &stats);
+
+	// the second handshake resumes the session saved by the first
+	assert(stats.handshakes == 2);
+	assert(stats.resumed == 1);
+
+	sa_tls_cfg_destroy(&cfg.tls);
+	free(cfg.tls.ca_string);
+}
+
+void test_sa_secret_get_bytes_cached()
+{
+	const char* expected = "127.0.0.1";
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR;
+	cfg.port = AGENT_PORT;
+	cfg.timeout = 2000;
+	cfg.cache.ttl = 60000;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	sa_set_log_function(&mylog);
+
+	for (int i = 0; i < 2; i++) {
+		size_t result_size = 0;
+		uint8_t* secret;
+		sa_err err = sa_secret_get_bytes(&c, "secrets:pass:pass", &secret, &result_size);
+
+		assert(err.code == SA_OK);
+
+		secret[result_size] = 0;
+		assert(!strcmp(expected, (char*)secret));
+		free(secret);
+
+		assert(c.cache->n_entries == 1);
+	}
+
+	// errors are not cached
+	size_t result_size = 0;
+	uint8_t* secret;
+	sa_err err = sa_secret_get_bytes(&c, "secrets:pass:fakesecret", &secret, &result_size);
+
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+	assert(c.cache->n_entries == 1);
+
+	sa_client_destroy(&c);
+}
+
+void test_sa_secret_get_prepared()
+{
+	const char* expected = "127.0.0.1";
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR;
+	cfg.port = AGENT_PORT;
+	cfg.timeout = 2000;
+	cfg.pool_size = 1;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	sa_set_log_function(&mylog);
+
+	sa_secret_handle* h;
+	sa_err err = sa_secret_prepare(&c, "secrets:pass:pass", &h);
+	assert(err.code == SA_OK);
+
+	for (int i = 0; i < 3; i++) {
+		size_t result_size = 0;
+		uint8_t* secret;
+		err = sa_secret_get_prepared(h, &secret, &result_size);
+
+		assert(err.code == SA_OK);
+
+		secret[result_size] = 0;
+		assert(!strcmp(expected, (char*)secret));
+		free(secret);
+	}
+
+	sa_secret_handle_destroy(h);
+
+	err = sa_secret_prepare(&c, "secrets:pass:fakesecret", &h);
+	assert(err.code == SA_OK);
+
+	size_t result_size = 0;
+	uint8_t* secret;
+	err = sa_secret_get_prepared(h, &secret, &result_size);
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+
+	sa_secret_handle_destroy(h);
+
+	err = sa_secret_prepare(&c, "secrets:", &h);
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+
+	// the resource and key are escaped in the request json
+	const char* res = "a\"b\\c";
+	const char* key = "k\n\x01";
+	char req[200];
+	uint32_t req_sz = sa_build_secret_request(req, res, (uint32_t)strlen(res), key,
+			(uint32_t)strlen(key));
+	assert(req_sz <= sa_secret_request_max_size((uint32_t)strlen(res), (uint32_t)strlen(key)));
+
+	const char* want = "{\"Resource\":\"a\\\"b\\\\c\",\"SecretKey\":\"k\\u000a\\u0001\"}";
+	assert(req_sz == 8 + strlen(want));
+	assert(ntohl(*(uint32_t*)&req[4]) == strlen(want));
+	assert(memcmp(req + 8, want, strlen(want)) == 0);
+
+	sa_client_destroy(&c);
+}
+
+void test_sa_cache_lru_and_stale()
+{
+	sa_cache_cfg cfg;
+	sa_cache_cfg_init(&cfg);
+	cfg.ttl = 1;
+	cfg.stale_ttl = 60000;
+	cfg.max_entries = 2;
+
+	sa_cache* cache = sa_cache_new(&cfg, NULL);
+
+	sa_cache_put(cache, "r:a", 3, (const uint8_t*)"1", 1);
+	sa_cache_put(cache, "r:b", 3, (const uint8_t*)"2", 1);
+	sa_cache_put(cache, "r:c", 3, (const uint8_t*)"3", 1);
+
+	// least recently used entry was evicted
+	uint8_t* v;
+	size_t size;
+	assert(cache->n_entries == 2);
+	assert(sa_cache_get(cache, "r:a", 3, &v, &size) == SA_CACHE_MISS);
+
+	usleep(5000);
+
+	// only one caller is asked to refresh an expired entry, others get the stale value
+	assert(sa_cache_get(cache, "r:b", 3, &v, &size) == SA_CACHE_REFRESH);
+	assert(size == 1 && v[0] == '2');
+	sa_cache_free_value(cache, v, size);
+
+	assert(sa_cache_get(cache, "r:b", 3, &v, &size) == SA_CACHE_HIT);
+	sa_cache_free_value(cache, v, size);
+
+	// after a failed refresh the next caller retries
+	sa_cache_refresh_failed(cache, "r:b", 3);
+	assert(sa_cache_get(cache, "r:b", 3, &v, &size) == SA_CACHE_REFRESH);
+	sa_cache_free_value(cache, v, size);
+
+	sa_cache_put(cache, "r:b", 3, (const uint8_t*)"4", 1);
+	assert(sa_cache_get(cache, "r:b", 3, &v, &size) == SA_CACHE_HIT);
+	assert(size == 1 && v[0] == '4');
+	sa_cache_free_value(cache, v, size);
+
+	sa_cache_destroy(cache);
+}
+
+void test_sa_secret_get_many()
+{
+	const char* expected = "127.0.0.1";
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR;
+	cfg.port = AGENT_PORT;
+	cfg.timeout = 2000;
+	cfg.pool_size = 1;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	sa_set_log_function(&mylog);
+
+	// more paths than are pipelined at once
+	const size_t n = 40;
+	const char* paths[n];
+	sa_secret_result results[n];
+
+	for (size_t i = 0; i < n; i++) {
+		paths[i] = "secrets:pass:pass";
+	}
+
+	// a missing secret and a bad path only fail their own results
+	paths[3] = "secrets:pass:fakesecret";
+	paths[7] = "secrets:";
+
+	sa_err err = sa_secret_get_many(&c, paths, n, results);
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+
+	for (size_t i = 0; i < n; i++) {
+		if (i == 3 || i == 7) {
+			assert(results[i].err.code == SA_FAILED_BAD_REQUEST);
+			assert(results[i].value == NULL);
+			continue;
+		}
+
+		assert(results[i].err.code == SA_OK);
+
+		results[i].value[results[i].size] = 0;
+		assert(!strcmp(expected, (char*)results[i].value));
+		free(results[i].value);
+	}
+
+	// the whole batch used one connection
+	assert(sa_pool_idle_count(c.endpoints[0].pool) == 1);
+
+	sa_client_destroy(&c);
+}
+
+// drives req to completion the way an external event loop would
+void poll_request(sa_request* req)
+{
+	while (! sa_request_advance(req)) {
+		short events;
+		int fd = sa_request_fd(req, &events);
+		assert(fd >= 0 && events != 0);
+
+		struct pollfd pfd = {
+			.fd = fd,
+			.events = events
+		};
+
+		poll(&pfd, 1, sa_request_timeout(req));
+	}
+
+	short events;
+	assert(sa_request_fd(req, &events) == -1);
+}
+
+void test_sa_request_poll()
+{
+	const char* expected = "127.0.0.1";
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = "localhost"; // resolved off the calling thread
+	cfg.port = AGENT_PORT;
+	cfg.timeout = 2000;
+	cfg.pool_size = 1;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	sa_set_log_function(&mylog);
+
+	for (int i = 0; i < 2; i++) {
+		sa_request* req;
+		sa_err err = sa_request_start(&c, "secrets:pass:pass", &req);
+		assert(err.code == SA_OK);
+
+		poll_request(req);
+
+		uint8_t* secret;
+		size_t result_size = 0;
+		err = sa_request_result(req, &secret, &result_size);
+		assert(err.code == SA_OK);
+
+		secret[result_size] = 0;
+		assert(!strcmp(expected, (char*)secret));
+
+		free(secret);
+		sa_request_destroy(req);
+
+		// the connection was returned to the pool
+		assert(sa_pool_idle_count(c.endpoints[0].pool) == 1);
+	}
+
+	sa_request* req;
+	sa_err err = sa_request_start(&c, "secrets:pass:fakesecret", &req);
+	assert(err.code == SA_OK);
+
+	poll_request(req);
+
+	uint8_t* secret = NULL;
+	size_t result_size = 0;
+	err = sa_request_result(req, &secret, &result_size);
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+	assert(secret == NULL);
+
+	sa_request_destroy(req);
+
+	err = sa_request_start(&c, "secrets:", &req);
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+
+	sa_client_destroy(&c);
+}
+
+void test_sa_request_poll_tls()
+{
+	const char* expected = "127.0.0.1";
+
+	const char* capath = "./src/test/test-data/cacert.pem";
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR_TLS;
+	cfg.port = AGENT_PORT_TLS;
+	cfg.timeout = 3000;
+	cfg.tls.ca_string = readCertFile(capath);
+	cfg.tls.enabled = true;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	sa_set_log_function(&mylog);
+
+	sa_request* req;
+	sa_err err = sa_request_start(&c, "secrets:pass:pass", &req);
+	assert(err.code == SA_OK);
+
+	poll_request(req);
+
+	uint8_t* secret;
+	size_t result_size = 0;
+	err = sa_request_result(req, &secret, &result_size);
+	assert(err.code == SA_OK);
+
+	secret[result_size] = 0;
+	assert(!strcmp(expected, (char*)secret));
+
+	free(secret);
+	sa_request_destroy(req);
+	sa_client_destroy(&c);
+	sa_tls_cfg_destroy(&cfg.tls);
+	free(cfg.tls.ca_string);
+}
+
+// runs on the poll backend when built without io_uring
+void test_sa_secret_get_bytes_io_uring()
+{
+	const char* expected = "127.0.0.1";
+	const char* capath = "./src/test/test-data/cacert.pem";
+
+	for (int tls = 0; tls < 2; tls++) {
+		sa_cfg cfg;
+		sa_cfg_init(&cfg);
+		cfg.addr = tls ? AGENT_ADDR_TLS : AGENT_ADDR;
+		cfg.port = tls ? AGENT_PORT_TLS : AGENT_PORT;
+		cfg.timeout = 3000;
+		cfg.pool_size = 1;
+		cfg.io_uring = true;
+
+		if (tls) {
+			cfg.tls.ca_string = readCertFile(capath);
+			cfg.tls.enabled = true;
+		}
+
+		sa_client c;
+		sa_client_init(&c, &cfg);
+
+		sa_set_log_function(&mylog);
+
+		// a new connection, then the pooled one
+		for (int i = 0; i < 2; i++) {
+			size_t result_size = 0;
+			uint8_t* secret;
+			sa_err err = sa_secret_get_bytes(&c, "secrets:pass:pass", &secret, &result_size);
+			assert(err.code == SA_OK);
+
+			secret[result_size] = 0;
+			assert(!strcmp(expected, (char*)secret));
+			free(secret);
+
+			assert(sa_pool_idle_count(c.endpoints[0].pool) == 1);
+		}
+
+		// the pooled connection still works with the poll backend
+		cfg.io_uring = false;
+
+		size_t result_size = 0;
+		uint8_t* secret;
+		sa_err err = sa_secret_get_bytes(&c, "secrets:pass:pass", &secret, &result_size);
+		assert(err.code == SA_OK);
+		free(secret);
+
+		cfg.io_uring = true;
+
+		err = sa_secret_get_bytes(&c, "secrets:pass:fakesecret", &secret, &result_size);
+		assert(err.code == SA_FAILED_BAD_REQUEST);
+
+		sa_client_destroy(&c);
+
+		if (tls) {
+			sa_tls_cfg_destroy(&cfg.tls);
+			free(cfg.tls.ca_string);
+		}
+	}
+}
+
+// a listener whose full accept queue leaves new connects hanging, returns its port
+int stalled_listener(int* fds, int n_fds)
+{
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t len = sizeof(sa);
+	assert(bind(lfd, (struct sockaddr*)&sa, sizeof(sa)) == 0);
+	assert(listen(lfd, 0) == 0);
+	assert(getsockname(lfd, (struct sockaddr*)&sa, &len) == 0);
+
+	fds[0] = lfd;
+	for (int i = 1; i < n_fds; i++) {
+		fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		connect(fds[i], (struct sockaddr*)&sa, sizeof(sa));
+	}
+
+	return ntohs(sa.sin_port);
+}
+
+void test_sa_connect_race()
+{
+	sa_set_log_function(&mylog);
+
+	int fds[4];
+	char stalled_port[8];
+	snprintf(stalled_port, sizeof(stalled_port), "%d", stalled_listener(fds, 4));
+
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+	struct addrinfo* stalled;
+	struct addrinfo* agent;
+	assert(getaddrinfo("127.0.0.1", stalled_port, &hints, &stalled) == 0);
+	assert(getaddrinfo(AGENT_ADDR, AGENT_PORT, &hints, &agent) == 0);
+
+	// a hanging address no longer holds up the fetch for the whole timeout
+	stalled->ai_next = agent;
+
+	int fd = -1;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	sa_err err = sa_connect_race(stalled, sa_now_ms() + 5000, &fd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	assert(err.code == SA_OK);
+	assert(fd != -1);
+	// the agent was tried after the stalled address's head start
+	assert(elapsed_ms >= 250 && elapsed_ms < 1000);
+	close(fd);
+
+	// the deadline is honoured when nothing answers
+	stalled->ai_next = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	err = sa_connect_race(stalled, sa_now_ms() + 300, &fd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	assert(err.code == SA_FAILED_TIMEOUT);
+	assert(elapsed_ms >= 300 && elapsed_ms < 1000);
+
+	freeaddrinfo(stalled);
+	freeaddrinfo(agent);
+
+	for (int i = 0; i < 4; i++) {
+		close(fds[i]);
+	}
+}
+
+void test_sa_resolver()
+{
+	const char* expected = "127.0.0.1";
+	const char* path = "secrets:pass:pass";
+
+	sa_set_log_function(&mylog);
+
+	// looked up once then reused until dns_ttl expires
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = "localhost";
+	cfg.port = AGENT_PORT;
+	cfg.timeout = 2000;
+	cfg.dns_ttl = 60000;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+	assert(c.resolver != NULL);
+	assert(sa_resolver_get(c.resolver, cfg.addr, cfg.port) == NULL);
+
+	size_t result_size = 0;
+	uint8_t* secret;
+	sa_err err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+	assert(err.code == SA_OK);
+	secret[result_size] = 0;
+	assert(!strcmp(expected, (char*)secret));
+	free(secret);
+
+	sa_addrs* first = sa_resolver_get(c.resolver, cfg.addr, cfg.port);
+	sa_addrs* second = sa_resolver_get(c.resolver, cfg.addr, cfg.port);
+	assert(first != NULL && first == second);
+	sa_addrs_release(first);
+	sa_addrs_release(second);
+
+	sa_client_destroy(&c);
+
+	// pinned addresses are used instead of looking up addr
+	sa_cfg_init(&cfg);
+	cfg.addr = "agent.invalid";
+	cfg.port = AGENT_PORT;
+	cfg.timeout = 2000;
+	cfg.pinned_addrs = "127.0.0.1";
+
+	sa_client_init(&c, &cfg);
+
+	err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+	assert(err.code == SA_OK);
+	secret[result_size] = 0;
+	assert(!strcmp(expected, (char*)secret));
+	free(secret);
+
+	sa_request* req;
+	err = sa_request_start(&c, path, &req);
+	assert(err.code == SA_OK);
+
+	poll_request(req);
+
+	err = sa_request_result(req, &secret, &result_size);
+	assert(err.code == SA_OK);
+	secret[result_size] = 0;
+	assert(!strcmp(expected, (char*)secret));
+	free(secret);
+	sa_request_destroy(req);
+
+	sa_client_destroy(&c);
+
+	// endpoints are each pinned to their own addresses, sa_cfg's are ignored
+	sa_endpoint_cfg pinned[2] = {
+		{ .addr = "agent-a.invalid", .port = AGENT_PORT, .pinned_addrs = "127.0.0.1" },
+		{ .addr = "agent-b.invalid", .port = AGENT_PORT, .pinned_addrs = "127.0.0.2" },
+	};
+
+	sa_cfg_init(&cfg);
+	cfg.addr = "agent.invalid";
+	cfg.port = AGENT_PORT;
+	cfg.timeout = 2000;
+	cfg.pinned_addrs = "127.0.0.3";
+	cfg.endpoints = pinned;
+	cfg.n_endpoints = 2;
+
+	sa_client_init(&c, &cfg);
+
+	assert(sa_resolver_get(c.resolver, cfg.addr, cfg.port) == NULL);
+
+	for (int i = 0; i < 2; i++) {
+		sa_addrs* addrs = sa_resolver_get(c.resolver, pinned[i].addr, pinned[i].port);
+		assert(addrs != NULL && addrs->ai->ai_family == AF_INET);
+		struct sockaddr_in* sin = (struct sockaddr_in*)addrs->ai->ai_addr;
+		assert(sin->sin_addr.s_addr == inet_addr(pinned[i].pinned_addrs));
+		sa_addrs_release(addrs);
+	}
+
+	for (int i = 0; i < 4; i++) {
+		err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+		assert(err.code == SA_OK);
+		secret[result_size] = 0;
+		assert(!strcmp(expected, (char*)secret));
+		free(secret);
+	}
+
+	sa_client_destroy(&c);
+}
+
+typedef struct unix_agent_s {
+	int lfd;
+	const char* json; // response to every request
+	int delay_ms; // before each response
+} unix_agent_cfg;
+
+uint32_t unix_agent_requests; // answered by every unix_agent, counted before the answer is sent
+
+// answers every request on a listening unix socket with the same response
+void* unix_agent(void* udata)
+{
+	unix_agent_cfg* cfg = (unix_agent_cfg*)udata;
+	int lfd = cfg->lfd;
+	const char* json = cfg->json;
+	uint32_t json_sz = (uint32_t)strlen(json);
+	int delay_ms = cfg->delay_ms;
+	free(cfg);
+
+	char resp_header[8];
+	*(uint32_t*)&resp_header[0] = htonl(0x51dec1cc);
+	*(uint32_t*)&resp_header[4] = htonl(json_sz);
+
+	int fd;
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		char header[8];
+		char body[1024];
+
+		while (recv(fd, header, 8, MSG_WAITALL) == 8) {
+			uint32_t sz = ntohl(*(uint32_t*)&header[4]);
+			if (sz > sizeof(body) || recv(fd, body, sz, MSG_WAITALL) != (ssize_t)sz) {
+				break;
+			}
+
+			if (delay_ms != 0) {
+				usleep(delay_ms * 1000);
+
+				// a request given up on while waiting would be counted in a later test
+				char peek;
+				if (recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+					break;
+				}
+			}
+
+			__atomic_add_fetch(&unix_agent_requests, 1, __ATOMIC_RELAXED);
+
+			send(fd, resp_header, 8, MSG_NOSIGNAL);
+			send(fd, json, json_sz, MSG_NOSIGNAL);
+		}
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * listens on the unix socket at path, an abstract socket if it starts with @,
+ * answering with json or, if it is NULL, like the agent would for pass:pass,
+ * delay_ms after each request
+*/
+int unix_listener(const char* path, const char* json, int delay_ms)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	size_t len = strlen(path);
+	memcpy(sun.sun_path, path, len);
+	socklen_t sun_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+
+	if (path[0] == '@') {
+		sun.sun_path[0] = '\0';
+		sun_len--;
+	}
+	else {
+		unlink(path);
+	}
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(lfd >= 0);
+	assert(bind(lfd, (struct sockaddr*)&sun, sun_len) == 0);
+	assert(listen(lfd, 16) == 0);
+
+	unix_agent_cfg* cfg = (unix_agent_cfg*) malloc(sizeof(unix_agent_cfg));
+	cfg->lfd = lfd;
+	cfg->json = json != NULL ? json : "{\"SecretValue\":\"MTI3LjAuMC4x\"}";
+	cfg->delay_ms = delay_ms;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, unix_agent, cfg);
+	pthread_detach(thread);
+
+	return lfd;
+}
+
+void test_sa_secret_get_bytes_unix()
+{
+	const char* expected = "127.0.0.1";
+	const char* path = "secrets:pass:pass";
+
+	sa_set_log_function(&mylog);
+
+	char abstract_addr[64];
+	snprintf(abstract_addr, sizeof(abstract_addr), "unix:@sa-test-%d", (int)getpid());
+	char file_addr[64];
+	snprintf(file_addr, sizeof(file_addr), "unix:./sa-test-%d.sock", (int)getpid());
+
+	int lfds[2];
+	lfds[0] = unix_listener(abstract_addr + strlen("unix:"), NULL, 0);
+	lfds[1] = unix_listener(file_addr + strlen("unix:"), NULL, 0);
+
+	char* addrs[2] = { abstract_addr, file_addr };
+
+	for (int i = 0; i < 2; i++) {
+		sa_cfg cfg;
+		sa_cfg_init(&cfg);
+		cfg.addr = addrs[i];
+		cfg.timeout = 2000;
+		cfg.peer_uid = (int)getuid();
+		cfg.tls.enabled = true; // never used for unix sockets
+
+		sa_client c;
+		sa_client_init(&c, &cfg);
+
+		size_t result_size = 0;
+		uint8_t* secret;
+		sa_err err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+		assert(err.code == SA_OK);
+		secret[result_size] = 0;
+		assert(!strcmp(expected, (char*)secret));
+		free(secret);
+
+		sa_request* req;
+		err = sa_request_start(&c, path, &req);
+		assert(err.code == SA_OK);
+
+		poll_request(req);
+
+		err = sa_request_result(req, &secret, &result_size);
+		assert(err.code == SA_OK);
+		secret[result_size] = 0;
+		assert(!strcmp(expected, (char*)secret));
+		free(secret);
+		sa_request_destroy(req);
+
+		// an agent running as another user is refused
+		cfg.peer_uid = (int)getuid() + 1;
+		err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+		assert(err.code == SA_FAILED_INTERNAL);
+
+		sa_client_destroy(&c);
+	}
+
+	shutdown(lfds[0], SHUT_RDWR);
+	shutdown(lfds[1], SHUT_RDWR);
+	unlink(file_addr + strlen("unix:"));
+}
+
+void test_sa_secret_get_bytes_hedged()
+{
+	const char* expected = "127.0.0.1";
+	const char* paths[2] = { "secrets:pass:pass", "secrets:pass:other" };
+
+	sa_set_log_function(&mylog);
+
+	char dead_addr[64];
+	snprintf(dead_addr, sizeof(dead_addr), "unix:@sa-test-dead-%d", (int)getpid());
+	char slow_addr[64];
+	snprintf(slow_addr, sizeof(slow_addr), "unix:@sa-test-slow-%d", (int)getpid());
+	char fast_addr[64];
+	snprintf(fast_addr, sizeof(fast_addr), "unix:@sa-test-fast-%d", (int)getpid());
+
+	int lfds[2];
+	lfds[0] = unix_listener(slow_addr + strlen("unix:"), NULL, 300);
+	lfds[1] = unix_listener(fast_addr + strlen("unix:"), NULL, 0);
+
+	// an agent that can't be reached is skipped for the next
+	sa_endpoint_cfg failover[2] = { { .addr = dead_addr }, { .addr = fast_addr } };
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.endpoints = failover;
+	cfg.n_endpoints = 2;
+	cfg.timeout = 2000;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	uint8_t* secret;
+	size_t result_size = 0;
+	sa_err err = sa_secret_get_bytes(&c, paths[0], &secret, &result_size);
+	assert(err.code == SA_OK);
+	secret[result_size] = 0;
+	assert(!strcmp(expected, (char*)secret));
+	free(secret);
+
+	sa_secret_result results[2];
+	err = sa_secret_get_many(&c, paths, 2, results);
+	assert(err.code == SA_OK);
+	for (int i = 0; i < 2; i++) {
+		results[i].value[results[i].size] = 0;
+		assert(!strcmp(expected, (char*)results[i].value));
+		free(results[i].value);
+	}
+
+	sa_client_destroy(&c);
+
+	// a slow agent is hedged to the next, and a dead one replaced at once
+	sa_endpoint_cfg hedged[3][2] = {
+		{ { .addr = slow_addr }, { .addr = fast_addr } },
+		{ { .addr = dead_addr }, { .addr = fast_addr } },
+		{ { .addr = fast_addr }, { .addr = slow_addr } }
+	};
+
+	for (int i = 0; i < 3; i++) {
+		cfg.endpoints = hedged[i];
+		cfg.hedge_percentile = 99;
+		cfg.hedge_min_delay = 20;
+		cfg.pool_size = 1;
+
+		sa_client_init(&c, &cfg);
+		assert(c.hedge != NULL);
+
+		for (int j = 0; j < 5; j++) {
+			uint64_t start = sa_now_ms();
+			err = sa_secret_get_bytes(&c, paths[0], &secret, &result_size);
+			uint64_t elapsed_ms = sa_now_ms() - start;
+
+			assert(err.code == SA_OK);
+			assert(elapsed_ms < 200);
+			secret[result_size] = 0;
+			assert(!strcmp(expected, (char*)secret));
+			free(secret);
+		}
+
+		sa_client_destroy(&c);
+	}
+
+	// the delay follows the percentile of recent fetches, above the minimum
+	sa_hedge* hedge = sa_hedge_new(50, 5);
+	assert(sa_hedge_delay_ms(hedge) == 5);
+
+	for (uint64_t ms = 1; ms <= 100; ms++) {
+		sa_hedge_record(hedge, ms * 1000);
+	}
+
+	// recomputed after 96 samples
+	assert(sa_hedge_delay_ms(hedge) == 48);
+	sa_hedge_destroy(hedge);
+
+	hedge = sa_hedge_new(50, 5);
+	for (int i = 0; i < SA_HEDGE_WINDOW; i++) {
+		sa_hedge_record(hedge, 100);
+	}
+	assert(sa_hedge_delay_ms(hedge) == 5);
+	sa_hedge_destroy(hedge);
+
+	shutdown(lfds[0], SHUT_RDWR);
+	shutdown(lfds[1], SHUT_RDWR);
+}
+
+void test_sa_endpoint_balance()
+{
+	const char* expected = "127.0.0.1";
+	const char* path = "secrets:pass:pass";
+
+	sa_set_log_function(&mylog);
+
+	// a failing endpoint is ejected, then probed by a single request
+	sa_endpoint eps[2];
+	sa_endpoint_init(&eps[0], "failing", AGENT_PORT);
+	sa_endpoint_init(&eps[1], "healthy", AGENT_PORT);
+	uint64_t picks = 0;
+
+	for (int i = 0; i < SA_EJECT_FAILURES; i++) {
+		sa_endpoint* ep = sa_endpoint_pick(eps, 2, 2, &picks);
+		assert(ep == &eps[0]);
+		sa_endpoint_done(ep, 100, SA_FAILED_INTERNAL);
+	}
+
+	uint64_t now = sa_now_ms();
+	assert(eps[0].ejected_until_ms >= now + SA_EJECT_BASE_MS - 10);
+	assert(eps[0].ejected_until_ms <= now + SA_EJECT_BASE_MS);
+
+	for (int i = 0; i < 20; i++) {
+		sa_endpoint* ep = sa_endpoint_pick(eps, 2, 0, &picks);
+		assert(ep == &eps[1]);
+		sa_endpoint_done(ep, 100, SA_OK);
+	}
+
+	// once the ejection expires a single probe is let through
+	eps[0].ejected_until_ms = sa_now_ms() - 1;
+	sa_endpoint* probe = sa_endpoint_pick(eps, 2, 2, &picks);
+	assert(probe == &eps[0] && eps[0].probing);
+	assert(sa_endpoint_pick(eps, 2, 0, &picks) == &eps[1]);
+	sa_endpoint_done(&eps[1], 100, SA_OK);
+
+	// a failed probe doubles the ejection
+	sa_endpoint_done(probe, 100, SA_FAILED_TIMEOUT);
+	now = sa_now_ms();
+	assert(eps[0].ejected_until_ms >= now + 2 * SA_EJECT_BASE_MS - 10);
+	assert(! eps[0].probing);
+
+	// if everything left is ejected the first to recover is used anyway
+	probe = sa_endpoint_pick(eps, 2, 2, &picks);
+	assert(probe == &eps[0]);
+
+	// and recovers it if it answers
+	sa_endpoint_done(probe, 100, SA_FAILED_BAD_REQUEST);
+	assert(eps[0].ejected_until_ms == 0 && eps[0].ejections == 0);
+	assert(eps[0].in_flight == 0 && eps[1].in_flight == 0);
+
+	sa_endpoint_destroy(&eps[0]);
+	sa_endpoint_destroy(&eps[1]);
+
+	// fetches are routed around an agent that stopped answering
+	char hung_addr[64];
+	snprintf(hung_addr, sizeof(hung_addr), "unix:@sa-test-hung-%d", (int)getpid());
+	char fast_addr[64];
+	snprintf(fast_addr, sizeof(fast_addr), "unix:@sa-test-up-%d", (int)getpid());
+
+	int lfds[2];
+	lfds[0] = unix_listener(hung_addr + strlen("unix:"), NULL, 10000);
+	lfds[1] = unix_listener(fast_addr + strlen("unix:"), NULL, 0);
+
+	sa_endpoint_cfg endpoints[2] = { { .addr = hung_addr }, { .addr = fast_addr } };
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.endpoints = endpoints;
+	cfg.n_endpoints = 2;
+	cfg.timeout = 200;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	int failed = 0;
+	uint64_t start = sa_now_ms();
+
+	for (int i = 0; i < 30; i++) {
+		uint8_t* secret;
+		size_t result_size = 0;
+		sa_err err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+
+		if (err.code != SA_OK) {
+			assert(err.code == SA_FAILED_TIMEOUT);
+			failed++;
+			continue;
+		}
+
+		secret[result_size] = 0;
+		assert(!strcmp(expected, (char*)secret));
+		free(secret);
+	}
+
+	assert(failed < SA_EJECT_FAILURES);
+	assert(sa_now_ms() - start < 1000);
+
+	sa_client_destroy(&c);
+
+	shutdown(lfds[0], SHUT_RDWR);
+	shutdown(lfds[1], SHUT_RDWR);
+}
+
+typedef struct coalesce_caller_s {
+	sa_client* c;
+	pthread_barrier_t* start;
+	sa_err err;
+	char secret[16];
+} coalesce_caller;
+
+void* coalesce_fetch(void* udata)
+{
+	coalesce_caller* caller = (coalesce_caller*)udata;
+	pthread_barrier_wait(caller->start);
+
+	uint8_t* secret;
+	size_t result_size = 0;
+	caller->err = sa_secret_get_bytes(caller->c, "secrets:pass:pass", &secret, &result_size);
+
+	if (caller->err.code == SA_OK) {
+		assert(result_size < sizeof(caller->secret));
+		memcpy(caller->secret, secret, result_size);
+		caller->secret[result_size] = 0;
+		free(secret);
+	}
+
+	return NULL;
+}
+
+void test_sa_secret_get_bytes_coalesced()
+{
+	const char* expected = "127.0.0.1";
+
+	sa_set_log_function(&mylog);
+
+	char addr[64];
+	snprintf(addr, sizeof(addr), "unix:@sa-test-coalesce-%d", (int)getpid());
+	int lfd = unix_listener(addr + strlen("unix:"), NULL, 200);
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = addr;
+	cfg.timeout = 2000;
+	cfg.coalesce = true;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	// callers of the same secret while it is being fetched share one request
+	enum { N_CALLERS = 8 };
+	coalesce_caller callers[N_CALLERS];
+	pthread_t threads[N_CALLERS];
+	pthread_barrier_t start;
+	pthread_barrier_init(&start, NULL, N_CALLERS);
+
+	uint32_t requests = __atomic_load_n(&unix_agent_requests, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < N_CALLERS; i++) {
+		callers[i].c = &c;
+		callers[i].start = &start;
+		pthread_create(&threads[i], NULL, coalesce_fetch, &callers[i]);
+	}
+
+	for (int i = 0; i < N_CALLERS; i++) {
+		pthread_join(threads[i], NULL);
+		assert(callers[i].err.code == SA_OK);
+		assert(!strcmp(expected, callers[i].secret));
+	}
+
+	pthread_barrier_destroy(&start);
+
+	assert(__atomic_load_n(&unix_agent_requests, __ATOMIC_RELAXED) == requests + 1);
+
+	sa_coalesce_stats stats;
+	sa_client_get_coalesce_stats(&c, &stats);
+	assert(stats.fetches == 1 && stats.coalesced == N_CALLERS - 1);
+
+	// a waiter gives up at its own deadline, not the first caller's
+	coalesce_caller leader = { .c = &c, .start = &start };
+	pthread_barrier_init(&start, NULL, 1);
+	pthread_create(&threads[0], NULL, coalesce_fetch, &leader);
+
+	while (true) {
+		sa_client_get_coalesce_stats(&c, &stats);
+		if (stats.fetches == 2) {
+			break;
+		}
+
+		usleep(1000);
+	}
+
+	uint8_t* secret;
+	size_t result_size = 0;
+	sa_err err = sa_secret_get_bytes_by(&c, "secrets:pass:pass", sa_now_ms() + 50, &secret,
+			&result_size);
+	assert(err.code == SA_FAILED_TIMEOUT);
+
+	pthread_join(threads[0], NULL);
+	pthread_barrier_destroy(&start);
+	assert(leader.err.code == SA_OK);
+	assert(!strcmp(expected, leader.secret));
+
+	sa_client_get_coalesce_stats(&c, &stats);
+	assert(stats.fetches == 2 && stats.coalesced == N_CALLERS);
+
+	sa_client_destroy(&c);
+
+	shutdown(lfd, SHUT_RDWR);
+}
+
+void test_sa_client_prefetch()
+{
+	const char* expected = "127.0.0.1";
+
+	sa_set_log_function(&mylog);
+
+	// an agent answering 8 connections at once, 100ms after each request
+	char addr[64];
+	snprintf(addr, sizeof(addr), "unix:@sa-test-prefetch-%d", (int)getpid());
+	int lfd = unix_listener(addr + strlen("unix:"), NULL, 100);
+
+	for (int i = 1; i < 8; i++) {
+		unix_agent_cfg* agent = (unix_agent_cfg*) malloc(sizeof(unix_agent_cfg));
+		agent->lfd = lfd;
+		agent->json = "{\"SecretValue\":\"MTI3LjAuMC4x\"}";
+		agent->delay_ms = 100;
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, unix_agent, agent);
+		pthread_detach(thread);
+	}
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = addr;
+	cfg.timeout = 2000;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	enum { N_PATHS = 33 };
+	const char* paths[N_PATHS];
+	for (int i = 0; i < N_PATHS; i++) {
+		paths[i] = "secrets:pass:pass";
+	}
+	paths[7] = "secrets:";
+
+	sa_secret_result results[N_PATHS];
+	uint64_t elapsed_us = 0;
+
+	// 32 fetches 8 at a time take 4 round trips, not 32
+	sa_err err = sa_client_prefetch(&c, paths, N_PATHS, 8, results, &elapsed_us);
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+	assert(elapsed_us >= 400000 && elapsed_us < 1500000);
+
+	for (int i = 0; i < N_PATHS; i++) {
+		if (i == 7) {
+			assert(results[i].err.code == SA_FAILED_BAD_REQUEST);
+			assert(results[i].value == NULL);
+			continue;
+		}
+
+		assert(results[i].err.code == SA_OK);
+		results[i].value[results[i].size] = 0;
+		assert(!strcmp(expected, (char*)results[i].value));
+		free(results[i].value);
+	}
+
+	err = sa_client_prefetch(&c, paths, 0, 8, results, &elapsed_us);
+	assert(err.code == SA_OK);
+
+	sa_client_destroy(&c);
+
+	shutdown(lfd, SHUT_RDWR);
+
+	// and over TLS, with the default concurrency
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR_TLS;
+	cfg.port = AGENT_PORT_TLS;
+	cfg.timeout = 3000;
+	cfg.tls.ca_string = readCertFile("./src/test/test-data/cacert.pem");
+	cfg.tls.enabled = true;
+
+	sa_client_init(&c, &cfg);
+
+	err = sa_client_prefetch(&c, paths + 8, 20, 0, results, NULL);
+	assert(err.code == SA_OK);
+
+	for (int i = 0; i < 20; i++) {
+		results[i].value[results[i].size] = 0;
+		assert(!strcmp(expected, (char*)results[i].value));
+		free(results[i].value);
+	}
+
+	sa_client_destroy(&c);
+	sa_tls_cfg_destroy(&cfg.tls);
+	free(cfg.tls.ca_string);
+}
+
+typedef struct config_stream_s {
+	char text[512];
+	size_t len;
+	int n_secrets;
+} config_stream;
+
+void config_write(void* udata, const uint8_t* data, size_t size, bool secret)
+{
+	config_stream* stream = (config_stream*)udata;
+
+	assert(stream->len + size < sizeof(stream->text));
+	memcpy(stream->text + stream->len, data, size);
+	stream->len += size;
+	stream->n_secrets += secret;
+}
+
+void test_sa_config_scan()
+{
+	const char* text =
+			"a: secrets:r1:k1\n"
+			"b: \"secrets:r2:k1\", c: secrets:r1:k1 d: mysecrets:r1:k9\n"
+			"e: secrets:\n"
+			"f: secrets:r1:k0:\n"
+			"g: secrets:k3";
+	const char* substituted =
+			"a: 127.0.0.1\n"
+			"b: \"127.0.0.1\", c: 127.0.0.1 d: mysecrets:r1:k9\n"
+			"e: secrets:\n"
+			"f: 127.0.0.1:\n"
+			"g: 127.0.0.1";
+
+	sa_set_log_function(&mylog);
+
+	// references are found in text order, and each secret once grouped by resource
+	sa_config_refs refs;
+	sa_err err = sa_config_scan(text, strlen(text), &refs);
+	assert(err.code == SA_OK);
+	assert(refs.n_refs == 5 && refs.n_secrets == 4);
+
+	const char* secrets[4] = { "secrets:k3", "secrets:r1:k0", "secrets:r1:k1", "secrets:r2:k1" };
+	size_t n_refs[4] = { 1, 1, 2, 1 };
+
+	for (int i = 0; i < 4; i++) {
+		assert(!strcmp(secrets[i], refs.secrets[i].path));
+		assert(refs.secrets[i].n_refs == n_refs[i]);
+	}
+
+	assert(refs.refs[0].secret == 2 && refs.refs[0].offset == 3 && refs.refs[0].len == 13);
+	assert(refs.refs[2].secret == 2);
+	assert(refs.refs[4].secret == 0);
+
+	char addr[64];
+	snprintf(addr, sizeof(addr), "unix:@sa-test-config-%d", (int)getpid());
+	int lfd = unix_listener(addr + strlen("unix:"), NULL, 0);
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = addr;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	// nothing is written until the secrets are fetched, then each is fetched once
+	config_stream stream = { .len = 0, .n_secrets = 0 };
+	err = sa_config_write(&refs, text, strlen(text), config_write, &stream);
+	assert(err.code != SA_OK && stream.len == 0);
+
+	uint32_t requests = __atomic_load_n(&unix_agent_requests, __ATOMIC_RELAXED);
+
+	err = sa_config_fetch(&c, &refs);
+	assert(err.code == SA_OK);
+	assert(__atomic_load_n(&unix_agent_requests, __ATOMIC_RELAXED) == requests + 4);
+
+	err = sa_config_write(&refs, text, strlen(text), config_write, &stream);
+	assert(err.code == SA_OK);
+	assert(stream.len == strlen(substituted) && stream.n_secrets == 5);
+	assert(!memcmp(substituted, stream.text, stream.len));
+
+	sa_config_refs_destroy(&refs);
+
+	uint8_t* out;
+	size_t out_len = 0;
+	err = sa_config_substitute(&c, text, strlen(text), &out, &out_len);
+	assert(err.code == SA_OK);
+	assert(out_len == strlen(substituted));
+	assert(!strcmp(substituted, (char*)out));
+	free(out);
+
+	// text without references is copied as is
+	err = sa_config_substitute(&c, "secrets", 7, &out, &out_len);
+	assert(err.code == SA_OK);
+	assert(out_len == 7 && !strcmp("secrets", (char*)out));
+	free(out);
+
+	sa_client_destroy(&c);
+
+	shutdown(lfd, SHUT_RDWR);
+}
+
+void test_sa_client_stats()
+{
+	const char* path = "secrets:pass:pass";
+	const char* paths[2] = { path, "secrets:pass:other" };
+
+	sa_set_log_function(&mylog);
+
+	// durations are bucketed to within 12.5%
+	static sa_histogram h;
+	for (uint64_t ns = 1000; ns <= 1000000; ns += 1000) {
+		sa_histogram_record(&h, ns);
+	}
+
+	assert(h.count == 1000 && h.max_ns == 1000000);
+	assert(sa_histogram_percentile(&h, 50) >= 500000 && sa_histogram_percentile(&h, 50) <= 562500);
+	assert(sa_histogram_percentile(&h, 99) >= 990000 && sa_histogram_percentile(&h, 100) == 1000000);
+
+	char addr[64];
+	snprintf(addr, sizeof(addr), "unix:@sa-test-stats-%d", (int)getpid());
+	int lfd = unix_listener(addr + strlen("unix:"), NULL, 2);
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = addr;
+	cfg.pool_size = 1;
+
+	// a client not keeping stats reports none
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	uint8_t* secret;
+	size_t size = 0;
+	sa_err err = sa_secret_get_bytes(&c, path, &secret, &size);
+	assert(err.code == SA_OK);
+	free(secret);
+
+	sa_stats stats;
+	sa_client_get_stats(&c, &stats, false);
+	assert(stats.fetches == 0 && stats.phases[SA_PHASE_REQUEST].count == 0);
+
+	sa_client_destroy(&c);
+
+	cfg.stats = true;
+	sa_client_init(&c, &cfg);
+
+	for (int i = 0; i < 3; i++) {
+		err = sa_secret_get_bytes(&c, path, &secret, &size);
+		assert(err.code == SA_OK);
+		free(secret);
+	}
+
+	uint8_t buf[2];
+	err = sa_secret_get_into(&c, path, buf, sizeof(buf), &size);
+	assert(err.code == SA_FAILED_BUFFER_TOO_SMALL);
+
+	// one at a time, the agent serves a connection at a time
+	sa_secret_result results[2];
+	err = sa_client_prefetch(&c, paths, 2, 1, results, NULL);
+	assert(err.code == SA_OK);
+	free(results[0].value);
+	free(results[1].value);
+
+	sa_client_get_stats(&c, &stats, false);
+	assert(stats.fetches == 6 && stats.cache_hits == 0);
+	assert(stats.errors[SA_OK] == 5 && stats.errors[SA_FAILED_BUFFER_TOO_SMALL] == 1);
+	assert(stats.reused >= 2);
+	assert(stats.bytes_sent > 0 && stats.bytes_received >= 6 * 8);
+
+	// every request went through each phase of the exchange, connecting only when none was pooled
+	const sa_histogram* req = &stats.phases[SA_PHASE_REQUEST];
+	assert(req->count == 6);
+	assert(stats.phases[SA_PHASE_SEND].count == 6);
+	assert(stats.phases[SA_PHASE_FIRST_BYTE].count == 6);
+	assert(stats.phases[SA_PHASE_BODY].count >= 5);
+	assert(stats.phases[SA_PHASE_CONNECT].count >= 1 && stats.phases[SA_PHASE_CONNECT].count <= 6 - stats.reused);
+	assert(stats.phases[SA_PHASE_TLS_HANDSHAKE].count == 0);
+
+	// each waited out the agent's delay
+	assert(req->sum_ns >= 6 * 2000000);
+	assert(sa_histogram_percentile(req, 50) >= 2000000);
+	assert(sa_histogram_percentile(req, 50) <= sa_histogram_percentile(req, 99));
+	assert(sa_histogram_percentile(req, 99) <= req->max_ns);
+
+	// a reset snapshot has the counts, the next starts over
+	sa_stats snap;
+	sa_client_get_stats(&c, &snap, true);
+	assert(snap.fetches == 6 && snap.phases[SA_PHASE_REQUEST].count == 6);
+
+	sa_client_get_stats(&c, &snap, false);
+	assert(snap.fetches == 0 && snap.bytes_received == 0 && snap.phases[SA_PHASE_REQUEST].count == 0);
+
+	sa_client_destroy(&c);
+
+	shutdown(lfd, SHUT_RDWR);
+}
+
+typedef struct trace_log_s {
+	sa_trace_event events[256];
+	bool ends[256]; // whether each event was passed to the end hook
+	uint32_t n;
+} trace_log;
+
+void trace_event(trace_log* log, const sa_trace_event* event, bool end)
+{
+	assert(log->n < 256);
+	log->events[log->n] = *event;
+	log->ends[log->n++] = end;
+}
+
+void trace_start(void* udata, const sa_trace_event* event)
+{
+	trace_event((trace_log*)udata, event, false);
+}
+
+void trace_end(void* udata, const sa_trace_event* event)
+{
+	trace_event((trace_log*)udata, event, true);
+}
+
+// the index of the end of the phase of request id, from index from, -1 if there is none
+int trace_find_end(const trace_log* log, uint32_t from, uint64_t id, sa_phase phase)
+{
+	for (uint32_t i = from; i < log->n; i++) {
+		if (log->ends[i] && log->events[i].request_id == id && log->events[i].phase == phase) {
+			return (int)i;
+		}
+	}
+
+	return -1;
+}
+
+// checks every phase traced ends, in time order, with the bytes it moved
+void trace_check(const trace_log* log)
+{
+	for (uint32_t i = 0; i < log->n; i++) {
+		const sa_trace_event* ev = &log->events[i];
+
+		assert(ev->request_id != 0);
+		assert(i == 0 || ev->time_ns >= log->events[i - 1].time_ns);
+
+		if (! log->ends[i]) {
+			assert(trace_find_end(log, i + 1, ev->request_id, ev->phase) > 0);
+			continue;
+		}
+
+		if (ev->phase == SA_PHASE_SEND || ev->phase == SA_PHASE_BODY) {
+			assert(ev->bytes > 0);
+		}
+		else if (ev->phase == SA_PHASE_FIRST_BYTE) {
+			assert(ev->bytes == 8);
+		}
+	}
+}
+
+void test_sa_client_trace()
+{
+	const char* path = "secrets:pass:pass";
+
+	sa_set_log_function(&mylog);
+
+	char addr[64];
+	snprintf(addr, sizeof(addr), "unix:@sa-test-trace-%d", (int)getpid());
+	int lfd = unix_listener(addr + strlen("unix:"), NULL, 0);
+
+	static trace_log log;
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = addr;
+	cfg.pool_size = 1;
+	cfg.trace.start = trace_start;
+	cfg.trace.end = trace_end;
+	cfg.trace.udata = &log;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	uint8_t* secret;
+	size_t size = 0;
+
+	for (int i = 0; i < 2; i++) {
+		sa_err err = sa_secret_get_bytes(&c, path, &secret, &size);
+		assert(err.code == SA_OK);
+		free(secret);
+	}
+
+	// and once through the non-blocking requests
+	sa_secret_result result;
+	sa_err err = sa_client_prefetch(&c, &path, 1, 0, &result, NULL);
+	assert(err.code == SA_OK);
+	free(result.value);
+
+	trace_check(&log);
+
+	// each fetch is a request with its own id, which it starts and ends
+	uint64_t ids[3];
+	uint32_t n_ids = 0;
+
+	for (uint32_t i = 0; i < log.n; i++) {
+		if (log.events[i].phase == SA_PHASE_REQUEST && ! log.ends[i]) {
+			assert(n_ids < 3);
+			ids[n_ids++] = log.events[i].request_id;
+		}
+	}
+
+	assert(n_ids == 3 && ids[0] != ids[1] && ids[1] != ids[2]);
+
+	uint32_t json_sz = (uint32_t)strlen("{\"SecretValue\":\"MTI3LjAuMC4x\"}");
+
+	for (uint32_t r = 0; r < 3; r++) {
+		assert(trace_find_end(&log, 0, ids[r], SA_PHASE_REQUEST) > 0);
+		assert(trace_find_end(&log, 0, ids[r], SA_PHASE_SEND) > 0);
+		assert(trace_find_end(&log, 0, ids[r], SA_PHASE_FIRST_BYTE) > 0);
+
+		int body = trace_find_end(&log, 0, ids[r], SA_PHASE_BODY);
+		assert(body > 0 && log.events[body].bytes == json_sz);
+
+		// only the first connects, the others use the pooled connection
+		assert((trace_find_end(&log, 0, ids[r], SA_PHASE_RESOLVE) > 0) == (r == 0));
+		assert((trace_find_end(&log, 0, ids[r], SA_PHASE_CONNECT) > 0) == (r == 0));
+	}
+
+	sa_client_destroy(&c);
+
+	// the end hook alone is enough
+	log.n = 0;
+	cfg.trace.start = NULL;
+	sa_client_init(&c, &cfg);
+
+	err = sa_secret_get_bytes(&c, path, &secret, &size);
+	assert(err.code == SA_OK);
+	free(secret);
+
+	assert(log.n > 0);
+	for (uint32_t i = 0; i < log.n; i++) {
+		assert(log.ends[i]);
+	}
+
+	sa_client_destroy(&c);
+
+	shutdown(lfd, SHUT_RDWR);
+
+	// the second tls handshake resumes the first's session
+	log.n = 0;
+
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR_TLS;
+	cfg.port = AGENT_PORT_TLS;
+	cfg.timeout = 3000;
+	cfg.tls.ca_string = readCertFile("./src/test/test-data/cacert.pem");
+	cfg.tls.enabled = true;
+	cfg.trace.start = trace_start;
+	cfg.trace.end = trace_end;
+	cfg.trace.udata = &log;
+
+	sa_client_init(&c, &cfg);
+
+	for (int i = 0; i < 2; i++) {
+		err = sa_secret_get_bytes(&c, path, &secret, &size);
+		assert(err.code == SA_OK);
+		free(secret);
+	}
+
+	trace_check(&log);
+
+	uint32_t handshakes = 0;
+
+	for (uint32_t i = 0; i < log.n; i++) {
+		if (log.ends[i] && log.events[i].phase == SA_PHASE_TLS_HANDSHAKE) {
+			assert(log.events[i].resumed == (handshakes == 1));
+			handshakes++;
+		}
+	}
+
+	assert(handshakes == 2);
+
+	sa_client_destroy(&c);
+	sa_tls_cfg_destroy(&cfg.tls);
+	free(cfg.tls.ca_string);
+}
+
+// answers one request on lfd a byte every 50ms, as an agent that is alive but too slow would
+void* drip_agent(void* udata)
+{
+	int lfd = (int)(intptr_t)udata;
+	const char* json = "{\"SecretValue\":\"MTI3LjAuMC4xMTI3LjAuMC4xMTI3LjAuMC4xMTI3LjAuMC4x\"}";
+	uint32_t json_sz = (uint32_t)strlen(json);
+
+	char resp_header[8];
+	*(uint32_t*)&resp_header[0] = htonl(0x51dec1cc);
+	*(uint32_t*)&resp_header[4] = htonl(json_sz);
+
+	int fd;
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		char header[8];
+		char body[1024];
+
+		if (recv(fd, header, 8, MSG_WAITALL) == 8) {
+			uint32_t sz = ntohl(*(uint32_t*)&header[4]);
+			if (sz <= sizeof(body) && recv(fd, body, sz, MSG_WAITALL) == (ssize_t)sz) {
+				send(fd, resp_header, 8, MSG_NOSIGNAL);
+
+				for (uint32_t i = 0; i < json_sz; i++) {
+					if (send(fd, json + i, 1, MSG_NOSIGNAL) != 1) {
+						break;
+					}
+					usleep(50 * 1000);
+				}
+			}
+		}
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+void test_sa_secret_get_bytes_deadline()
+{
+	const char* path = "secrets:pass:pass";
+
+	sa_set_log_function(&mylog);
+
+	char addr[64];
+	snprintf(addr, sizeof(addr), "unix:@sa-test-drip-%d", (int)getpid());
+
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	size_t len = strlen(addr + strlen("unix:"));
+	memcpy(sun.sun_path, addr + strlen("unix:"), len);
+	sun.sun_path[0] = '\0';
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(lfd >= 0);
+	assert(bind(lfd, (struct sockaddr*)&sun, offsetof(struct sockaddr_un, sun_path) + len) == 0);
+	assert(listen(lfd, 16) == 0);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, drip_agent, (void*)(intptr_t)lfd);
+	pthread_detach(thread);
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = addr;
+	cfg.timeout = 300;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	// each byte arrives well within the timeout but the whole response does not
+	uint8_t* secret;
+	size_t result_size = 0;
+	uint64_t start = sa_now_ms();
+	sa_err err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+	uint64_t elapsed_ms = sa_now_ms() - start;
+	assert(err.code == SA_FAILED_TIMEOUT);
+	assert(elapsed_ms >= 300 && elapsed_ms < 600);
+
+	// a deadline given by the caller replaces cfg.timeout
+	start = sa_now_ms();
+	err = sa_secret_get_bytes_by(&c, path, start + 150, &secret, &result_size);
+	elapsed_ms = sa_now_ms() - start;
+	assert(err.code == SA_FAILED_TIMEOUT);
+	assert(elapsed_ms >= 150 && elapsed_ms < 300);
+
+	// a deadline that has passed fails without waiting
+	start = sa_now_ms();
+	err = sa_secret_get_bytes_by(&c, path, start - 1, &secret, &result_size);
+	elapsed_ms = sa_now_ms() - start;
+	assert(err.code == SA_FAILED_TIMEOUT);
+	assert(elapsed_ms < 50);
+
+	sa_client_destroy(&c);
+	shutdown(lfd, SHUT_RDWR);
+
+	// with no timeout a call waits as long as the agent takes
+	char slow_addr[64];
+	snprintf(slow_addr, sizeof(slow_addr), "unix:@sa-test-untimed-%d", (int)getpid());
+	int slow_lfd = unix_listener(slow_addr + strlen("unix:"), NULL, 100);
+
+	int timeouts[2] = { 0, -1 };
+
+	for (int i = 0; i < 2; i++) {
+		cfg.addr = slow_addr;
+		cfg.timeout = timeouts[i];
+		sa_client_init(&c, &cfg);
+
+		err = sa_secret_get_bytes(&c, path, &secret, &result_size);
+		assert(err.code == SA_OK);
+		free(secret);
+
+		sa_request* req;
+		err = sa_request_start(&c, path, &req);
+		assert(err.code == SA_OK);
+		poll_request(req);
+		err = sa_request_result(req, &secret, &result_size);
+		assert(err.code == SA_OK);
+		free(secret);
+		sa_request_destroy(req);
+
+		sa_client_destroy(&c);
+	}
+
+	shutdown(slow_lfd, SHUT_RDWR);
+}
+
+// decodes in with the current kernel, in each of the four ways
+void b64_decode_all(const char* in, uint32_t in_len, uint8_t* outs[4], uint32_t sizes[4], bool valid[2])
+{
+	sa_b64_decode(in, in_len, outs[0], &sizes[0]);
+
+	memcpy(outs[1], in, in_len);
+	sa_b64_decode_in_place(outs[1], in_len, &sizes[1]);
+
+	valid[0] = sa_b64_validate_and_decode(in, in_len, outs[2], &sizes[2]);
+
+	memcpy(outs[3], in, in_len);
+	valid[1] = sa_b64_validate_and_decode_in_place(outs[3], in_len, &sizes[3]);
+}
+
+void test_sa_b64_kernels()
+{
+	const sa_b64_kernel kernels[] = { SA_B64_SSE41, SA_B64_AVX2, SA_B64_AVX512VBMI };
+	const char corrupt[] = { '=', '-', '_', ' ', '\0', '\x80', '\xff', 'A' + 0x80 };
+
+	uint8_t raw[800];
+	char enc[1100];
+	uint8_t* want[4];
+	uint8_t* got[4];
+
+	for (int i = 0; i < 4; i++) {
+		want[i] = (uint8_t*) malloc(sizeof(enc));
+		got[i] = (uint8_t*) malloc(sizeof(enc));
+	}
+
+	srand(1);
+
+	for (int k = 0; k < 3; k++) {
+		if (! sa_b64_set_kernel(kernels[k])) {
+			printf("kernel %d not supported, skipped\n", kernels[k]);
+			continue;
+		}
+
+		for (uint32_t raw_sz = 0; raw_sz < sizeof(raw); raw_sz++) {
+			for (uint32_t i = 0; i < raw_sz; i++) {
+				raw[i] = (uint8_t)rand();
+			}
+
+			sa_b64_encode(raw, raw_sz, enc);
+			uint32_t enc_len = sa_b64_encoded_len(raw_sz);
+
+			// every other input has one bad character somewhere
+			if (raw_sz % 2 == 1) {
+				enc[rand() % enc_len] = corrupt[rand() % sizeof(corrupt)];
+			}
+
+			uint32_t want_sizes[4];
+			uint32_t got_sizes[4];
+			bool want_valid[2];
+			bool got_valid[2];
+
+			sa_b64_set_kernel(SA_B64_SCALAR);
+			b64_decode_all(enc, enc_len, want, want_sizes, want_valid);
+
+			sa_b64_set_kernel(kernels[k]);
+			b64_decode_all(enc, enc_len, got, got_sizes, got_valid);
+
+			// decoding without validating matches even for bad input
+			for (int i = 0; i < 2; i++) {
+				assert(got_sizes[i] == want_sizes[i]);
+				assert(memcmp(got[i], want[i], want_sizes[i]) == 0);
+			}
+
+			for (int i = 0; i < 2; i++) {
+				assert(got_valid[i] == want_valid[i]);
+
+				if (want_valid[i]) {
+					assert(got_sizes[i + 2] == want_sizes[i + 2]);
+					assert(memcmp(got[i + 2], want[i + 2], want_sizes[i + 2]) == 0);
+				}
+			}
+
+			// an empty input is never valid
+			if (raw_sz % 2 == 0 && raw_sz != 0) {
+				assert(got_valid[0] && got_sizes[2] == raw_sz);
+				assert(memcmp(got[2], raw, raw_sz) == 0);
+			}
+		}
+	}
+
+	for (int i = 0; i < 4; i++) {
+		free(want[i]);
+		free(got[i]);
+	}
+
+	sa_b64_set_kernel(SA_B64_AUTO);
+}
+
+void test_sa_b64_stream()
+{
+	uint8_t raw[600];
+	char enc[800];
+	uint8_t want[800];
+	uint8_t got[800];
+
+	srand(2);
+
+	for (uint32_t raw_sz = 0; raw_sz < sizeof(raw); raw_sz++) {
+		for (uint32_t i = 0; i < raw_sz; i++) {
+			raw[i] = (uint8_t)rand();
+		}
+
+		sa_b64_encode(raw, raw_sz, enc);
+		uint32_t enc_len = sa_b64_encoded_len(raw_sz);
+
+		// some inputs are corrupted, or are cut off or have more after padding
+		switch (raw_sz % 4) {
+		case 1:
+			enc[rand() % enc_len] = "=-_ \x80"[rand() % 5];
+			break;
+		case 2:
+			enc_len -= (enc_len > 4) ? 1 + rand() % 3 : 0;
+			break;
+		case 3:
+			if (raw_sz > 3) {
+				memcpy(enc + enc_len, "QUFB", 4);
+				enc_len += 4;
+			}
+			break;
+		}
+
+		uint32_t want_size = 0;
+		bool want_valid = sa_b64_validate_and_decode(enc, enc_len, want, &want_size);
+
+		// split anywhere, including inside quads
+		sa_b64_stream stream;
+		sa_b64_stream_init(&stream);
+
+		uint32_t got_size = 0;
+		bool got_valid = true;
+
+		for (uint32_t i = 0; i < enc_len && got_valid; ) {
+			uint32_t n = 1 + rand() % 70;
+			n = n < enc_len - i ? n : enc_len - i;
+
+			assert(sa_b64_stream_out_size(&stream, n) <= sizeof(got) - got_size);
+
+			uint32_t out_size;
+			got_valid = sa_b64_stream_update(&stream, enc + i, n, got + got_size, &out_size);
+			got_size += out_size;
+			i += n;
+		}
+
+		got_valid = got_valid && sa_b64_stream_finish(&stream);
+
+		assert(got_valid == want_valid);
+
+		if (want_valid) {
+			assert(got_size == want_size);
+			assert(memcmp(got, want, want_size) == 0);
+		}
+	}
+}
+
+void test_sa_secret_get_bytes_streamed()
+{
+	sa_set_log_function(&mylog);
+
+	// spans several reads, with escaped slashes and trailing whitespace
+	uint32_t raw_sz = 60000;
+	uint8_t* raw = (uint8_t*) malloc(raw_sz);
+	for (uint32_t i = 0; i < raw_sz; i++) {
+		raw[i] = (uint8_t)(i * 7 + i / 256);
+	}
+
+	uint32_t enc_len = sa_b64_encoded_len(raw_sz);
+	char* enc = (char*) malloc(enc_len + 1);
+	sa_b64_encode(raw, raw_sz, enc);
+	enc[enc_len] = '\0';
+
+	char* json = (char*) malloc(2 * enc_len + 64);
+	char* p = json + sprintf(json, " { \"SecretValue\" : \"");
+
+	for (uint32_t i = 0; i < enc_len; i++) {
+		if (enc[i] == '/') {
+			*p++ = '\\';
+		}
+
+		*p++ = enc[i];
+	}
+
+	sprintf(p, " \\n\"}\n");
+
+	char addrs[2][64];
+	snprintf(addrs[0], sizeof(addrs[0]), "unix:@sa-test-streamed-%d", (int)getpid());
+	snprintf(addrs[1], sizeof(addrs[1]), "unix:@sa-test-error-%d", (int)getpid());
+
+	int lfds[2];
+	lfds[0] = unix_listener(addrs[0] + strlen("unix:"), json, 0);
+	lfds[1] = unix_listener(addrs[1] + strlen("unix:"), "{\"Error\":\"no such secret\"}", 0);
+
+	for (int i = 0; i < 2; i++) {
+		sa_cfg cfg;
+		sa_cfg_init(&cfg);
+		cfg.addr = addrs[i];
+		cfg.timeout = 2000;
+		cfg.pool_size = 1;
+
+		sa_client c;
+		sa_client_init(&c, &cfg);
+
+		uint8_t* secret;
+		size_t result_size = 0;
+		sa_err err = sa_secret_get_bytes(&c, "secrets:pass:pass", &secret, &result_size);
+
+		if (i == 0) {
+			assert(err.code == SA_OK);
+			assert(result_size == raw_sz);
+			assert(memcmp(secret, raw, raw_sz) == 0);
+			free(secret);
+		}
+		else {
+			assert(err.code == SA_FAILED_BAD_REQUEST);
+		}
+
+		// the response was read whole, so the connection is reusable
+		assert(sa_pool_idle_count(c.endpoints[0].pool) == 1);
+
+		sa_client_destroy(&c);
+		shutdown(lfds[i], SHUT_RDWR);
+	}
+
+	free(json);
+	free(enc);
+	free(raw);
+}
+
+// members after the streamed SecretValue are checked as when the response is parsed whole
+void test_sa_secret_get_bytes_streamed_members()
+{
+	const struct {
+		const char* json;
+		const char* expected; // NULL if rejected
+	} cases[] = {
+		{ "{\"SecretValue\":\"cGFzcw==\",\"Error\":\"denied\"}", NULL },
+		{ "{\"SecretValue\":\"cGFzcw==\"} x", NULL },
+		{ "{\"SecretValue\":\"cGFzcw==\"", NULL },
+		{ "{\"SecretValue\":\"cGFzcw==\",\"SecretValue\":1}", NULL },
+		{ "{\"SecretValue\":\"cGFzc\\x\"}", NULL },
+		{ "{\"SecretValue\":\"cGFzcw==\" } \n", "pass" },
+		{ "{\"SecretValue\":\"cGFzcw==\" , \"Version\":[1, {\"Error\":\"nested\"}]}", "pass" },
+		{ "{\"SecretValue\":\"!!!!\",\"SecretValue\":\"d29yZA==\"}", "word" },
+		{ "{\"SecretValue\":\"cGFz\\u0063w==\"}", "pass" },
+		{ "{\"SecretValue\":\"\\u0063GFzcw\\u003d\\u003D\\u0020\"}", "pass" },
+		{ "{\"SecretValue\":\"cGFzcw==\\u0041\"}", NULL },
+		{ "{\"SecretValue\":\"cGFz\\u00e9w==\"}", NULL },
+		{ "{\"SecretValue\":\"cGFz\\u00zzw==\"}", NULL },
+		{ "{\"SecretValue\":\"cGFz\\u0000w==\"}", NULL },
+		{ "{\"SecretValue\":\"\\ud83d\\ude00\",\"SecretValue\":\"d29yZA==\"}", "word" },
+		{ "{\"SecretValue\":\"\\ud83d\",\"SecretValue\":\"d29yZA==\"}", NULL },
+		{ "{\"SecretValue\":\"\\ude00\",\"SecretValue\":\"d29yZA==\"}", NULL }
+	};
+
+	sa_set_log_function(&mylog);
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		const char* expected = cases[i].expected;
+
+		// the same as the buffered parser
+		size_t size = 0;
+		uint8_t* parsed = sa_parse_json(cases[i].json, &size);
+		assert((parsed == NULL) == (expected == NULL));
+		free(parsed);
+
+		char addr[64];
+		snprintf(addr, sizeof(addr), "unix:@sa-test-members-%d-%zu", (int)getpid(), i);
+		int lfd = unix_listener(addr + strlen("unix:"), cases[i].json, 0);
+
+		sa_cfg cfg;
+		sa_cfg_init(&cfg);
+		cfg.addr = addr;
+		cfg.timeout = 2000;
+
+		sa_client c;
+		sa_client_init(&c, &cfg);
+
+		uint8_t* secret;
+		sa_err err = sa_secret_get_bytes(&c, "secrets:pass:pass", &secret, &size);
+
+		if (expected == NULL) {
+			assert(err.code == SA_FAILED_BAD_REQUEST);
+		}
+		else {
+			assert(err.code == SA_OK);
+			assert(size == strlen(expected) && memcmp(secret, expected, size) == 0);
+			free(secret);
+		}
+
+		uint8_t buf[16];
+		err = sa_secret_get_into(&c, "secrets:pass:pass", buf, sizeof(buf), &size);
+
+		if (expected == NULL) {
+			assert(err.code == SA_FAILED_BAD_REQUEST);
+		}
+		else {
+			assert(err.code == SA_OK);
+			assert(size == strlen(expected) && memcmp(buf, expected, size) == 0);
+
+			err = sa_secret_get_into(&c, "secrets:pass:pass", buf, 2, &size);
+			assert(err.code == SA_FAILED_BUFFER_TOO_SMALL && size == strlen(expected));
+		}
+
+		sa_client_destroy(&c);
+		shutdown(lfd, SHUT_RDWR);
+	}
+
+	// a \u escape split between the reads of a long response
+	uint32_t raw_sz = 15000;
+	uint8_t* raw = (uint8_t*) malloc(raw_sz);
+	for (uint32_t i = 0; i < raw_sz; i++) {
+		raw[i] = (uint8_t)(i * 7 + i / 256);
+	}
+
+	uint32_t enc_len = sa_b64_encoded_len(raw_sz);
+	char* enc = (char*) malloc(enc_len + 1);
+	sa_b64_encode(raw, raw_sz, enc);
+	enc[enc_len] = '\0';
+
+	char* json = (char*) malloc(enc_len + 64);
+	uint8_t* big = (uint8_t*) malloc(raw_sz + 1);
+	const uint32_t read_sz = 16 * 1024;
+
+	for (uint32_t split = 1; split < 6; split++) {
+		// the escape starts split bytes before the end of the first read
+		uint32_t at = read_sz - split - (uint32_t)strlen("{\"SecretValue\":\"");
+		int n = sprintf(json, "{\"SecretValue\":\"%.*s\\u%04x%s\"}", (int)at, enc,
+				(unsigned)enc[at], enc + at + 1);
+		assert(n > (int)read_sz);
+
+		size_t size = 0;
+		uint8_t* parsed = sa_parse_json(json, &size);
+		assert(parsed != NULL && size == raw_sz && memcmp(parsed, raw, raw_sz) == 0);
+		free(parsed);
+
+		char addr[64];
+		snprintf(addr, sizeof(addr), "unix:@sa-test-split-%d-%u", (int)getpid(), split);
+		int lfd = unix_listener(addr + strlen("unix:"), json, 0);
+
+		sa_cfg cfg;
+		sa_cfg_init(&cfg);
+		cfg.addr = addr;
+		cfg.timeout = 2000;
+
+		sa_client c;
+		sa_client_init(&c, &cfg);
+
+		uint8_t* secret;
+		sa_err err = sa_secret_get_bytes(&c, "secrets:pass:pass", &secret, &size);
+		assert(err.code == SA_OK && size == raw_sz && memcmp(secret, raw, raw_sz) == 0);
+		free(secret);
+
+		err = sa_secret_get_into(&c, "secrets:pass:pass", big, raw_sz, &size);
+		assert(err.code == SA_OK && size == raw_sz && memcmp(big, raw, raw_sz) == 0);
+
+		sa_client_destroy(&c);
+		shutdown(lfd, SHUT_RDWR);
+	}
+
+	free(big);
+	free(json);
+	free(enc);
+	free(raw);
+}
+
+void test_sa_secret_get_into()
+{
+	sa_set_log_function(&mylog);
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR;
+	cfg.port = AGENT_PORT;
+	cfg.timeout = 2000;
+	cfg.pool_size = 1;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	const char* expected = "127.0.0.1";
+	uint8_t buf[256];
+	size_t size = 0;
+
+	// ask for the size
+	sa_err err = sa_secret_get_into(&c, "secrets:pass:pass", NULL, 0, &size);
+	assert(err.code == SA_FAILED_BUFFER_TOO_SMALL && size == strlen(expected));
+
+	memset(buf, 'x', sizeof(buf));
+	err = sa_secret_get_into(&c, "secrets:pass:pass", buf, 4, &size);
+	assert(err.code == SA_FAILED_BUFFER_TOO_SMALL && size == strlen(expected));
+	assert(memcmp(buf, "\0\0\0\0x", 5) == 0);
+
+	// the too small response was read whole, so the connection was kept
+	assert(sa_pool_idle_count(c.endpoints[0].pool) == 1);
+
+	err = sa_secret_get_into(&c, "secrets:pass:pass", buf, strlen(expected), &size);
+	assert(err.code == SA_OK && size == strlen(expected));
+	assert(memcmp(buf, expected, size) == 0);
+
+	sa_secret_handle* h;
+	assert(sa_secret_prepare(&c, "secrets:pass:pass", &h).code == SA_OK);
+	err = sa_secret_get_prepared_into(h, buf, sizeof(buf), &size);
+	assert(err.code == SA_OK && size == strlen(expected));
+	assert(memcmp(buf, expected, size) == 0);
+	sa_secret_handle_destroy(h);
+
+	// errors are parsed in scratch if they don't fit the caller's buffer
+	err = sa_secret_get_into(&c, "secrets:pass:fakesecret", buf, 4, &size);
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+	err = sa_secret_get_into(&c, "secrets:pass:fakesecret", buf, sizeof(buf), &size);
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+	assert(sa_pool_idle_count(c.endpoints[0].pool) == 1);
+
+	sa_client_destroy(&c);
+
+	// a big padded secret, streamed and with SecretValue not first so it isn't
+	uint32_t raw_sz = 60001;
+	uint8_t* raw = (uint8_t*) malloc(raw_sz);
+	for (uint32_t i = 0; i < raw_sz; i++) {
+		raw[i] = (uint8_t)(i * 13 + i / 256);
+	}
+
+	uint32_t enc_len = sa_b64_encoded_len(raw_sz);
+	char* json[2];
+	json[0] = (char*) malloc(enc_len + 64);
+	json[1] = (char*) malloc(enc_len + 64);
+	char* p = json[0] + sprintf(json[0], "{\"SecretValue\":\"");
+	sa_b64_encode(raw, raw_sz, p);
+	sprintf(p + enc_len, "\"}");
+	p = json[1] + sprintf(json[1], "{\"x\":1,\"SecretValue\":\"");
+	sa_b64_encode(raw, raw_sz, p);
+	sprintf(p + enc_len, "\"}");
+
+	uint8_t* big = (uint8_t*) malloc(enc_len + 64);
+
+	for (int j = 0; j < 2; j++) {
+		char addr[64];
+		snprintf(addr, sizeof(addr), "unix:@sa-test-into-%d-%d", j, (int)getpid());
+		int lfd = unix_listener(addr + strlen("unix:"), json[j], 0);
+
+		cfg.addr = addr;
+		sa_client_init(&c, &cfg);
+
+		// exactly the size, one byte short and room for the whole json
+		size_t caps[] = { raw_sz, raw_sz - 1, enc_len + 64 };
+
+		for (int i = 0; i < 3; i++) {
+			size = 0;
+			err = sa_secret_get_into(&c, "secrets:pass:pass", big, caps[i], &size);
+			assert(size == raw_sz);
+
+			if (caps[i] < raw_sz) {
+				assert(err.code == SA_FAILED_BUFFER_TOO_SMALL);
+			}
+			else {
+				assert(err.code == SA_OK);
+				assert(memcmp(big, raw, raw_sz) == 0);
+			}
+
+			assert(sa_pool_idle_count(c.endpoints[0].pool) == 1);
+		}
+
+		sa_client_destroy(&c);
+		shutdown(lfd, SHUT_RDWR);
+	}
+
+	free(big);
+	free(json[0]);
+	free(json[1]);
+	free(raw);
+}
+
+// counts the buffers outstanding from the slab it wraps
+typedef struct counted_slab_s {
+	sa_slab* slab;
+	int n_allocs;
+	int n_out;
+} counted_slab;
+
+void* counted_alloc(size_t size, void* udata)
+{
+	counted_slab* cs = (counted_slab*)udata;
+	void* p = sa_slab_alloc(size, cs->slab);
+
+	if (p != NULL) {
+		__atomic_add_fetch(&cs->n_allocs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&cs->n_out, 1, __ATOMIC_RELAXED);
+	}
+
+	return p;
+}
+
+void counted_free(void* p, void* udata)
+{
+	counted_slab* cs = (counted_slab*)udata;
+	__atomic_sub_fetch(&cs->n_out, 1, __ATOMIC_RELAXED);
+	sa_slab_free(p, cs->slab);
+}
+
+void test_sa_slab()
+{
+	sa_set_log_function(&mylog);
+
+	sa_slab* slab = sa_slab_new(4096);
+	if (slab == NULL) {
+		printf("could not lock a secret slab, skipped\n");
+		return;
+	}
+
+	sa_allocator a;
+	sa_slab_allocator(slab, &a);
+
+	// freed blocks are zeroed and reused by their size class
+	uint8_t* p = (uint8_t*) sa_alloc(&a, 50);
+	assert(p != NULL);
+	memset(p, 'x', 50);
+	sa_free(&a, p);
+
+	for (int i = 0; i < 64; i++) {
+		assert(p[i] == 0);
+	}
+
+	assert(sa_alloc(&a, 64) == p);
+	sa_free(&a, p);
+
+	uint8_t* q = (uint8_t*) sa_alloc(&a, 65);
+	assert(q != NULL && q != p);
+	sa_free(&a, q);
+
+	// the region is all there is
+	assert(sa_alloc(&a, 8192) == NULL);
+
+	void* blocks[64];
+	int n = 0;
+	while ((blocks[n] = sa_alloc(&a, 1000)) != NULL) {
+		n++;
+	}
+
+	assert(n > 0 && n < 4);
+
+	for (int i = 0; i < n; i++) {
+		sa_free(&a, blocks[i]);
+	}
+
+	sa_slab_destroy(slab);
+
+	// every secret buffer of a client comes from its allocator
+	counted_slab cs;
+	cs.slab = sa_slab_new(256 * 1024);
+	cs.n_allocs = 0;
+	cs.n_out = 0;
+	if (cs.slab == NULL) {
+		printf("could not lock a secret slab, skipped\n");
+		return;
+	}
+
+	sa_cfg cfg;
+	sa_cfg_init(&cfg);
+	cfg.addr = AGENT_ADDR;
+	cfg.port = AGENT_PORT;
+	cfg.timeout = 2000;
+	cfg.cache.ttl = 60000;
+	cfg.alloc.alloc = counted_alloc;
+	cfg.alloc.free = counted_free;
+	cfg.alloc.udata = &cs;
+
+	sa_client c;
+	sa_client_init(&c, &cfg);
+
+	for (int i = 0; i < 2; i++) {
+		size_t size = 0;
+		uint8_t* secret;
+		sa_err err = sa_secret_get_bytes(&c, "secrets:pass:pass", &secret, &size);
+
+		assert(err.code == SA_OK);
+		assert(size == strlen("127.0.0.1") && memcmp(secret, "127.0.0.1", size) == 0);
+		assert(secret > cs.slab->region && secret < cs.slab->region + cs.slab->size);
+		sa_secret_free(&c, secret, size);
+	}
+
+	size_t size = 0;
+	uint8_t* secret;
+	sa_err err = sa_secret_get_bytes(&c, "secrets:pass:fakesecret", &secret, &size);
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+
+	const char* paths[3] = {"secrets:pass:pass", "secrets:pass:fakesecret", "secrets:pass:pass"};
+	sa_secret_result results[3];
+	err = sa_secret_get_many(&c, paths, 3, results);
+	assert(err.code == SA_FAILED_BAD_REQUEST);
+
+	for (int i = 0; i < 3; i++) {
+		sa_secret_free(&c, results[i].value, results[i].size);
+	}
+
+	// the cached copy is the only buffer left
+	assert(cs.n_allocs > 4);
+	assert(cs.n_out == 1);
+
+	sa_client_destroy(&c);
+	assert(cs.n_out == 0);
+
+	sa_slab_destroy(cs.slab);
+}
+
+void test_sa_json_scan()
+{
+	typedef struct {
+		const char* json;
+		bool valid;
+		const char* error; // NULL if absent or not a string
+		const char* secret_value;
+	} json_case;
+
+	const json_case cases[] = {
+		{ "{\"SecretValue\":\"cGFzcw==\"}", true, NULL, "cGFzcw==" },
+		{ " \r\n\t{ \"SecretValue\" : \"a\\/b\" , \"x\" : [1, -0, 2.5e-3, true, false, null, {}] } \n", true, NULL, "a/b" },
+		{ "{\"Error\":\"no \\\"such\\\" secret\"}", true, "no \"such\" secret", NULL },
+		{ "{\"Secret\\u0056alue\":\"\\u00e9\\u20ac\\ud83d\\ude00\\b\\f\\n\\r\\t\\\\\"}", true, NULL, "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\b\f\n\r\t\\" },
+		{ "{\"SecretValue\":\"a\",\"SecretValue\":\"b\"}", true, NULL, "b" },
+		{ "{\"SecretValue\":\"a\",\"SecretValue\":{\"SecretValue\":\"c\"}}", true, NULL, NULL },
+		{ "{\"SecretValue\":1,\"Error\":[\"e\"]}", true, NULL, NULL },
+		{ "{\"x\":{\"SecretValue\":\"a\"}}", true, NULL, NULL },
+		{ "[\"SecretValue\",\"a\"]", true, NULL, NULL },
+		{ "{\"a\":\"\xc3\xa9\xef\xbf\xbf\xf4\x8f\xbf\xbf\"}", true, NULL, NULL },
+		{ "{\"a\":[9223372036854775807,-9223372036854775808,1e308,-1.7976931348623157e308,1e-999]}", true, NULL, NULL },
+		{ "", false, NULL, NULL },
+		{ "\"SecretValue\"", false, NULL, NULL },
+		{ "{\"SecretValue\":\"a\"} x", false, NULL, NULL },
+		{ "{\"SecretValue\":\"a\",}", false, NULL, NULL },
+		{ "{\"SecretValue\" \"a\"}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"a\"", false, NULL, NULL },
+		{ "{\"SecretValue\":\"a}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"a\tb\"}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"\\x\"}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"\\u00\"}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"\\u0000\"}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"\\ud83d\"}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"\\ude00\"}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"\xc0\xaf\"}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"\xed\xa0\x80\"}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"\xf4\x90\x80\x80\"}", false, NULL, NULL },
+		{ "{\"SecretValue\":\"\xe2\x82\"}", false, NULL, NULL },
+		{ "{\"a\":01}", false, NULL, NULL },
+		{ "{\"a\":-}", false, NULL, NULL },
+		{ "{\"a\":1.}", false, NULL, NULL },
+		{ "{\"a\":1e}", false, NULL, NULL },
+		{ "{\"a\":.5}", false, NULL, NULL },
+		{ "{\"a\":9223372036854775808}", false, NULL, NULL },
+		{ "{\"a\":-9223372036854775809}", false, NULL, NULL },
+		{ "{\"a\":1.8e308}", false, NULL, NULL },
+		{ "{\"a\":0.0001e313}", false, NULL, NULL },
+		{ "{\"a\":tru}", false, NULL, NULL },
+		{ "{\"a\":nulls}", false, NULL, NULL },
+		{ "{\"a\":[1 2]}", false, NULL, NULL },
+		{ "{\"a\" :1}}", false, NULL, NULL },
+		{ "{a:1}", false, NULL, NULL },
+		{ "{\"a\":1}\f", false, NULL, NULL },
+	};
+
+	sa_set_log_function(&mylog);
+
+	for (uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		char* json = strdup(cases[i].json);
+		sa_json_response res;
+
+		assert(sa_json_scan_response(json, &res) == cases[i].valid);
+
+		if (cases[i].valid) {
+			const char* want[2] = { cases[i].error, cases[i].secret_value };
+			const char* got[2] = { res.error, res.secret_value };
+			uint32_t got_len[2] = { res.error_len, res.secret_value_len };
+
+			for (int m = 0; m < 2; m++) {
+				assert((want[m] == NULL) == (got[m] == NULL));
+
+				if (want[m] != NULL) {
+					assert(got_len[m] == strlen(want[m]));
+					assert(strcmp(got[m], want[m]) == 0);
+				}
+			}
+		}
+
+		free(json);
+	}
+
+	// json_loads() limits nesting to 2048 values, counting the innermost scalar
+	char* deep = (char*) malloc(2 * 2049 + 2);
+	uint32_t depths[] = { 2047, 2048, 2049 };
+
+	for (int d = 0; d < 3; d++) {
+		for (int scalar = 0; scalar < 2; scalar++) {
+			char* p = deep;
+			memset(p, '[', depths[d]);
+			p += depths[d];
+			if (scalar) {
+				*p++ = '1';
+			}
+			memset(p, ']', depths[d]);
+			p[depths[d]] = '\0';
+
+			sa_json_response res;
+			assert(sa_json_scan_response(deep, &res) == (depths[d] + scalar <= 2048));
+		}
+	}
+
+	free(deep);
+
+	// the secret is decoded where it is, and moved to the start of the buffer
+	char* json = strdup("{\"SecretValue\": \"cGF\\/zcw=\\n \" }");
+	size_t size = 0;
+	size_t json_sz = strlen(json);
+	uint8_t* secret = sa_parse_json_in_place(json, json_sz, &size);
+	assert(secret == (uint8_t*)json && size == 5 && memcmp(secret, "pa\x7f\xcd\xcc", 5) == 0);
+
+	// nothing of the encoded secret is left after it
+	for (size_t i = size; i <= json_sz; i++) {
+		assert(json[i] == '\0');
+	}
+	free(json);
+}
+
+#ifdef SA_USE_JANSSON
+
+void nolog(const char* format, ...)
+{
+}
+
+// scans a copy of json and checks the result against json_loads()
+void json_check(const char* json)
+{
+	json_error_t jerr;
+	json_t* doc = json_loads(json, 0, &jerr);
+
+	char* copy = strdup(json);
+	sa_json_response res;
+	bool valid = sa_json_scan_response(copy, &res);
+
+	if (valid != (doc != NULL)) {
+		printf("scanner %s, jansson %s (%s): %s\n", valid ? "accepts" : "rejects",
+				doc != NULL ? "accepts" : "rejects", doc != NULL ? "" : jerr.text, json);
+		assert(false);
+	}
+
+	if (doc != NULL) {
+		const char* keys[2] = { "Error", "SecretValue" };
+		const char* got[2] = { res.error, res.secret_value };
+		uint32_t got_len[2] = { res.error_len, res.secret_value_len };
+
+		for (int m = 0; m < 2; m++) {
+			const char* want;
+			size_t want_len;
+
+			if (json_unpack(doc, "{s:s%}", keys[m], &want, &want_len) != 0) {
+				assert(got[m] == NULL);
+			}
+			else {
+				assert(got[m] != NULL && got_len[m] == want_len);
+				assert(memcmp(got[m], want, want_len) == 0);
+			}
+		}
+
+		json_decref(doc);
+	}
+
+	free(copy);
+
+	// and the secret decoded from it matches
+	size_t want_size = 0;
+	size_t got_size = 0;
+	uint8_t* want = sa_parse_json_jansson(json, &want_size);
+	uint8_t* got = sa_parse_json(json, &got_size);
+
+	assert((want == NULL) == (got == NULL));
+
+	if (want != NULL) {
+		assert(got_size == want_size && memcmp(got, want, want_size) == 0);
+	}
+
+	free(want);
+	free(got);
+}
+
+void test_sa_json_fuzz()
+{
+	static const char* seeds[] = {
+		"{\"SecretValue\":\"cGFzc3dvcmQ=\"}",
+		"{\"Error\":\"secret not found\"}",
+		" {\n \"SecretValue\" : \"YS9i\\/Yw==\\n\" ,\"Error\":null }",
+		"{\"Secret\\u0056alue\":\"QUJD\",\"SecretValue\":\"\\u0051UJE\"}",
+		"{\"x\":[1,-2.5e10,true,false,null,{\"y\":\"\\ud83d\\ude00\\u00e9\"}],\"SecretValue\":\"QQ==\"}",
+		"[{\"SecretValue\":\"QQ==\"},\"\xc3\xa9\xe2\x82\xac\",9223372036854775807,1.7e308]",
+	};
+
+	// bytes which tend to change the meaning of a document
+	static const char bytes[] = "{}[],:\"\\/ \n\t\fuUeE+-.0123456789abfnrtlsQ=\x01\x7f\x80\xbf\xc3\xa9\xed\xa0\xf0\xf4\x90";
+
+	char json[512];
+
+	sa_set_log_function(&nolog);
+	srand(3);
+
+	for (int iter = 0; iter < 300000; iter++) {
+		const char* seed = seeds[rand() % (sizeof(seeds) / sizeof(seeds[0]))];
+		size_t len = strlen(seed);
+		memcpy(json, seed, len + 1);
+
+		for (int n = 1 + rand() % 4; n > 0; n--) {
+			size_t pos = (size_t)rand() % (len + 1);
+			char b = bytes[rand() % (sizeof(bytes) - 1)];
+
+			switch (rand() % 4) {
+			case 0: // replace
+				if (pos < len) {
+					json[pos] = b;
+				}
+				break;
+			case 1: // insert
+				if (len + 2 < sizeof(json)) {
+					memmove(json + pos + 1, json + pos, len - pos + 1);
+					json[pos] = b;
+					len++;
+				}
+				break;
+			case 2: // delete
+				if (pos < len) {
+					memmove(json + pos, json + pos + 1, len - pos);
+					len--;
+				}
+				break;
+			case 3: { // repeat a span
+				size_t span = 1 + (size_t)rand() % 8;
+				if (pos + span <= len && len + span + 1 < sizeof(json)) {
+					memmove(json + pos + span, json + pos, len - pos + 1);
+					len += span;
+				}
+				break;
+			}
+			}
+		}
+
+		json_check(json);
+	}
+
+	sa_set_log_function(&mylog);
+}
+
+#endif
+
 typedef void (*test_func)();
 
 void run_test(test_func f, char* name) {
@@ -251,6 +2962,38 @@ int main(int argc, char const *argv[])
 	run_test(&test_sa_secret_get_bytes_bad_secret, "test_sa_secret_get_bytes_bad_secret");
 	run_test(&test_sa_secret_get_bytes_missing_resource_name, "test_sa_secret_get_bytes_missing_resource_name");
 	run_test(&test_sa_secret_get_bytes_tls, "test_sa_secret_get_bytes_tls");
+	run_test(&test_sa_secret_get_bytes_pooled, "test_sa_secret_get_bytes_pooled");
+	run_test(&test_sa_socket_syscalls, "test_sa_socket_syscalls");
+	run_test(&test_sa_secret_get_bytes_tls_shared_context, "test_sa_secret_get_bytes_tls_shared_context");
+	run_test(&test_sa_secret_get_bytes_tls_resumed, "test_sa_secret_get_bytes_tls_resumed");
+	run_test(&test_sa_secret_get_bytes_cached, "test_sa_secret_get_bytes_cached");
+	run_test(&test_sa_cache_lru_and_stale, "test_sa_cache_lru_and_stale");
+	run_test(&test_sa_secret_get_prepared, "test_sa_secret_get_prepared");
+	run_test(&test_sa_secret_get_many, "test_sa_secret_get_many");
+	run_test(&test_sa_request_poll, "test_sa_request_poll");
+	run_test(&test_sa_request_poll_tls, "test_sa_request_poll_tls");
+	run_test(&test_sa_secret_get_bytes_io_uring, "test_sa_secret_get_bytes_io_uring");
+	run_test(&test_sa_connect_race, "test_sa_connect_race");
+	run_test(&test_sa_resolver, "test_sa_resolver");
+	run_test(&test_sa_secret_get_bytes_unix, "test_sa_secret_get_bytes_unix");
+	run_test(&test_sa_secret_get_bytes_deadline, "test_sa_secret_get_bytes_deadline");
+	run_test(&test_sa_secret_get_bytes_hedged, "test_sa_secret_get_bytes_hedged");
+	run_test(&test_sa_endpoint_balance, "test_sa_endpoint_balance");
+	run_test(&test_sa_secret_get_bytes_coalesced, "test_sa_secret_get_bytes_coalesced");
+	run_test(&test_sa_client_prefetch, "test_sa_client_prefetch");
+	run_test(&test_sa_config_scan, "test_sa_config_scan");
+	run_test(&test_sa_client_stats, "test_sa_client_stats");
+	run_test(&test_sa_client_trace, "test_sa_client_trace");
+	run_test(&test_sa_b64_kernels, "test_sa_b64_kernels");
+	run_test(&test_sa_b64_stream, "test_sa_b64_stream");
+	run_test(&test_sa_secret_get_bytes_streamed, "test_sa_secret_get_bytes_streamed");
+	run_test(&test_sa_secret_get_bytes_streamed_members, "test_sa_secret_get_bytes_streamed_members");
+	run_test(&test_sa_json_scan, "test_sa_json_scan");
+	run_test(&test_sa_secret_get_into, "test_sa_secret_get_into");
+	run_test(&test_sa_slab, "test_sa_slab");
+#ifdef SA_USE_JANSSON
+	run_test(&test_sa_json_fuzz, "test_sa_json_fuzz");
+#endif
 
 	printf("TESTS SUCCEEDED\n");
 